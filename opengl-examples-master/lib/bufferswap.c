@@ -11,6 +11,7 @@
 #include <GLFW/glfw3.h>
 #include "kuhl-util.h"
 #include "dgr.h"
+#include "texload.h"
 
 static int viewmat_swapinterval = 0;
 static float fps = 0;
@@ -39,6 +40,8 @@ int bufferswap_get_refresh_rate(void)
 	/* If there is only one monitor, we can figure out the refresh rate */
 	int numMonitors = 0;
 	GLFWmonitor** monitorList = glfwGetMonitors(&numMonitors);
+	if(numMonitors == 0) // headless or no monitors connected
+		return 60;
 	if(numMonitors == 1)
 	{
 		const GLFWvidmode *mode = glfwGetVideoMode(monitorList[0]);
@@ -113,7 +116,7 @@ static void bufferswap_stats_fps(void)
 		long expectedTimePerFrame = (1.0/refreshRate*1000000);
 		long timeLastFrame = list[newestIdx] - list[(newestIdx-1+FPS_SAMPLES)%FPS_SAMPLES];
 
-		if(timeLastFrame > expectedTimePerFrame*1.5)
+		if(timeLastFrame > expectedTimePerFrame*1.5 && !kuhl_headless())
 		{
 			msg(MSG_DEBUG, "Skipped a frame. %ld usec between framebuffer swaps (budget %ld usec).", timeLastFrame, expectedTimePerFrame);
 		}
@@ -271,6 +274,46 @@ static void bufferswap_latencyreduce()
 	return;
 }
 
+/** Ends a frame when we are rendering into an offscreen framebuffer
+ * instead of a window. There is nothing to swap, so we wait for
+ * rendering to finish instead. This makes the FPS reflect how long
+ * frames actually take and prevents a software rasterizer from
+ * queueing up an unbounded amount of work.
+ *
+ * If window.headlessframes is set, the window is told to close after
+ * that many frames so that programs can run unattended.
+ */
+static void bufferswap_headless(void)
+{
+	static int frames = 0;
+	static long startTime = 0;
+	static int maxFrames = -1;
+	if(maxFrames == -1)
+	{
+		maxFrames = kuhl_config_int("window.headlessframes", 0, 0);
+		if(maxFrames < 0)
+			maxFrames = 0;
+	}
+
+	glFinish();
+	bufferswap_stats_fps();
+
+	long now = kuhl_microseconds();
+	if(frames == 0)
+		startTime = now;
+	frames++;
+
+	if(maxFrames > 0 && frames == maxFrames)
+	{
+		/* The first frame is excluded since we start timing at the
+		 * end of it. */
+		float seconds = (now-startTime)/1000000.0f;
+		if(frames > 1 && seconds > 0)
+			msg(MSG_INFO, "Headless: Rendered %d frames in %.3f seconds (%.1f fps)", frames, seconds, (frames-1)/seconds);
+		glfwSetWindowShouldClose(kuhl_get_window(), 1);
+	}
+}
+
 /** Get swap interval settings and apply them by calling glfwSwapInterval().
  */
 static void bufferswap_init(void)
@@ -321,7 +364,7 @@ void bufferswap(void)
 	/* Call initialization function the first time bufferswap() is
 	 * called. */
 	static int needsInit = 1;
-	if(needsInit)
+	if(needsInit && !kuhl_headless())
 	{
 		bufferswap_init();
 		needsInit = 0;
@@ -330,11 +373,16 @@ void bufferswap(void)
 	dgr_update(1,0); // DGR Master should send before blocking at swap.
 
 	/* Swap the buffers */
-	if(viewmat_swapinterval == 0 ||
+	if(kuhl_headless())
+		bufferswap_headless();
+	else if(viewmat_swapinterval == 0 ||
 	   kuhl_config_boolean("bufferswap.latencyreduce", 1,1) == 0) // if FPS is unrestricted.
 		bufferswap_simple();
 	else
 		bufferswap_latencyreduce();
 
+	/* Upload part of any textures being loaded in the background. */
+	texload_update();
+
 	dgr_update(0,1); // DGR Slave should receive after swap (and before drawing)
 }
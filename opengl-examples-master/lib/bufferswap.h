@@ -39,6 +39,14 @@
       send/receive appropriately.
 
     * Monitors FPS and allows the user to retrieve the current FPS.
+
+    * When rendering headless (window.headless=1), there is no window
+      to swap. bufferswap() instead marks the end of the frame by
+      waiting for rendering to finish and can close the window after
+      window.headlessframes frames.
+
+    * Uploads part of any textures that are being loaded in the
+      background (see texload.h) after each frame.
     
     @author Scott Kuhl
  */
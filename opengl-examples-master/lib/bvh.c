@@ -0,0 +1,676 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "bvh.h"
+#include "kuhl-nodep.h"
+#include "vecmat.h"
+#include "msg.h"
+
+/** Sets a box so that growing it with any other box results in the
+ * other box. */
+static void bvh_box_empty(float box[6])
+{
+	for(int i=0; i<6; i=i+2)
+	{
+		box[i]   = FLT_MAX;
+		box[i+1] = -FLT_MAX;
+	}
+}
+
+/** Expands a box so that it encloses another box. */
+static void bvh_box_grow(float box[6], const float other[6])
+{
+	for(int i=0; i<6; i=i+2)
+	{
+		if(other[i] < box[i])
+			box[i] = other[i];
+		if(other[i+1] > box[i+1])
+			box[i+1] = other[i+1];
+	}
+}
+
+/** Frees the tree, items and boxes in a BVH but not the triangles. */
+static void bvh_clear(bvh *b)
+{
+	free(b->nodes);
+	free(b->items);
+	free(b->boxes);
+	b->nodes = NULL;
+	b->items = NULL;
+	b->boxes = NULL;
+	b->nodeCount = 0;
+	b->itemCount = 0;
+}
+
+/** Creates a new, empty bounding volume hierarchy.
+
+    @return A new BVH which should be freed with bvh_free().
+*/
+bvh* bvh_new(void)
+{
+	bvh *b = kuhl_malloc(sizeof(bvh));
+	memset(b, 0, sizeof(bvh));
+	return b;
+}
+
+/** Frees a bounding volume hierarchy.
+
+    @param b The BVH to free.
+*/
+void bvh_free(bvh *b)
+{
+	if(b == NULL)
+		return;
+	bvh_clear(b);
+	free(b->triangles);
+	free(b);
+}
+
+/** Recursively creates the nodes for items[first] through
+ * items[first+count-1]. Items are split at the midpoint of the
+ * longest axis of the box around their centers.
+ *
+ * @return The index of the new node.
+ */
+static int bvh_build_node(bvh *b, const float *centers, int first, int count)
+{
+	int index = b->nodeCount++;
+	bvh_node *node = &(b->nodes[index]);
+	node->left = node->right = -1;
+	node->first = first;
+	node->count = count;
+
+	float centerBox[6];
+	bvh_box_empty(node->box);
+	bvh_box_empty(centerBox);
+	for(int i=first; i<first+count; i++)
+	{
+		int item = b->items[i];
+		bvh_box_grow(node->box, b->boxes+item*6);
+		const float *c = centers+item*3;
+		float cbox[6] = { c[0], c[0], c[1], c[1], c[2], c[2] };
+		bvh_box_grow(centerBox, cbox);
+	}
+	if(count <= BVH_LEAF_SIZE)
+		return index;
+
+	int axis = 0;
+	for(int i=1; i<3; i++)
+	{
+		if(centerBox[2*i+1]-centerBox[2*i] > centerBox[2*axis+1]-centerBox[2*axis])
+			axis = i;
+	}
+	float mid = (centerBox[2*axis] + centerBox[2*axis+1]) / 2;
+
+	/* Move items with centers below the midpoint to the front. */
+	int split = first;
+	for(int i=first; i<first+count; i++)
+	{
+		if(centers[b->items[i]*3+axis] < mid)
+		{
+			int tmp = b->items[i];
+			b->items[i] = b->items[split];
+			b->items[split] = tmp;
+			split++;
+		}
+	}
+	/* If all of the centers are on one side (for example, if they
+	 * are all the same), split the items in half. */
+	int leftCount = split - first;
+	if(leftCount == 0 || leftCount == count)
+		leftCount = count / 2;
+
+	node->count = 0;
+	int left = bvh_build_node(b, centers, first, leftCount);
+	int right = bvh_build_node(b, centers, first+leftCount, count-leftCount);
+	node->left = left;
+	node->right = right;
+	return index;
+}
+
+/** Builds the tree from the item boxes already stored in b->boxes. */
+static void bvh_build_tree(bvh *b)
+{
+	int count = b->itemCount;
+	b->items = kuhl_malloc(sizeof(int)*(count > 0 ? count : 1));
+	/* A binary tree with at most BVH_LEAF_SIZE items per leaf has
+	 * fewer than 2*count nodes. */
+	b->nodes = kuhl_malloc(sizeof(bvh_node)*(count > 0 ? 2*count : 1));
+	b->nodeCount = 0;
+	for(int i=0; i<count; i++)
+		b->items[i] = i;
+
+	if(count == 0)
+	{
+		bvh_node *root = &(b->nodes[b->nodeCount++]);
+		bvh_box_empty(root->box);
+		root->left = root->right = -1;
+		root->first = root->count = 0;
+		return;
+	}
+
+	float *centers = kuhl_malloc(sizeof(float)*3*count);
+	for(int i=0; i<count; i++)
+	{
+		const float *box = b->boxes+i*6;
+		vec3f_set(centers+i*3, (box[0]+box[1])/2, (box[2]+box[3])/2, (box[4]+box[5])/2);
+	}
+	bvh_build_node(b, centers, 0, count);
+	free(centers);
+}
+
+/** Builds a bounding volume hierarchy from an array of boxes. Any
+ * existing tree in the BVH is replaced.
+
+    @param b The BVH.
+
+    @param boxes An array of 6*count floats containing the box of
+    each item (xmin, xmax, ymin, ymax, zmin, zmax). The boxes are
+    copied. Queries return the index of a box in this array.
+
+    @param count The number of boxes.
+*/
+void bvh_build(bvh *b, const float *boxes, int count)
+{
+	if(b == NULL)
+		return;
+	bvh_clear(b);
+	free(b->triangles);
+	b->triangles = NULL;
+
+	if(count < 0 || (count > 0 && boxes == NULL))
+		count = 0;
+	b->itemCount = count;
+	b->boxes = kuhl_malloc(sizeof(float)*6*(count > 0 ? count : 1));
+	if(count > 0)
+		memcpy(b->boxes, boxes, sizeof(float)*6*count);
+	bvh_build_tree(b);
+}
+
+/** Builds a bounding volume hierarchy from a list of triangles. If
+ * bvh_ray() is called without a function, rays are tested against
+ * the triangles themselves instead of their boxes.
+
+    @param b The BVH.
+
+    @param positions Array of vertex positions (x, y, z).
+
+    @param indices Array of 3*triangleCount indices into positions or
+    NULL if every three consecutive positions form a triangle.
+
+    @param triangleCount The number of triangles. Queries return
+    the index of a triangle.
+*/
+void bvh_build_triangles(bvh *b, const float *positions, const unsigned int *indices, int triangleCount)
+{
+	if(b == NULL)
+		return;
+	if(positions == NULL || triangleCount < 0)
+		triangleCount = 0;
+
+	float *boxes = kuhl_malloc(sizeof(float)*6*(triangleCount > 0 ? triangleCount : 1));
+	float *triangles = kuhl_malloc(sizeof(float)*9*(triangleCount > 0 ? triangleCount : 1));
+	for(int i=0; i<triangleCount; i++)
+	{
+		float *box = boxes+i*6;
+		bvh_box_empty(box);
+		for(int j=0; j<3; j++)
+		{
+			unsigned int v = indices ? indices[i*3+j] : (unsigned int) (i*3+j);
+			const float *p = positions+v*3;
+			vec3f_copy(triangles+i*9+j*3, p);
+			float pbox[6] = { p[0], p[0], p[1], p[1], p[2], p[2] };
+			bvh_box_grow(box, pbox);
+		}
+	}
+	bvh_build(b, boxes, triangleCount);
+	b->triangles = triangles;
+	free(boxes);
+}
+
+/** Calculates the box of each kuhl_geometry object in a list after
+ * it is transformed by its GeomTransform and a model matrix. Objects
+ * without a bounding box get an infinite box so that queries always
+ * return them.
+ *
+ * @return An array of 6 floats per object that must be free()'d.
+ */
+static float* bvh_geometry_boxes(kuhl_geometry *geom, const float model[16], int *count)
+{
+	*count = (int) kuhl_geometry_count(geom);
+	float *boxes = kuhl_malloc(sizeof(float)*6*(*count > 0 ? *count : 1));
+	int i = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next, i++)
+	{
+		float *box = boxes+i*6;
+		if(!g->has_bounds)
+		{
+			for(int j=0; j<6; j=j+2)
+			{
+				box[j]   = -FLT_MAX;
+				box[j+1] = FLT_MAX;
+			}
+			continue;
+		}
+		float mat[16];
+		if(model)
+			mat4f_mult_mat4f_new(mat, model, g->matrix);
+		else
+			mat4f_copy(mat, g->matrix);
+		memcpy(box, g->aabbox, sizeof(float)*6);
+		kuhl_bbox_transform(box, mat);
+	}
+	return boxes;
+}
+
+/** Builds a bounding volume hierarchy from the objects in a
+ * kuhl_geometry list. Queries return the position of an object in
+ * the list (0 for geom, 1 for geom->next, etc).
+
+    @param b The BVH.
+
+    @param geom The list of geometry. Each object uses its bounding
+    box (kuhl_geometry->aabbox) transformed by its GeomTransform
+    matrix. Objects without bounds are returned by every query.
+
+    @param model A matrix applied to every object in the list (for
+    example, the model matrix) or NULL.
+
+    @return The number of objects in the BVH.
+*/
+int bvh_build_geometry(bvh *b, kuhl_geometry *geom, const float model[16])
+{
+	if(b == NULL)
+		return 0;
+	int count = 0;
+	float *boxes = bvh_geometry_boxes(geom, model, &count);
+	bvh_build(b, boxes, count);
+	free(boxes);
+	return count;
+}
+
+/** Updates the boxes in a bounding volume hierarchy after the items
+ * have moved without changing the structure of the tree.
+
+    @param b The BVH.
+
+    @param boxes The new box of each item (6 floats per item in the
+    same order as when the tree was built) or NULL if the caller
+    modified b->boxes directly.
+*/
+void bvh_refit(bvh *b, const float *boxes)
+{
+	if(b == NULL || b->nodeCount == 0)
+		return;
+	if(boxes)
+		memcpy(b->boxes, boxes, sizeof(float)*6*b->itemCount);
+
+	/* Children are stored after their parents, so visiting the
+	 * nodes backwards updates every child before its parent. */
+	for(int i=b->nodeCount-1; i>=0; i--)
+	{
+		bvh_node *node = &(b->nodes[i]);
+		bvh_box_empty(node->box);
+		if(node->left < 0)
+		{
+			for(int j=node->first; j<node->first+node->count; j++)
+				bvh_box_grow(node->box, b->boxes+b->items[j]*6);
+		}
+		else
+		{
+			bvh_box_grow(node->box, b->nodes[node->left].box);
+			bvh_box_grow(node->box, b->nodes[node->right].box);
+		}
+	}
+}
+
+/** Updates a BVH built with bvh_build_geometry() after the
+ * GeomTransform matrices (for example, from kuhl_update_model()) or
+ * the model matrix changed. The list must contain the same objects as
+ * when the tree was built.
+
+    @param b The BVH.
+
+    @param geom The list of geometry.
+
+    @param model A matrix applied to every object in the list or NULL.
+*/
+void bvh_refit_geometry(bvh *b, kuhl_geometry *geom, const float model[16])
+{
+	if(b == NULL)
+		return;
+	int count = 0;
+	float *boxes = bvh_geometry_boxes(geom, model, &count);
+	if(count != b->itemCount)
+		msg(MSG_ERROR, "Unable to refit BVH with %d items using a list of %d geometry objects.", b->itemCount, count);
+	else
+		bvh_refit(b, boxes);
+	free(boxes);
+}
+
+/** Adds every item under a node to a list. */
+static void bvh_collect(const bvh *b, int index, list *results)
+{
+	const bvh_node *node = &(b->nodes[index]);
+	if(node->left < 0)
+	{
+		for(int i=node->first; i<node->first+node->count; i++)
+			list_append(results, &(b->items[i]));
+		return;
+	}
+	bvh_collect(b, node->left, results);
+	bvh_collect(b, node->right, results);
+}
+
+/** Tests a box against frustum planes.
+ *
+ * @return 0 if the box is outside of the frustum, 1 if it intersects
+ * the frustum and 2 if it is entirely inside of the frustum.
+ */
+static int bvh_box_frustum(const float box[6], float planes[6][4])
+{
+	int inside = 1;
+	for(int i=0; i<6; i++)
+	{
+		const float *p = planes[i];
+		/* The corner furthest along the plane normal and the corner
+		 * furthest against it. */
+		float far = p[0]*(p[0] > 0 ? box[1] : box[0]) +
+		            p[1]*(p[1] > 0 ? box[3] : box[2]) +
+		            p[2]*(p[2] > 0 ? box[5] : box[4]) + p[3];
+		if(far < 0)
+			return 0;
+		float near = p[0]*(p[0] > 0 ? box[0] : box[1]) +
+		             p[1]*(p[1] > 0 ? box[2] : box[3]) +
+		             p[2]*(p[2] > 0 ? box[4] : box[5]) + p[3];
+		if(near < 0)
+			inside = 0;
+	}
+	return inside ? 2 : 1;
+}
+
+static void bvh_frustum_node(const bvh *b, int index, float planes[6][4], list *results)
+{
+	const bvh_node *node = &(b->nodes[index]);
+	int result = bvh_box_frustum(node->box, planes);
+	if(result == 0)
+		return;
+	if(result == 2)
+	{
+		bvh_collect(b, index, results);
+		return;
+	}
+	if(node->left < 0)
+	{
+		for(int i=node->first; i<node->first+node->count; i++)
+		{
+			if(bvh_box_frustum(b->boxes+b->items[i]*6, planes))
+				list_append(results, &(b->items[i]));
+		}
+		return;
+	}
+	bvh_frustum_node(b, node->left, planes, results);
+	bvh_frustum_node(b, node->right, planes, results);
+}
+
+/** Finds the items whose boxes are at least partially inside of a
+ * view frustum.
+
+    @param b The BVH.
+
+    @param planes The frustum planes in the same coordinate system as
+    the boxes in the BVH (see kuhl_frustum_planes()).
+
+    @param results A list of ints (created with list_new(n,
+    sizeof(int), NULL)) that the index of each item is appended to.
+
+    @return The number of items appended to results.
+*/
+int bvh_frustum(const bvh *b, float planes[6][4], list *results)
+{
+	if(b == NULL || results == NULL || b->itemCount == 0)
+		return 0;
+	int before = list_length(results);
+	bvh_frustum_node(b, 0, planes, results);
+	return list_length(results) - before;
+}
+
+/** Checks if two boxes overlap. */
+static int bvh_box_overlap(const float a[6], const float box[6])
+{
+	for(int i=0; i<6; i=i+2)
+	{
+		if(a[i] > box[i+1] || a[i+1] < box[i])
+			return 0;
+	}
+	return 1;
+}
+
+static void bvh_overlap_node(const bvh *b, int index, const float box[6], list *results)
+{
+	const bvh_node *node = &(b->nodes[index]);
+	if(!bvh_box_overlap(node->box, box))
+		return;
+	if(node->left < 0)
+	{
+		for(int i=node->first; i<node->first+node->count; i++)
+		{
+			if(bvh_box_overlap(b->boxes+b->items[i]*6, box))
+				list_append(results, &(b->items[i]));
+		}
+		return;
+	}
+	bvh_overlap_node(b, node->left, box, results);
+	bvh_overlap_node(b, node->right, box, results);
+}
+
+/** Finds the items whose boxes overlap a box. Useful for collision
+ * detection: check which items overlap the box around a moving
+ * object and then test those items more precisely.
+
+    @param b The BVH.
+
+    @param box The query box (xmin, xmax, ymin, ymax, zmin, zmax).
+
+    @param results A list of ints that the index of each item is
+    appended to.
+
+    @return The number of items appended to results.
+*/
+int bvh_overlap(const bvh *b, const float box[6], list *results)
+{
+	if(b == NULL || results == NULL || b->itemCount == 0)
+		return 0;
+	int before = list_length(results);
+	bvh_overlap_node(b, 0, box, results);
+	return list_length(results) - before;
+}
+
+/** Intersects a ray with a box using the slab method.
+ *
+ * @param invDir 1/dir for each component of the ray direction.
+ *
+ * @return The distance to where the ray enters the box (0 if the
+ * origin is inside of the box) or -1 if the ray misses the box or
+ * only hits it beyond maxDist.
+ */
+static float bvh_ray_box(const float box[6], const float origin[3], const float invDir[3], float maxDist)
+{
+	float tmin = 0, tmax = maxDist;
+	for(int i=0; i<3; i++)
+	{
+		float t1 = (box[2*i]   - origin[i]) * invDir[i];
+		float t2 = (box[2*i+1] - origin[i]) * invDir[i];
+		/* 0*inf is NaN when the ray is parallel to a slab and starts
+		 * on its boundary; treat that as inside. */
+		if(t1 != t1) t1 = -FLT_MAX;
+		if(t2 != t2) t2 = FLT_MAX;
+		if(t1 > t2)
+		{
+			float tmp = t1; t1 = t2; t2 = tmp;
+		}
+		if(t1 > tmin) tmin = t1;
+		if(t2 < tmax) tmax = t2;
+		if(tmin > tmax)
+			return -1;
+	}
+	return tmin;
+}
+
+/** Intersects a ray with a triangle (Moller-Trumbore).
+ *
+ * @return The distance along the ray or -1 if there is no hit.
+ */
+static float bvh_ray_triangle(const float tri[9], const float origin[3], const float dir[3])
+{
+	float e1[3], e2[3], p[3], t[3], q[3];
+	vec3f_sub_new(e1, tri+3, tri);
+	vec3f_sub_new(e2, tri+6, tri);
+	vec3f_cross_new(p, dir, e2);
+	float det = vec3f_dot(e1, p);
+	if(fabsf(det) < 1e-12f)
+		return -1;
+	float invDet = 1.0f / det;
+	vec3f_sub_new(t, origin, tri);
+	float u = vec3f_dot(t, p) * invDet;
+	if(u < 0 || u > 1)
+		return -1;
+	vec3f_cross_new(q, t, e1);
+	float v = vec3f_dot(dir, q) * invDet;
+	if(v < 0 || u + v > 1)
+		return -1;
+	return vec3f_dot(e2, q) * invDet;
+}
+
+/** State shared by the recursive ray traversal. */
+typedef struct {
+	const float *origin, *dir;
+	float invDir[3];
+	bvh_ray_func func;
+	void *data;
+	float best; /**< Distance to the closest hit so far */
+	int bestItem; /**< Closest item hit so far */
+} bvh_ray_state;
+
+static void bvh_ray_node(const bvh *b, int index, bvh_ray_state *s)
+{
+	const bvh_node *node = &(b->nodes[index]);
+	if(bvh_ray_box(node->box, s->origin, s->invDir, s->best) < 0)
+		return;
+	if(node->left < 0)
+	{
+		for(int i=node->first; i<node->first+node->count; i++)
+		{
+			int item = b->items[i];
+			float t;
+			if(s->func)
+				t = s->func(item, s->origin, s->dir, s->data);
+			else if(b->triangles)
+				t = bvh_ray_triangle(b->triangles+item*9, s->origin, s->dir);
+			else
+				t = bvh_ray_box(b->boxes+item*6, s->origin, s->invDir, s->best);
+			if(t >= 0 && t <= s->best)
+			{
+				s->best = t;
+				s->bestItem = item;
+			}
+		}
+		return;
+	}
+
+	/* Visit the closer child first so that the second child can
+	 * often be skipped. */
+	int first = node->left, second = node->right;
+	float tl = bvh_ray_box(b->nodes[first].box, s->origin, s->invDir, s->best);
+	float tr = bvh_ray_box(b->nodes[second].box, s->origin, s->invDir, s->best);
+	if(tr >= 0 && (tl < 0 || tr < tl))
+	{
+		first = node->right;
+		second = node->left;
+	}
+	bvh_ray_node(b, first, s);
+	bvh_ray_node(b, second, s);
+}
+
+/** Finds the closest item hit by a ray.
+
+    @param b The BVH.
+
+    @param origin The start of the ray.
+
+    @param dir The direction of the ray. It does not need to be
+    normalized; distances are measured in multiples of dir.
+
+    @param maxDist Ignore hits further away than this (use FLT_MAX
+    for no limit).
+
+    @param func Function which tests if the ray hits an item
+    exactly. If NULL, the ray is tested against the triangles (if the
+    BVH was built with bvh_build_triangles()) or against the box of
+    each item.
+
+    @param data Pointer passed to func.
+
+    @param hitDist Filled in with the distance to the hit. Can be NULL.
+
+    @return The index of the closest item hit or -1 if nothing was hit.
+*/
+int bvh_ray(const bvh *b, const float origin[3], const float dir[3], float maxDist,
+            bvh_ray_func func, void *data, float *hitDist)
+{
+	if(b == NULL || b->itemCount == 0)
+		return -1;
+
+	bvh_ray_state s;
+	s.origin = origin;
+	s.dir = dir;
+	for(int i=0; i<3; i++)
+		s.invDir[i] = 1.0f / dir[i]; // infinity if dir[i] is 0
+	s.func = func;
+	s.data = data;
+	s.best = maxDist;
+	s.bestItem = -1;
+	bvh_ray_node(b, 0, &s);
+
+	if(hitDist && s.bestItem >= 0)
+		*hitDist = s.best;
+	return s.bestItem;
+}
+
+/** Finds the item closest to p1 that is hit by the line segment from
+ * p1 to p2.
+
+    @param b The BVH.
+
+    @param p1 The start of the segment.
+
+    @param p2 The end of the segment.
+
+    @param func Function which tests if the segment hits an item
+    exactly or NULL (see bvh_ray()).
+
+    @param data Pointer passed to func.
+
+    @param hitFraction Filled in with the location of the hit between
+    0 (at p1) and 1 (at p2). Can be NULL.
+
+    @return The index of the item hit or -1 if nothing was hit.
+*/
+int bvh_segment(const bvh *b, const float p1[3], const float p2[3],
+                bvh_ray_func func, void *data, float *hitFraction)
+{
+	float dir[3];
+	vec3f_sub_new(dir, p2, p1);
+	return bvh_ray(b, p1, dir, 1, func, data, hitFraction);
+}
@@ -0,0 +1,103 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    A bounding volume hierarchy (BVH) is a binary tree of axis-aligned
+    bounding boxes. Each leaf contains a few items (objects or
+    triangles) and each interior node contains a box which encloses
+    both of its children. Queries skip entire subtrees whose boxes
+    don't intersect the query, so finding the items inside of a view
+    frustum, overlapping a box or hit by a ray takes roughly O(log n)
+    time instead of O(n).
+
+    A BVH can be built from:
+     - an array of boxes (bvh_build()),
+     - an array of triangles (bvh_build_triangles()), or
+     - the nodes in a kuhl_geometry list (bvh_build_geometry()).
+
+    If the items move, bvh_refit() updates the boxes in the tree
+    without changing its structure. Refitting is much faster than
+    rebuilding, but queries become slower if the items move far from
+    where they were when the tree was built. In that case, rebuild
+    the tree.
+
+    Boxes are stored as xmin, xmax, ymin, ymax, zmin, zmax (the same
+    as kuhl_geometry->aabbox and kuhl_bbox_transform()).
+
+    <pre>
+    // CPU picking without reading back pixels:
+    bvh *b = bvh_new();
+    bvh_build_triangles(b, positions, indices, triangleCount);
+    float dist;
+    int tri = bvh_ray(b, rayOrigin, rayDir, FLT_MAX, NULL, NULL, &dist);
+    </pre>
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "kuhl-util.h"
+#include "list.h"
+
+/** Maximum number of items stored in a leaf of the tree. */
+#define BVH_LEAF_SIZE 4
+
+/** A node in a bounding volume hierarchy. Children are always stored
+ * after their parent in bvh->nodes. */
+typedef struct {
+	float box[6]; /**< Box enclosing everything in this node */
+	int left; /**< Index of the left child or -1 if this is a leaf */
+	int right; /**< Index of the right child or -1 if this is a leaf */
+	int first; /**< Index into bvh->items of the first item in a leaf */
+	int count; /**< Number of items in a leaf (0 for interior nodes) */
+} bvh_node;
+
+typedef struct {
+	bvh_node *nodes; /**< Nodes of the tree; nodes[0] is the root */
+	int nodeCount; /**< Number of nodes in the tree */
+	int *items; /**< Item indices, reordered so each leaf is contiguous */
+	float *boxes; /**< Box of each item (6 floats per item, in the original order) */
+	int itemCount; /**< Number of items in the tree */
+	float *triangles; /**< Vertices of each triangle (9 floats per item) if built with bvh_build_triangles() */
+} bvh;
+
+/** Function that checks if a ray hits an item exactly.
+
+    @param item The index of the item.
+
+    @param origin The origin of the ray.
+
+    @param dir The direction of the ray.
+
+    @param data The data pointer passed to bvh_ray().
+
+    @return The distance along the ray (in multiples of dir) to the
+    intersection, or a negative number if the ray misses the item.
+*/
+typedef float (*bvh_ray_func)(int item, const float origin[3], const float dir[3], void *data);
+
+bvh* bvh_new(void);
+void bvh_free(bvh *b);
+void bvh_build(bvh *b, const float *boxes, int count);
+void bvh_build_triangles(bvh *b, const float *positions, const unsigned int *indices, int triangleCount);
+int bvh_build_geometry(bvh *b, kuhl_geometry *geom, const float model[16]);
+void bvh_refit(bvh *b, const float *boxes);
+void bvh_refit_geometry(bvh *b, kuhl_geometry *geom, const float model[16]);
+
+int bvh_frustum(const bvh *b, float planes[6][4], list *results);
+int bvh_overlap(const bvh *b, const float box[6], list *results);
+int bvh_ray(const bvh *b, const float origin[3], const float dir[3], float maxDist,
+            bvh_ray_func func, void *data, float *hitDist);
+int bvh_segment(const bvh *b, const float p1[3], const float p2[3],
+                bvh_ray_func func, void *data, float *hitFraction);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
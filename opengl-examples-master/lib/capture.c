@@ -0,0 +1,425 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#define CAPTURE_THREADS 1
+#endif
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include "capture.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "queue.h"
+#include "msg.h"
+#include "video.h"
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+#include "imageio.h"
+#else
+#include "stb_image_write.h" // implementation is in kuhl-util.c
+#endif
+
+/** The largest number of pixel pack buffers we will use. */
+#define CAPTURE_MAX_BUFFERS 8
+
+/** A read of the framebuffer into a pixel pack buffer which may not
+ * have finished yet. */
+typedef struct {
+	GLuint pbo;       /**< Pixel pack buffer that the pixels are read into */
+	GLsizeiptr size;  /**< Current size of the buffer in bytes */
+	GLsync fence;     /**< Signaled when the read has finished */
+	int width, height;
+	char *filename;   /**< File to write to */
+	video_encoder *video; /**< Video to add the frame to (instead of a file) */
+} capture_readback;
+
+/** An image waiting to be flipped and encoded. */
+typedef struct {
+	unsigned char *pixels; /**< RGB pixels with the bottom row first */
+	int width, height;
+	char *filename;
+	video_encoder *video;
+} capture_job;
+
+static capture_readback capture_ring[CAPTURE_MAX_BUFFERS];
+static int capture_buffers = 0; /**< Number of buffers in ring, 0 before capture_init() */
+static int capture_oldest = 0;  /**< Index of the oldest read in the ring */
+static int capture_pending = 0; /**< Number of reads in the ring */
+
+static queue *capture_jobs = NULL;  /**< Images waiting for the encoder */
+static int capture_queue_max = 0;   /**< Maximum length of capture_jobs */
+static unsigned int capture_captured = 0;
+static unsigned int capture_dropped = 0;
+
+#ifdef CAPTURE_THREADS
+static pthread_t capture_thread;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when a job is added or the encoder should exit. */
+static pthread_cond_t capture_cond_work = PTHREAD_COND_INITIALIZER;
+/** Signaled when the encoder finishes a job. */
+static pthread_cond_t capture_cond_idle = PTHREAD_COND_INITIALIZER;
+static int capture_busy = 0; /**< Is the encoder writing an image? */
+static int capture_quit = 0; /**< Should the encoder exit when the queue is empty? */
+#endif
+
+
+/** Returns a name for a frame that can be used in messages. */
+static const char* capture_name(const char *filename, const video_encoder *video)
+{
+	if(filename)
+		return filename;
+	return video->filename;
+}
+
+/** Flips and writes an image to disk (or adds the frame to a video)
+ * and frees the job.
+
+    @return 1 if the image was written, 0 otherwise.
+*/
+static int capture_write(capture_job *job)
+{
+	int ok = 0;
+	if(job->video)
+	{
+		/* The video encoder flips the image while converting it. */
+		ok = video_encoder_frame(job->video, job->pixels, job->width, job->height);
+		free(job->pixels);
+		return ok;
+	}
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	/* imageout() flips the image itself. */
+	imageio_info info;
+	info.width    = job->width;
+	info.height   = job->height;
+	info.depth    = 8;
+	info.quality  = 85;
+	info.colorspace = sRGBColorspace;
+	info.filename = job->filename;
+	info.comment  = NULL;
+	info.type     = CharPixel;
+	info.map      = "RGB";
+	ok = imageout(&info, job->pixels);
+#else
+	kuhl_flip_texture_array(job->pixels, job->width, job->height, 3);
+	const char *s = job->filename;
+	size_t len = strlen(s);
+	if(len > 4 && !strcmp(s + len - 4, ".png"))
+		ok = stbi_write_png(s, job->width, job->height, 3, job->pixels, job->width*3);
+	else if(len > 4 && !strcmp(s + len - 4, ".tga"))
+		ok = stbi_write_tga(s, job->width, job->height, 3, job->pixels);
+	else if(len > 4 && !strcmp(s + len - 4, ".bmp"))
+		ok = stbi_write_bmp(s, job->width, job->height, 3, job->pixels);
+#endif
+	if(!ok)
+		msg(MSG_ERROR, "Failed to write captured frame to %s", job->filename);
+
+	free(job->pixels);
+	free(job->filename);
+	return ok;
+}
+
+#ifdef CAPTURE_THREADS
+/** Encodes images from capture_jobs until capture_quit is set and the
+ * queue is empty. */
+static void* capture_worker(void *arg)
+{
+	pthread_mutex_lock(&capture_mutex);
+	while(1)
+	{
+		while(queue_length(capture_jobs) == 0 && !capture_quit)
+			pthread_cond_wait(&capture_cond_work, &capture_mutex);
+		if(queue_length(capture_jobs) == 0)
+			break;
+
+		capture_job job;
+		queue_remove(capture_jobs, &job);
+		capture_busy = 1;
+		pthread_mutex_unlock(&capture_mutex);
+
+		int ok = capture_write(&job);
+
+		pthread_mutex_lock(&capture_mutex);
+		capture_busy = 0;
+		if(ok)
+			capture_captured++;
+		pthread_cond_broadcast(&capture_cond_idle);
+	}
+	pthread_mutex_unlock(&capture_mutex);
+	return NULL;
+}
+
+/** Lets the encoder finish the images that are already queued. Reads
+ * that are still in the ring are lost because the OpenGL context may
+ * already be gone; call capture_flush() to keep them. */
+static void capture_shutdown(void)
+{
+	pthread_mutex_lock(&capture_mutex);
+	capture_quit = 1;
+	pthread_cond_broadcast(&capture_cond_work);
+	pthread_mutex_unlock(&capture_mutex);
+	pthread_join(capture_thread, NULL);
+}
+#endif
+
+/** Creates the pixel pack buffers and starts the encoder thread the
+ * first time that it is called. */
+static void capture_init(void)
+{
+	if(capture_buffers > 0)
+		return;
+
+	capture_buffers = kuhl_config_int("capture.buffers", 3, 3);
+	if(capture_buffers < 1)
+		capture_buffers = 1;
+	if(capture_buffers > CAPTURE_MAX_BUFFERS)
+		capture_buffers = CAPTURE_MAX_BUFFERS;
+	capture_queue_max = kuhl_config_int("capture.queue", 8, 8);
+	if(capture_queue_max < 1)
+		capture_queue_max = 1;
+
+	memset(capture_ring, 0, sizeof(capture_ring));
+	for(int i=0; i<capture_buffers; i++)
+		glGenBuffers(1, &capture_ring[i].pbo);
+	kuhl_errorcheck();
+
+	capture_jobs = queue_new(capture_queue_max, sizeof(capture_job));
+#ifdef CAPTURE_THREADS
+	if(pthread_create(&capture_thread, NULL, capture_worker, NULL) != 0)
+	{
+		msg(MSG_FATAL, "Unable to start the frame capture thread.");
+		exit(EXIT_FAILURE);
+	}
+	atexit(capture_shutdown);
+#endif
+	msg(MSG_DEBUG, "Frame capture: %d pixel pack buffers, up to %d frames waiting to be encoded.",
+	    capture_buffers, capture_queue_max);
+}
+
+/** Copies the pixels out of the oldest pixel pack buffer (whose read
+ * must be finished) and hands them to the encoder. The oldest read
+ * is then removed from the ring.
+
+    @param wait If 1, wait for the encoder to make room when the queue
+    is full. If 0, drop the frame instead.
+*/
+static void capture_finish(int wait)
+{
+	capture_readback *r = &capture_ring[capture_oldest];
+	glDeleteSync(r->fence);
+	r->fence = 0;
+	capture_oldest = (capture_oldest+1) % capture_buffers;
+	capture_pending--;
+
+	capture_job job;
+	job.width = r->width;
+	job.height = r->height;
+	job.filename = r->filename;
+	job.video = r->video;
+	r->filename = NULL;
+	r->video = NULL;
+
+#ifdef CAPTURE_THREADS
+	pthread_mutex_lock(&capture_mutex);
+	while(wait && queue_length(capture_jobs) >= capture_queue_max)
+		pthread_cond_wait(&capture_cond_idle, &capture_mutex);
+	int full = queue_length(capture_jobs) >= capture_queue_max;
+	if(full)
+		capture_dropped++;
+	/* If the encoder thread has already exited (we are called from
+	 * an atexit() handler), write the image here instead. */
+	int stopped = capture_quit;
+	pthread_mutex_unlock(&capture_mutex);
+	if(full)
+	{
+		msg(MSG_DEBUG, "Frame capture: Encoder is behind, dropped %s", capture_name(job.filename, job.video));
+		free(job.filename);
+		return;
+	}
+#endif
+
+	size_t size = (size_t) job.width*job.height*3;
+	job.pixels = kuhl_malloc(size);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo);
+	void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if(mapped != NULL)
+	{
+		memcpy(job.pixels, mapped, size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	kuhl_errorcheck();
+	if(mapped == NULL)
+	{
+		msg(MSG_ERROR, "Frame capture: Failed to map pixel pack buffer for %s", capture_name(job.filename, job.video));
+		free(job.pixels);
+		free(job.filename);
+		return;
+	}
+
+#ifdef CAPTURE_THREADS
+	if(!stopped)
+	{
+		pthread_mutex_lock(&capture_mutex);
+		queue_add(capture_jobs, &job);
+		pthread_cond_signal(&capture_cond_work);
+		pthread_mutex_unlock(&capture_mutex);
+		return;
+	}
+#endif
+	if(capture_write(&job))
+		capture_captured++;
+}
+
+/** Starts reading the current framebuffer into the next pixel pack
+ * buffer. Exactly one of filename and video should be set. */
+static int capture_read(const char *filename, video_encoder *video)
+{
+	capture_init();
+	capture_poll();
+
+	if(capture_pending == capture_buffers)
+	{
+#ifdef CAPTURE_THREADS
+		pthread_mutex_lock(&capture_mutex);
+		capture_dropped++;
+		pthread_mutex_unlock(&capture_mutex);
+#else
+		capture_dropped++;
+#endif
+		msg(MSG_DEBUG, "Frame capture: All pixel pack buffers are busy, dropped %s", capture_name(filename, video));
+		return 0;
+	}
+
+	int width, height;
+	glfwGetFramebufferSize(kuhl_get_window(), &width, &height);
+
+	capture_readback *r = &capture_ring[(capture_oldest+capture_pending) % capture_buffers];
+	GLsizeiptr size = (GLsizeiptr) width*height*3;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, r->pbo);
+	if(r->size != size)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		r->size = size;
+	}
+
+	/* Rows of RGB pixels aren't necessarily a multiple of 4 bytes
+	 * long. */
+	GLint alignment;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	r->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	r->width = width;
+	r->height = height;
+	r->filename = filename ? strdup(filename) : NULL;
+	r->video = video;
+	capture_pending++;
+	kuhl_errorcheck();
+	return 1;
+}
+
+/** Starts reading the current framebuffer so that it can be written
+    to an image file later. The read happens asynchronously; call
+    capture_poll() once per frame so that finished reads are passed to
+    the encoder.
+
+    @param filename The image file to write. Without ImageMagick, the
+    file must end in .png, .tga or .bmp.
+
+    @return 1 if the frame will be captured, 0 if it was dropped
+    because all of the pixel pack buffers are still in use.
+*/
+int capture_frame(const char *filename)
+{
+	return capture_read(filename, NULL);
+}
+
+/** Starts reading the current framebuffer so that it can be added to
+    a video. Like capture_frame(), the frame is read asynchronously
+    and encoded on the encoder thread. Frames are added to the video
+    in the order they were captured.
+
+    @param video A video created with video_encoder_new() whose size
+    matches the framebuffer. Call capture_flush() before
+    video_encoder_free().
+
+    @return 1 if the frame will be captured, 0 if it was dropped.
+*/
+int capture_video_frame(video_encoder *video)
+{
+	return capture_read(NULL, video);
+}
+
+/** Passes any finished framebuffer reads to the encoder without
+ * waiting for the GPU. Call once per frame while capturing. */
+void capture_poll(void)
+{
+	while(capture_pending > 0)
+	{
+		GLenum result = glClientWaitSync(capture_ring[capture_oldest].fence, 0, 0);
+		if(result == GL_TIMEOUT_EXPIRED)
+			return;
+		if(result == GL_WAIT_FAILED)
+			msg(MSG_ERROR, "Frame capture: Failed to wait on fence.");
+		capture_finish(0);
+	}
+}
+
+/** Waits until every frame passed to capture_frame() has been written
+ * to disk (or dropped). */
+void capture_flush(void)
+{
+	while(capture_pending > 0)
+	{
+		GLsync fence = capture_ring[capture_oldest].fence;
+		GLenum result;
+		do {
+			result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		} while(result == GL_TIMEOUT_EXPIRED);
+		capture_finish(1);
+	}
+
+#ifdef CAPTURE_THREADS
+	if(capture_jobs == NULL)
+		return;
+	pthread_mutex_lock(&capture_mutex);
+	while(queue_length(capture_jobs) > 0 || capture_busy)
+		pthread_cond_wait(&capture_cond_idle, &capture_mutex);
+	pthread_mutex_unlock(&capture_mutex);
+#endif
+}
+
+/** Retrieves how many frames have been written and how many were
+ * dropped because the GPU or the encoder was behind.
+
+    @param captured Set to the number of frames written to disk. May
+    be NULL.
+
+    @param dropped Set to the number of frames that were dropped. May
+    be NULL.
+*/
+void capture_stats(unsigned int *captured, unsigned int *dropped)
+{
+#ifdef CAPTURE_THREADS
+	pthread_mutex_lock(&capture_mutex);
+#endif
+	if(captured)
+		*captured = capture_captured;
+	if(dropped)
+		*dropped = capture_dropped;
+#ifdef CAPTURE_THREADS
+	pthread_mutex_unlock(&capture_mutex);
+#endif
+}
@@ -0,0 +1,59 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Captures the framebuffer to image files without stalling the
+    rendering loop. kuhl_screenshot() calls glReadPixels() into
+    client memory which waits until the GPU has finished the frame and
+    then encodes the image on the render thread. Instead, this file:
+
+    * Reads the framebuffer into one of a small ring of pixel pack
+      buffers and puts a fence after the read. The read finishes on
+      the GPU while we continue rendering. A later call to
+      capture_poll() copies the pixels out once the fence has signaled.
+
+    * Hands the pixels to a background thread which flips the image
+      vertically and encodes it, either as an image file or as the
+      next frame of a video (see video_encoder_new()). On machines
+      without pthreads, the images are encoded during capture_poll()
+      instead.
+
+    * Limits how many images may wait to be encoded. If the encoder
+      falls behind (or every pixel pack buffer is still in use), the
+      frame is dropped and counted instead of slowing rendering down.
+
+    <pre>
+    // In the display function, after rendering the frame:
+    capture_frame("frame-00001.png");
+    ...
+    capture_poll();  // once per frame
+    ...
+    capture_flush(); // before exiting to write pending images
+    </pre>
+
+    Settings: capture.buffers sets the number of pixel pack buffers
+    (default 3), and capture.queue sets the number of images that may
+    wait for the encoder (default 8).
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include "video.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int capture_frame(const char *filename);
+int capture_video_frame(video_encoder *video);
+void capture_poll(void);
+void capture_flush(void);
+void capture_stats(unsigned int *captured, unsigned int *dropped);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -94,11 +94,15 @@ int font_info_new(font_info* info, const GLuint program, const char* fontFile, c
 	glBindVertexArray(info->vao);
 	kuhl_errorcheck();
 	
-	glGenBuffers(1, &info->vbo);
+	/* Each character is a quad of four vertices that is written
+	 * into a streaming buffer instead of reallocating a buffer with
+	 * glBufferData() for every character. Each region holds 256
+	 * characters. */
+	info->stream = streambuf_new(sizeof(GLfloat)*4*4*256, 3);
 	kuhl_errorcheck();
 	glEnableVertexAttribArray(info->attribute_coord);
 	kuhl_errorcheck();
-	glBindBuffer(GL_ARRAY_BUFFER, info->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, streambuf_id(info->stream));
 	kuhl_errorcheck();
 	glVertexAttribPointer(info->attribute_coord, 4, GL_FLOAT, GL_FALSE, 0, 0);
 	kuhl_errorcheck();
@@ -137,7 +141,8 @@ void font_info_release(font_info* info)
 {
 	glDeleteTextures(1, &info->tex);
 	glDeleteVertexArrays(1, &info->vao);
-	glDeleteBuffers(1, &info->vbo);
+	streambuf_free(info->stream);
+	info->stream = NULL;
 }
 
 void font_release() {
@@ -186,9 +191,13 @@ static void render_char(font_info* info, const char ch, float* x, float* y, floa
 		{x2 + w, -y2 - h, 1, 1},
 	};
 
-	glBufferData(GL_ARRAY_BUFFER, sizeof box, box, GL_DYNAMIC_DRAW);
+	/* Every character is drawn right after it is written, so the
+	 * stream can move to the next region whenever one fills up. */
+	if(!streambuf_fits(info->stream, sizeof box))
+		streambuf_next(info->stream);
+	GLintptr offset = streambuf_write(info->stream, box, sizeof box);
 	kuhl_errorcheck();
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glDrawArrays(GL_TRIANGLE_STRIP, offset / sizeof box[0], 4);
 	kuhl_errorcheck();
 	
 	*x += (g->advance.x >> 6) * sx;
@@ -203,7 +212,7 @@ void font_draw(font_info* info, const char *text, float x, float y) {
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, info->tex);
 	glBindVertexArray(info->vao);
-	glBindBuffer(GL_ARRAY_BUFFER, info->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, streambuf_id(info->stream));
 	glEnableVertexAttribArray(info->attribute_coord);
 	
 	y += info->pointSize; // Bitmaps start at bottom-left corner.
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <GL/glew.h>
+#include "streambuf.h"
 
 
 
@@ -20,7 +21,7 @@ typedef struct _font_info_ {
 	//float colorBG[4];
 	GLuint program;
 	GLuint tex;
-	GLuint vbo;
+	streambuf *stream;
 	GLuint vao;
 	GLint uniform_tex;
 	GLint attribute_coord;
@@ -0,0 +1,432 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#define JOBS_THREADS 1
+#endif
+
+#include "jobs.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "msg.h"
+
+/** The largest number of worker threads we will start. */
+#define JOBS_MAX_THREADS 32
+
+/** A job waiting to run. */
+typedef struct {
+	jobs_func func;
+	void *arg;
+	jobs_group *group;
+} jobs_item;
+
+/** A range of indices for jobs_parallel_for(). */
+typedef struct {
+	jobs_range_func func;
+	void *arg;
+	int begin, end;
+} jobs_range;
+
+#ifdef JOBS_THREADS
+/** The jobs added by one thread. The thread that owns the deque adds
+ * and removes jobs at the bottom. Other threads steal jobs from the
+ * top, which are the oldest jobs and usually the largest amount of
+ * remaining work. */
+typedef struct {
+	pthread_mutex_t lock;
+	jobs_item *items;
+	int capacity;
+	int top;    /**< Index of the oldest job */
+	int bottom; /**< Index after the newest job */
+} jobs_deque;
+
+/** One deque per worker plus one (index 0) shared by threads that
+ * aren't workers, such as the main thread. */
+static jobs_deque jobs_deques[JOBS_MAX_THREADS+1];
+static pthread_t jobs_threads[JOBS_MAX_THREADS];
+static int jobs_worker_count = 0;
+static int jobs_initialized = 0;
+
+/** Protects jobs_sleeping, jobs_quit and the pending count in every
+ * jobs_group. */
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when jobs are added or the workers should exit. */
+static pthread_cond_t jobs_cond_work = PTHREAD_COND_INITIALIZER;
+/** Signaled when the last job in a group finishes. */
+static pthread_cond_t jobs_cond_done = PTHREAD_COND_INITIALIZER;
+static int jobs_sleeping = 0; /**< Number of workers waiting for jobs */
+static int jobs_quit = 0;
+
+/** Stores the index of the deque for each worker thread. */
+static pthread_key_t jobs_key;
+
+/** Returns the index of the deque that the calling thread should add
+ * jobs to. */
+static int jobs_self(void)
+{
+	return (int) (intptr_t) pthread_getspecific(jobs_key);
+}
+
+/** Adds a job to the bottom of a deque. */
+static void jobs_push(int index, const jobs_item *item)
+{
+	jobs_deque *d = &jobs_deques[index];
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom == d->capacity)
+	{
+		/* Move the jobs to the start of the array, and make the array
+		 * larger if it is at least half full. */
+		int count = d->bottom - d->top;
+		if(count >= d->capacity/2)
+		{
+			d->capacity = d->capacity < 64 ? 64 : d->capacity*2;
+			d->items = realloc(d->items, sizeof(jobs_item)*d->capacity);
+			if(d->items == NULL)
+			{
+				msg(MSG_FATAL, "Failed to allocate space for jobs.");
+				exit(EXIT_FAILURE);
+			}
+		}
+		memmove(d->items, d->items+d->top, sizeof(jobs_item)*count);
+		d->top = 0;
+		d->bottom = count;
+	}
+	d->items[d->bottom++] = *item;
+	pthread_mutex_unlock(&d->lock);
+}
+
+/** Removes the newest job from a deque.
+ * @return 1 if a job was removed, 0 if the deque was empty. */
+static int jobs_pop(int index, jobs_item *item)
+{
+	jobs_deque *d = &jobs_deques[index];
+	int found = 0;
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top)
+	{
+		*item = d->items[--d->bottom];
+		found = 1;
+	}
+	if(d->bottom == d->top)
+		d->top = d->bottom = 0;
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+/** Removes the oldest job from a deque.
+ * @return 1 if a job was removed, 0 if the deque was empty. */
+static int jobs_steal(int index, jobs_item *item)
+{
+	jobs_deque *d = &jobs_deques[index];
+	int found = 0;
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top)
+	{
+		*item = d->items[d->top++];
+		found = 1;
+	}
+	if(d->bottom == d->top)
+		d->top = d->bottom = 0;
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+/** Finds a job for a thread to run, first from its own deque and then
+ * by stealing from the others.
+ * @return 1 if a job was found. */
+static int jobs_take(int self, jobs_item *item)
+{
+	if(jobs_pop(self, item))
+		return 1;
+	for(int i=1; i<=jobs_worker_count; i++)
+	{
+		int victim = (self+i) % (jobs_worker_count+1);
+		if(jobs_steal(victim, item))
+			return 1;
+	}
+	return 0;
+}
+
+/** @return 1 if any deque contains a job. */
+static int jobs_any_queued(void)
+{
+	for(int i=0; i<=jobs_worker_count; i++)
+	{
+		jobs_deque *d = &jobs_deques[i];
+		pthread_mutex_lock(&d->lock);
+		int count = d->bottom - d->top;
+		pthread_mutex_unlock(&d->lock);
+		if(count > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/** Wakes up sleeping workers after jobs were added. */
+static void jobs_wake(int all)
+{
+	pthread_mutex_lock(&jobs_mutex);
+	if(jobs_sleeping > 0)
+	{
+		if(all)
+			pthread_cond_broadcast(&jobs_cond_work);
+		else
+			pthread_cond_signal(&jobs_cond_work);
+	}
+	pthread_mutex_unlock(&jobs_mutex);
+}
+#endif
+
+/** Runs a job and marks it as finished in its group. */
+static void jobs_run(const jobs_item *item)
+{
+	item->func(item->arg);
+#ifdef JOBS_THREADS
+	pthread_mutex_lock(&jobs_mutex);
+	item->group->pending--;
+	if(item->group->pending == 0)
+		pthread_cond_broadcast(&jobs_cond_done);
+	pthread_mutex_unlock(&jobs_mutex);
+#else
+	item->group->pending--;
+#endif
+}
+
+#ifdef JOBS_THREADS
+/** Runs jobs until jobs_quit is set. */
+static void* jobs_worker(void *arg)
+{
+	int self = (int) (intptr_t) arg;
+	pthread_setspecific(jobs_key, arg);
+
+	while(1)
+	{
+		jobs_item item;
+		if(jobs_take(self, &item))
+		{
+			jobs_run(&item);
+			continue;
+		}
+
+		pthread_mutex_lock(&jobs_mutex);
+		if(jobs_quit)
+		{
+			pthread_mutex_unlock(&jobs_mutex);
+			break;
+		}
+		/* Jobs are added before jobs_mutex is locked to wake us, so
+		 * checking again while holding the lock ensures that we
+		 * don't sleep through a wake up. */
+		jobs_sleeping++;
+		if(!jobs_any_queued())
+			pthread_cond_wait(&jobs_cond_work, &jobs_mutex);
+		jobs_sleeping--;
+		pthread_mutex_unlock(&jobs_mutex);
+	}
+	return NULL;
+}
+
+/** Stops the workers when the program exits. */
+static void jobs_shutdown(void)
+{
+	pthread_mutex_lock(&jobs_mutex);
+	jobs_quit = 1;
+	pthread_cond_broadcast(&jobs_cond_work);
+	pthread_mutex_unlock(&jobs_mutex);
+	for(int i=0; i<jobs_worker_count; i++)
+		pthread_join(jobs_threads[i], NULL);
+}
+#endif
+
+/** Starts the worker threads. This is called automatically the first
+ * time a job is added and only needs to be called directly to start
+ * the threads early. */
+void jobs_init(void)
+{
+#ifdef JOBS_THREADS
+	if(jobs_initialized)
+		return;
+	jobs_initialized = 1;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(cpus < 1)
+		cpus = 1;
+	jobs_worker_count = kuhl_config_int("jobs.threads", (int) cpus-1, (int) cpus-1);
+	if(jobs_worker_count < 0)
+		jobs_worker_count = 0;
+	if(jobs_worker_count > JOBS_MAX_THREADS)
+		jobs_worker_count = JOBS_MAX_THREADS;
+
+	pthread_key_create(&jobs_key, NULL);
+	for(int i=0; i<=jobs_worker_count; i++)
+	{
+		memset(&jobs_deques[i], 0, sizeof(jobs_deque));
+		pthread_mutex_init(&jobs_deques[i].lock, NULL);
+	}
+	for(int i=0; i<jobs_worker_count; i++)
+	{
+		if(pthread_create(&jobs_threads[i], NULL, jobs_worker, (void*) (intptr_t) (i+1)) != 0)
+		{
+			msg(MSG_FATAL, "Unable to start job thread.");
+			exit(EXIT_FAILURE);
+		}
+	}
+	atexit(jobs_shutdown);
+	msg(MSG_DEBUG, "Jobs: Started %d worker threads.", jobs_worker_count);
+#endif
+}
+
+/** @return The number of threads that run jobs, including the thread
+ * that waits for them. */
+int jobs_thread_count(void)
+{
+#ifdef JOBS_THREADS
+	jobs_init();
+	return jobs_worker_count+1;
+#else
+	return 1;
+#endif
+}
+
+/** Prepares a group before jobs are added to it. */
+void jobs_group_init(jobs_group *group)
+{
+	group->pending = 0;
+}
+
+/** Adds a job to a group. The job may start running before this
+ * function returns.
+
+    @param group The group to add the job to.
+
+    @param func The function to run.
+
+    @param arg The value to pass to func.
+*/
+void jobs_add(jobs_group *group, jobs_func func, void *arg)
+{
+	jobs_item item = { func, arg, group };
+#ifdef JOBS_THREADS
+	jobs_init();
+	if(jobs_worker_count > 0)
+	{
+		pthread_mutex_lock(&jobs_mutex);
+		group->pending++;
+		pthread_mutex_unlock(&jobs_mutex);
+		jobs_push(jobs_self(), &item);
+		jobs_wake(0);
+		return;
+	}
+#endif
+	/* Without workers, run the job right away. */
+	group->pending++;
+	jobs_run(&item);
+}
+
+/** Waits for every job in a group to finish. The calling thread runs
+ * jobs (from any group) while it waits.
+
+    @param group The group to wait for.
+*/
+void jobs_wait(jobs_group *group)
+{
+#ifdef JOBS_THREADS
+	if(!jobs_initialized)
+		return;
+	int self = jobs_self();
+	while(1)
+	{
+		pthread_mutex_lock(&jobs_mutex);
+		int pending = group->pending;
+		pthread_mutex_unlock(&jobs_mutex);
+		if(pending == 0)
+			return;
+
+		jobs_item item;
+		if(jobs_take(self, &item))
+		{
+			jobs_run(&item);
+			continue;
+		}
+
+		/* The remaining jobs in the group are running on other
+		 * threads. */
+		pthread_mutex_lock(&jobs_mutex);
+		if(group->pending > 0)
+			pthread_cond_wait(&jobs_cond_done, &jobs_mutex);
+		pthread_mutex_unlock(&jobs_mutex);
+	}
+#endif
+}
+
+/** Runs one range of indices for jobs_parallel_for(). */
+static void jobs_range_run(void *arg)
+{
+	jobs_range *range = (jobs_range*) arg;
+	range->func(range->arg, range->begin, range->end);
+}
+
+/** Calls a function on every index from 0 to count-1, split into
+    ranges that run on the worker threads. Returns once every range
+    has finished.
+
+    @param count The number of indices.
+
+    @param grain The number of indices in each range. If 0, the
+    indices are split into about four ranges per thread.
+
+    @param func The function to call with each range.
+
+    @param arg The value to pass to func.
+*/
+void jobs_parallel_for(int count, int grain, jobs_range_func func, void *arg)
+{
+	if(count <= 0)
+		return;
+	int threads = jobs_thread_count();
+	if(grain <= 0)
+		grain = (count + threads*4 - 1) / (threads*4);
+	if(threads == 1 || grain >= count)
+	{
+		func(arg, 0, count);
+		return;
+	}
+
+	int rangeCount = (count + grain - 1) / grain;
+	jobs_range *ranges = kuhl_malloc(sizeof(jobs_range)*rangeCount);
+	jobs_group group;
+	jobs_group_init(&group);
+
+#ifdef JOBS_THREADS
+	/* Add all of the ranges before waking the workers. The ranges
+	 * are added in reverse order so that this thread starts at the
+	 * beginning and the workers steal from the end. */
+	int self = jobs_self();
+	pthread_mutex_lock(&jobs_mutex);
+	group.pending = rangeCount;
+	pthread_mutex_unlock(&jobs_mutex);
+	for(int i=rangeCount-1; i>=0; i--)
+	{
+		ranges[i].func = func;
+		ranges[i].arg = arg;
+		ranges[i].begin = i*grain;
+		ranges[i].end = i == rangeCount-1 ? count : (i+1)*grain;
+		jobs_item item = { jobs_range_run, &ranges[i], &group };
+		jobs_push(self, &item);
+	}
+	jobs_wake(1);
+#endif
+	jobs_wait(&group);
+	free(ranges);
+}
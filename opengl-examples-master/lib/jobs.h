@@ -0,0 +1,76 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    A small pool of worker threads for splitting CPU work (updating
+    many animated models, transforming vertices, culling, etc) across
+    the cores of the machine.
+
+    Each thread has its own queue of jobs. A thread adds jobs to and
+    runs jobs from the end of its own queue. When its queue is empty,
+    it steals the oldest job from another thread's queue. Jobs belong
+    to a jobs_group, and jobs_wait() returns once every job in the
+    group has finished. The thread which calls jobs_wait() runs jobs
+    while it waits, so jobs can add and wait on jobs of their own.
+
+    <pre>
+    jobs_group group;
+    jobs_group_init(&group);
+    for(int i=0; i<modelCount; i++)
+        jobs_add(&group, update_model, models[i]);
+    jobs_wait(&group);
+    </pre>
+
+    jobs_parallel_for() splits a loop into jobs and waits for them:
+
+    <pre>
+    void transform(void *arg, int begin, int end)
+    {
+        for(int i=begin; i<end; i++)
+            ...
+    }
+    jobs_parallel_for(vertexCount, 0, transform, data);
+    </pre>
+
+    Jobs must not call OpenGL since only the thread that created the
+    context can use it.
+
+    Settings:
+
+    * jobs.threads: Number of worker threads to start in addition to
+      the thread which adds the jobs. Defaults to one less than the
+      number of processors. If it is 0, or if pthreads aren't
+      available, jobs run immediately in jobs_add().
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A function that a job runs. */
+typedef void (*jobs_func)(void *arg);
+/** A function that jobs_parallel_for() runs on a range of indices (begin to end-1). */
+typedef void (*jobs_range_func)(void *arg, int begin, int end);
+
+/** A set of jobs that can be waited on with jobs_wait(). */
+typedef struct {
+	int pending; /**< Number of jobs in the group which haven't finished */
+} jobs_group;
+
+void jobs_init(void);
+int jobs_thread_count(void);
+void jobs_group_init(jobs_group *group);
+void jobs_add(jobs_group *group, jobs_func func, void *arg);
+void jobs_wait(jobs_group *group);
+void jobs_parallel_for(int count, int grain, jobs_range_func func, void *arg);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h> // intptr_t
 #include <math.h>
 #include <float.h> // for FLT_MAX
 #ifndef _WIN32
@@ -47,6 +48,11 @@
 
 #include "kuhl-util.h"
 #include "vecmat.h"
+#include "simplify.h"
+#include "capture.h"
+#include "texcache.h"
+#include "texcompress.h"
+#include "modelcache.h"
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
 #include "imageio.h"
 #else /* use STB image loading if ImageMagick isn't available' */
@@ -57,6 +63,11 @@
 #endif
 
 static GLFWwindow *the_window = NULL;
+/** Set when window.headless is enabled. */
+static int the_headless = 0;
+/** The framebuffer which is drawn into instead of the window when
+ * running headless (0 otherwise). */
+static GLuint the_headless_framebuffer = 0;
 
 
 #ifdef KUHL_UTIL_USE_ASSIMP
@@ -97,6 +108,23 @@ GLFWwindow* kuhl_get_window(void)
 	return the_window;
 }
 
+/** Returns 1 if we are rendering without a visible window (see
+ * window.headless in bin/config/headless.ini) or 0 otherwise. */
+int kuhl_headless(void)
+{
+	return the_headless;
+}
+
+/** Returns the framebuffer that is displayed (or read back when
+ * running headless) at the end of each frame. Code which renders
+ * into its own framebuffer should bind this framebuffer instead of
+ * framebuffer 0 when it is done so that it also works in headless
+ * mode. */
+GLuint kuhl_default_framebuffer(void)
+{
+	return the_headless_framebuffer;
+}
+
 
 /** Write diagnostic information to the log file. Should be called
  * after GLFW and GLEW are initialized. */
@@ -224,6 +252,16 @@ void kuhl_diagnostics(void)
  * provided. */
 static GLFWwindow* kuhl_glfw_create_window(int width, int height, const char *title)
 {
+	/* Headless windows are never shown, so fullscreen settings don't
+	 * apply. The window size becomes the size of our offscreen
+	 * framebuffer. */
+	if(the_headless)
+	{
+		int windowWidth = kuhl_config_int("window.width", width, width);
+		int windowHeight = kuhl_config_int("window.height", height, height);
+		return glfwCreateWindow(windowWidth, windowHeight, title, NULL, NULL);
+	}
+
 	/* If window.setting is set to anything (besides false, no, 0,
 	 * etc) then assume that they want the window fullscreen. */
 	const char *theMonitor = kuhl_config_get("window.fullscreen");
@@ -268,6 +306,79 @@ static GLFWwindow* kuhl_glfw_create_window(int width, int height, const char *ti
 	return window;
 }
 
+/** Asks GLFW for a context that doesn't need a display. With GLFW
+ * 3.4 or newer, the null platform is used so that no X server or
+ * Wayland compositor is needed at all. The context itself is created
+ * with EGL (surfaceless) or OSMesa depending on window.headlessapi. */
+static void kuhl_headless_init_hints(void)
+{
+#ifdef GLFW_PLATFORM_NULL
+	glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#else
+	msg(MSG_WARNING, "GLFW is older than 3.4 and has no null platform. Headless mode will still need a display (for example, Xvfb).");
+#endif
+}
+
+/** Window hints for headless mode. Must be called after glfwInit(). */
+static void kuhl_headless_window_hints(void)
+{
+	glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+#ifdef GLFW_CONTEXT_CREATION_API
+	const char *api = kuhl_config_get("window.headlessapi");
+#ifdef GLFW_OSMESA_CONTEXT_API
+	if(api != NULL && strcasecmp(api, "osmesa") == 0)
+	{
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+		msg(MSG_DEBUG, "Headless: Using an OSMesa context.");
+		return;
+	}
+#endif
+	if(api != NULL && strcasecmp(api, "egl") != 0)
+		msg(MSG_WARNING, "Headless: window.headlessapi '%s' is not supported, using EGL instead.", api);
+	glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+	msg(MSG_DEBUG, "Headless: Using an EGL context.");
+#endif
+}
+
+/** Creates the framebuffer that we render into when running
+ * headless and leaves it bound. The framebuffer has the same size as
+ * the (invisible) window so that code which asks GLFW for the
+ * framebuffer size sets up the correct viewport. Exits on error. */
+static void kuhl_headless_framebuffer_init(GLFWwindow *window)
+{
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+
+	/* Use sRGB storage when linear color is used so that
+	 * GL_FRAMEBUFFER_SRGB behaves like it does on an sRGB capable
+	 * window. */
+	GLenum colorFormat = GL_RGBA8;
+	if(kuhl_config_int("color.linear", 1, 1) == 1)
+		colorFormat = GL_SRGB8_ALPHA8;
+
+	GLuint renderbuffers[2];
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, colorFormat, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &the_headless_framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, the_headless_framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if(status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		msg(MSG_FATAL, "Headless: Framebuffer is incomplete (0x%x).", status);
+		exit(EXIT_FAILURE);
+	}
+	glViewport(0, 0, width, height);
+	kuhl_errorcheck();
+	msg(MSG_INFO, "Headless: Rendering into a %dx%d offscreen framebuffer.", width, height);
+}
+
 void kuhl_glfw_move_window(GLFWwindow *window)
 {
 	int x, y;
@@ -338,11 +449,16 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 
 	// Tell GLFW to call our function when an error occurs.
 	glfwSetErrorCallback(kuhl_glfw_error);
+	the_headless = kuhl_config_boolean("window.headless", 0, 0);
+	if(the_headless)
+		kuhl_headless_init_hints();
 	if(!glfwInit()) // initialize glfw
 	{
 		msg(MSG_FATAL, "Failed to initialize GLFW.\n");
 		exit(EXIT_FAILURE);
 	}
+	if(the_headless)
+		kuhl_headless_window_hints();
 
 	if(oglProfile >= 32)
 	{
@@ -374,6 +490,13 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 		msg(MSG_DEBUG, "Using non-linear sRGB color in fragment program. Set color.linear=1 to convert to linear colorspace.");
 
 
+	/* Our headless framebuffer isn't multisampled so that it can be
+	 * read back with glReadPixels(). */
+	if(the_headless && msaaSamples > 1)
+	{
+		msg(MSG_DEBUG, "Headless: Ignoring request for %d MSAA samples.", msaaSamples);
+		msaaSamples = 0;
+	}
 	if(msaaSamples > 1)
 		glfwWindowHint(GLFW_SAMPLES, msaaSamples);
 
@@ -381,6 +504,8 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 	GLFWwindow *window = kuhl_glfw_create_window(width, height, argv[0]);
 	if(!window)
 	{
+		if(the_headless)
+			msg(MSG_FATAL, "Headless: GLFW must be built with EGL or OSMesa support to create a context without a display. Try setting window.headlessapi.");
 		msg(MSG_FATAL, "Failed to create a GLFW window.\n");
 		exit(EXIT_FAILURE);
 	}
@@ -390,6 +515,12 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 	/* Initialize GLEW (must be done after context is made current) */
 	glewExperimental = GL_TRUE;
 	GLenum glewError = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	/* GLEW built for GLX complains when the context came from EGL
+	 * but it still loads the OpenGL functions. */
+	if(the_headless && glewError == GLEW_ERROR_NO_GLX_DISPLAY)
+		glewError = GLEW_OK;
+#endif
 	if(glewError)
 	{
 		msg(MSG_FATAL, "Error initializing GLEW: %s\n", glewGetErrorString(glewError));
@@ -407,6 +538,8 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 		glEnable(GL_FRAMEBUFFER_SRGB);
 	if(msaaSamples > 1)
 		glEnable(GL_MULTISAMPLE);
+	if(the_headless)
+		kuhl_headless_framebuffer_init(window);
 
 
 
@@ -551,6 +684,342 @@ void kuhl_print_program_info(GLuint program)
 	kuhl_errorcheck();
 }
 
+
+/** A GLSL variable name and the location that OpenGL assigned to
+ * it. Used by kuhl_program_cache. */
+typedef struct
+{
+	char *name;     /**< GLSL variable name */
+	uint32_t hash;  /**< Hash of name (see kuhl_private_location_hash()) */
+	GLint location; /**< Location of the variable, -1 if it is missing or inactive. */
+} kuhl_location;
+
+/** A list of name/location pairs and a hash table to find them by
+ * name. Used by kuhl_program_cache. */
+typedef struct
+{
+	kuhl_location *items; /**< The name/location pairs */
+	int count;            /**< Number of items */
+	int *buckets;         /**< Index into items or -1 if empty (open addressing) */
+	int bucket_count;     /**< Number of buckets (a power of 2, at least twice count) */
+	int misses;           /**< Number of items with location -1 that were added after the table was filled */
+} kuhl_location_table;
+
+/** Maximum number of missing or inactive names that are remembered
+ * in each kuhl_location_table. Names built at runtime (for example,
+ * per-light uniform names) could otherwise make the table grow
+ * forever. Missing names beyond this are requested from OpenGL every
+ * time. */
+#define KUHL_LOCATION_MAX_MISSES 64
+
+/** Uniform and attribute locations for a single GLSL program. Asking
+ * OpenGL for a location (glGetUniformLocation(), etc) requires a
+ * string lookup inside of the driver. kuhl_geometry_draw() needs
+ * several locations for every piece of geometry every frame, so we
+ * ask OpenGL once per program and remember the answers here. */
+typedef struct
+{
+	kuhl_location_table uniforms; /**< Uniform variable locations */
+	kuhl_location_table attribs;  /**< Vertex attribute locations */
+
+	/* Uniforms that kuhl_geometry_draw() sets for every geometry. */
+	GLint loc_HasTex;
+	GLint loc_BoneMat;
+	GLint loc_NumBones;
+	int bone_block; /**< KUHL_BONES_MATRIX or KUHL_BONES_DUALQUAT if the program reads bones from a uniform block, 0 otherwise */
+	GLint loc_GeomTransform;
+	GLint loc_BoneFrames; /**< Sampler for the texture created by kuhl_bake_model() */
+	GLint loc_BoneFrameRate;
+} kuhl_program_cache;
+
+/** Array of location caches indexed by GLSL program ID. */
+static kuhl_program_cache **kuhl_program_caches = NULL;
+static GLuint kuhl_program_caches_len = 0; /**< Length of kuhl_program_caches */
+
+/** FNV-1a hash of a GLSL variable name. */
+static uint32_t kuhl_private_location_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for(const unsigned char *c = (const unsigned char*) name; *c; c++)
+		h = (h ^ *c) * 16777619u;
+	return h;
+}
+
+/** Searches a table of name/location pairs.
+ *
+ * @return The index of the name in table->items or -1 if the name was
+ * not found.
+ */
+static int kuhl_private_location_find(const kuhl_location_table *table, const char *name)
+{
+	if(table->bucket_count == 0)
+		return -1;
+	uint32_t hash = kuhl_private_location_hash(name);
+	int mask = table->bucket_count-1;
+	for(int b = hash & mask; table->buckets[b] >= 0; b = (b+1) & mask)
+	{
+		const kuhl_location *loc = &(table->items[table->buckets[b]]);
+		if(loc->hash == hash && strcmp(loc->name, name) == 0)
+			return table->buckets[b];
+	}
+	return -1;
+}
+
+/** Appends a name/location pair to a table of locations.
+ *
+ * @return The location that was stored.
+ */
+static GLint kuhl_private_location_add(kuhl_location_table *table, const char *name, GLint location)
+{
+	table->items = realloc(table->items, sizeof(kuhl_location)*(table->count+1));
+	if(table->items == NULL)
+	{
+		msg(MSG_FATAL, "Failed to allocate space for GLSL variable location cache.");
+		exit(EXIT_FAILURE);
+	}
+	kuhl_location *loc = &(table->items[table->count]);
+	loc->name = strdup(name);
+	loc->hash = kuhl_private_location_hash(name);
+	loc->location = location;
+	table->count++;
+
+	/* Keep the table at most half full. Rebuild the buckets when it
+	 * grows. */
+	if(table->count*2 > table->bucket_count)
+	{
+		table->bucket_count = table->bucket_count == 0 ? 32 : table->bucket_count*2;
+		table->buckets = realloc(table->buckets, sizeof(int)*table->bucket_count);
+		if(table->buckets == NULL)
+		{
+			msg(MSG_FATAL, "Failed to allocate space for GLSL variable location cache.");
+			exit(EXIT_FAILURE);
+		}
+		for(int i=0; i<table->bucket_count; i++)
+			table->buckets[i] = -1;
+		for(int i=0; i<table->count-1; i++)
+		{
+			int b = table->items[i].hash & (table->bucket_count-1);
+			while(table->buckets[b] >= 0)
+				b = (b+1) & (table->bucket_count-1);
+			table->buckets[b] = i;
+		}
+	}
+	int b = loc->hash & (table->bucket_count-1);
+	while(table->buckets[b] >= 0)
+		b = (b+1) & (table->bucket_count-1);
+	table->buckets[b] = table->count-1;
+	return location;
+}
+
+/** Frees the memory used by a table of locations. */
+static void kuhl_private_location_free(kuhl_location_table *table)
+{
+	for(int i=0; i<table->count; i++)
+		free(table->items[i].name);
+	free(table->items);
+	free(table->buckets);
+	memset(table, 0, sizeof(kuhl_location_table));
+}
+
+/** Looks up a name that was enumerated when a location cache was
+ * filled.
+ *
+ * @return The location or -1 if the name is not in the table.
+ */
+static GLint kuhl_private_location_get(const kuhl_location_table *table, const char *name)
+{
+	int idx = kuhl_private_location_find(table, name);
+	return idx < 0 ? -1 : table->items[idx].location;
+}
+
+/** Removes and frees the location cache for a GLSL program (if there
+ * is one).
+ *
+ * @param program The GLSL program that the cache was created for.
+ */
+static void kuhl_private_program_cache_free(GLuint program)
+{
+	if(program >= kuhl_program_caches_len || kuhl_program_caches[program] == NULL)
+		return;
+
+	kuhl_program_cache *cache = kuhl_program_caches[program];
+	kuhl_private_location_free(&cache->uniforms);
+	kuhl_private_location_free(&cache->attribs);
+	free(cache);
+	kuhl_program_caches[program] = NULL;
+}
+
+/** Creates a location cache for a GLSL program by enumerating all of
+ * the active uniforms and attributes in the program. Any existing
+ * cache for the program is discarded first since OpenGL can reuse
+ * the ID of a deleted program.
+ *
+ * @param program A successfully linked GLSL program.
+ *
+ * @return The new cache.
+ */
+static kuhl_program_cache* kuhl_private_program_cache_fill(GLuint program)
+{
+	kuhl_private_program_cache_free(program);
+
+	if(program >= kuhl_program_caches_len)
+	{
+		GLuint newLen = program+16;
+		kuhl_program_caches = realloc(kuhl_program_caches, sizeof(kuhl_program_cache*)*newLen);
+		if(kuhl_program_caches == NULL)
+		{
+			msg(MSG_FATAL, "Failed to allocate space for GLSL program location cache.");
+			exit(EXIT_FAILURE);
+		}
+		for(GLuint i=kuhl_program_caches_len; i<newLen; i++)
+			kuhl_program_caches[i] = NULL;
+		kuhl_program_caches_len = newLen;
+	}
+
+	kuhl_program_cache *cache = kuhl_malloc(sizeof(kuhl_program_cache));
+	memset(cache, 0, sizeof(kuhl_program_cache));
+	kuhl_program_caches[program] = cache;
+
+	char name[1024];
+	GLint arraySize = 0;
+	GLenum type = 0;
+	GLsizei actualLength = 0;
+
+	GLint numVars = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &numVars);
+	for(int i=0; i<numVars; i++)
+	{
+		glGetActiveUniform(program, i, 1024, &actualLength, &arraySize, &type, name);
+		GLint location = glGetUniformLocation(program, name);
+		/* Uniforms inside of uniform blocks don't have a location. */
+		if(location == -1)
+			continue;
+		kuhl_private_location_add(&cache->uniforms, name, location);
+
+		/* Arrays are listed as "name[0]". Also store "name" so
+		 * callers can use either. */
+		char *bracket = strstr(name, "[0]");
+		if(bracket != NULL && bracket[3] == '\0')
+		{
+			*bracket = '\0';
+			kuhl_private_location_add(&cache->uniforms, name, location);
+		}
+	}
+
+	numVars = 0;
+	glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &numVars);
+	for(int i=0; i<numVars; i++)
+	{
+		glGetActiveAttrib(program, i, 1024, &actualLength, &arraySize, &type, name);
+		GLint location = glGetAttribLocation(program, name);
+		kuhl_private_location_add(&cache->attribs, name, location);
+	}
+	kuhl_errorcheck();
+
+	/* Any name that wasn't enumerated above is missing or
+	 * inactive. */
+	cache->loc_HasTex        = kuhl_private_location_get(&cache->uniforms, "HasTex");
+	cache->loc_BoneMat       = kuhl_private_location_get(&cache->uniforms, "BoneMat");
+	cache->loc_NumBones      = kuhl_private_location_get(&cache->uniforms, "NumBones");
+	cache->loc_GeomTransform = kuhl_private_location_get(&cache->uniforms, "GeomTransform");
+	cache->loc_BoneFrames    = kuhl_private_location_get(&cache->uniforms, "BoneFrames");
+	cache->loc_BoneFrameRate = kuhl_private_location_get(&cache->uniforms, "BoneFrameRate");
+
+	/* Bones in a uniform block are read from the buffer bound to
+	 * KUHL_BONE_BINDING. */
+	if(GLEW_VERSION_3_1 || GLEW_ARB_uniform_buffer_object)
+	{
+		GLuint block = glGetUniformBlockIndex(program, "BonePalette");
+		if(block != GL_INVALID_INDEX)
+			cache->bone_block = KUHL_BONES_MATRIX;
+		else if((block = glGetUniformBlockIndex(program, "BoneDualQuats")) != GL_INVALID_INDEX)
+			cache->bone_block = KUHL_BONES_DUALQUAT;
+		if(block != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, block, KUHL_BONE_BINDING);
+		kuhl_errorcheck();
+	}
+
+	return cache;
+}
+
+/** Retrieves the location cache for a GLSL program. If the program
+ * wasn't created with kuhl_create_program(), the cache is created the
+ * first time it is requested.
+ *
+ * @param program The GLSL program.
+ *
+ * @return The location cache or NULL if program is not a valid,
+ * linked GLSL program.
+ */
+static kuhl_program_cache* kuhl_private_program_cache_get(GLuint program)
+{
+	if(program < kuhl_program_caches_len && kuhl_program_caches[program] != NULL)
+		return kuhl_program_caches[program];
+
+	if(program == 0 || !glIsProgram(program))
+		return NULL;
+	GLint linkStatus = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+	if(linkStatus == GL_FALSE)
+		return NULL;
+	return kuhl_private_program_cache_fill(program);
+}
+
+/** Remembers the location of a name which wasn't enumerated when a
+ * location cache was filled. Names that OpenGL found are always
+ * remembered since a program only has a limited number of them.
+ * Only KUHL_LOCATION_MAX_MISSES missing names are remembered.
+ *
+ * @return The location.
+ */
+static GLint kuhl_private_location_remember(kuhl_location_table *table, const char *name, GLint location)
+{
+	if(location == -1)
+	{
+		if(table->misses >= KUHL_LOCATION_MAX_MISSES)
+			return location;
+		table->misses++;
+	}
+	return kuhl_private_location_add(table, name, location);
+}
+
+/** Looks up the location of a uniform variable in a location
+ * cache. Names which weren't enumerated when the cache was filled
+ * (for example, "BoneMat[3]") are requested from OpenGL once and then
+ * remembered (see kuhl_private_location_remember()).
+ *
+ * @param cache The cache for the program. If NULL, OpenGL is asked directly.
+ *
+ * @return The location of the uniform or -1 if it is missing or inactive.
+ */
+static GLint kuhl_private_cache_uniform(kuhl_program_cache *cache, GLuint program, const char *name)
+{
+	if(cache == NULL)
+		return glGetUniformLocation(program, name);
+	int idx = kuhl_private_location_find(&cache->uniforms, name);
+	if(idx >= 0)
+		return cache->uniforms.items[idx].location;
+	return kuhl_private_location_remember(&cache->uniforms, name, glGetUniformLocation(program, name));
+}
+
+/** Looks up the location of an attribute variable in a location
+ * cache.
+ *
+ * @param cache The cache for the program. If NULL, OpenGL is asked directly.
+ *
+ * @return The location of the attribute or -1 if it is missing or inactive.
+ */
+static GLint kuhl_private_cache_attrib(kuhl_program_cache *cache, GLuint program, const char *name)
+{
+	if(cache == NULL)
+		return glGetAttribLocation(program, name);
+	int idx = kuhl_private_location_find(&cache->attribs, name);
+	if(idx >= 0)
+		return cache->attribs.items[idx].location;
+	return kuhl_private_location_remember(&cache->attribs, name, glGetAttribLocation(program, name));
+}
+
+
 /** Detaches shaders from the given GLSL program, deletes the program,
  * and flags the shaders for deletion.
  *
@@ -558,6 +1027,10 @@ void kuhl_print_program_info(GLuint program)
  */
 void kuhl_delete_program(GLuint program)
 {
+	/* Forget cached locations even if the program is invalid---the
+	 * program ID may be reused by OpenGL. */
+	kuhl_private_program_cache_free(program);
+
 	if(!glIsProgram(program))
 	{
 		msg(MSG_WARNING, "Tried to delete a program (%d) that does not exist.", program);
@@ -636,6 +1109,10 @@ GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename)
 	 * ready to draw (i.e., have a vertex array object set up, etc). */
 
 	kuhl_print_program_info(program);
+
+	/* Remember the locations of all of the active variables so we
+	 * don't need to ask OpenGL for them while drawing. */
+	kuhl_private_program_cache_fill(program);
     // printf("GLSL program %d: Success!\n", program);
 	return program;
 }
@@ -659,7 +1136,8 @@ void kuhl_print_program_log(GLuint program)
 /** Provides functionality similar to glGetUniformLocation() with
  * error checking. However, unlike glGetUniformLocation(), this
  * function gets the location of the variable from the active OpenGL
- * program instead of a specified one. If a problem occurs, an
+ * program instead of a specified one. Locations are looked up in a
+ * per-program cache instead of asking OpenGL. If a problem occurs, an
  * appropriate error message is printed to the standard error. This
  * function may exit or return -1 if the uniform location is not
  * found.
@@ -685,14 +1163,15 @@ GLint kuhl_get_uniform(const char *uniformName)
 		return -1;
 	}
 
-	if(!glIsProgram(currentProgram))
+	kuhl_program_cache *cache = kuhl_private_program_cache_get(currentProgram);
+	if(cache == NULL)
 	{
 		msg(MSG_ERROR, "The current active program (%d) is not a valid GLSL program.\n", currentProgram);
 		return -1;
 	}
 
 	static int missingUniformCount = 0;
-	GLint loc = glGetUniformLocation(currentProgram, uniformName);
+	GLint loc = kuhl_private_cache_uniform(cache, currentProgram, uniformName);
 	kuhl_errorcheck();
 	if(loc == -1 && missingUniformCount < 50)
 	{
@@ -707,6 +1186,27 @@ GLint kuhl_get_uniform(const char *uniformName)
 	return loc;
 }
 
+/** Gets the location of a uniform variable in a GLSL program from the
+ * same per-program cache that kuhl_get_uniform() uses. Unlike
+ * kuhl_get_uniform(), the program does not need to be in use and no
+ * message is printed if the variable is missing, so it is suitable
+ * for uniforms that are optional in some programs.
+ *
+ * @param program The GLSL program.
+ *
+ * @param uniformName The name of the uniform variable.
+ *
+ * @return The location of the uniform variable or -1 if it is missing
+ * or inactive.
+ */
+GLint kuhl_get_uniform_program(GLuint program, const char *uniformName)
+{
+	kuhl_program_cache *cache = kuhl_private_program_cache_get(program);
+	if(cache == NULL || uniformName == NULL)
+		return -1;
+	return kuhl_private_cache_uniform(cache, program, uniformName);
+}
+
 /** glGetAttribLocation() with error checking. This function behaves
  * the same as glGetAttribLocation() except that when an error
  * occurs, it prints an error message if the attribute variable doesn't
@@ -740,7 +1240,7 @@ GLint kuhl_get_attribute(GLuint program, const char *attributeName)
 		msg(MSG_ERROR, "Cannot get attribute '%s' from program %d because the program is not linked.\n", attributeName, program);
 	}
 
-	GLint loc = glGetAttribLocation(program, attributeName);
+	GLint loc = kuhl_private_cache_attrib(kuhl_private_program_cache_get(program), program, attributeName);
 	kuhl_errorcheck();
 	if(loc == -1)
 	{
@@ -866,13 +1366,14 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
 
 	// The 8 vertices of the bounding box
-	float coords[8][3] = { {bbox[xmin], bbox[ymin], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmin], bbox[ymax], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymin], bbox[zmax] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmin] },
-	                       {bbox[xmax], bbox[ymax], bbox[zmax] } };
+	float coords[8][4] = { {bbox[xmin], bbox[ymin], bbox[zmin], 1 },
+	                       {bbox[xmin], bbox[ymin], bbox[zmax], 1 },
+	                       {bbox[xmin], bbox[ymax], bbox[zmin], 1 },
+	                       {bbox[xmin], bbox[ymax], bbox[zmax], 1 },
+	                       {bbox[xmax], bbox[ymin], bbox[zmin], 1 },
+	                       {bbox[xmax], bbox[ymin], bbox[zmax], 1 },
+	                       {bbox[xmax], bbox[ymax], bbox[zmin], 1 },
+	                       {bbox[xmax], bbox[ymax], bbox[zmax], 1 } };
 	// Transform the 8 vertices of the bounding box
 	for(int i=0; i<8; i++)
 		mat4f_mult_vec4f_new(coords[i], mat, coords[i]);
@@ -903,10 +1404,10 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 }
 
 
-#if 0
 /** Checks if the axis-aligned bounding box of two kuhl_geometry objects intersect.
 
-    @return 1 if the bounding boxes intersect; 0 otherwise
+    @return 1 if the bounding boxes intersect; 0 otherwise (or if
+    either object has no bounding box).
 
     @param geom1 One of the pieces of geometry.
     @param mat1 A 4x4 transformation matrix to be applied to the bounding box of geom1 prior to checking for collision.
@@ -916,6 +1417,9 @@ void kuhl_bbox_transform(float bbox[6], float mat[16])
 int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
                           kuhl_geometry *geom2, float mat2[16])
 {
+	if(!geom1->has_bounds || !geom2->has_bounds)
+		return 0;
+
 	float box1[6], box2[6];
 	for(int i=0; i<6; i++)
 	{
@@ -923,7 +1427,7 @@ int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
 		box2[i] = geom2->aabbox[i];
 	}
 	kuhl_bbox_transform(box1, mat1);
-	kuhl_bbox_transform(box2, mat1);
+	kuhl_bbox_transform(box2, mat2);
 
 	int xmin=0, xmax=1, ymin=2, ymax=3, zmin=4, zmax=5;
 	// If the smallest x coordinate in geom1 is larger than the
@@ -943,7 +1447,159 @@ int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
 	if(box1[zmax] < box2[zmin]) return 0;
 	return 1;
 }
+
+/** Number of kuhl_geometry objects drawn and culled by
+ * kuhl_geometry_draw_culled() since kuhl_geometry_cull_stats() was
+ * last called. */
+static unsigned int kuhl_private_cull_drawn = 0;
+static unsigned int kuhl_private_cull_culled = 0;
+
+/** Extracts the six planes of a view frustum from a
+ * modelview-projection matrix. Points inside of the frustum are on
+ * the positive side of every plane (i.e., a*x+b*y+c*z+d >= 0). The
+ * planes are in the coordinate system that the matrix transforms
+ * from (object coordinates for a modelview-projection matrix, world
+ * coordinates for a view-projection matrix).
+ *
+ * @param planes Filled in with the a, b, c, d coefficients of the
+ * left, right, bottom, top, near and far planes. The planes are not
+ * normalized.
+ *
+ * @param modelviewProjection The projection matrix multiplied by
+ * the modelview matrix.
+ */
+void kuhl_frustum_planes(float planes[6][4], const float modelviewProjection[16])
+{
+	const float *m = modelviewProjection;
+	for(int i=0; i<4; i++)
+	{
+		/* Column-major: row r of the matrix is m[r], m[4+r], m[8+r], m[12+r] */
+		float row0 = m[4*i+0], row1 = m[4*i+1], row2 = m[4*i+2], row3 = m[4*i+3];
+		planes[0][i] = row3 + row0; // left
+		planes[1][i] = row3 - row0; // right
+		planes[2][i] = row3 + row1; // bottom
+		planes[3][i] = row3 - row1; // top
+		planes[4][i] = row3 + row2; // near
+		planes[5][i] = row3 - row2; // far
+	}
+}
+
+/** Checks if the bounding volume of a single kuhl_geometry object
+ * (geom->next is ignored) is at least partially inside of a view
+ * frustum. The bounding sphere is tested first and the bounding box
+ * is only tested if the sphere intersects a plane.
+ *
+ * @param geom The geometry to check.
+ *
+ * @param planes Frustum planes in the object coordinates of the
+ * geometry (see kuhl_frustum_planes()).
+ *
+ * @return 0 if the geometry is entirely outside of the frustum, 1 if
+ * it may be visible.
+ */
+static int kuhl_private_geometry_in_frustum(const kuhl_geometry *geom, float planes[6][4])
+{
+	const float *s = geom->bsphere;
+	const float *b = geom->aabbox;
+	int intersects = 0;
+	for(int i=0; i<6; i++)
+	{
+		const float *p = planes[i];
+		float len = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+		float dist = p[0]*s[0] + p[1]*s[1] + p[2]*s[2] + p[3];
+		if(dist < -s[3]*len)
+			return 0;
+		if(dist < s[3]*len)
+			intersects = 1;
+	}
+	if(!intersects)
+		return 1;
+
+	/* For each plane, check the corner of the box that is furthest
+	 * along the plane normal. If it is outside, the box is too. */
+	for(int i=0; i<6; i++)
+	{
+		const float *p = planes[i];
+		float x = p[0] > 0 ? b[1] : b[0];
+		float y = p[1] > 0 ? b[3] : b[2];
+		float z = p[2] > 0 ? b[5] : b[4];
+		if(p[0]*x + p[1]*y + p[2]*z + p[3] < 0)
+			return 0;
+	}
+	return 1;
+}
+
+/** Calculates the frustum planes in the object coordinates of a
+ * kuhl_geometry object including its GeomTransform matrix. */
+static void kuhl_private_geometry_planes(float planes[6][4], const kuhl_geometry *geom, const float modelviewProjection[16])
+{
+	float mvpg[16];
+	mat4f_mult_mat4f_new(mvpg, modelviewProjection, geom->matrix);
+	kuhl_frustum_planes(planes, mvpg);
+}
+
+/** Checks if a single kuhl_geometry object may be visible given a
+ * modelview-projection matrix. Skinned geometry is never culled
+ * because the bones may move the vertices outside of the bounding
+ * volume. Instanced geometry is never culled because each instance
+ * is drawn in a different place. */
+static int kuhl_private_geometry_visible(const kuhl_geometry *geom, const float modelviewProjection[16])
+{
+	if(!geom->has_bounds || geom->instance_count > 0)
+		return 1;
+#if KUHL_UTIL_USE_ASSIMP
+	if(geom->bones)
+		return 1;
 #endif
+	float planes[6][4];
+	kuhl_private_geometry_planes(planes, geom, modelviewProjection);
+	return kuhl_private_geometry_in_frustum(geom, planes);
+}
+
+/** Checks if a single kuhl_geometry object (geom->next is ignored)
+ * may be visible. The bounding box and sphere of the geometry are
+ * transformed by geom->matrix (GeomTransform), the modelview matrix
+ * and the projection matrix and compared against the view frustum.
+ *
+ * @param geom The geometry to check.
+ *
+ * @param modelview The modelview matrix the geometry will be drawn with.
+ *
+ * @param projection The projection matrix (for example, from viewmat_get()).
+ *
+ * @return 0 if the geometry is entirely outside of the view frustum,
+ * 1 if it may be visible, if it doesn't have a bounding volume or if
+ * it is skinned.
+ */
+int kuhl_geometry_visible(const kuhl_geometry *geom, const float modelview[16], const float projection[16])
+{
+	if(geom == NULL)
+		return 0;
+	float mvp[16];
+	mat4f_mult_mat4f_new(mvp, projection, modelview);
+	return kuhl_private_geometry_visible(geom, mvp);
+}
+
+/** Returns the number of kuhl_geometry objects that were drawn and
+ * culled by kuhl_geometry_draw_culled() since the last time this
+ * function was called. Call it once per frame to get per-frame
+ * counts.
+ *
+ * @param drawn Filled in with the number of objects that were
+ * drawn. Can be NULL.
+ *
+ * @param culled Filled in with the number of objects that were
+ * skipped because they were outside of the view frustum. Can be NULL.
+ */
+void kuhl_geometry_cull_stats(unsigned int *drawn, unsigned int *culled)
+{
+	if(drawn)
+		*drawn = kuhl_private_cull_drawn;
+	if(culled)
+		*culled = kuhl_private_cull_culled;
+	kuhl_private_cull_drawn = 0;
+	kuhl_private_cull_culled = 0;
+}
 
 
 /** Adds a texture to the provided kuhl_geometry object.
@@ -992,7 +1648,7 @@ void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name
 	}
 
 	/* Find the uniform variable location inside of the GLSL program. */
-	GLint samplerLocation = glGetUniformLocation(geom->program, name);
+	GLint samplerLocation = kuhl_private_cache_uniform(kuhl_private_program_cache_get(geom->program), geom->program, name);
 	if(samplerLocation == -1)
 	{
 		if(kg_options & KG_WARN)
@@ -1065,10 +1721,17 @@ int kuhl_geometry_attrib_index(kuhl_geometry *geom, const char *name)
  * interested in.
  *
  * @param size A pointer to an integer that will be filled in with the
- * length of the data retrieved.
+ * number of floats from the start of the returned array to the last
+ * component of this attribute for the last vertex of this geometry
+ * ((vertex_count-1)*stride + components). It doesn't include the
+ * vertices of other geometry in a merged buffer.
  *
  * @return A pointer to a array of floats which contains all of
- * per-vertex data for this attribute. Any changes you make to the
+ * per-vertex data for this attribute. If the attribute is stored in an
+ * interleaved buffer (see kuhl_geometry_attrib_interleaved()), the
+ * pointer points at the first element of this attribute and
+ * consecutive vertices are kuhl_geometry_attrib_stride() floats
+ * apart. Any changes you make to the
  * array will automatically be propagated back to OpenGL before the
  * next time the geometry is drawn. The array should NOT be
  * free()'d. It also should NOT be accessed after the geometry is
@@ -1076,7 +1739,18 @@ int kuhl_geometry_attrib_index(kuhl_geometry *geom, const char *name)
  * kuhl_geometry_attrib_get() every frame. If you aren't changing the
  * data but still want access to it, it is best to make a copy of the
  * array that kuhl_geometry_attrib_get() returns instead of calling it
- * every single frame to retrieve the same data repeatedly.
+ * every single frame to retrieve the same data repeatedly. Call
+ * kuhl_geometry_attrib_unmap() after making the copy. Returns NULL if
+ * the attribute is missing, is stored in a format other than floats
+ * (see kuhl_geometry_attrib_typed() and the model.compact setting) or
+ * is stored in a buffer owned by the caller, so callers must check
+ * the result.
+ *
+ * Geometry merged with kuhl_geometry_merge() (see model.merge) shares
+ * one buffer with the rest of the model, and the other geometry in
+ * the model doesn't know that the buffer is mapped. Call
+ * kuhl_geometry_attrib_unmap() before drawing any part of a merged
+ * model.
  */
 GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size)
 {
@@ -1092,6 +1766,16 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 
 	/* Bind the VAO and the buffer we are interested in */
 	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->type != GL_FLOAT)
+	{
+		msg(MSG_WARNING, "Unable to retrieve attribute '%s' as an array of floats because it is stored in a compact format.", name);
+		return NULL;
+	}
+	if(attrib->external)
+	{
+		msg(MSG_WARNING, "Unable to retrieve attribute '%s' because it is stored in a buffer that kuhl_geometry doesn't own (see kuhl_geometry_attrib_buffer()).", name);
+		return NULL;
+	}
 	if(!glIsBuffer(attrib->bufferobject) || !glIsVertexArray(geom->vao))
 		return NULL;
 	glBindVertexArray(geom->vao);
@@ -1115,7 +1799,22 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 	kuhl_errorcheck();
 	if(ret == NULL)
 		return NULL;
-	*size = bufferNumFloats;
+	/* Every attribute in an interleaved buffer is now mapped. */
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		if(geom->attribs[i].bufferobject == attrib->bufferobject)
+			geom->attribs[i].mapped = 1;
+	}
+	/* Merged geometry starts partway through the shared buffer (see
+	 * kuhl_geometry_merge()). */
+	GLint strideBytes = attrib->stride ? attrib->stride : (GLint) (attrib->components*sizeof(GLfloat));
+	GLint offsetFloats = (attrib->offset + geom->base_vertex*strideBytes) / (GLint) sizeof(GLfloat);
+	ret += offsetFloats;
+	GLint strideFloats = strideBytes / (GLint) sizeof(GLfloat);
+	if(geom->vertex_count > 0)
+		*size = ((GLint) geom->vertex_count-1)*strideFloats + (GLint) attrib->components;
+	if(*size > bufferNumFloats - offsetFloats)
+		*size = bufferNumFloats - offsetFloats;
 
 	// unbind
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -1125,40 +1824,314 @@ GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *
 	return ret;
 }
 
-/** Changes the GLSL program that is used by a kuhl_geometry object.
- *
- * @param geom A geometry that you want to change the GLSL program for.
+/** Unmaps the buffer that kuhl_geometry_attrib_get() mapped. The
+ * array that kuhl_geometry_attrib_get() returned can't be used
+ * afterwards. kuhl_geometry_draw() unmaps buffers before drawing, but
+ * a buffer which is never unmapped can't be drawn from in any other
+ * way (for example, when the attribute is later replaced with
+ * kuhl_geometry_attrib_buffer()).
  *
- * @param program The new GLSL program you wish to use with the geometry.
+ * @param geom The geometry object containing the attribute.
  *
- * @param kg_options Set this to KG_FULL_LIST to apply the new program
- * to all geometries in the kuhl_geometry linked list. Otherwise, set
- * to 0.
+ * @param name The GLSL variable name of the attribute.
  */
-void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
+void kuhl_geometry_attrib_unmap(kuhl_geometry *geom, const char *name)
 {
-	if(geom == NULL)
+	if(geom == NULL || name == NULL)
+		return;
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0 || !geom->attribs[index].mapped)
 		return;
 
-	if(kg_options & KG_FULL_LIST)
-		kuhl_geometry_program(geom->next, program, kg_options);
-
-	// If the caller deleted their old program and created a new one,
-	// the new program ID might match the old program ID. Therefore,
-	// we can't rely on the program IDs to verify that the user
-	// changed the program.
+	GLuint buffer = geom->attribs[index].bufferobject;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	GLint bufferIsMapped = 0;
+	glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_MAPPED, &bufferIsMapped);
+	if(bufferIsMapped && glUnmapBuffer(GL_ARRAY_BUFFER) == GL_FALSE)
+		msg(MSG_WARNING, "The contents of the buffer storing attribute '%s' were lost while it was mapped.", name);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
 
-	if(!glIsProgram(program))
+	/* Attributes in an interleaved buffer share the buffer that we
+	 * just unmapped. */
+	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
-		msg(MSG_WARNING, "GLSL program %d is not a valid program.\n",program);
+		if(geom->attribs[i].bufferobject == buffer)
+			geom->attribs[i].mapped = 0;
 	}
+}
 
-	geom->program = program;
+/** Returns the number of floats between the start of one vertex and
+ * the start of the next vertex for an attribute in the array returned
+ * by kuhl_geometry_attrib_get().
+ *
+ * @param geom The geometry object containing the attribute.
+ *
+ * @param name The GLSL variable name of the attribute.
+ *
+ * @return The number of floats between consecutive vertices (equal
+ * to the number of components in the attribute unless the attribute
+ * is stored in an interleaved buffer). Returns 0 if the attribute was
+ * not found or if it is not stored as floats.
+ */
+GLint kuhl_geometry_attrib_stride(kuhl_geometry *geom, const char *name)
+{
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0)
+		return 0;
 
-	/* Iterate through the vertex attributes in this kuhl_geometry
-	 * object and determine where these attributes should go in the
-	 * newly specified program. */
-	glBindVertexArray(geom->vao);
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(attrib->type != GL_FLOAT)
+		return 0;
+	if(attrib->stride == 0)
+		return attrib->components;
+	return attrib->stride / sizeof(GLfloat);
+}
+
+/** Calculates the number of bytes that one vertex of an attribute
+ * uses when the vertices are tightly packed.
+ *
+ * @param type The OpenGL type of each component (GL_FLOAT,
+ * GL_HALF_FLOAT, GL_UNSIGNED_BYTE, GL_INT_2_10_10_10_REV, etc.).
+ *
+ * @param components The number of components per vertex.
+ *
+ * @return The number of bytes per vertex or 0 if the type is not
+ * supported.
+ */
+static GLsizei kuhl_private_attrib_packed_bytes(GLenum type, GLuint components)
+{
+	GLsizei bytes = 0;
+	switch(type)
+	{
+		case GL_FLOAT:
+		case GL_INT:
+		case GL_UNSIGNED_INT:
+			bytes = 4*components; break;
+		case GL_HALF_FLOAT:
+		case GL_SHORT:
+		case GL_UNSIGNED_SHORT:
+			bytes = 2*components; break;
+		case GL_BYTE:
+		case GL_UNSIGNED_BYTE:
+			bytes = components; break;
+		case GL_INT_2_10_10_10_REV:
+		case GL_UNSIGNED_INT_2_10_10_10_REV:
+			/* All four components are packed into 32 bits. */
+			if(components != 4)
+				return 0;
+			bytes = 4; break;
+		default:
+			return 0;
+	}
+	return bytes;
+}
+
+/** Calculates the number of bytes that one vertex of an attribute
+ * uses in a buffer. The result is rounded up to a multiple of 4 bytes
+ * so that each vertex (and each attribute in an interleaved buffer)
+ * remains aligned.
+ *
+ * @param type The OpenGL type of each component.
+ *
+ * @param components The number of components per vertex.
+ *
+ * @return The number of bytes per vertex or 0 if the type is not
+ * supported.
+ */
+static GLsizei kuhl_private_attrib_bytes(GLenum type, GLuint components)
+{
+	return (kuhl_private_attrib_packed_bytes(type, components) + 3) & ~3;
+}
+
+/** Frees the name of an attribute in a kuhl_geometry object and
+ * deletes the buffer that stores it unless the buffer is shared with
+ * another attribute in an interleaved buffer.
+ *
+ * @param geom The geometry object containing the attribute.
+ *
+ * @param index The index of the attribute in geom->attribs[].
+ */
+static void kuhl_private_attrib_release(kuhl_geometry *geom, unsigned int index)
+{
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+	free(attrib->name);
+	attrib->name = NULL;
+
+	int shared = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		if(i != index && geom->attribs[i].bufferobject == attrib->bufferobject)
+			shared = 1;
+	}
+	if(!shared && !attrib->external && glIsBuffer(attrib->bufferobject))
+		glDeleteBuffers(1, &(attrib->bufferobject));
+	attrib->bufferobject = 0;
+	attrib->mapped = 0;
+	attrib->external = 0;
+}
+
+/** Returns the number of bytes an entry in a vertex layout uses in
+ * each vertex (see kuhl_private_attrib_bytes()). A type of 0 in the
+ * layout means GL_FLOAT. */
+static GLsizei kuhl_private_layout_bytes(const kuhl_vertex_layout *layout)
+{
+	return kuhl_private_attrib_bytes(layout->type == 0 ? GL_FLOAT : layout->type,
+	                                 layout->components);
+}
+
+/** Tells OpenGL where the data for an attribute is inside of the
+ * currently bound GL_ARRAY_BUFFER.
+ *
+ * @param attribLocation The attribute location in the GLSL program.
+ *
+ * @param attrib The attribute.
+ */
+static void kuhl_private_attrib_pointer(GLint attribLocation, const kuhl_attrib *attrib)
+{
+	glVertexAttribPointer(
+		attribLocation, // attribute location in glsl program
+		attrib->components, // number of elements (x,y,z)
+		attrib->type, // type of each element
+		attrib->normalized, // should OpenGL normalize values?
+		attrib->stride, // bytes between vertices (0=tightly packed)
+		(const GLvoid*) (intptr_t) attrib->offset ); // offset of first element
+}
+
+/** Sets the attribute divisor using OpenGL 3.3 or the
+ * ARB_instanced_arrays extension, whichever is available. */
+static void kuhl_private_attrib_divisor(GLuint index, GLuint divisor)
+{
+	if(GLEW_VERSION_3_3)
+		glVertexAttribDivisor(index, divisor);
+	else
+		glVertexAttribDivisorARB(index, divisor);
+}
+
+/** Number of floats used by each instance in the per-instance buffer
+ * (a 4x4 matrix followed by an RGB color and the animation time
+ * offset and speed). */
+#define KUHL_INSTANCE_FLOATS 21
+
+/** Connects the per-instance buffer of a kuhl_geometry object to the
+ * in_InstanceMatrix and in_InstanceColor attributes in its GLSL
+ * program. Used by kuhl_geometry_instances() and
+ * kuhl_geometry_program().
+ *
+ * @param geom The geometry whose VAO should be updated.
+ *
+ * @param warnIfAttribMissing If nonzero, print a warning if
+ * in_InstanceMatrix is missing from the GLSL program.
+ */
+static void kuhl_private_instances_connect(kuhl_geometry *geom, int warnIfAttribMissing)
+{
+	kuhl_program_cache *cache = kuhl_private_program_cache_get(geom->program);
+	GLint matLoc   = kuhl_private_cache_attrib(cache, geom->program, "in_InstanceMatrix");
+	GLint colorLoc = kuhl_private_cache_attrib(cache, geom->program, "in_InstanceColor");
+	GLint animLoc  = kuhl_private_cache_attrib(cache, geom->program, "in_InstanceAnim");
+	if(matLoc == -1 && warnIfAttribMissing)
+		msg(MSG_WARNING, "GLSL program %d doesn't have an 'in mat4 in_InstanceMatrix' attribute. Every instance will be drawn in the same place.", geom->program);
+
+	const GLsizei stride = KUHL_INSTANCE_FLOATS*sizeof(GLfloat);
+	glBindVertexArray(geom->vao);
+	glBindBuffer(GL_ARRAY_BUFFER, geom->instance_bufferobject);
+	if(matLoc != -1)
+	{
+		/* A mat4 attribute uses four consecutive locations, one per
+		 * column. */
+		for(int i=0; i<4; i++)
+		{
+			glEnableVertexAttribArray(matLoc+i);
+			glVertexAttribPointer(matLoc+i, 4, GL_FLOAT, GL_FALSE, stride,
+			                      (const GLvoid*) (intptr_t) (sizeof(GLfloat)*4*i));
+			kuhl_private_attrib_divisor(matLoc+i, 1);
+		}
+	}
+	if(colorLoc != -1)
+	{
+		glEnableVertexAttribArray(colorLoc);
+		glVertexAttribPointer(colorLoc, 3, GL_FLOAT, GL_FALSE, stride,
+		                      (const GLvoid*) (intptr_t) (sizeof(GLfloat)*16));
+		kuhl_private_attrib_divisor(colorLoc, 1);
+	}
+	if(animLoc != -1)
+	{
+		glEnableVertexAttribArray(animLoc);
+		glVertexAttribPointer(animLoc, 2, GL_FLOAT, GL_FALSE, stride,
+		                      (const GLvoid*) (intptr_t) (sizeof(GLfloat)*19));
+		kuhl_private_attrib_divisor(animLoc, 1);
+	}
+	kuhl_errorcheck();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+/** Disables the per-instance attributes in the VAO of a kuhl_geometry
+ * object so that it can be drawn without instancing again.
+ *
+ * @param geom The geometry whose VAO should be updated.
+ */
+static void kuhl_private_instances_disconnect(kuhl_geometry *geom)
+{
+	kuhl_program_cache *cache = kuhl_private_program_cache_get(geom->program);
+	GLint matLoc   = kuhl_private_cache_attrib(cache, geom->program, "in_InstanceMatrix");
+	GLint colorLoc = kuhl_private_cache_attrib(cache, geom->program, "in_InstanceColor");
+	GLint animLoc  = kuhl_private_cache_attrib(cache, geom->program, "in_InstanceAnim");
+
+	glBindVertexArray(geom->vao);
+	for(int i=0; matLoc != -1 && i<4; i++)
+	{
+		glDisableVertexAttribArray(matLoc+i);
+		kuhl_private_attrib_divisor(matLoc+i, 0);
+	}
+	if(colorLoc != -1)
+	{
+		glDisableVertexAttribArray(colorLoc);
+		kuhl_private_attrib_divisor(colorLoc, 0);
+	}
+	if(animLoc != -1)
+	{
+		glDisableVertexAttribArray(animLoc);
+		kuhl_private_attrib_divisor(animLoc, 0);
+	}
+	glBindVertexArray(0);
+	kuhl_errorcheck();
+}
+
+/** Changes the GLSL program that is used by a kuhl_geometry object.
+ *
+ * @param geom A geometry that you want to change the GLSL program for.
+ *
+ * @param program The new GLSL program you wish to use with the geometry.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to apply the new program
+ * to all geometries in the kuhl_geometry linked list. Otherwise, set
+ * to 0.
+ */
+void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
+{
+	if(geom == NULL)
+		return;
+
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_program(geom->next, program, kg_options);
+
+	// If the caller deleted their old program and created a new one,
+	// the new program ID might match the old program ID. Therefore,
+	// we can't rely on the program IDs to verify that the user
+	// changed the program.
+
+	if(!glIsProgram(program))
+	{
+		msg(MSG_WARNING, "GLSL program %d is not a valid program.\n",program);
+	}
+
+	geom->program = program;
+
+	/* Iterate through the vertex attributes in this kuhl_geometry
+	 * object and determine where these attributes should go in the
+	 * newly specified program. */
+	glBindVertexArray(geom->vao);
 	for(unsigned int i=0; i<geom->attrib_count; i++)
 	{
 		kuhl_attrib *attrib = &(geom->attribs[i]);
@@ -1169,21 +2142,9 @@ void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
 		GLint attribLocation = kuhl_get_attribute(geom->program, attrib->name);
 		glEnableVertexAttribArray(attribLocation);
 
-		/* Get the size of the buffer */
-		GLint bufferSize = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
-		GLint bufferNumFloats = bufferSize/sizeof(GLfloat);
-		GLint components = bufferNumFloats / geom->vertex_count;
-
 		/* Connect this vertex attribute with the (possibly different)
 		 * attribute location. */
-		glVertexAttribPointer(
-			attribLocation, // attribute location in glsl program
-			components, // number of elements (x,y,z)
-			GL_FLOAT, // type of each element
-			GL_FALSE, // should OpenGL normalize values?
-			0,        // no extra data between each position
-			0 );      // offset of first element
+		kuhl_private_attrib_pointer(attribLocation, attrib);
 		kuhl_errorcheck();
 	}
 
@@ -1191,9 +2152,68 @@ void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
 	 * they are determined in kuhl_geometry_draw() */
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
+
+	/* Connect per-instance data to the new program too. */
+	if(geom->instance_count > 0)
+		kuhl_private_instances_connect(geom, 1);
 }
 
 
+/** Calculates the bounding box and bounding sphere of a
+ * kuhl_geometry object from its vertex positions. Called when
+ * in_Position is added to the geometry.
+ *
+ * @param geom The geometry to update. geom->vertex_count positions
+ * are read.
+ *
+ * @param data Pointer to the first component of the position of the
+ * first vertex.
+ *
+ * @param components The number of components in each position (2 or
+ * more; z is 0 if there are only 2).
+ *
+ * @param stride The number of bytes between consecutive positions.
+ */
+static void kuhl_private_geometry_bounds(kuhl_geometry *geom, const void *data, GLuint components, GLsizei stride)
+{
+	geom->has_bounds = 0;
+	if(data == NULL || components < 2 || geom->vertex_count == 0)
+		return;
+
+	float *b = geom->aabbox;
+	for(int i=0; i<6; i=i+2)
+	{
+		b[i]   = FLT_MAX;
+		b[i+1] = -FLT_MAX;
+	}
+	for(GLuint v=0; v<geom->vertex_count; v++)
+	{
+		const GLfloat *p = (const GLfloat*) ((const char*) data + (size_t) v*stride);
+		for(GLuint k=0; k<3; k++)
+		{
+			float c = k < components ? p[k] : 0;
+			if(c < b[2*k])   b[2*k]   = c;
+			if(c > b[2*k+1]) b[2*k+1] = c;
+		}
+	}
+
+	/* The sphere is centered on the box; find the vertex furthest
+	 * from the center. */
+	float *s = geom->bsphere;
+	vec3f_set(s, (b[0]+b[1])/2, (b[2]+b[3])/2, (b[4]+b[5])/2);
+	float radius2 = 0;
+	for(GLuint v=0; v<geom->vertex_count; v++)
+	{
+		const GLfloat *p = (const GLfloat*) ((const char*) data + (size_t) v*stride);
+		float d[3] = { p[0]-s[0], p[1]-s[1], (components > 2 ? p[2] : 0)-s[2] };
+		float dist2 = vec3f_normSq(d);
+		if(dist2 > radius2)
+			radius2 = dist2;
+	}
+	s[3] = sqrtf(radius2);
+	geom->has_bounds = 1;
+}
+
 /** Adds a vertex attribute (such as vertex position, normal, color,
  * texture coordinate, etc) to the geometry object.
  *
@@ -1213,6 +2233,42 @@ void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
  * object.
  */
 void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int warnIfAttribMissing)
+{
+	kuhl_geometry_attrib_typed(geom, data, components, GL_FLOAT, GL_FALSE, name, warnIfAttribMissing);
+}
+
+/** Adds a vertex attribute to the geometry object which is stored in
+ * a format other than 32-bit floats. Compact formats reduce the
+ * amount of memory and bandwidth that the geometry uses. For
+ * example, texture coordinates can be stored as GL_HALF_FLOAT,
+ * normals as normalized GL_INT_2_10_10_10_REV or GL_SHORT, and colors
+ * as normalized GL_UNSIGNED_BYTE. Regardless of the format, the
+ * attribute appears as a float vector in the GLSL program.
+ *
+ * @param geom The geometry to add the attribute to.
+ *
+ * @param data An array containing geom->vertex_count tightly packed
+ * vertices of data in the specified type. Vertices which aren't a
+ * multiple of 4 bytes long (for example, three GL_UNSIGNED_BYTE or
+ * GL_HALF_FLOAT components) are padded when they are copied into
+ * the buffer.
+ *
+ * @param components The number of components per vertex in this
+ * attribute. Must be 4 for the packed 2_10_10_10 types.
+ *
+ * @param type The OpenGL type of each component.
+ *
+ * @param normalized If GL_TRUE, integer values are mapped into the
+ * range [0,1] (unsigned) or [-1,1] (signed) in the GLSL program.
+ *
+ * @param name The GLSL variable name that this attribute should be
+ * connected to.
+ *
+ * @param warnIfAttribMissing If nonzero, print a warning if the
+ * attribute isn't present in the GLSL program for this geometry
+ * object.
+ */
+void kuhl_geometry_attrib_typed(kuhl_geometry *geom, const void *data, GLuint components, GLenum type, GLboolean normalized, const char* name, int warnIfAttribMissing)
 {
 	if(name == NULL || strlen(name) == 0)
 	{
@@ -1234,6 +2290,12 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because this attribute has 0 components.\n", name);
 		return;
 	}
+	GLsizei bytesPerVertex = kuhl_private_attrib_bytes(type, components);
+	if(bytesPerVertex == 0)
+	{
+		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because type 0x%x with %u components is not supported.\n", name, type, components);
+		return;
+	}
 	if(!glIsVertexArray(geom->vao))
 	{
 		msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because the geometry has an invalid vertex array object %d\n", name, geom->vao);
@@ -1246,7 +2308,7 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 
 	// Get attribute location directly so kuhl_get_attribute() and
 	// this function don't print the same error repeatedly.
-	GLint attribLocation = glGetAttribLocation(geom->program, name);
+	GLint attribLocation = kuhl_private_cache_attrib(kuhl_private_program_cache_get(geom->program), geom->program, name);
 	if(attribLocation == -1)
 	{
 		if(warnIfAttribMissing)
@@ -1268,9 +2330,7 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	else
 	{
 		/* If overwriting, free resources from old attribute. */
-		free(geom->attribs[destIndex].name);
-		if(glIsBuffer(geom->attribs[destIndex].bufferobject))
-			glDeleteBuffers(1, &(geom->attribs[destIndex].bufferobject));
+		kuhl_private_attrib_release(geom, destIndex);
 	}
 	msg(MSG_DEBUG, "Storing attribute %s at index %d in kuhl_geometry; connected to location %d in program %d", name, destIndex, attribLocation, geom->program);
 
@@ -1284,6 +2344,13 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	/* Set up this attribute. */
 	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
 	attrib->name = strdup(name);
+	attrib->mapped = 0;
+	attrib->external = 0;
+	attrib->components = components;
+	attrib->type = type;
+	attrib->normalized = normalized;
+	attrib->stride = bytesPerVertex;
+	attrib->offset = 0;
 
 	/* Switch to our vertex array object. */
 	glBindVertexArray(geom->vao);
@@ -1300,23 +2367,41 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
 	kuhl_errorcheck();
 
+	/* Each vertex in the buffer starts on a 4 byte boundary. Pad the
+	 * vertices if they are packed closer together than that. */
+	GLsizei packedBytes = kuhl_private_attrib_packed_bytes(type, components);
+	unsigned char *padded = NULL;
+	if(packedBytes != bytesPerVertex)
+	{
+		padded = kuhl_malloc((size_t)bytesPerVertex*geom->vertex_count);
+		for(GLuint i=0; i<geom->vertex_count; i++)
+		{
+			unsigned char *dest = padded + (size_t)i*bytesPerVertex;
+			memcpy(dest, (const unsigned char*)data + (size_t)i*packedBytes, packedBytes);
+			memset(dest+packedBytes, 0, bytesPerVertex-packedBytes);
+		}
+	}
+
 	/* Copy our data into the buffer object that is currently bound. */
 	glBufferData(GL_ARRAY_BUFFER,
-	             sizeof(GLfloat)*geom->vertex_count*components,
-	             data, GL_STATIC_DRAW);
+	             (GLsizeiptr)bytesPerVertex*geom->vertex_count,
+	             padded ? (const void*) padded : data, GL_STATIC_DRAW);
+	free(padded);
 	kuhl_errorcheck();
 
+	if(strcmp(name, "in_Position") == 0)
+	{
+		if(type == GL_FLOAT)
+			kuhl_private_geometry_bounds(geom, data, components, bytesPerVertex);
+		else
+			geom->has_bounds = 0;
+	}
+
 	/* Tell OpenGL some information about the data that is in the
 	 * buffer. Among other things, we need to tell OpenGL which
 	 * attribute number (i.e., variable) the data should correspond to
 	 * in the vertex program. */
-	glVertexAttribPointer(
-		attribLocation, // attribute location in glsl program
-		components, // number of elements (x,y,z)
-		GL_FLOAT, // type of each element
-		GL_FALSE, // should OpenGL normalize values?
-		0,        // no extra data between each position
-		0 );      // offset of first element
+	kuhl_private_attrib_pointer(attribLocation, attrib);
 	kuhl_errorcheck();
 
 	// unbind
@@ -1324,364 +2409,2041 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	glBindVertexArray(0);
 }
 
-/** Calculates the number of objects in the kuhl_geometry linked list.
-
-    @param geom The geometry object which you want to know the length of.
-
-    @return The number of geometry objects in the list.
-*/
-unsigned int kuhl_geometry_count(const kuhl_geometry *geom)
+/** Adds several vertex attributes to the geometry object which are
+ * stored together in a single interleaved buffer. For example, a
+ * layout of { {"in_Position", 3}, {"in_Normal", 3}, {"in_TexCoord", 2} }
+ * means that the data array contains x,y,z,nx,ny,nz,u,v for the first
+ * vertex followed by the same for the second vertex, etc. Storing the
+ * attributes this way requires only one buffer object and one upload
+ * and improves the locality of vertex fetches.
+ *
+ * Each layout entry may also specify a compact type (see
+ * kuhl_geometry_attrib_typed()). Every attribute occupies a multiple
+ * of 4 bytes in the vertex; the caller must pad the data accordingly.
+ *
+ * @param geom The geometry to add the attributes to.
+ *
+ * @param data An array that contains the interleaved attribute
+ * data for geom->vertex_count vertices.
+ *
+ * @param layout An array describing the attributes in the order that
+ * they appear in each vertex.
+ *
+ * @param layout_count The number of items in the layout array.
+ *
+ * @param warnIfAttribMissing If nonzero, print a warning if an
+ * attribute isn't present in the GLSL program for this geometry
+ * object. Attributes that are missing from the program are skipped
+ * (but still occupy space in the buffer).
+ */
+void kuhl_geometry_attrib_interleaved(kuhl_geometry *geom, const void *data, const kuhl_vertex_layout *layout, unsigned int layout_count, int warnIfAttribMissing)
 {
-	if(geom == NULL)
-		return 0;
-	const kuhl_geometry *g = geom;
-	unsigned int count = 1;
-	while(g->next != NULL)
+	if(geom == NULL || data == NULL || layout == NULL || layout_count == 0)
 	{
-		count++;
-		g = g->next;
+		msg(MSG_WARNING, "Unable to add interleaved attributes because the geometry, data, or layout was NULL or empty.\n");
+		return;
 	}
-	return count;
-}
-
-
-/** Initializes the vertex array object (VAO) associated with this
-    kuhl_geometry and initializes other variables inside of the struct.
-
-    @param geom A kuhl_geometry struct populated with the information
-    necessary to draw some geometry.
-
-    @param program A GLSL program to be used when rendering this
-    geometry.
-
-    @param vertexCount The number of vertices in this piece of geometry.
-
-    @param primitive_type OpenGL primitive type of the geometry.
-*/
-void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type)
-{
-	if(geom == NULL)
+	if(!glIsVertexArray(geom->vao))
 	{
-		msg(MSG_FATAL, "You called kuhl_geometry_new() with geom parameter set to NULL.");
-		exit(EXIT_FAILURE);
+		msg(MSG_WARNING, "Unable to add interleaved attributes to the geometry object because the geometry has an invalid vertex array object %d\n", geom->vao);
+		return;
 	}
 
-	kuhl_errorcheck();
-
-	/* Ask OpenGL for one vertex array object "name" (really an
-	 * integer that you can think of as an ID number) that we can use
-	 * for a new VAO (vertex array object) */
-	glGenVertexArrays(1, &(geom->vao));
-	/* Bind to the VAO to finish creating it */
-	glBindVertexArray(geom->vao);
-	glBindVertexArray(0); // unbind
-
-	/* Check if the program is valid (we don't need to enable it here). */
-	if(!glIsProgram(program))
+	/* Find the location of each attribute in the program and the
+	 * size of each vertex. */
+	kuhl_program_cache *cache = kuhl_private_program_cache_get(geom->program);
+	GLint *locations = kuhl_malloc(sizeof(GLint)*layout_count);
+	GLsizei stride = 0;
+	int activeCount = 0;
+	for(unsigned int i=0; i<layout_count; i++)
 	{
-		msg(MSG_FATAL, "The program you specified in your kuhl_geometry struct (%d) is not a valid GLSL program.\n", geom->program);
-		exit(EXIT_FAILURE);
+		if(layout[i].name == NULL || strlen(layout[i].name) == 0 ||
+		   kuhl_private_layout_bytes(&layout[i]) == 0)
+		{
+			msg(MSG_FATAL, "Item %u in the vertex layout is missing a name or has an unsupported type or number of components.\n", i);
+			exit(EXIT_FAILURE);
+		}
+		stride += kuhl_private_layout_bytes(&layout[i]);
+		locations[i] = kuhl_private_cache_attrib(cache, geom->program, layout[i].name);
+		if(locations[i] == -1)
+		{
+			if(warnIfAttribMissing)
+				msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
+				    layout[i].name, geom->program);
+		}
+		else
+			activeCount++;
 	}
 
-	if(vertexCount == 0)
+	/* If none of the attributes are used by the program, don't
+	 * create a buffer. */
+	if(activeCount == 0)
 	{
-		//msg(MSG_WARNING, "You are creating a geometry object with a vertexCount of 0.\n");
+		free(locations);
+		return;
 	}
 
-	geom->program = program;
-	geom->vertex_count = vertexCount;
-	geom->primitive_type = primitive_type;
-
-	geom->attrib_count = 0;
-	geom->texture_count = 0;
-
-	geom->indices_len = 0;
-	geom->indices_bufferobject = 0;
+	glBindVertexArray(geom->vao);
+	GLuint bufferobject = 0;
+	glGenBuffers(1, &bufferobject);
+	glBindBuffer(GL_ARRAY_BUFFER, bufferobject);
+	glBufferData(GL_ARRAY_BUFFER,
+	             (GLsizeiptr)stride*geom->vertex_count,
+	             data, GL_STATIC_DRAW);
+	kuhl_errorcheck();
 
-	mat4f_identity(geom->matrix);
-	geom->has_been_drawn = 0;
+	GLsizei offset = 0;
+	for(unsigned int i=0; i<layout_count; i++)
+	{
+		GLsizei thisOffset = offset;
+		offset += kuhl_private_layout_bytes(&layout[i]);
+		if(locations[i] == -1)
+			continue;
 
-#if KUHL_UTIL_USE_ASSIMP
-	geom->assimp_node  = NULL;
-	geom->assimp_scene = NULL;
-	geom->bones        = NULL;
+		/* If another attribute in kuhl_geometry has the same name,
+		 * overwrite it. */
+		int destIndex = kuhl_geometry_attrib_index(geom, layout[i].name);
+		if(destIndex < 0)
+		{
+			destIndex = geom->attrib_count;
+			if(destIndex == MAX_ATTRIBUTES)
+			{
+				msg(MSG_FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
+				exit(EXIT_FAILURE);
+			}
+			geom->attrib_count++;
+		}
+		else
+			kuhl_private_attrib_release(geom, destIndex);
+		msg(MSG_DEBUG, "Storing interleaved attribute %s at index %d in kuhl_geometry; connected to location %d in program %d", layout[i].name, destIndex, locations[i], geom->program);
+
+		kuhl_attrib *attrib = &(geom->attribs[destIndex]);
+		attrib->name = strdup(layout[i].name);
+		attrib->bufferobject = bufferobject;
+		attrib->mapped = 0;
+		attrib->external = 0;
+		attrib->components = layout[i].components;
+		attrib->type = layout[i].type == 0 ? GL_FLOAT : layout[i].type;
+		attrib->normalized = layout[i].normalized;
+		attrib->stride = stride;
+		attrib->offset = thisOffset;
+
+		if(strcmp(attrib->name, "in_Position") == 0)
+		{
+			if(attrib->type == GL_FLOAT)
+				kuhl_private_geometry_bounds(geom, (const char*) data + thisOffset, attrib->components, stride);
+			else
+				geom->has_bounds = 0;
+		}
+
+		glEnableVertexAttribArray(locations[i]);
+		kuhl_private_attrib_pointer(locations[i], attrib);
+		kuhl_errorcheck();
+	}
+	free(locations);
+
+	// unbind
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+/** Connects a vertex attribute to data in a buffer that the caller
+ * created and owns. The buffer is not copied and is not deleted by
+ * kuhl_geometry_delete(). This is useful for dynamic vertex data that
+ * is written into a different part of a buffer each frame (see
+ * streambuf.h). Calling this function again with the same buffer and
+ * name only moves the attribute to the new offset.
+ *
+ * @param geom The geometry to add the attribute to.
+ *
+ * @param bufferobject The OpenGL buffer containing the data.
+ *
+ * @param offset The byte offset in the buffer of the data for the
+ * first vertex. The data must be tightly packed.
+ *
+ * @param components The number of components per vertex.
+ *
+ * @param type The type of each component (typically GL_FLOAT).
+ *
+ * @param normalized Normalize integer components?
+ *
+ * @param name The GLSL variable name that this attribute should be
+ * connected to.
+ *
+ * @param kg_options If KG_WARN is set, print a warning if the
+ * attribute isn't present in the GLSL program.
+ */
+void kuhl_geometry_attrib_buffer(kuhl_geometry *geom, GLuint bufferobject, GLintptr offset, GLuint components, GLenum type, GLboolean normalized, const char *name, int kg_options)
+{
+	if(geom == NULL || name == NULL)
+		return;
+	GLsizei bytesPerVertex = kuhl_private_attrib_bytes(type, components);
+	if(bytesPerVertex == 0 || !glIsBuffer(bufferobject))
+	{
+		msg(MSG_WARNING, "Unable to connect attribute '%s' to buffer %u with %u components of type 0x%x.", name, bufferobject, components, type);
+		return;
+	}
+
+	GLint attribLocation = kuhl_private_cache_attrib(kuhl_private_program_cache_get(geom->program), geom->program, name);
+	if(attribLocation == -1)
+	{
+		if(kg_options & KG_WARN)
+			msg(MSG_WARNING, "Unable to add attribute '%s' to the geometry object because it was missing or inactive in program %d\n",
+			    name, geom->program);
+		return;
+	}
+
+	int destIndex = kuhl_geometry_attrib_index(geom, name);
+	if(destIndex < 0)
+	{
+		destIndex = geom->attrib_count;
+		if(destIndex == MAX_ATTRIBUTES)
+		{
+			msg(MSG_FATAL, "You tried to add more than %d attributes to a kuhl_geometry object\n", MAX_ATTRIBUTES);
+			exit(EXIT_FAILURE);
+		}
+		geom->attrib_count++;
+	}
+	else
+	{
+		kuhl_attrib *old = &(geom->attribs[destIndex]);
+		/* Moving an existing attribute to a new offset is the
+		 * common case. Avoid the work below if nothing changed. */
+		if(old->external && old->bufferobject == bufferobject &&
+		   old->offset == (GLsizei) offset && old->components == components &&
+		   old->type == type && old->normalized == normalized)
+			return;
+		kuhl_private_attrib_release(geom, destIndex);
+	}
+
+	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
+	attrib->name = strdup(name);
+	attrib->bufferobject = bufferobject;
+	attrib->mapped = 0;
+	attrib->external = 1;
+	attrib->components = components;
+	/* We can't see the data, so we can't calculate bounds. */
+	if(strcmp(name, "in_Position") == 0)
+		geom->has_bounds = 0;
+	attrib->type = type;
+	attrib->normalized = normalized;
+	attrib->stride = bytesPerVertex;
+	attrib->offset = (GLsizei) offset;
+
+	glBindVertexArray(geom->vao);
+	glBindBuffer(GL_ARRAY_BUFFER, bufferobject);
+	glEnableVertexAttribArray(attribLocation);
+	kuhl_private_attrib_pointer(attribLocation, attrib);
+	kuhl_errorcheck();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+/** Causes kuhl_geometry_draw() to draw several copies (instances) of
+ * the geometry with a single draw call. Each instance has its own
+ * transformation matrix and color which are provided to the GLSL
+ * program as per-instance attributes:
+ *
+ * in mat4 in_InstanceMatrix; // model matrix for this instance
+ * in vec3 in_InstanceColor;  // color for this instance (white if colors==NULL)
+ *
+ * The vertex program should compute the modelview matrix for each
+ * instance as ModelView * in_InstanceMatrix where ModelView
+ * typically contains only the view matrix. See assimp-instanced.vert
+ * for an example. This function can be called again (e.g., every
+ * frame) to update the instances; the existing buffer is reused.
+ *
+ * Requires OpenGL 3.3 or the ARB_instanced_arrays extension.
+ *
+ * @param geom The geometry to draw multiple times.
+ *
+ * @param matrices An array of instanceCount 4x4 column-major matrices
+ * (i.e., instanceCount*16 floats).
+ *
+ * @param colors An array of instanceCount*3 floats containing an RGB
+ * color for each instance or NULL if every instance should be white.
+ *
+ * @param instanceCount The number of instances. Set to 0 to stop
+ * drawing the geometry with instancing.
+ *
+ * @param kg_options If KG_WARN is set, warn if the in_InstanceMatrix
+ * attribute is missing from the GLSL program. If KG_FULL_LIST is set,
+ * the same instances are applied to every geometry object in the
+ * list. The per-instance data is uploaded only once and shared by
+ * the list. Without KG_FULL_LIST, only geom is changed; the rest of
+ * the list keeps drawing the instances it already had.
+ */
+void kuhl_geometry_instances(kuhl_geometry *geom, const GLfloat *matrices, const GLfloat *colors, GLuint instanceCount, int kg_options)
+{
+	kuhl_geometry_instances_anim(geom, matrices, colors, NULL, instanceCount, kg_options);
+}
+
+/** Checks if the instance buffer of a kuhl_geometry object is also
+ * used by geometry later in the list (see KG_FULL_LIST in
+ * kuhl_geometry_instances()). */
+static int kuhl_private_instances_shared(const kuhl_geometry *geom)
+{
+	if(geom->instance_bufferobject == 0)
+		return 0;
+	for(const kuhl_geometry *g = geom->next; g != NULL; g = g->next)
+	{
+		if(g->instance_bufferobject == geom->instance_bufferobject)
+			return 1;
+	}
+	return 0;
+}
+
+/** Like kuhl_geometry_instances(), but each instance can also play a
+ * model that was baked with kuhl_bake_model() from a different point
+ * in the animation and at a different speed. The values are provided
+ * to the GLSL program as a per-instance attribute:
+ *
+ * in vec2 in_InstanceAnim; // time offset in seconds, playback speed
+ *
+ * See assimp-baked.vert for an example.
+ *
+ * @param anim An array of instanceCount*2 floats containing the time
+ * offset and speed of each instance or NULL to use an offset of 0 and
+ * a speed of 1 for every instance.
+ *
+ * For the other parameters, see kuhl_geometry_instances().
+ */
+void kuhl_geometry_instances_anim(kuhl_geometry *geom, const GLfloat *matrices, const GLfloat *colors, const GLfloat *anim, GLuint instanceCount, int kg_options)
+{
+	if(geom == NULL)
+		return;
+	if(instanceCount > 0 && matrices == NULL)
+	{
+		msg(MSG_WARNING, "Unable to set up instances because the matrices array was NULL.");
+		return;
+	}
+	if(instanceCount > 0 && !(GLEW_VERSION_3_3 || GLEW_ARB_instanced_arrays))
+	{
+		msg(MSG_FATAL, "Drawing instanced geometry requires OpenGL 3.3 or ARB_instanced_arrays.");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Copy the matrices and colors into a single interleaved array. */
+	GLfloat *data = NULL;
+	if(instanceCount > 0)
+	{
+		data = kuhl_malloc(sizeof(GLfloat)*KUHL_INSTANCE_FLOATS*instanceCount);
+		for(GLuint i=0; i<instanceCount; i++)
+		{
+			GLfloat *d = data + i*KUHL_INSTANCE_FLOATS;
+			mat4f_copy(d, matrices+i*16);
+			if(colors)
+				vec3f_copy(d+16, colors+i*3);
+			else
+				vec3f_set(d+16, 1, 1, 1);
+			d[19] = anim ? anim[i*2]   : 0;
+			d[20] = anim ? anim[i*2+1] : 1;
+		}
+	}
+
+	/* Reuse the buffer that the first geometry already has unless
+	 * other geometry that we aren't changing shares it. */
+	GLuint bufferobject = geom->instance_bufferobject;
+	if(instanceCount > 0)
+	{
+		if(!glIsBuffer(bufferobject) ||
+		   (!(kg_options & KG_FULL_LIST) && kuhl_private_instances_shared(geom)))
+			glGenBuffers(1, &bufferobject);
+		glBindBuffer(GL_ARRAY_BUFFER, bufferobject);
+		/* Providing new data with glBufferData() lets the driver
+		 * allocate new storage instead of waiting for previous draw
+		 * calls to finish using the old data. */
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*KUHL_INSTANCE_FLOATS*instanceCount,
+		             data, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
+		free(data);
+	}
+
+	/* A buffer shared by several objects in the list is deleted
+	 * only by the last object which uses it. */
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		if(instanceCount == 0)
+		{
+			/* Stop drawing this geometry with instancing. */
+			if(glIsBuffer(g->instance_bufferobject))
+			{
+				kuhl_private_instances_disconnect(g);
+				if(!kuhl_private_instances_shared(g))
+					glDeleteBuffers(1, &(g->instance_bufferobject));
+			}
+			g->instance_bufferobject = 0;
+		}
+		else if(g->instance_bufferobject != bufferobject)
+		{
+			if(glIsBuffer(g->instance_bufferobject) && !kuhl_private_instances_shared(g))
+				glDeleteBuffers(1, &(g->instance_bufferobject));
+			g->instance_bufferobject = bufferobject;
+			kuhl_private_instances_connect(g, kg_options & KG_WARN);
+		}
+		g->instance_count = instanceCount;
+
+		if(!(kg_options & KG_FULL_LIST))
+			break;
+	}
+}
+
+/** Returns the number of indices stored in the index buffer of a
+ * kuhl_geometry object, including every level of detail (see
+ * kuhl_geometry_lod()). */
+static GLuint kuhl_private_geometry_index_total(const kuhl_geometry *geom)
+{
+	if(geom->lod_count > 1)
+		return geom->lod_first[geom->lod_count-1] + geom->lod_len[geom->lod_count-1];
+	return geom->indices_len;
+}
+
+/** Finds the indices to draw for the level of detail selected with
+ * kuhl_geometry_lod_select().
+ *
+ * @param geom The geometry.
+ *
+ * @param first Filled in with the position of the first index in
+ * the index buffer.
+ *
+ * @return The number of indices to draw.
+ */
+static GLuint kuhl_private_geometry_lod_range(const kuhl_geometry *geom, GLuint *first)
+{
+	*first = geom->first_index;
+	if(geom->lod == 0 || geom->lod >= geom->lod_count)
+		return geom->indices_len;
+	*first += geom->lod_first[geom->lod];
+	return geom->lod_len[geom->lod];
+}
+
+/** Checks if a kuhl_geometry object can be merged with
+ * kuhl_geometry_merge(). The object must use indices, store all of
+ * its attributes in one (interleaved) buffer, not be instanced and
+ * not already be merged. */
+static int kuhl_private_geometry_mergeable(const kuhl_geometry *geom)
+{
+	if(geom->merged || geom->indices_len == 0 || geom->vertex_count == 0 ||
+	   geom->attrib_count == 0 || geom->instance_count > 0)
+		return 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		const kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(attrib->bufferobject != geom->attribs[0].bufferobject ||
+		   attrib->mapped || attrib->external)
+			return 0;
+	}
+	return 1;
+}
+
+/** Checks if two kuhl_geometry objects use the same program,
+ * primitive type and vertex layout so that they can share a VAO. */
+static int kuhl_private_geometry_same_layout(const kuhl_geometry *a, const kuhl_geometry *b)
+{
+	if(a->program != b->program || a->primitive_type != b->primitive_type ||
+	   a->attrib_count != b->attrib_count)
+		return 0;
+	for(unsigned int i=0; i<a->attrib_count; i++)
+	{
+		const kuhl_attrib *aa = &(a->attribs[i]);
+		const kuhl_attrib *ba = &(b->attribs[i]);
+		if(strcmp(aa->name, ba->name) != 0 ||
+		   aa->components != ba->components || aa->type != ba->type ||
+		   aa->normalized != ba->normalized ||
+		   aa->stride != ba->stride || aa->offset != ba->offset)
+			return 0;
+	}
+	return 1;
+}
+
+/** Moves the vertices and indices of the objects in a kuhl_geometry
+ * list into shared buffers so that they can be drawn with fewer
+ * state changes. Objects that use the same GLSL program, primitive
+ * type and vertex layout are copied into one vertex buffer, one
+ * index buffer and one VAO. Each object remembers where its data
+ * starts in the shared buffers (geom->base_vertex and
+ * geom->first_index). kuhl_geometry_draw() then draws consecutive
+ * merged objects that also share textures and a GeomTransform matrix
+ * with a single glMultiDrawElementsBaseVertex() call.
+ *
+ * Only objects that have indices and that store all of their
+ * attributes in a single buffer (such as models loaded with
+ * kuhl_load_model()) are merged. Other objects are left alone.
+ *
+ * After merging, the objects should be treated as read-only: do not
+ * replace their attributes or indices, and change their program with
+ * kuhl_geometry_program() and KG_FULL_LIST only. The list must be
+ * deleted as a whole with kuhl_geometry_delete().
+ *
+ * Requires OpenGL 3.2 or ARB_draw_elements_base_vertex.
+ *
+ * @param geom The list of geometry objects to merge.
+ */
+void kuhl_geometry_merge(kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return;
+	if(!(GLEW_VERSION_3_2 || GLEW_ARB_draw_elements_base_vertex))
+	{
+		msg(MSG_WARNING, "Unable to merge geometry because OpenGL 3.2 or ARB_draw_elements_base_vertex is not available.");
+		return;
+	}
+
+	unsigned int listLength = kuhl_geometry_count(geom);
+	kuhl_geometry **group = kuhl_malloc(sizeof(kuhl_geometry*)*listLength);
+	unsigned int mergedCount = 0, groupCount = 0;
+
+	for(kuhl_geometry *first = geom; first != NULL; first = first->next)
+	{
+		if(!kuhl_private_geometry_mergeable(first))
+			continue;
+
+		/* Find all of the objects that can share buffers with this one. */
+		unsigned int groupSize = 0;
+		GLsizeiptr vertexBytes = 0;
+		GLuint indexCount = 0;
+		int shortIndices = 1;
+		GLsizei stride = first->attribs[0].stride;
+		if(stride == 0)
+			stride = kuhl_private_attrib_bytes(first->attribs[0].type, first->attribs[0].components);
+		for(kuhl_geometry *g = first; g != NULL; g = g->next)
+		{
+			if(!kuhl_private_geometry_mergeable(g) || !kuhl_private_geometry_same_layout(first, g))
+				continue;
+			group[groupSize++] = g;
+			vertexBytes += (GLsizeiptr) g->vertex_count * stride;
+			indexCount += kuhl_private_geometry_index_total(g);
+			if(g->indices_type != GL_UNSIGNED_SHORT)
+				shortIndices = 0;
+		}
+		if(groupSize < 2)
+			continue;
+
+		/* Read the data back from the existing buffers and
+		 * concatenate it. */
+		GLsizei indexSize = shortIndices ? sizeof(GLushort) : sizeof(GLuint);
+		char *vertices = kuhl_malloc(vertexBytes);
+		char *indices = kuhl_malloc(indexSize*indexCount);
+		GLsizeiptr vertexPos = 0;
+		GLuint indexPos = 0;
+		for(unsigned int i=0; i<groupSize; i++)
+		{
+			kuhl_geometry *g = group[i];
+			GLsizeiptr bytes = (GLsizeiptr) g->vertex_count * stride;
+			glBindBuffer(GL_COPY_READ_BUFFER, g->attribs[0].bufferobject);
+			glGetBufferSubData(GL_COPY_READ_BUFFER, 0, bytes, vertices+vertexPos);
+
+			/* Copy every level of detail (see kuhl_geometry_lod()). */
+			GLuint gIndexCount = kuhl_private_geometry_index_total(g);
+			glBindBuffer(GL_COPY_READ_BUFFER, g->indices_bufferobject);
+			char *dest = indices + indexSize*indexPos;
+			if(g->indices_type == GL_UNSIGNED_SHORT && !shortIndices)
+			{
+				/* Widen 16-bit indices so every object in the
+				 * group uses the same index type. */
+				GLushort *tmp = kuhl_malloc(sizeof(GLushort)*gIndexCount);
+				glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(GLushort)*gIndexCount, tmp);
+				for(GLuint j=0; j<gIndexCount; j++)
+					((GLuint*)dest)[j] = tmp[j];
+				free(tmp);
+			}
+			else
+				glGetBufferSubData(GL_COPY_READ_BUFFER, 0, indexSize*gIndexCount, dest);
+
+			g->base_vertex = (GLint) (vertexPos / stride);
+			g->first_index = indexPos;
+			vertexPos += bytes;
+			indexPos += gIndexCount;
+		}
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		kuhl_errorcheck();
+
+		/* Create the shared VAO and buffers. */
+		GLuint vao, vertexBuffer, indexBuffer;
+		glGenVertexArrays(1, &vao);
+		glBindVertexArray(vao);
+		glGenBuffers(1, &vertexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, vertexBytes, vertices, GL_STATIC_DRAW);
+		glGenBuffers(1, &indexBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexSize*indexCount, indices, GL_STATIC_DRAW);
+		free(vertices);
+		free(indices);
+
+		kuhl_program_cache *cache = kuhl_private_program_cache_get(first->program);
+		for(unsigned int i=0; i<first->attrib_count; i++)
+		{
+			GLint loc = kuhl_private_cache_attrib(cache, first->program, first->attribs[i].name);
+			if(loc == -1)
+				continue;
+			glEnableVertexAttribArray(loc);
+			kuhl_private_attrib_pointer(loc, &(first->attribs[i]));
+		}
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
+
+		/* Replace the buffers of each object with the shared ones. */
+		for(unsigned int i=0; i<groupSize; i++)
+		{
+			kuhl_geometry *g = group[i];
+			if(glIsBuffer(g->attribs[0].bufferobject))
+				glDeleteBuffers(1, &(g->attribs[0].bufferobject));
+			if(glIsBuffer(g->indices_bufferobject))
+				glDeleteBuffers(1, &(g->indices_bufferobject));
+			if(glIsVertexArray(g->vao))
+				glDeleteVertexArrays(1, &(g->vao));
+			for(unsigned int j=0; j<g->attrib_count; j++)
+				g->attribs[j].bufferobject = vertexBuffer;
+			g->indices_bufferobject = indexBuffer;
+			g->indices_type = shortIndices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+			g->vao = vao;
+			g->merged = 1;
+		}
+		kuhl_errorcheck();
+		mergedCount += groupSize;
+		groupCount++;
+	}
+	free(group);
+
+	if(mergedCount > 0)
+		msg(MSG_DEBUG, "Merged %u of %u geometry objects into %u shared buffer(s).", mergedCount, listLength, groupCount);
+}
+
+/** Calculates the number of objects in the kuhl_geometry linked list.
+
+    @param geom The geometry object which you want to know the length of.
+
+    @return The number of geometry objects in the list.
+*/
+unsigned int kuhl_geometry_count(const kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return 0;
+	const kuhl_geometry *g = geom;
+	unsigned int count = 1;
+	while(g->next != NULL)
+	{
+		count++;
+		g = g->next;
+	}
+	return count;
+}
+
+
+/** Initializes the vertex array object (VAO) associated with this
+    kuhl_geometry and initializes other variables inside of the struct.
+
+    @param geom A kuhl_geometry struct populated with the information
+    necessary to draw some geometry.
+
+    @param program A GLSL program to be used when rendering this
+    geometry.
+
+    @param vertexCount The number of vertices in this piece of geometry.
+
+    @param primitive_type OpenGL primitive type of the geometry.
+*/
+void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type)
+{
+	if(geom == NULL)
+	{
+		msg(MSG_FATAL, "You called kuhl_geometry_new() with geom parameter set to NULL.");
+		exit(EXIT_FAILURE);
+	}
+
+	kuhl_errorcheck();
+
+	/* Ask OpenGL for one vertex array object "name" (really an
+	 * integer that you can think of as an ID number) that we can use
+	 * for a new VAO (vertex array object) */
+	glGenVertexArrays(1, &(geom->vao));
+	/* Bind to the VAO to finish creating it */
+	glBindVertexArray(geom->vao);
+	glBindVertexArray(0); // unbind
+
+	/* Check if the program is valid (we don't need to enable it here). */
+	if(!glIsProgram(program))
+	{
+		msg(MSG_FATAL, "The program you specified in your kuhl_geometry struct (%d) is not a valid GLSL program.\n", geom->program);
+		exit(EXIT_FAILURE);
+	}
+
+	if(vertexCount == 0)
+	{
+		//msg(MSG_WARNING, "You are creating a geometry object with a vertexCount of 0.\n");
+	}
+
+	geom->program = program;
+	geom->vertex_count = vertexCount;
+	geom->primitive_type = primitive_type;
+
+	geom->attrib_count = 0;
+	geom->texture_count = 0;
+
+	geom->indices_len = 0;
+	geom->indices_bufferobject = 0;
+	geom->indices_type = GL_UNSIGNED_INT;
+
+	geom->instance_count = 0;
+	geom->instance_bufferobject = 0;
+
+	geom->base_vertex = 0;
+	geom->first_index = 0;
+	geom->merged = 0;
+	geom->lod_count = 0;
+	geom->lod = 0;
+
+	mat4f_identity(geom->matrix);
+	geom->has_bounds = 0;
+	geom->has_been_drawn = 0;
+
+	for(int i=0; i<KUHL_OCCLUSION_VIEWPORTS; i++)
+	{
+		geom->occlusion_query[i] = 0;
+		geom->occlusion_pending[i] = 0;
+		geom->occluded[i] = 0;
+	}
+
+#if KUHL_UTIL_USE_ASSIMP
+	geom->assimp_node  = NULL;
+	geom->assimp_scene = NULL;
+	geom->bones        = NULL;
+	geom->skeleton     = NULL;
+	geom->skeleton_node = -1;
+#endif
+
+	geom->next = NULL;
+}
+
+/** Applies a set of indices to the geometry so that vertices can be
+ * re-used by multiple triangles or lines.
+ *
+ * @param geom The geometry that the indices should be used with.
+ *
+ * @param indices A list of indices. Each index refers to a specific vertex.
+ *
+ * @param indexCount The number of indices. For example, if the
+ * geometry object consists of triangles, indexCount should be
+ * numTriangles*3.
+ *
+ * If the geometry has fewer than 65536 vertices, the indices are
+ * stored on the graphics card as 16-bit values to save memory.
+*/
+void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount)
+{
+	if(indexCount == 0 || indices == NULL)
+	{
+		//UNCOMMENT!!!!!!!!!!!!//msg(MSG_WARNING, "indexCount was zero or indices array was NULL\n");
+		return;
+	}
+
+	if(geom->primitive_type == GL_TRIANGLES && indexCount % 3 != 0)
+	{
+		msg(MSG_FATAL, "indexCount=%u was not a multiple of 3 even though this geometry has triangles in it.", indexCount);
+		exit(EXIT_FAILURE);
+	}
+	else if(geom->primitive_type == GL_LINES && indexCount % 2 != 0)
+	{
+		msg(MSG_FATAL, "indexCount=%u was not a multiple of 2 even though this geometry has lines in it.", indexCount);
+		exit(EXIT_FAILURE);
+	}
+
+	/* TODO: Check if indices are already set? If so, print an error
+	 * message and/or free the old indices buffer before making a new
+	 * one to replace it. */
+
+	geom->indices_len = indexCount;
+
+	/* Verify that the indices the user passed in are
+	 * appropriate. If there are only 10 vertices, then a user
+	 * can't draw a vertex at index 10, 11, 13, etc. */
+	for(GLuint i=0; i<geom->indices_len; i++)
+	{
+		if(indices[i] >= geom->vertex_count)
+			msg(MSG_ERROR, "kuhl_geometry has %d vertices but indices[%d] is asking for vertex at index %d to be drawn.\n",
+			    geom->vertex_count, i, indices[i]);
+	}
+
+	/* Enable VAO */
+	glBindVertexArray(geom->vao);
+
+	/* Set up a buffer object (BO) which is a place to store the
+	 * *indices* on the graphics card. */
+	glGenBuffers(1, &(geom->indices_bufferobject));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
+	kuhl_errorcheck();
+
+	/* Copy the indices data into the currently bound buffer. If
+	 * every index fits in 16 bits, store them as GLushorts. */
+	if(geom->vertex_count < 65536)
+	{
+		GLushort *shortIndices = kuhl_malloc(sizeof(GLushort)*geom->indices_len);
+		for(GLuint i=0; i<geom->indices_len; i++)
+			shortIndices[i] = (GLushort) indices[i];
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort)*geom->indices_len,
+		             shortIndices, GL_STATIC_DRAW);
+		free(shortIndices);
+		geom->indices_type = GL_UNSIGNED_SHORT;
+	}
+	else
+	{
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*geom->indices_len,
+		             indices, GL_STATIC_DRAW);
+		geom->indices_type = GL_UNSIGNED_INT;
+	}
+	kuhl_errorcheck();
+	// Don't unbind GL_ELEMENT_ARRAY_BUFFER since the VAO keeps track of this for us.
+
+	// unbind vao
+	glBindVertexArray(0);
+}
+
+/** Applies a set of triangle indices to the geometry (see
+ * kuhl_geometry_indices()) along with simplified versions of the
+ * triangles which can be drawn when the geometry is far away. Each
+ * level of detail has roughly half as many triangles as the previous
+ * one and is generated with simplify_mesh(). All of the levels share
+ * the vertices of the geometry and are stored one after another in
+ * the same index buffer. Use kuhl_geometry_lod_select() to choose
+ * the level that kuhl_geometry_draw() uses.
+ *
+ * @param geom The geometry to apply the indices to. The geometry
+ * must contain GL_TRIANGLES; otherwise, only the full resolution
+ * indices are applied.
+ *
+ * @param positions The vertex positions of the geometry (the same
+ * positions that were passed to kuhl_geometry_attrib()).
+ *
+ * @param stride The number of floats from the start of one position
+ * to the start of the next one (3 for tightly packed positions).
+ *
+ * @param indices The full resolution triangles.
+ *
+ * @param indexCount The number of indices.
+ *
+ * @param levels The number of levels of detail, including the full
+ * resolution mesh (at most MAX_LODS). Fewer levels are created if
+ * the mesh can't be simplified any further.
+ */
+void kuhl_geometry_lod(kuhl_geometry *geom, const GLfloat *positions, GLuint stride, GLuint *indices, GLuint indexCount, unsigned int levels)
+{
+	if(levels > MAX_LODS)
+		levels = MAX_LODS;
+	if(levels < 2 || geom->primitive_type != GL_TRIANGLES || positions == NULL ||
+	   indices == NULL || indexCount == 0)
+	{
+		kuhl_geometry_indices(geom, indices, indexCount);
+		return;
+	}
+
+	GLuint *allIndices = kuhl_malloc(sizeof(GLuint)*indexCount*levels);
+	memcpy(allIndices, indices, sizeof(GLuint)*indexCount);
+	geom->lod_first[0] = 0;
+	geom->lod_len[0] = indexCount;
+	geom->lod_error[0] = 0;
+	geom->lod_count = 1;
+	GLuint total = indexCount;
+
+	for(unsigned int level=1; level<levels; level++)
+	{
+		/* Simplify from the full mesh each time so the error is
+		 * measured against the original surface. */
+		GLuint target = (indexCount >> level) / 3 * 3;
+		float error = 0;
+		GLuint len = simplify_mesh(allIndices+total, indices, indexCount,
+		                           positions, geom->vertex_count, stride, target, &error);
+
+		/* Stop if the mesh could barely be simplified beyond the
+		 * previous level. */
+		if(len == 0 || len*10 > geom->lod_len[geom->lod_count-1]*9)
+			break;
+		geom->lod_first[geom->lod_count] = total;
+		geom->lod_len[geom->lod_count] = len;
+		geom->lod_error[geom->lod_count] = error;
+		geom->lod_count++;
+		total += len;
+	}
+
+	kuhl_geometry_indices(geom, allIndices, total);
+	free(allIndices);
+	/* kuhl_geometry_indices() uploaded every level, but only the
+	 * first one is the full mesh. */
+	geom->indices_len = indexCount;
+	geom->lod = 0;
+
+	for(unsigned int i=1; i<geom->lod_count; i++)
+		msg(MSG_DEBUG, "Level of detail %u: %u of %u triangles, error=%f", i, geom->lod_len[i]/3, indexCount/3, geom->lod_error[i]);
+}
+
+/** Chooses the level of detail for a single kuhl_geometry object
+ * (see kuhl_geometry_lod_select()). */
+static unsigned int kuhl_private_geometry_lod_pick(const kuhl_geometry *geom, const float modelview[16], const float projection[16],
+                                                   const int viewport[4], float maxPixels)
+{
+	if(geom->lod_count < 2 || !geom->has_bounds ||
+	   modelview == NULL || projection == NULL || viewport == NULL)
+		return 0;
+
+	float mv[16];
+	mat4f_mult_mat4f_new(mv, modelview, geom->matrix);
+	float center[4] = { geom->bsphere[0], geom->bsphere[1], geom->bsphere[2], 1 };
+	mat4f_mult_vec4f(center, mv);
+
+	/* The largest amount that the matrix scales the object by. */
+	float scale = 0;
+	for(int i=0; i<3; i++)
+	{
+		float s = sqrtf(mv[i*4]*mv[i*4] + mv[i*4+1]*mv[i*4+1] + mv[i*4+2]*mv[i*4+2]);
+		if(s > scale)
+			scale = s;
+	}
+
+	/* Number of pixels that one unit covers at the nearest point of
+	 * the bounding sphere. */
+	float pixelsPerUnit = viewport[3]/2.0f * projection[5];
+	if(projection[15] == 0) // perspective projection
+	{
+		float distance = -center[2] - geom->bsphere[3]*scale;
+		if(distance <= 0)
+			return 0;
+		pixelsPerUnit = pixelsPerUnit / distance;
+	}
+
+	unsigned int lod = 0;
+	for(unsigned int i=1; i<geom->lod_count; i++)
+	{
+		if(geom->lod_error[i] * scale * pixelsPerUnit <= maxPixels)
+			lod = i;
+	}
+	return lod;
+}
+
+/** Selects which level of detail (see kuhl_geometry_lod()) will be
+ * drawn based on how large the geometry appears on the screen. The
+ * coarsest level whose error is smaller than model.loderror pixels
+ * (default 1) is chosen.
+ *
+ * @param geom The geometry.
+ *
+ * @param modelview The modelview matrix that the geometry will be
+ * drawn with.
+ *
+ * @param projection The projection matrix that the geometry will be
+ * drawn with.
+ *
+ * @param viewport The viewport that the geometry will be drawn in
+ * (see viewmat_get_viewport()). If NULL, the full resolution mesh is
+ * selected.
+ *
+ * @param kg_options If KG_FULL_LIST is set, a level is chosen for
+ * every object in the geom list. Otherwise, only geom is changed.
+ *
+ * @return The level of detail chosen for geom (0 is the full mesh).
+ */
+unsigned int kuhl_geometry_lod_select(kuhl_geometry *geom, const float modelview[16], const float projection[16], const int viewport[4], int kg_options)
+{
+	static float maxPixels = -1;
+	if(maxPixels < 0)
+	{
+		maxPixels = kuhl_config_float("model.loderror", 1, 1);
+		if(maxPixels < 0)
+			maxPixels = 1;
+	}
+
+	unsigned int lod = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		g->lod = kuhl_private_geometry_lod_pick(g, modelview, projection, viewport, maxPixels);
+		if(g == geom)
+			lod = g->lod;
+		if(!(kg_options & KG_FULL_LIST))
+			break;
+	}
+	return lod;
+}
+
+
+
+/** Returns 1 if the "fast draw" mode was requested with the
+ * kuhl.fastdraw configuration setting. In this mode,
+ * kuhl_geometry_draw() skips the per-geometry validation, error
+ * checking and OpenGL state queries. This mode is useful once a
+ * program is known to work and you want to draw many pieces of
+ * geometry efficiently. */
+static int kuhl_private_fastdraw(void)
+{
+	static int fastdraw = -1;
+	if(fastdraw == -1)
+	{
+		fastdraw = kuhl_config_boolean("kuhl.fastdraw", 0, 0);
+		if(fastdraw)
+			msg(MSG_INFO, "kuhl_geometry_draw() will skip validation and state restoration between geometry (kuhl.fastdraw=1).");
+	}
+	return fastdraw;
+}
+
+/** Counts how many objects, starting with geom, can be drawn with a
+ * single glMultiDrawElementsBaseVertex() call. Objects can only be
+ * drawn together if they share the same program, buffers, textures
+ * and GeomTransform matrix and if they don't have bones or
+ * instances. This is typically true for the static meshes of a model
+ * that has been merged with kuhl_geometry_merge().
+ *
+ * @param geom The first object in the batch.
+ *
+ * @return The number of objects in the batch (at least 1).
+ */
+static unsigned int kuhl_private_geometry_batch(const kuhl_geometry *geom)
+{
+	unsigned int count = 1;
+	if(geom->indices_len == 0 || geom->instance_count > 0 || geom->merged == 0)
+		return count;
+#if KUHL_UTIL_USE_ASSIMP
+	if(geom->bones)
+		return count;
+#endif
+
+	for(const kuhl_geometry *g = geom->next; g != NULL; g = g->next)
+	{
+		if(g->merged == 0 ||
+		   g->vao != geom->vao ||
+		   g->program != geom->program ||
+		   g->primitive_type != geom->primitive_type ||
+		   g->indices_len == 0 ||
+		   g->indices_type != geom->indices_type ||
+		   g->instance_count > 0 ||
+		   g->texture_count != geom->texture_count ||
+		   memcmp(g->matrix, geom->matrix, sizeof(float)*16) != 0)
+			break;
+#if KUHL_UTIL_USE_ASSIMP
+		if(g->bones)
+			break;
+#endif
+		int same = 1;
+		for(unsigned int i=0; i<g->texture_count; i++)
+		{
+			if(g->textures[i].textureId != geom->textures[i].textureId ||
+			   strcmp(g->textures[i].name, geom->textures[i].name) != 0)
+				same = 0;
+		}
+		for(unsigned int i=0; i<g->attrib_count; i++)
+		{
+			if(g->attribs[i].mapped)
+				same = 0;
+		}
+		if(!same)
+			break;
+		count++;
+	}
+	return count;
+}
+
+/** Arrays passed to glMultiDrawElementsBaseVertex(). They are reused
+ * by every batched draw (which only happens on the thread that owns
+ * the OpenGL context) instead of being allocated each time. */
+static GLsizei *kuhl_private_multidraw_counts = NULL;
+static const GLvoid **kuhl_private_multidraw_offsets = NULL;
+static GLint *kuhl_private_multidraw_base = NULL;
+static unsigned int kuhl_private_multidraw_size = 0;
+
+/** Makes sure the multidraw arrays can hold at least count
+ * entries. */
+static void kuhl_private_multidraw_reserve(unsigned int count)
+{
+	if(count <= kuhl_private_multidraw_size)
+		return;
+	unsigned int size = kuhl_private_multidraw_size > 0 ? kuhl_private_multidraw_size : 16;
+	while(size < count)
+		size *= 2;
+	kuhl_private_multidraw_counts = realloc(kuhl_private_multidraw_counts, sizeof(GLsizei)*size);
+	kuhl_private_multidraw_offsets = realloc(kuhl_private_multidraw_offsets, sizeof(GLvoid*)*size);
+	kuhl_private_multidraw_base = realloc(kuhl_private_multidraw_base, sizeof(GLint)*size);
+	if(kuhl_private_multidraw_counts == NULL || kuhl_private_multidraw_offsets == NULL ||
+	   kuhl_private_multidraw_base == NULL)
+	{
+		msg(MSG_FATAL, "Unable to allocate space to draw %u objects at once.", count);
+		exit(EXIT_FAILURE);
+	}
+	kuhl_private_multidraw_size = size;
+}
+
+/** Sets the uniform variables, binds the textures and VAO and issues
+ * the draw call for a single kuhl_geometry object. The GLSL program
+ * for the geometry must already be in use. Used internally by
+ * kuhl_geometry_draw() and kuhl_geometry_draw_state().
+ *
+ * @param geom The geometry to draw (the rest of the list is ignored).
+ *
+ * @param cache The location cache for geom->program.
+ *
+ * @param state If NULL, validate everything and check for errors. If
+ * not NULL, skip validation and error checking, skip binding
+ * textures and VAOs that the state says are already bound and update
+ * the state and its counters.
+ *
+ * @param batch The number of objects, starting with geom, to draw
+ * with a single glMultiDrawElementsBaseVertex() call. Must be 1
+ * unless kuhl_private_geometry_batch() says the objects can be drawn
+ * together.
+ */
+static void kuhl_private_geometry_draw_node(kuhl_geometry *geom, kuhl_program_cache *cache, kuhl_draw_state *state, unsigned int batch)
+{
+	int fast = (state != NULL);
+
+	/* Bind all of the textures used in this geometry to texture
+	 * units. */
+	int hasTex = 0;
+	for(unsigned int i=0; i<geom->texture_count; i++)
+	{
+		kuhl_texture *tex = &(geom->textures[i]);
+		if(!fast && !glIsTexture(tex->textureId))
+			continue;
+
+		/* Check if the sampler variable is available in the GLSL
+		 * program. If not, don't send the texture. */
+		GLint loc = kuhl_private_cache_uniform(cache, geom->program, tex->name);
+		if(loc == -1)
+			continue;
+
+		if(strcmp(tex->name, "tex") == 0)
+			hasTex = 1;
+
+		/* Tell OpenGL that the texture that we refer to in our
+		 * GLSL program is going to be in texture unit number 'i'.
+		 */
+		glUniform1i(loc, i);
+		if(state && state->textures[i] == tex->textureId)
+			continue;
+		/* Turn on appropriate texture unit */
+		glActiveTexture(GL_TEXTURE0+i);
+		/* Bind the texture that we want to use while the correct
+		 * texture unit is enabled. */
+		glBindTexture(GL_TEXTURE_2D, tex->textureId);
+		if(state)
+		{
+			state->textures[i] = tex->textureId;
+			state->texture_changes++;
+		}
+		else
+			kuhl_errorcheck();
+	}
+
+	/* Set the HasTex variable if it exists in the GLSL program. */
+	if(cache->loc_HasTex != -1)
+	    glUniform1i(cache->loc_HasTex, hasTex);
+
+	/* Try to set uniform variables if they are active in the current
+	 * GLSL program. If they are not active, don't print any warning
+	 * messages. */
+	int numBones = 0;
+#ifdef KUHL_UTIL_USE_ASSIMP
+	if(geom->bones)
+	{
+		if(geom->bones->baked && cache->loc_BoneFrames != -1)
+		{
+			/* Every frame of the animation is in the texture, and
+			 * the program picks the frame for each instance. */
+			glUniform1i(cache->loc_BoneFrames, KUHL_BONE_TEXTURE_UNIT);
+			if(cache->loc_BoneFrameRate != -1)
+				glUniform1f(cache->loc_BoneFrameRate, geom->bones->baked_fps);
+			glActiveTexture(GL_TEXTURE0+KUHL_BONE_TEXTURE_UNIT);
+			glBindTexture(GL_TEXTURE_2D, geom->bones->baked);
+			glActiveTexture(GL_TEXTURE0);
+			numBones = geom->bones->count;
+		}
+		else if(cache->bone_block == geom->bones->palette_type && geom->bones->palette)
+		{
+			/* Upload the bones once after kuhl_update_model() changes
+			 * them instead of every time the geometry is drawn. */
+			if(geom->bones->dirty)
+			{
+				glBindBuffer(GL_UNIFORM_BUFFER, geom->bones->palette);
+				if(geom->bones->palette_type == KUHL_BONES_DUALQUAT)
+					glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(float)*8*geom->bones->count, geom->bones->dualquats[0]);
+				else
+					glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(float)*16*geom->bones->count, geom->bones->matrices[0]);
+				glBindBuffer(GL_UNIFORM_BUFFER, 0);
+				geom->bones->dirty = 0;
+			}
+			glBindBufferBase(GL_UNIFORM_BUFFER, KUHL_BONE_BINDING, geom->bones->palette);
+			numBones = geom->bones->count;
+		}
+		else if(cache->bone_block == 0 && cache->loc_BoneMat != -1)
+		{
+			/* Only send the bones that the mesh uses. */
+			glUniformMatrix4fv(cache->loc_BoneMat, geom->bones->count, 0, geom->bones->matrices[0]);
+			numBones = geom->bones->count;
+		}
+		else if(cache->bone_block != 0 && geom->has_been_drawn == 0)
+			msg(MSG_WARNING, "The GLSL program expects bones stored as %s but the model was loaded with %s. Set model.dualquat to match the program.",
+			    cache->bone_block == KUHL_BONES_DUALQUAT ? "dual quaternions" : "matrices",
+			    geom->bones->palette_type == KUHL_BONES_DUALQUAT ? "dual quaternions" : "matrices");
+	}
 #endif
+	if(cache->loc_NumBones != -1)
+	    glUniform1i(cache->loc_NumBones, numBones);
 
-	geom->next = NULL;
+	if(cache->loc_GeomTransform != -1)
+		glUniformMatrix4fv(cache->loc_GeomTransform, 1, 0, geom->matrix);
+	else if(geom->has_been_drawn == 0)
+	{ /* If the geom->matrix was not the identity and if it is not in
+	   * the GLSL shader program, print a helpful warning message. */
+		float identity[16];
+		mat4f_identity(identity);
+		float sum = 0;
+		for(int i=0; i<16; i++)
+			sum += fabsf(identity[i] - (geom->matrix)[i]);
+		if(sum > 0.00001)
+		{
+			printf("\n\n");
+			printf("ERROR: You must include a 'uniform mat4 GeomTransform' variable in your GLSL shader (program %d) when you load/display a model with kuhl-util. This matrix should be applied to the vertices in your model before you multiply by your modelview matrix in the vertex program. For example:\n\ngl_Position = Projection * ModelView * GeomTransform * in_Position\n\n", geom->program);
+			printf("This matrix is required to correctly translate/rotate/scale your geometry and is also used by some models to implement animation. This matrix is stored inside of a variable called 'matrix' in kuhl_geometry and is set to the identity matrix by default. This message only gets printed if you are using something that actually sets the matrix to something other than the identity. Earlier versions of this software simply transformed the vertices as the file was being loaded instead of doing it in the vertex program.\n");
+			printf("\n");
+			printf("We would set the GeomTransform to:\n");
+			mat4f_print(geom->matrix);
+			printf("This program will resume running in 2 seconds...\n");
+			sleep(2);
+			printf("...continuing despite the missing variable.\n");
+		}
+	}
+
+	/* Use the vertex array object for this geometry */
+	if(state == NULL || state->vao != geom->vao)
+	{
+		glBindVertexArray(geom->vao);
+		if(state)
+		{
+			state->vao = geom->vao;
+			state->vao_changes++;
+		}
+		else
+			kuhl_errorcheck();
+	}
+
+	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
+	 * be mapped. Here, we check if the buffers are mapped. If they
+	 * are, we unmap them before we draw the geometry. In fast mode,
+	 * we trust the flag that kuhl_geometry_attrib_get() sets instead
+	 * of asking OpenGL about every buffer. */
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(fast && !attrib->mapped)
+			continue;
+		/* Buffers owned by the caller may be persistently mapped
+		 * on purpose (see streambuf.h). */
+		if(attrib->external)
+			continue;
+
+		/* Even in fast mode, ask OpenGL if a flagged buffer is still
+		 * mapped: buffers shared with other geometry (see
+		 * kuhl_geometry_merge()) may have been unmapped already. */
+		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		GLint bufferIsMapped = 0;
+		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_MAPPED, &bufferIsMapped);
+		if(!fast)
+			kuhl_errorcheck();
+		if(bufferIsMapped)
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		/* Attributes in an interleaved buffer share the buffer
+		 * that we just unmapped. */
+		for(unsigned int j=i; j<geom->attrib_count; j++)
+		{
+			if(geom->attribs[j].bufferobject == attrib->bufferobject)
+				geom->attribs[j].mapped = 0;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		if(!fast)
+			kuhl_errorcheck();
+	}
+
+	/* If the user provided us with indices, use glDrawElements() to
+	 * draw the geometry. */
+	if(geom->indices_len > 0 && (fast || glIsBuffer(geom->indices_bufferobject)))
+	{
+		GLsizei indexSize = geom->indices_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+		GLuint first = 0;
+		GLsizei indexCount = kuhl_private_geometry_lod_range(geom, &first);
+		const GLvoid *firstIndex = (const GLvoid*) (intptr_t) (first * indexSize);
+		if(batch > 1)
+		{
+			/* Draw several pieces of geometry stored in the same
+			 * buffers (see kuhl_geometry_merge()) with one call. */
+			kuhl_private_multidraw_reserve(batch);
+			GLsizei *counts = kuhl_private_multidraw_counts;
+			const GLvoid **offsets = kuhl_private_multidraw_offsets;
+			GLint *baseVertices = kuhl_private_multidraw_base;
+			kuhl_geometry *g = geom;
+			for(unsigned int i=0; i<batch; i++, g = g->next)
+			{
+				GLuint gFirst = 0;
+				counts[i] = kuhl_private_geometry_lod_range(g, &gFirst);
+				offsets[i] = (const GLvoid*) (intptr_t) (gFirst * indexSize);
+				baseVertices[i] = g->base_vertex;
+				g->has_been_drawn = 1;
+			}
+			glMultiDrawElementsBaseVertex(geom->primitive_type, counts, geom->indices_type,
+			                              (const GLvoid* const*) offsets, batch, baseVertices);
+		}
+		else if(geom->instance_count > 0 && geom->base_vertex != 0)
+			glDrawElementsInstancedBaseVertex(geom->primitive_type,
+			                                  indexCount,
+			                                  geom->indices_type,
+			                                  firstIndex, geom->instance_count,
+			                                  geom->base_vertex);
+		else if(geom->instance_count > 0)
+			glDrawElementsInstanced(geom->primitive_type,
+			                        indexCount,
+			                        geom->indices_type,
+			                        firstIndex, geom->instance_count);
+		else if(geom->base_vertex != 0)
+			glDrawElementsBaseVertex(geom->primitive_type,
+			                         indexCount,
+			                         geom->indices_type,
+			                         firstIndex, geom->base_vertex);
+		else
+			glDrawElements(geom->primitive_type,
+			               indexCount,
+			               geom->indices_type,
+			               firstIndex);
+	}
+	else
+	{
+		/* If the user didn't provide us with indices, just draw the
+		 * vertices in order. */
+		if(geom->instance_count > 0)
+			glDrawArraysInstanced(geom->primitive_type, 0, geom->vertex_count, geom->instance_count);
+		else
+			glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
+	}
+	if(state)
+		state->draw_calls++;
+	else
+		kuhl_errorcheck();
+
+	/* Indicate in the struct that we have successfully drawn this
+	 * geom once. */
+	geom->has_been_drawn = 1;
 }
 
-/** Applies a set of indices to the geometry so that vertices can be
- * re-used by multiple triangles or lines.
+/** Prepares a kuhl_draw_state struct so that it can be used with
+ * kuhl_geometry_draw_state(). The GLSL program and VAO that are
+ * currently in use are recorded so that kuhl_draw_state_end() can
+ * restore them.
  *
- * @param geom The geometry that the indices should be used with.
+ * @param state The state to initialize.
+ */
+void kuhl_draw_state_begin(kuhl_draw_state *state)
+{
+	memset(state, 0, sizeof(kuhl_draw_state));
+	GLint previouslyUsedProgram = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &previouslyUsedProgram);
+	GLint previousVAO=0;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+	state->program = state->previous_program = (GLuint) previouslyUsedProgram;
+	state->vao = state->previous_vao = (GLuint) previousVAO;
+	/* We don't know which textures are bound, so the first texture
+	 * that is used in each texture unit will always be bound. */
+}
+
+/** Draws a batch of objects using a kuhl_draw_state. See
+ * kuhl_geometry_draw_state() and kuhl_private_geometry_batch(). */
+static int kuhl_private_geometry_draw_state(kuhl_geometry *geom, kuhl_draw_state *state, unsigned int batch)
+{
+	if(geom == NULL || geom->vertex_count == 0 || geom->attrib_count == 0)
+		return 0;
+
+	kuhl_program_cache *cache = kuhl_private_program_cache_get(geom->program);
+	if(cache == NULL)
+		return 0;
+
+	/* Only switch programs when consecutive geometry uses
+	 * different programs. */
+	if(geom->program != state->program)
+	{
+		glUseProgram(geom->program);
+		state->program = geom->program;
+		state->program_changes++;
+	}
+	kuhl_private_geometry_draw_node(geom, cache, state, batch);
+	return 1;
+}
+
+/** Draws a single kuhl_geometry object (geom->next is ignored)
+ * without validating it and without saving or restoring the OpenGL
+ * state. The program, VAO and textures are only changed if they
+ * differ from the ones recorded in the state. Use this function to
+ * draw many objects efficiently between calls to
+ * kuhl_draw_state_begin() and kuhl_draw_state_end(). If you change
+ * the program, VAO or textures yourself in between, call
+ * kuhl_draw_state_begin() again.
  *
- * @param indices A list of indices. Each index refers to a specific vertex.
+ * @param geom The geometry to draw.
  *
- * @param indexCount The number of indices. For example, if the
- * geometry object consists of triangles, indexCount should be
- * numTriangles*3.
-*/
-void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount)
+ * @param state The state initialized by kuhl_draw_state_begin(). The
+ * counters in the state are incremented.
+ *
+ * @return 1 if the geometry was drawn, 0 otherwise.
+ */
+int kuhl_geometry_draw_state(kuhl_geometry *geom, kuhl_draw_state *state)
 {
-	if(indexCount == 0 || indices == NULL)
+	return kuhl_private_geometry_draw_state(geom, state, 1);
+}
+
+/** Restores the GLSL program and VAO that were in use when
+ * kuhl_draw_state_begin() was called. Textures remain bound to their
+ * texture units and GL_TEXTURE0 is left as the active texture unit.
+ *
+ * @param state The state initialized by kuhl_draw_state_begin().
+ */
+void kuhl_draw_state_end(kuhl_draw_state *state)
+{
+	glActiveTexture(GL_TEXTURE0);
+	if(state->program != state->previous_program)
+		glUseProgram(state->previous_program);
+	if(state->vao != state->previous_vao)
+		glBindVertexArray(state->previous_vao);
+	state->program = state->previous_program;
+	state->vao = state->previous_vao;
+	kuhl_errorcheck();
+}
+
+/** Number of occlusion queries issued and objects found to be
+ * occluded since kuhl_geometry_occlusion_stats() was last called. */
+static unsigned int kuhl_private_occlusion_queries = 0;
+static unsigned int kuhl_private_occlusion_occluded = 0;
+
+/** The viewport that is being drawn (see kuhl_occlusion_viewport()). */
+static int kuhl_private_occlusion_viewport = 0;
+
+/** Values returned by kuhl_private_geometry_occlusion_begin() which
+ * tell the caller how to draw an object. */
+#define KUHL_OCCLUSION_SKIP 0 /**< Don't draw the object. */
+#define KUHL_OCCLUSION_DRAW 1 /**< Draw the object normally. */
+#define KUHL_OCCLUSION_QUERY 2 /**< Draw the object inside of an occlusion query. */
+#define KUHL_OCCLUSION_CONDITIONAL 3 /**< Draw the object with conditional rendering. */
+
+/** GLSL program, VAO and location of the BoxMVP uniform used to draw
+ * bounding boxes for occlusion queries. */
+static GLuint kuhl_private_occlusion_program = 0;
+static GLuint kuhl_private_occlusion_vao = 0;
+static GLint kuhl_private_occlusion_mvp = -1;
+
+/** Returns 1 if occlusion culling was enabled with the
+ * kuhl.occlusion configuration setting and is supported by the
+ * OpenGL implementation. */
+static int kuhl_private_occlusion(void)
+{
+	static int occlusion = -1;
+	if(occlusion == -1)
 	{
-		//UNCOMMENT!!!!!!!!!!!!//msg(MSG_WARNING, "indexCount was zero or indices array was NULL\n");
-		return;
+		occlusion = kuhl_config_boolean("kuhl.occlusion", 0, 0);
+		if(occlusion && !GLEW_VERSION_1_5 && !GLEW_ARB_occlusion_query)
+		{
+			msg(MSG_WARNING, "kuhl.occlusion is set, but occlusion queries are not supported.");
+			occlusion = 0;
+		}
+		if(occlusion)
+			msg(MSG_INFO, "Objects hidden behind other objects will be skipped by culled draws (kuhl.occlusion=1).");
 	}
+	return occlusion;
+}
 
-	if(geom->primitive_type == GL_TRIANGLES && indexCount % 3 != 0)
+/** Returns the type of occlusion query to use. GL_ANY_SAMPLES_PASSED
+ * can stop counting after the first sample passes. */
+static GLenum kuhl_private_occlusion_target(void)
+{
+	if(GLEW_VERSION_3_3 || GLEW_ARB_occlusion_query2)
+		return GL_ANY_SAMPLES_PASSED;
+	return GL_SAMPLES_PASSED;
+}
+
+/** Compiles a shader for kuhl_private_occlusion_init(). */
+static GLuint kuhl_private_occlusion_shader(const char *text, GLenum shader_type)
+{
+	GLuint shader = glCreateShader(shader_type);
+	glShaderSource(shader, 1, &text, NULL);
+	glCompileShader(shader);
+	GLint status = GL_FALSE;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if(status != GL_TRUE)
 	{
-		msg(MSG_FATAL, "indexCount=%u was not a multiple of 3 even though this geometry has triangles in it.", indexCount);
+		char logString[1024];
+		glGetShaderInfoLog(shader, 1024, NULL, logString);
+		msg(MSG_FATAL, "Failed to compile the occlusion query shader:\n%s", kuhl_trim_whitespace(logString));
 		exit(EXIT_FAILURE);
 	}
-	else if(geom->primitive_type == GL_LINES && indexCount % 2 != 0)
+	return shader;
+}
+
+/** Creates the GLSL program and the VAO containing a unit cube which
+ * are used to draw bounding boxes for occlusion queries. */
+static void kuhl_private_occlusion_init(void)
+{
+	if(kuhl_private_occlusion_program != 0)
+		return;
+
+	const char *vertText =
+		"#version 150\n"
+		"uniform mat4 BoxMVP;\n"
+		"in vec3 in_Position;\n"
+		"void main() { gl_Position = BoxMVP * vec4(in_Position, 1.0); }\n";
+	const char *fragText =
+		"#version 150\n"
+		"out vec4 fragColor;\n"
+		"void main() { fragColor = vec4(1.0); }\n";
+
+	GLuint program = glCreateProgram();
+	GLuint vert = kuhl_private_occlusion_shader(vertText, GL_VERTEX_SHADER);
+	GLuint frag = kuhl_private_occlusion_shader(fragText, GL_FRAGMENT_SHADER);
+	glAttachShader(program, vert);
+	glAttachShader(program, frag);
+	glBindAttribLocation(program, 0, "in_Position");
+	glLinkProgram(program);
+	glDeleteShader(vert);
+	glDeleteShader(frag);
+	GLint status = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if(status != GL_TRUE)
 	{
-		msg(MSG_FATAL, "indexCount=%u was not a multiple of 2 even though this geometry has lines in it.", indexCount);
+		msg(MSG_FATAL, "Failed to link the occlusion query program.");
+		kuhl_print_program_log(program);
 		exit(EXIT_FAILURE);
 	}
+	kuhl_private_occlusion_program = program;
+	kuhl_private_occlusion_mvp = glGetUniformLocation(program, "BoxMVP");
+
+	/* Corner i of the cube is at (i&1, (i>>1)&1, (i>>2)&1). The
+	 * triangles are counterclockwise when viewed from outside of the
+	 * cube. */
+	static const GLfloat corners[] = { 0,0,0, 1,0,0, 0,1,0, 1,1,0,
+	                                   0,0,1, 1,0,1, 0,1,1, 1,1,1 };
+	static const GLubyte indices[] = { 4,6,2, 4,2,0,  1,3,7, 1,7,5,
+	                                   1,5,4, 1,4,0,  2,6,7, 2,7,3,
+	                                   2,3,1, 2,1,0,  4,5,7, 4,7,6 };
+	GLint previousVAO = 0;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+	glGenVertexArrays(1, &kuhl_private_occlusion_vao);
+	glBindVertexArray(kuhl_private_occlusion_vao);
+	GLuint buffers[2];
+	glGenBuffers(2, buffers);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	glBindVertexArray(previousVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+}
 
-	/* TODO: Check if indices are already set? If so, print an error
-	 * message and/or free the old indices buffer before making a new
-	 * one to replace it. */
+/** Calculates a matrix which transforms the unit cube onto the
+ * bounding box of geom and then into clip coordinates.
+ *
+ * @param boxMVP Filled in with the matrix.
+ *
+ * @param geom The geometry.
+ *
+ * @param modelviewProjection The modelview-projection matrix of the geometry.
+ *
+ * @return 1 if the box is entirely in front of the near clipping
+ * plane, 0 if the box crosses it. If the box crosses the near plane,
+ * the camera may be inside of the box and part of the box would be
+ * clipped, so the box can't be used to test if the object is
+ * visible.
+ */
+static int kuhl_private_geometry_occlusion_box(float boxMVP[16], const kuhl_geometry *geom, const float modelviewProjection[16])
+{
+	const float *b = geom->aabbox;
+	float boxMat[16];
+	mat4f_scale_new(boxMat, b[1]-b[0], b[3]-b[2], b[5]-b[4]);
+	boxMat[12] = b[0];
+	boxMat[13] = b[2];
+	boxMat[14] = b[4];
+	mat4f_mult_mat4f_new(boxMVP, modelviewProjection, geom->matrix);
+	mat4f_mult_mat4f_new(boxMVP, boxMVP, boxMat);
 
-	geom->indices_len = indexCount;
+	for(int i=0; i<8; i++)
+	{
+		float p[4] = { (float) (i&1), (float) ((i>>1)&1), (float) ((i>>2)&1), 1 };
+		mat4f_mult_vec4f(p, boxMVP);
+		if(p[3] <= 0 || p[2] < -p[3])
+			return 0;
+	}
+	return 1;
+}
 
-	/* Verify that the indices the user passed in are
-	 * appropriate. If there are only 10 vertices, then a user
-	 * can't draw a vertex at index 10, 11, 13, etc. */
-	for(GLuint i=0; i<geom->indices_len; i++)
+/** Draws the bounding box of an object inside of its occlusion query
+ * without writing to the color or depth buffers.
+ *
+ * @param geom The geometry.
+ *
+ * @param state The draw state to update or NULL to restore the
+ * program and VAO that were in use.
+ *
+ * @param query The occlusion query to draw the box in.
+ *
+ * @param boxMVP The matrix calculated by kuhl_private_geometry_occlusion_box().
+ */
+static void kuhl_private_geometry_occlusion_proxy(kuhl_geometry *geom, kuhl_draw_state *state, GLuint query, const float boxMVP[16])
+{
+	kuhl_private_occlusion_init();
+
+	GLint previousProgram = 0, previousVAO = 0;
+	if(state == NULL)
 	{
-		if(indices[i] >= geom->vertex_count)
-			msg(MSG_ERROR, "kuhl_geometry has %d vertices but indices[%d] is asking for vertex at index %d to be drawn.\n",
-			    geom->vertex_count, i, indices[i]);
+		glGetIntegerv(GL_CURRENT_PROGRAM, &previousProgram);
+		glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
 	}
+	GLboolean colorMask[4], depthMask;
+	glGetBooleanv(GL_COLOR_WRITEMASK, colorMask);
+	glGetBooleanv(GL_DEPTH_WRITEMASK, &depthMask);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
 
-	/* Enable VAO */
-	glBindVertexArray(geom->vao);
+	glUseProgram(kuhl_private_occlusion_program);
+	glUniformMatrix4fv(kuhl_private_occlusion_mvp, 1, 0, boxMVP);
+	glBindVertexArray(kuhl_private_occlusion_vao);
+	glBeginQuery(kuhl_private_occlusion_target(), query);
+	glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, 0);
+	glEndQuery(kuhl_private_occlusion_target());
 
-	/* Set up a buffer object (BO) which is a place to store the
-	 * *indices* on the graphics card. */
-	glGenBuffers(1, &(geom->indices_bufferobject));
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geom->indices_bufferobject);
-	kuhl_errorcheck();
+	glColorMask(colorMask[0], colorMask[1], colorMask[2], colorMask[3]);
+	glDepthMask(depthMask);
+	if(state == NULL)
+	{
+		glUseProgram(previousProgram);
+		glBindVertexArray(previousVAO);
+	}
+	else
+	{
+		state->program = kuhl_private_occlusion_program;
+		state->vao = kuhl_private_occlusion_vao;
+		state->program_changes++;
+		state->vao_changes++;
+		state->draw_calls++;
+	}
+}
 
-	/* Copy the indices data into the currently bound buffer. */
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*geom->indices_len,
-	             indices, GL_STATIC_DRAW);
-	kuhl_errorcheck();
-	// Don't unbind GL_ELEMENT_ARRAY_BUFFER since the VAO keeps track of this for us.
+/** Decides if an object should be drawn based on the result of the
+ * occlusion query that was issued for it in a previous frame. The
+ * CPU never waits for a query result: If the result isn't available
+ * yet, the previous result is used.
+ *
+ * Objects which were visible are drawn inside of a new occlusion
+ * query. For objects which were occluded, only the bounding box is
+ * drawn inside of a new query. If conditional rendering is
+ * available, the object is also drawn but the GPU skips it if none of
+ * its bounding box was visible; otherwise the object is skipped until
+ * the query says it is visible again.
+ *
+ * @param geom The geometry to draw.
+ *
+ * @param state The draw state or NULL.
+ *
+ * @param modelviewProjection The modelview-projection matrix or NULL
+ * if occlusion culling should not be used.
+ *
+ * @return One of the KUHL_OCCLUSION_* values. The caller must pass
+ * the value to kuhl_private_geometry_occlusion_end() after drawing
+ * (or skipping) the object.
+ */
+static int kuhl_private_geometry_occlusion_begin(kuhl_geometry *geom, kuhl_draw_state *state, const float *modelviewProjection)
+{
+	/* Each viewport (for example, each eye of an HMD) sees different
+	 * objects, so each one has its own queries. */
+	int v = kuhl_private_occlusion_viewport;
+	if(modelviewProjection == NULL || !kuhl_private_occlusion() ||
+	   !geom->has_bounds || geom->instance_count > 0 ||
+	   v < 0 || v >= KUHL_OCCLUSION_VIEWPORTS)
+		return KUHL_OCCLUSION_DRAW;
+#if KUHL_UTIL_USE_ASSIMP
+	if(geom->bones)
+		return KUHL_OCCLUSION_DRAW;
+#endif
 
-	// unbind vao
-	glBindVertexArray(0);
+	if(geom->occlusion_query[v] == 0)
+		glGenQueries(1, &(geom->occlusion_query[v]));
+
+	/* Collect the result of a query from a previous frame if the GPU
+	 * has finished it. */
+	if(geom->occlusion_pending[v])
+	{
+		GLuint available = 0;
+		glGetQueryObjectuiv(geom->occlusion_query[v], GL_QUERY_RESULT_AVAILABLE, &available);
+		if(available)
+		{
+			GLuint samples = 0;
+			glGetQueryObjectuiv(geom->occlusion_query[v], GL_QUERY_RESULT, &samples);
+			geom->occluded[v] = (samples == 0);
+			geom->occlusion_pending[v] = 0;
+		}
+	}
+
+	float boxMVP[16];
+	if(geom->occluded[v] && !kuhl_private_geometry_occlusion_box(boxMVP, geom, modelviewProjection))
+		geom->occluded[v] = 0;
+
+	if(!geom->occluded[v])
+	{
+		if(geom->occlusion_pending[v])
+			return KUHL_OCCLUSION_DRAW;
+		glBeginQuery(kuhl_private_occlusion_target(), geom->occlusion_query[v]);
+		geom->occlusion_pending[v] = 1;
+		kuhl_private_occlusion_queries++;
+		if(state)
+			state->occlusion_queries++;
+		return KUHL_OCCLUSION_QUERY;
+	}
+
+	kuhl_private_occlusion_occluded++;
+	if(state)
+		state->occluded++;
+	if(geom->occlusion_pending[v])
+		return KUHL_OCCLUSION_SKIP;
+
+	kuhl_private_geometry_occlusion_proxy(geom, state, geom->occlusion_query[v], boxMVP);
+	geom->occlusion_pending[v] = 1;
+	kuhl_private_occlusion_queries++;
+	if(state)
+		state->occlusion_queries++;
+
+	if(GLEW_VERSION_3_0 || GLEW_NV_conditional_render)
+	{
+		glBeginConditionalRender(geom->occlusion_query[v], GL_QUERY_WAIT);
+		return KUHL_OCCLUSION_CONDITIONAL;
+	}
+	return KUHL_OCCLUSION_SKIP;
 }
 
+/** Ends the occlusion query or conditional rendering started by
+ * kuhl_private_geometry_occlusion_begin().
+ *
+ * @param occlusion The value returned by kuhl_private_geometry_occlusion_begin().
+ */
+static void kuhl_private_geometry_occlusion_end(int occlusion)
+{
+	if(occlusion == KUHL_OCCLUSION_QUERY)
+		glEndQuery(kuhl_private_occlusion_target());
+	else if(occlusion == KUHL_OCCLUSION_CONDITIONAL)
+		glEndConditionalRender();
+}
 
+/** Tells culled draws which viewport is being drawn so that each
+ * viewport keeps its own occlusion queries. Otherwise, the second eye
+ * of an HMD would reuse the results from the first eye. Called by
+ * viewmat_begin_eye(); programs which draw several viewports without
+ * viewmat should call it before drawing each viewport. Occlusion
+ * culling is skipped in viewports numbered KUHL_OCCLUSION_VIEWPORTS
+ * or higher.
+ *
+ * @param viewportID The viewport that is about to be drawn.
+ */
+void kuhl_occlusion_viewport(int viewportID)
+{
+	kuhl_private_occlusion_viewport = viewportID;
+}
 
-/** Draws a kuhl_geometry struct to the screen. The struct passed into
- * this function should have been set up with kuhl_geometry_new() and
- * at least one position attribute with kuhl_geometry_attrib() before
- * calling this function.
+/** Retrieves the number of occlusion queries that were issued and
+ * the number of objects that were found to be occluded by culled
+ * draws (kuhl_geometry_draw_culled() and
+ * kuhl_geometry_draw_occlusion()) since the last time this function
+ * was called, and then resets the counters. Occlusion culling is
+ * enabled with the kuhl.occlusion configuration setting.
+ *
+ * @param queries Filled in with the number of occlusion queries
+ * issued. Can be NULL.
+ *
+ * @param occluded Filled in with the number of objects that were
+ * skipped (or drawn conditionally) because they were hidden behind
+ * other objects. Can be NULL.
+ */
+void kuhl_geometry_occlusion_stats(unsigned int *queries, unsigned int *occluded)
+{
+	if(queries)
+		*queries = kuhl_private_occlusion_queries;
+	if(occluded)
+		*occluded = kuhl_private_occlusion_occluded;
+	kuhl_private_occlusion_queries = 0;
+	kuhl_private_occlusion_occluded = 0;
+}
 
- @param geom The geometry to draw to the screen. If the kuhl_geometry
- object is a part of a linked list, this function will draw each of
- the objects in order. */
-void kuhl_geometry_draw(kuhl_geometry *geom)
+/** Determines how many objects starting with geom should be drawn
+ * with one draw call (see kuhl_private_geometry_batch()) when
+ * objects outside of the view frustum are culled. A batch only
+ * includes visible objects.
+ *
+ * @param geom The first object in the batch.
+ *
+ * @param modelviewProjection The modelview-projection matrix to cull
+ * with or NULL to disable culling.
+ *
+ * @return The number of objects to draw, or 0 if geom is outside of
+ * the view frustum and should be skipped.
+ */
+static unsigned int kuhl_private_geometry_cull_batch(const kuhl_geometry *geom, const float *modelviewProjection)
 {
-	if(geom == NULL)
-		return;
-	if(geom->vertex_count == 0)
+	unsigned int batch = kuhl_private_geometry_batch(geom);
+	if(modelviewProjection == NULL)
+		return batch;
+
+	/* Each object has its own occlusion query, so objects can't be
+	 * drawn together. */
+	if(batch > 1 && kuhl_private_occlusion())
+		batch = 1;
+
+	if(!kuhl_private_geometry_visible(geom, modelviewProjection))
 	{
-	//temp commented out so I can read prints	msg(MSG_WARNING, "You tried to draw geometry which contained 0 vertices.");
-		return;
+		kuhl_private_cull_culled++;
+		return 0;
 	}
-	if(geom->attrib_count == 0)
+	const kuhl_geometry *g = geom->next;
+	for(unsigned int i=1; i<batch; i++, g = g->next)
 	{
-		msg(MSG_WARNING, "You tried to draw geometry which had no attributes. It needs at least one attribute (i.e., vertex position)");
-		return;
+		if(!kuhl_private_geometry_visible(g, modelviewProjection))
+		{
+			batch = i;
+			break;
+		}
 	}
+	kuhl_private_cull_drawn += batch;
+	return batch;
+}
 
-	kuhl_errorcheck();
-
-	/* Record the OpenGL state so that we can restore it when we have
-	 * finished drawing. */
-	GLint previouslyUsedProgram = 0;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &previouslyUsedProgram);
-	GLint previouslyBoundTexture = 0;
-	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
-	GLint previouslyActiveTexture = 0;
-	glGetIntegerv(GL_ACTIVE_TEXTURE, &previouslyActiveTexture);
-	GLint previousVAO=0;
-	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+/** Draws every kuhl_geometry object in a list without validating
+ * the objects and without restoring the OpenGL state between
+ * consecutive objects. Used by kuhl_geometry_draw() when
+ * kuhl.fastdraw is set.
+ *
+ * @param geom The first item in the list of geometry to draw.
+ *
+ * @param modelviewProjection The modelview-projection matrix used to
+ * cull objects outside of the view frustum or NULL.
+ */
+static void kuhl_private_geometry_draw_fast(kuhl_geometry *geom, const float *modelviewProjection)
+{
+	kuhl_draw_state state;
+	kuhl_draw_state_begin(&state);
+	kuhl_geometry *g = geom;
+	while(g != NULL)
+	{
+		/* Stop at the same objects that the default path stops at
+		 * so that kuhl.fastdraw doesn't change what is drawn. */
+		if(g->vertex_count == 0 || g->attrib_count == 0)
+			break;
 
-	/* Check that there is a valid program and VAO object for us to use. */
-	if(glIsProgram(geom->program) == 0)
-	{
-		msg(MSG_ERROR, "Program (%d) is invalid. Have you initialized this kuhl_geometry object?\n", geom->program);
-		kuhl_errorcheck();
-		return;
+		unsigned int batch = kuhl_private_geometry_cull_batch(g, modelviewProjection);
+		if(batch == 0)
+		{
+			g = g->next;
+			continue;
+		}
+		int occlusion = kuhl_private_geometry_occlusion_begin(g, &state, modelviewProjection);
+		int drawn = occlusion == KUHL_OCCLUSION_SKIP || kuhl_private_geometry_draw_state(g, &state, batch);
+		kuhl_private_geometry_occlusion_end(occlusion);
+		if(!drawn) // invalid program
+			break;
+		for(unsigned int i=0; i<batch; i++)
+			g = g->next;
 	}
-	else if (glIsVertexArray(geom->vao) == 0)
+	kuhl_draw_state_end(&state);
+}
+
+
+/** Draws a list of kuhl_geometry objects. See kuhl_geometry_draw().
+ *
+ * @param geom The geometry to draw.
+ *
+ * @param modelviewProjection The modelview-projection matrix used to
+ * cull objects outside of the view frustum or NULL to draw every
+ * object.
+ */
+static void kuhl_private_geometry_draw_list(kuhl_geometry *geom, const float *modelviewProjection)
+{
+	if(kuhl_private_fastdraw())
 	{
-		msg(MSG_ERROR, "Vertex array object (%d) is invalid.\n", geom->vao);
-		kuhl_errorcheck();
+		kuhl_private_geometry_draw_fast(geom, modelviewProjection);
 		return;
 	}
-	glUseProgram(geom->program);
-	kuhl_errorcheck();
 
-	/* Bind all of the textures used in this geometry to texture
-	 * units. */
-	int hasTex = 0;
-	for(unsigned int i=0; i<geom->texture_count; i++)
+	for(; geom != NULL; geom = geom->next)
 	{
-		kuhl_texture *tex = &(geom->textures[i]);
-		if(!glIsTexture(tex->textureId))
-			continue;
+		/* Like the recursive version of this function, stop drawing
+		 * the rest of the list at an empty object. */
+		if(geom->vertex_count == 0)
+		{
+			//temp commented out so I can read prints	msg(MSG_WARNING, "You tried to draw geometry which contained 0 vertices.");
+			return;
+		}
+		if(geom->attrib_count == 0)
+		{
+			msg(MSG_WARNING, "You tried to draw geometry which had no attributes. It needs at least one attribute (i.e., vertex position)");
+			return;
+		}
 
-		/* Check if the sampler variable is available in the GLSL
-		 * program. If not, don't send the texture. */
-		GLint loc = glGetUniformLocation(geom->program, tex->name);
-		if(loc == -1)
+		/* Skip objects outside of the view frustum (if culling).
+		 * Objects that share buffers after kuhl_geometry_merge() may
+		 * be drawn with a single draw call. */
+		unsigned int batch = kuhl_private_geometry_cull_batch(geom, modelviewProjection);
+		if(batch == 0)
 			continue;
 
-		if(strcmp(tex->name, "tex") == 0)
-			hasTex = 1;
+		/* Skip objects hidden behind other objects (if kuhl.occlusion
+		 * is set). */
+		int occlusion = kuhl_private_geometry_occlusion_begin(geom, NULL, modelviewProjection);
+		if(occlusion == KUHL_OCCLUSION_SKIP)
+			continue;
 
-		/* Tell OpenGL that the texture that we refer to in our
-		 * GLSL program is going to be in texture unit number 'i'.
-		 */
-		glUniform1i(loc, i);
-		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Bind the texture that we want to use while the correct
-		 * texture unit is enabled. */
-		glBindTexture(GL_TEXTURE_2D, tex->textureId);
 		kuhl_errorcheck();
-	}
-
-	/* Set the HasTex variable if it exists in the GLSL program. */
-	GLint loc;
-	loc = glGetUniformLocation(geom->program, "HasTex");
-	if(loc != -1)
-	    glUniform1i(loc, hasTex);
 
-	/* Try to set uniform variables if they are active in the current
-	 * GLSL program. If they are not active, don't print any warning
-	 * messages. */
-	int numBones = 0;
-#ifdef KUHL_UTIL_USE_ASSIMP
-	if(geom->bones)
-	{
-		loc = glGetUniformLocation(geom->program, "BoneMat");
-		if(loc != -1)
+		/* Record the OpenGL state so that we can restore it when we have
+		 * finished drawing. */
+		GLint previouslyUsedProgram = 0;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &previouslyUsedProgram);
+		GLint previouslyBoundTexture = 0;
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
+		GLint previouslyActiveTexture = 0;
+		glGetIntegerv(GL_ACTIVE_TEXTURE, &previouslyActiveTexture);
+		GLint previousVAO=0;
+		glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+
+		/* Check that there is a valid program and VAO object for us to
+		 * use. A program that we have a location cache for is valid. */
+		kuhl_program_cache *cache = kuhl_private_program_cache_get(geom->program);
+		if(cache == NULL)
 		{
-			glUniformMatrix4fv(loc, MAX_BONES, 0, geom->bones->matrices[0]);
-			numBones = geom->bones->count;
+			msg(MSG_ERROR, "Program (%d) is invalid. Have you initialized this kuhl_geometry object?\n", geom->program);
+			kuhl_errorcheck();
+			kuhl_private_geometry_occlusion_end(occlusion);
+			return;
 		}
-	}
-#endif
-	loc = glGetUniformLocation(geom->program, "NumBones");
-	if(loc != -1)
-	    glUniform1i(loc, numBones);
-
-	loc = glGetUniformLocation(geom->program, "GeomTransform");
-	if(loc != -1)
-		glUniformMatrix4fv(loc, 1, 0, geom->matrix);
-	else if(geom->has_been_drawn == 0)
-	{ /* If the geom->matrix was not the identity and if it is not in
-	   * the GLSL shader program, print a helpful warning message. */
-		float identity[16];
-		mat4f_identity(identity);
-		float sum = 0;
-		for(int i=0; i<16; i++)
-			sum += fabsf(identity[i] - (geom->matrix)[i]);
-		if(sum > 0.00001)
+		else if (glIsVertexArray(geom->vao) == 0)
 		{
-			printf("\n\n");
-			printf("ERROR: You must include a 'uniform mat4 GeomTransform' variable in your GLSL shader (program %d) when you load/display a model with kuhl-util. This matrix should be applied to the vertices in your model before you multiply by your modelview matrix in the vertex program. For example:\n\ngl_Position = Projection * ModelView * GeomTransform * in_Position\n\n", geom->program);
-			printf("This matrix is required to correctly translate/rotate/scale your geometry and is also used by some models to implement animation. This matrix is stored inside of a variable called 'matrix' in kuhl_geometry and is set to the identity matrix by default. This message only gets printed if you are using something that actually sets the matrix to something other than the identity. Earlier versions of this software simply transformed the vertices as the file was being loaded instead of doing it in the vertex program.\n");
-			printf("\n");
-			printf("We would set the GeomTransform to:\n");
-			mat4f_print(geom->matrix);
-			printf("This program will resume running in 2 seconds...\n");
-			sleep(2);
-			printf("...continuing despite the missing variable.\n");
+			msg(MSG_ERROR, "Vertex array object (%d) is invalid.\n", geom->vao);
+			kuhl_errorcheck();
+			kuhl_private_geometry_occlusion_end(occlusion);
+			return;
 		}
-	}
+		glUseProgram(geom->program);
+		kuhl_errorcheck();
 
-	/* Use the vertex array object for this geometry */
-	glBindVertexArray(geom->vao);
-	kuhl_errorcheck();
+		kuhl_private_geometry_draw_node(geom, cache, NULL, batch);
+		kuhl_private_geometry_occlusion_end(occlusion);
 
-	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
-	 * be mapped. Here, we check if the buffers are mapped. If they
-	 * are, we unmap them before we draw the geometry. */
-	for(unsigned int i=0; i<geom->attrib_count; i++)
-	{
-		glBindBuffer(GL_ARRAY_BUFFER, geom->attribs[i].bufferobject);
-		GLint bufferIsMapped = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_MAPPED, &bufferIsMapped);
-		kuhl_errorcheck();
-		if(bufferIsMapped)
-			glUnmapBuffer(GL_ARRAY_BUFFER);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		kuhl_errorcheck();
-	}
+		/* Batched objects are drawn with the textures of the first
+		 * one (see kuhl_private_geometry_batch()). */
+		unsigned int textureCount = geom->texture_count;
+		for(unsigned int i=1; i<batch; i++)
+			geom = geom->next;
 
-	/* If the user provided us with indices, use glDrawElements() to
-	 * draw the geometry. */
-	if(geom->indices_len > 0 && glIsBuffer(geom->indices_bufferobject))
-	{
-		glDrawElements(geom->primitive_type,
-		               geom->indices_len,
-		               GL_UNSIGNED_INT,
-		               NULL);
-		kuhl_errorcheck();
-	}
-	else
-	{
-		/* If the user didn't provide us with indices, just draw the
-		 * vertices in order. */
-		glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
-		kuhl_errorcheck();
-	}
+		/* For each texture unit that we bound a texture to, unbind the
+		 * texture since we have finished drawing the geometry */
+		for(unsigned int i=0; i<textureCount; i++)
+		{
+			kuhl_errorcheck();
+			/* Turn on appropriate texture unit */
+			glActiveTexture(GL_TEXTURE0+i);
+			kuhl_errorcheck();
+			/* Unbind the texture */
+			glBindTexture(GL_TEXTURE_2D, 0);
+			kuhl_errorcheck();
+		}
 
+		/* Restore previously active texture */
+		glActiveTexture(previouslyActiveTexture);
 
-	/* For each texture unit that we bound a texture to, unbind the
-	 * texture since we have finished drawing the geometry */
-	for(unsigned int i=0; i<geom->texture_count; i++)
-	{
-		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Unbind the texture */
-		glBindTexture(GL_TEXTURE_2D, 0);
-		kuhl_errorcheck();
-	}
+		/* Restore previously bound texture */
+		glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
 
-	/* Indicate in the struct that we have successfully drawn this
-	 * geom once. */
-	geom->has_been_drawn = 1;
+		/* Restore the GLSL program that was used before this function was
+		 * called. */
+		glUseProgram(previouslyUsedProgram);
 
-	/* Restore previously active texture */
-	glActiveTexture(previouslyActiveTexture);
+		/* Unbind the VAO */
+		glBindVertexArray(previousVAO);
+		kuhl_errorcheck();
+	} /* Draw the next nodes in the list. */
+}
 
-	/* Restore previously bound texture */
-	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+/** Draws a kuhl_geometry struct to the screen. The struct passed into
+ * this function should have been set up with kuhl_geometry_new() and
+ * at least one position attribute with kuhl_geometry_attrib() before
+ * calling this function.
+ *
+ * If the kuhl.fastdraw configuration setting is enabled, the geometry
+ * is drawn without validation and without saving and restoring the
+ * OpenGL state for each object in the list (see
+ * kuhl_geometry_draw_state()).
 
-	/* Restore the GLSL program that was used before this function was
-	 * called. */
-	glUseProgram(previouslyUsedProgram);
+ @param geom The geometry to draw to the screen. If the kuhl_geometry
+ object is a part of a linked list, this function will draw each of
+ the objects in order. */
+void kuhl_geometry_draw(kuhl_geometry *geom)
+{
+	kuhl_private_geometry_draw_list(geom, NULL);
+}
 
-	/* Unbind the VAO */
-	glBindVertexArray(previousVAO);
-	kuhl_errorcheck();
+/** Draws the objects in a kuhl_geometry list which may be inside of
+ * the view frustum. Objects whose bounding volume (see
+ * kuhl_geometry_visible()) is entirely outside of the frustum are
+ * skipped. Otherwise, this function behaves the same as
+ * kuhl_geometry_draw(). The number of objects drawn and culled can
+ * be retrieved with kuhl_geometry_cull_stats().
+ *
+ * @param geom The geometry to draw.
+ *
+ * @param modelview The modelview matrix that the caller sent to the
+ * GLSL program for this geometry.
+ *
+ * @param projection The projection matrix that the caller sent to
+ * the GLSL program (for example, from viewmat_get()).
+ */
+void kuhl_geometry_draw_culled(kuhl_geometry *geom, const float modelview[16], const float projection[16])
+{
+	float mvp[16];
+	mat4f_mult_mat4f_new(mvp, projection, modelview);
+	kuhl_private_geometry_draw_list(geom, mvp);
+}
 
-	/* Draw the next nodes in the list. */
-	kuhl_geometry_draw(geom->next);
+/** Draws a single kuhl_geometry object (geom->next is ignored) with
+ * kuhl_geometry_draw_state() unless an occlusion query from a
+ * previous frame says that it is hidden behind other objects. If the
+ * kuhl.occlusion configuration setting is not enabled, this is the
+ * same as kuhl_geometry_draw_state(). The caller should draw objects
+ * roughly front to back and is responsible for view frustum culling
+ * (see kuhl_geometry_visible()).
+ *
+ * @param geom The geometry to draw.
+ *
+ * @param state The state initialized by kuhl_draw_state_begin(). The
+ * counters in the state, including the occlusion counters, are
+ * incremented.
+ *
+ * @param modelview The modelview matrix that the caller sent to the
+ * GLSL program for this geometry.
+ *
+ * @param projection The projection matrix that the caller sent to
+ * the GLSL program.
+ *
+ * @return 1 if the geometry was drawn (possibly with conditional
+ * rendering), 0 otherwise.
+ */
+int kuhl_geometry_draw_occlusion(kuhl_geometry *geom, kuhl_draw_state *state, const float modelview[16], const float projection[16])
+{
+	if(geom == NULL)
+		return 0;
+	float mvp[16];
+	mat4f_mult_mat4f_new(mvp, projection, modelview);
+	int drawn = 0;
+	int occlusion = kuhl_private_geometry_occlusion_begin(geom, state, mvp);
+	if(occlusion != KUHL_OCCLUSION_SKIP)
+		drawn = kuhl_private_geometry_draw_state(geom, state, 1);
+	kuhl_private_geometry_occlusion_end(occlusion);
+	return drawn;
 }
 
 /** Deletes kuhl_geometry struct by freeing the OpenGL buffers that
@@ -1714,9 +4476,11 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
 		if(attrib->name)
 			free(attrib->name);
 		attrib->name = NULL;
-		if(glIsBuffer(attrib->bufferobject))
+		if(!attrib->external && glIsBuffer(attrib->bufferobject))
 			glDeleteBuffers(1, &(attrib->bufferobject));
 		attrib->bufferobject = 0;
+		attrib->mapped = 0;
+		attrib->external = 0;
 	}
 	geom->attrib_count = 0;
 
@@ -1724,11 +4488,33 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
 		glDeleteBuffers(1, &(geom->indices_bufferobject));
 	geom->indices_bufferobject = 0;
 	geom->indices_len = 0;
+	geom->base_vertex = 0;
+	geom->first_index = 0;
+	geom->merged = 0;
+	geom->lod_count = 0;
+	geom->lod = 0;
+
+	/* The instance buffer may be shared with other geometry in the
+	 * list which may have already deleted it. */
+	if(glIsBuffer(geom->instance_bufferobject))
+		glDeleteBuffers(1, &(geom->instance_bufferobject));
+	geom->instance_bufferobject = 0;
+	geom->instance_count = 0;
 
 	if(glIsVertexArray(geom->vao))
 		glDeleteVertexArrays(1, &(geom->vao));
 	geom->vao = 0;
+	geom->has_bounds = 0;
 	geom->has_been_drawn = 0;
+
+	for(int i=0; i<KUHL_OCCLUSION_VIEWPORTS; i++)
+	{
+		if(geom->occlusion_query[i])
+			glDeleteQueries(1, &(geom->occlusion_query[i]));
+		geom->occlusion_query[i] = 0;
+		geom->occlusion_pending[i] = 0;
+		geom->occluded[i] = 0;
+	}
 }
 
 
@@ -2149,7 +4935,9 @@ static float kuhl_read_texture_file_stb(const char *filename, GLuint *texName, G
 
 /** Uses either ImageMagick (preferred) or STB (a fallback) to read an
  * image file from disk and bind it to an OpenGL texture name.
- * Requires OpenGL 2.0 or better.
+ * Requires OpenGL 2.0 or better. KTX, KTX2 and DDS files which
+ * contain compressed textures are loaded without decoding them (see
+ * kuhl_read_texture_file_compressed()).
  *
  * @param filename name of file to load
  *
@@ -2179,6 +4967,9 @@ float kuhl_read_texture_file_wrap(const char *filename, GLuint *texName, GLuint
 	}
 
 
+	if(texcompress_is_container(filename))
+		return kuhl_read_texture_file_compressed(filename, texName, wrapS, wrapT);
+
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
 	return kuhl_read_texture_file_im(filename, texName, wrapS, wrapT);
 #else
@@ -2246,8 +5037,11 @@ static void kuhl_screenshot_stb(const char *outputImageFilename)
 	             GL_RGB,GL_UNSIGNED_BYTE, data);
 	kuhl_errorcheck();
 
-	//kuhl_flip_texture_array(data, windowWidth, windowHeight, 3);
-	stbi_flip_vertically_on_write(1);
+	/* Flip the image ourselves instead of using
+	 * stbi_flip_vertically_on_write() since that setting is global
+	 * and would also affect images written by the frame capture
+	 * thread (see capture.c). */
+	kuhl_flip_texture_array(data, windowWidth, windowHeight, 3);
 
 	int ok=0;
 	const char *s = outputImageFilename;
@@ -2282,6 +5076,21 @@ void kuhl_screenshot(const char *outputImageFilename)
 }
 
 
+static video_encoder *kuhl_video_record_encoder = NULL;
+
+/** Writes the remaining frames and closes the video when the program
+ * exits. */
+static void kuhl_video_record_finish(void)
+{
+	capture_flush();
+	unsigned int captured, dropped;
+	capture_stats(&captured, &dropped);
+	if(dropped > 0)
+		msg(MSG_WARNING, "Video recording dropped %u of %u frames.", dropped, captured+dropped);
+	video_encoder_free(kuhl_video_record_encoder);
+	kuhl_video_record_encoder = NULL;
+}
+
 /** Records individual frames to image files that can later be
   combined into a single video file. Call this function every frame
   and it will capture the image data from the frame buffer and write
@@ -2290,8 +5099,17 @@ void kuhl_screenshot(const char *outputImageFilename)
   function writes TIFF files to avoid unnecessary computation
   compressing images. Instructions for converting the image files into
   a video file using ffmpeg or avconv will be printed to standard
-  out. This may run slowly if you are saving files to a non-local
-  filesystem.
+  out. Frames are read back and written to disk in the background
+  (see capture.h), so recording doesn't slow down rendering. If the
+  disk can't keep up, frames are dropped; capture_stats() reports how
+  many. Call capture_flush() before exiting to write the last few
+  frames.
+
+  If video.recordmode is set to "stream" in the config file, the
+  frames are instead encoded directly into a single video file named
+  "label.mp4" (see video_encoder_new()). This uses far less disk
+  space and disk bandwidth than writing each frame to its own file,
+  which matters for large framebuffers.
 
     @param fileLabel If fileLabel is set to "label", this function
     will create files such as "label-00000000.tif"
@@ -2311,6 +5129,29 @@ void kuhl_video_record(const char *fileLabel, int fps)
 	int usec_between_pictures = 1000000/fps;  // integer division...
 
 	if(time_of_next_picture == 0) // if first time called.
+	{
+		const char *mode = kuhl_config_get("video.recordmode");
+		if(mode != NULL && strcasecmp(mode, "stream") == 0)
+		{
+			char videoFile[1024];
+			snprintf(videoFile, 1024, "%s.mp4", fileLabel);
+			int width, height;
+			glfwGetFramebufferSize(kuhl_get_window(), &width, &height);
+			kuhl_video_record_encoder = video_encoder_new(videoFile, width, height, fps);
+			if(kuhl_video_record_encoder == NULL)
+				msg(MSG_WARNING, "Unable to stream video to %s, recording individual frames instead.", videoFile);
+		}
+		/* Registered even when writing individual frames so that the
+		 * last few frames are written. */
+		atexit(kuhl_video_record_finish);
+	}
+
+	if(time_of_next_picture == 0 && kuhl_video_record_encoder != NULL)
+	{
+		msg(MSG_INFO, "Recording %d frames per second to %s.", fps, kuhl_video_record_encoder->filename);
+		time_of_next_picture = kuhl_microseconds() + usec_between_pictures;
+	}
+	else if(time_of_next_picture == 0)
 	{
 		msg(MSG_INFO, "Recording %d frames per second. NOTE: If your screen is too large, then we may be unable to actually record images at the requested FPS rate.\n", fps);
 		msg(MSG_INFO, "Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
@@ -2329,24 +5170,22 @@ void kuhl_video_record(const char *fileLabel, int fps)
 
 		char filename[1024];
 		snprintf(filename, 1024, "%s-%08d.%s", fileLabel, kuhl_video_record_frame, exten);
-		kuhl_screenshot(filename); // TODO: Should we check if the screenshot writes?
+		/* Read the frame asynchronously so recording doesn't change
+		 * the frame timing. Frames are dropped (and counted) if we
+		 * can't keep up. */
+		if(kuhl_video_record_encoder)
+			capture_video_frame(kuhl_video_record_encoder);
+		else
+			capture_frame(filename);
 		kuhl_video_record_frame++;
 	}
+	capture_poll();
 }
 
 
 
 #ifdef KUHL_UTIL_USE_ASSIMP
 
-/** This struct is used internally by kuhl_util.c to keep track of all textures that are associated with models that have been loaded. */
-typedef struct {
-	char *textureFileName; /**< The filename of a texture */
-	GLuint textureID;      /**< The OpenGL texture name for that texture */
-} textureIdMapStruct;
-#define textureIdMapMaxSize 1024*32 /**< Maximum number of textures that can be loaded from models */
-static textureIdMapStruct textureIdMap[textureIdMapMaxSize]; /**<List of textures for the models */
-static int textureIdMapSize = 0; /**< Number of items in textureIdMap */
-
 
 /** Recursively traverse a tree of ASSIMP nodes and updates the
  * bounding box information.
@@ -2725,7 +5564,20 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 	// aiProcessFlags |= aiProcessPreset_TargetRealtime_Fast;    // a bit slower, adds additional processing
 	aiProcessFlags |= aiProcessPreset_TargetRealtime_Quality; // Does even more processing during model load.
 	aiProcessFlags |= aiProcess_OptimizeMeshes|aiProcess_OptimizeGraph; // fixes models with many small meshes
-	const struct aiScene* scene = aiImportFileExWithProperties(modelFilenameVarying, aiProcessFlags, NULL, propStore);
+
+	/* Importing and post-processing a large model can take a long
+	 * time. Use the scene from the last time that this model was
+	 * imported if the file and the flags haven't changed. If you
+	 * change the import properties above, increase
+	 * MODELCACHE_VERSION in modelcache.c. */
+	const struct aiScene* scene = modelcache_load(modelFilename, aiProcessFlags);
+	if(scene == NULL)
+	{
+		scene = aiImportFileExWithProperties(modelFilenameVarying, aiProcessFlags, NULL, propStore);
+		if(scene != NULL)
+			modelcache_save(modelFilename, aiProcessFlags, scene);
+	}
+	aiReleasePropertyStore(propStore);
 	free(modelFilenameVarying);
 	if(scene == NULL)
 		return NULL;
@@ -2745,16 +5597,6 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 	// Uncomment this line to print additional information about the model:
 	// kuhl_print_aiScene_info(modelFilename, scene);
 
-	/* For safety, zero out our texture ID map if it is supposed to be empty right now. */
-	if(textureIdMapSize == 0)
-	{
-		for(int i=0; i<textureIdMapMaxSize; i++)
-		{
-			textureIdMap[i].textureFileName = NULL;
-			textureIdMap[i].textureID = 0;
-		}
-	}
-
 	/* For each material that has a texture in the scene, try to load the corresponding texture file. */
 	for(unsigned int m=0; m < scene->mNumMaterials; m++)
 	{
@@ -2764,38 +5606,17 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 
 		if(aiGetMaterialTexture(scene->mMaterials[m], aiTextureType_DIFFUSE,  texIndex, &path, NULL, NULL, NULL, NULL, NULL, NULL) == AI_SUCCESS)
 		{
-			/* Don't load a texture that we have already loaded. */
+			/* Load the texture through the texture cache so that
+			 * textures shared between materials (or models) are
+			 * only loaded once. Models repeat their textures instead
+			 * of clamping them. The scene stays loaded for the rest
+			 * of the program, so the reference is never released. */
 			char *fullpath = kuhl_private_assimp_fullpath(path.data, modelFilename, textureDirname);
-			int alreadyExists = 0;
-			for(int i=0; i<textureIdMapSize; i++)
-			{
-				if(strcmp(fullpath, textureIdMap[i].textureFileName) == 0)
-				{
-					alreadyExists=1;
-					break;
-				}
-			}
-			if(alreadyExists > 0) // no need to reload an already loaded texture
-			{
-				free(fullpath);
-				continue; // skip to next material.
-			}
-			if(kuhl_read_texture_file(fullpath, &texIndex) < 0)
+			if(texcache_find(fullpath, GL_REPEAT, GL_REPEAT) == 0 &&
+			   texcache_acquire(fullpath, GL_REPEAT, GL_REPEAT, NULL) == 0)
 			{
 				msg(MSG_WARNING, "%s refers to texture %s which we could not find at %s\n", modelFilename, path.data, fullpath);
 			}
-
-			/* Store the texture information in our list structure so
-			 * we can find the textureID from the filename when we
-			 * render the scene. */
-			if(textureIdMapSize >= textureIdMapMaxSize)
-			{
-				msg(MSG_FATAL, "You have loaded more textures than the hardcoded limit. Exiting.\n");
-				exit(EXIT_FAILURE);
-			}
-			textureIdMap[textureIdMapSize].textureFileName = strdup(fullpath);
-			textureIdMap[textureIdMapSize].textureID = texIndex;
-			textureIdMapSize++;
 			free(fullpath);
 		}
 
@@ -2838,185 +5659,374 @@ static const struct aiScene* kuhl_private_assimp_load(const char *modelFilename,
 		}
 	}
 
-	return scene;
+	return scene;
+}
+
+/* Finds the last key at or before a time. Position, rotation and
+ * scaling keys are different types, but they all start with the time
+ * of the key, so the keys are accessed with a stride.
+ *
+ * @param keys The first key.
+ * @param stride The size of each key in bytes.
+ * @param count The number of keys.
+ * @param ticks The time of the animation in ticks.
+ * @param cursor The key that was found last time. It is updated to the key that is found.
+ *
+ * @return The index of the last key at or before ticks (0 if ticks is before the first key).
+ */
+static unsigned int kuhl_private_anim_key(const void *keys, size_t stride, unsigned int count,
+                                          double ticks, unsigned int *cursor)
+{
+#define KEY_TIME(i) (*(const double*) ((const char*)keys + (size_t)(i)*stride))
+	unsigned int k = *cursor;
+	if(k >= count)
+		k = 0;
+
+	/* When an animation plays forward, the key is usually the same
+	 * as last time or a few keys later. */
+	if(KEY_TIME(k) <= ticks)
+	{
+		for(int steps=0; steps<4; steps++)
+		{
+			if(k+1 >= count || KEY_TIME(k+1) > ticks)
+			{
+				*cursor = k;
+				return k;
+			}
+			k++;
+		}
+	}
+
+	/* Otherwise (seeking, looping or a large time step), use a
+	 * binary search. */
+	unsigned int lo = 0, hi = count;
+	while(hi - lo > 1)
+	{
+		unsigned int mid = lo + (hi-lo)/2;
+		if(KEY_TIME(mid) <= ticks)
+			lo = mid;
+		else
+			hi = mid;
+	}
+#undef KEY_TIME
+	*cursor = lo;
+	return lo;
+}
+
+/* Returns how far a time is between two keys (0 to 1). */
+static float kuhl_private_anim_factor(double timeStart, double timeEnd, double ticks)
+{
+	if(timeEnd <= timeStart || ticks <= timeStart)
+		return 0;
+	if(ticks >= timeEnd)
+		return 1;
+	return (float) ((ticks - timeStart)/(timeEnd - timeStart));
+}
+
+/* Interpolates the position, rotation and scaling of an animated
+ * node from the keys in its channel. */
+static void kuhl_private_anim_sample_keys(kuhl_anim_track *track, double ticks,
+                                          float position[3], float rotation[4], float scaling[3])
+{
+	const struct aiNodeAnim *na = track->channel;
+	unsigned int start, end;
+	float factor;
+
+	/* Interpolate between two nearest keys */
+	start = kuhl_private_anim_key(na->mPositionKeys, sizeof(struct aiVectorKey), na->mNumPositionKeys,
+	                              ticks, &track->cursor[0]);
+	end = start+1 < na->mNumPositionKeys ? start+1 : start;
+	factor = kuhl_private_anim_factor(na->mPositionKeys[start].mTime, na->mPositionKeys[end].mTime, ticks);
+	float positionValStart[3] = { na->mPositionKeys[start].mValue.x,
+	                              na->mPositionKeys[start].mValue.y,
+	                              na->mPositionKeys[start].mValue.z };
+	float positionValEnd[3] = { na->mPositionKeys[end].mValue.x,
+	                            na->mPositionKeys[end].mValue.y,
+	                            na->mPositionKeys[end].mValue.z };
+	vec3f_scalarMult(positionValStart, (1-factor));
+	vec3f_scalarMult(positionValEnd, factor);
+	vec3f_add_new(position, positionValStart, positionValEnd);
+
+	start = kuhl_private_anim_key(na->mRotationKeys, sizeof(struct aiQuatKey), na->mNumRotationKeys,
+	                              ticks, &track->cursor[1]);
+	end = start+1 < na->mNumRotationKeys ? start+1 : start;
+	factor = kuhl_private_anim_factor(na->mRotationKeys[start].mTime, na->mRotationKeys[end].mTime, ticks);
+	float rotationValStart[4] = { na->mRotationKeys[start].mValue.x,
+	                              na->mRotationKeys[start].mValue.y,
+	                              na->mRotationKeys[start].mValue.z,
+	                              na->mRotationKeys[start].mValue.w };
+	float rotationValEnd[4] = { na->mRotationKeys[end].mValue.x,
+	                            na->mRotationKeys[end].mValue.y,
+	                            na->mRotationKeys[end].mValue.z,
+	                            na->mRotationKeys[end].mValue.w };
+	quatf_slerp_new(rotation, rotationValStart, rotationValEnd, factor);
+
+	start = kuhl_private_anim_key(na->mScalingKeys, sizeof(struct aiVectorKey), na->mNumScalingKeys,
+	                              ticks, &track->cursor[2]);
+	end = start+1 < na->mNumScalingKeys ? start+1 : start;
+	factor = kuhl_private_anim_factor(na->mScalingKeys[start].mTime, na->mScalingKeys[end].mTime, ticks);
+	float scalingValStart[3] = { na->mScalingKeys[start].mValue.x,
+	                             na->mScalingKeys[start].mValue.y,
+	                             na->mScalingKeys[start].mValue.z };
+	float scalingValEnd[3] = { na->mScalingKeys[end].mValue.x,
+	                           na->mScalingKeys[end].mValue.y,
+	                           na->mScalingKeys[end].mValue.z };
+	vec3f_scalarMult(scalingValStart, (1-factor));
+	vec3f_scalarMult(scalingValEnd, factor);
+	vec3f_add_new(scaling, scalingValStart, scalingValEnd);
+}
+
+/* Interpolates the position, rotation and scaling of an animated
+ * node from the frames that were resampled when the model was
+ * loaded. */
+static void kuhl_private_anim_sample_frames(const kuhl_anim_track *track, double ticks,
+                                            float position[3], float rotation[4], float scaling[3])
+{
+	double f = (ticks - track->start) / track->step;
+	unsigned int a, b;
+	float factor;
+	if(f <= 0)
+	{
+		a = b = 0;
+		factor = 0;
+	}
+	else if(f >= track->frames-1)
+	{
+		a = b = track->frames-1;
+		factor = 0;
+	}
+	else
+	{
+		a = (unsigned int) f;
+		b = a+1;
+		factor = (float) (f - a);
+	}
+
+	const float *s = track->samples;
+	const unsigned int n = track->frames;
+	for(int i=0; i<3; i++)
+	{
+		position[i] = s[i*n+a]*(1-factor) + s[i*n+b]*factor;
+		scaling[i]  = s[(7+i)*n+a]*(1-factor) + s[(7+i)*n+b]*factor;
+	}
+	float rotationValStart[4], rotationValEnd[4];
+	for(int i=0; i<4; i++)
+	{
+		rotationValStart[i] = s[(3+i)*n+a];
+		rotationValEnd[i]   = s[(3+i)*n+b];
+	}
+	quatf_slerp_new(rotation, rotationValStart, rotationValEnd, factor);
+}
+
+/* Resamples the keys of a track at a fixed rate so that
+ * kuhl_private_anim_matrix() doesn't need to search for keys.
+ *
+ * @param track The track to resample.
+ * @param duration The duration of the animation in ticks.
+ * @param step The time between samples in ticks.
+ */
+static void kuhl_private_anim_resample(kuhl_anim_track *track, double duration, double step)
+{
+	if(track->channel == NULL || step <= 0 || duration <= 0)
+		return;
+	unsigned int frames = (unsigned int) ceil(duration / step) + 1;
+	float *s = (float*) kuhl_malloc(sizeof(float)*10*frames);
+	for(unsigned int f=0; f<frames; f++)
+	{
+		float position[3], rotation[4], scaling[3];
+		kuhl_private_anim_sample_keys(track, fmin(f*step, duration), position, rotation, scaling);
+		for(int i=0; i<3; i++)
+		{
+			s[i*frames+f] = position[i];
+			s[(7+i)*frames+f] = scaling[i];
+		}
+		for(int i=0; i<4; i++)
+			s[(3+i)*frames+f] = rotation[i];
+	}
+	track->start = 0;
+	track->step = step;
+	track->frames = frames;
+	track->samples = s;
+	track->cursor[0] = track->cursor[1] = track->cursor[2] = 0;
 }
 
-/** Given a aiNodeAnim object and a time, return an appropriate
+/** Given an animated node and a time, return an appropriate
  * transformation matrix.
  *
  * @param transformResult The resulting transformation matrix.
- * @param na The aiNodeAnim to generate the matrix form.
+ * @param track The animation of the node to generate the matrix from.
  * @param ticks The time of the animation in TICKS (not seconds!)
  */
-static void kuhl_private_anim_matrix(float transformResult[16], const struct aiNodeAnim *na, double ticks)
+static void kuhl_private_anim_matrix(float transformResult[16], kuhl_anim_track *track, double ticks)
 {
-
-	/* Find indices of start and stop position keys */
-	unsigned int positionStart = 0;
-	for(unsigned int j=0; j<na->mNumPositionKeys-1; j++)
-		if(ticks < na->mPositionKeys[j+1].mTime)
-		{
-			positionStart = j;
-			break;
-		}
-	unsigned int positionEnd = positionStart+1;
-	if(positionEnd >= na->mNumPositionKeys)
-		positionEnd = positionStart;
-	/* Determine where we are in relation to the two nearest keys */
-	float deltaTime = na->mPositionKeys[positionEnd].mTime - na->mPositionKeys[positionStart].mTime;
-	float factor;
-	if(deltaTime != 0)
-		factor = (ticks - na->mPositionKeys[positionStart].mTime)/deltaTime;
+	float position[3], rotation[4], scaling[3];
+	if(track->frames > 0)
+		kuhl_private_anim_sample_frames(track, ticks, position, rotation, scaling);
 	else
-		factor = 0;
-
-	/* Interpolate between two nearest keys */
-	float positionValStart[3] = { na->mPositionKeys[positionStart].mValue.x,
-	                              na->mPositionKeys[positionStart].mValue.y,
-	                              na->mPositionKeys[positionStart].mValue.z };
-	float positionValEnd[3] = { na->mPositionKeys[positionEnd].mValue.x,
-	                            na->mPositionKeys[positionEnd].mValue.y,
-	                            na->mPositionKeys[positionEnd].mValue.z };
-	float positionValMid[3];
-	vec3f_scalarMult(positionValStart, (1-factor));
-	vec3f_scalarMult(positionValEnd, factor);
-	vec3f_add_new(positionValMid, positionValStart, positionValEnd);
-	float positionMatrix[16];
-	mat4f_translateVec_new(positionMatrix, positionValMid);
+		kuhl_private_anim_sample_keys(track, ticks, position, rotation, scaling);
 
-	/* Find indices of start and stop rotation keys */
-	unsigned int rotationStart = 0;
-	for(unsigned int j=0; j<na->mNumRotationKeys-1; j++)
-		if(ticks < na->mRotationKeys[j+1].mTime)
-		{
-			rotationStart = j;
-			break;
-		}
-	unsigned int rotationEnd = rotationStart+1;
-	if(rotationEnd >= na->mNumRotationKeys)
-		rotationEnd = rotationStart;
-	/* Determine where we are in relation to the two nearest keys */
-	deltaTime = na->mRotationKeys[rotationEnd].mTime - na->mRotationKeys[rotationStart].mTime;
-	if(deltaTime != 0)
-		factor = (ticks - na->mRotationKeys[rotationStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	/* Interpolate between two nearest keys */
-	float rotationValStart[4] = { na->mRotationKeys[rotationStart].mValue.x,
-	                              na->mRotationKeys[rotationStart].mValue.y,
-	                              na->mRotationKeys[rotationStart].mValue.z,
-	                              na->mRotationKeys[rotationStart].mValue.w };
-	float rotationValEnd[4] = { na->mRotationKeys[rotationEnd].mValue.x,
-	                            na->mRotationKeys[rotationEnd].mValue.y,
-	                            na->mRotationKeys[rotationEnd].mValue.z,
-	                            na->mRotationKeys[rotationEnd].mValue.w };
-	float rotationValMid[4];
-	//vec4f_normalize(rotationValStart);
-	//vec4f_normalize(rotationValEnd);
-	quatf_slerp_new(rotationValMid, rotationValStart, rotationValEnd, factor);
-	float rotationMatrix[16];
-	mat4f_rotateQuatVec_new(rotationMatrix, rotationValMid);
-
-	/* Find indices of start and stop scaling keys */
-	unsigned int scalingStart = 0;
-	for(unsigned int j=0; j<na->mNumScalingKeys-1; j++)
-		if(ticks < na->mScalingKeys[j+1].mTime)
-		{
-			scalingStart = j;
-			break;
-		}
-	unsigned int scalingEnd = scalingStart+1;
-	if(scalingEnd >= na->mNumScalingKeys)
-		scalingEnd = scalingStart;
-	/* Determine where we are in relation to the two nearest keys */
-	deltaTime = na->mScalingKeys[scalingEnd].mTime - na->mScalingKeys[scalingStart].mTime;
-	if(deltaTime != 0)
-		factor = (ticks - na->mScalingKeys[scalingStart].mTime)/deltaTime;
-	else
-		factor = 0;
-	/* Interpolate between two nearest keys */
-	float scalingValStart[3] = { na->mScalingKeys[scalingStart].mValue.x,
-	                             na->mScalingKeys[scalingStart].mValue.y,
-	                             na->mScalingKeys[scalingStart].mValue.z };
-	float scalingValEnd[3] = { na->mScalingKeys[scalingEnd].mValue.x,
-	                           na->mScalingKeys[scalingEnd].mValue.y,
-	                           na->mScalingKeys[scalingEnd].mValue.z };
-	float scalingValMid[3];
-	vec3f_scalarMult(scalingValStart, (1-factor));
-	vec3f_scalarMult(scalingValEnd, factor);
-	vec3f_add_new(scalingValMid, scalingValStart, scalingValEnd);
-	float scalingMatrix[16];
-	mat4f_scaleVec_new(scalingMatrix, scalingValMid);
+	float positionMatrix[16], rotationMatrix[16], scalingMatrix[16];
+	mat4f_translateVec_new(positionMatrix, position);
+	mat4f_rotateQuatVec_new(rotationMatrix, rotation);
+	mat4f_scaleVec_new(scalingMatrix, scaling);
 
 	// transformResult = translation * rotation * scaling
 	mat4f_mult_mat4f_new(transformResult, positionMatrix, rotationMatrix);
 	mat4f_mult_mat4f_new(transformResult, transformResult, scalingMatrix);
 }
 
-/* Returns the transformation matrix for a node (without considering
- * the transformations of the parent node). If there is no animation
- * information, the matrix is stored in the node itself. If there is
- * animation information, we ignore the matrix in the node and instead
- * calculate a matrix based on the animation information.
+/* Counts the nodes in a hierarchy. */
+static unsigned int kuhl_private_count_nodes(const struct aiNode *node)
+{
+	unsigned int count = 1;
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+		count += kuhl_private_count_nodes(node->mChildren[i]);
+	return count;
+}
+
+/* Returns the index of a node in a skeleton or -1 if it isn't there. */
+static int kuhl_private_skeleton_find(const kuhl_skeleton *skel, const struct aiNode *node)
+{
+	for(unsigned int i=0; i<skel->count; i++)
+		if(skel->nodes[i] == node)
+			return (int) i;
+	return -1;
+}
+
+/* Flattens the node hierarchy in a scene into a kuhl_skeleton. The
+ * nodes are stored in breadth-first order so that every parent comes
+ * before its children, and the animation channel for each node in
+ * each animation is found ahead of time.
+ *
+ * @param scene The ASSIMP scene.
  *
- * @param transformResult To be filled in with the matrix for the
- * requested node.
+ * @return A new kuhl_skeleton.
+ */
+static kuhl_skeleton* kuhl_private_skeleton_new(const struct aiScene *scene)
+{
+	kuhl_skeleton *skel = (kuhl_skeleton*) kuhl_malloc(sizeof(kuhl_skeleton));
+	skel->count = kuhl_private_count_nodes(scene->mRootNode);
+	skel->nodes = (const struct aiNode**) kuhl_malloc(sizeof(struct aiNode*)*skel->count);
+	skel->parent = (int*) kuhl_malloc(sizeof(int)*skel->count);
+	skel->world = (float*) kuhl_malloc(sizeof(float)*16*skel->count);
+	skel->updated = 0;
+	skel->warned_scale = 0;
+
+	/* Use the nodes array as the queue for a breadth-first traversal. */
+	skel->nodes[0] = scene->mRootNode;
+	skel->parent[0] = -1;
+	unsigned int tail = 1;
+	for(unsigned int head=0; head<tail; head++)
+	{
+		const struct aiNode *node = skel->nodes[head];
+		mat4f_identity(skel->world+16*head);
+		for(unsigned int i=0; i<node->mNumChildren; i++)
+		{
+			skel->nodes[tail] = node->mChildren[i];
+			skel->parent[tail] = (int) head;
+			tail++;
+		}
+	}
+
+	skel->tracks = (kuhl_anim_track*) calloc((size_t)skel->count*scene->mNumAnimations, sizeof(kuhl_anim_track));
+	if(skel->tracks == NULL)
+	{
+		msg(MSG_FATAL, "Failed to allocate animation tracks.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Resampling makes finding a frame O(1) instead of a search
+	 * through the keys, at the cost of memory and some precision
+	 * between samples. */
+	float rate = kuhl_config_float("model.resample", 0, 0);
+	for(unsigned int a=0; a<scene->mNumAnimations; a++)
+	{
+		const struct aiAnimation *anim = scene->mAnimations[a];
+		for(unsigned int c=0; c<anim->mNumChannels; c++)
+			for(unsigned int i=0; i<skel->count; i++)
+				if(strcmp(anim->mChannels[c]->mNodeName.data, skel->nodes[i]->mName.data) == 0)
+				{
+					kuhl_anim_track *track = skel->tracks + a*skel->count+i;
+					track->channel = anim->mChannels[c];
+					if(rate > 0 && anim->mTicksPerSecond > 0)
+						kuhl_private_anim_resample(track, anim->mDuration, anim->mTicksPerSecond/rate);
+					break;
+				}
+	}
+	return skel;
+}
+
+/* Computes the transform of every node in a skeleton relative to the
+ * root. Nodes which have a channel in the animation use the matrix
+ * from the animation; other nodes use the matrix in the node itself.
  *
- * @param scene The ASSIMP scene object containing the node.
+ * @param skel The skeleton to update.
  *
- * @param node The ASSIMP node object that we want animation
- * information about.
+ * @param scene The ASSIMP scene the skeleton was created from.
  *
  * @param animationNum If the file contains more than one animation,
  * indicates which animation to use. If you don't know, set this to 0.
  *
- * @param t The time in seconds that you want the animation matrix
- * for. If time is negative, this function is guaranteed to return the
- * transformation matrix in the node.
- *
- * @return Returns 1 if we successfully returned a matrix based on
- * animation information. Returns 0 if we simply returned the
- * transformation matrix in the node itself.
+ * @param t The time in seconds. If time is negative or past the end
+ * of the animation, every node uses the matrix in the node itself.
  */
-static int kuhl_private_node_matrix(float transformResult[16],
-                                    const struct aiScene *scene,
-                                    const struct aiNode *node,
-                                    unsigned int animationNum, double t)
+static void kuhl_private_skeleton_update(kuhl_skeleton *skel, const struct aiScene *scene,
+                                         unsigned int animationNum, double t)
 {
-	/* Copy the transform matrix from the node itself. This is the
-	 * matrix that the user will see if we are unable to find the
-	 * requested animation matrix for this node. */
-	mat4f_from_aiMatrix4x4(transformResult, node->mTransformation);
+	kuhl_anim_track *tracks = NULL;
+	double currentTick = 0;
+	if(animationNum < scene->mNumAnimations && t >= 0)
+	{
+		const struct aiAnimation *anim = scene->mAnimations[animationNum];
+		currentTick = t * anim->mTicksPerSecond;
+		if(currentTick <= anim->mDuration)
+			tracks = skel->tracks + animationNum*skel->count;
+	}
 
-	/* Return the transformation matrix from the node if: (1) The
-	 * requested animation number is too large. (2) A negative time
-	 * value is requested. */
-	if(animationNum >= scene->mNumAnimations || t < 0)
-		return 0;
+	/* Parents come before their children, so the parent's transform
+	 * is always ready when we reach a node. */
+	for(unsigned int i=0; i<skel->count; i++)
+	{
+		float local[16];
+		if(tracks && tracks[i].channel)
+			kuhl_private_anim_matrix(local, tracks+i, currentTick);
+		else
+			mat4f_from_aiMatrix4x4(local, skel->nodes[i]->mTransformation);
 
-	struct aiAnimation *anim = scene->mAnimations[animationNum];
+		float *world = skel->world + 16*i;
+		if(skel->parent[i] < 0)
+			mat4f_copy(world, local);
+		else
+			mat4f_mult_mat4f_new(world, skel->world + 16*skel->parent[i], local);
+	}
+}
 
-	/* If the time value too large for the animation, return the
-	 * transformation matrix form the node. */
-	double currentTick = t * anim->mTicksPerSecond;
-	if(currentTick > anim->mDuration)
-		return 0;
+/* Creates a skeleton for a model and connects each kuhl_geometry in
+ * the model (and each of its bones) to the nodes in the skeleton. */
+static void kuhl_private_skeleton_attach(kuhl_geometry *first_geom, const struct aiScene *scene)
+{
+	/* Only animated models need a skeleton. */
+	if(scene->mNumAnimations == 0)
+		return;
 
-	/* Find the channel corresponding to the node name passed in as
-	 * parameter. */
-	for(unsigned int i=0; i<anim->mNumChannels; i++)
+	kuhl_skeleton *skel = kuhl_private_skeleton_new(scene);
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
 	{
-		if(strcmp(anim->mChannels[i]->mNodeName.data, node->mName.data) == 0)
+		g->skeleton = skel;
+		g->skeleton_node = kuhl_private_skeleton_find(skel, g->assimp_node);
+		if(g->bones == NULL)
+			continue;
+		for(int b=0; b < g->bones->count; b++)
 		{
-			/* Get this node's matrix according to the animation
-			 * information. */
-			struct aiNodeAnim *na = anim->mChannels[i];
-			kuhl_private_anim_matrix(transformResult, na, currentTick);
-			return 1;
+			const struct aiNode *node = kuhl_assimp_find_node(g->bones->boneList[b]->mName.data, scene->mRootNode);
+			if(node == NULL)
+			{
+				msg(MSG_FATAL, "Failed to find node that corresponded to bone: %s\n", g->bones->boneList[b]->mName.data);
+				exit(EXIT_FAILURE);
+			}
+			g->bones->node[b] = kuhl_private_skeleton_find(skel, node);
 		}
 	}
-
-	return 0;
 }
 
 
@@ -3049,6 +6059,121 @@ kuhl_geometry* kuhl_geometry_append(kuhl_geometry *a, kuhl_geometry *b)
 
 
 
+/** Determines if models should be loaded with compact vertex
+ * formats (see the model.compact configuration setting).
+ *
+ * @return 0 if models should use floats for all vertex attributes, 1
+ * if compact formats should be used, or 2 if compact formats should
+ * be used and normals can be packed into GL_INT_2_10_10_10_REV.
+ */
+static int kuhl_private_model_compact(void)
+{
+	static int compact = -1;
+	if(compact == -1)
+	{
+		compact = kuhl_config_boolean("model.compact", 0, 0);
+		if(compact && (GLEW_VERSION_3_3 || GLEW_ARB_vertex_type_2_10_10_10_rev))
+			compact = 2;
+	}
+	return compact;
+}
+
+/** Returns the number of levels of detail that should be generated
+ * for each mesh in a model (see the model.lod configuration setting
+ * and kuhl_geometry_lod()). 1 means that only the full resolution
+ * mesh is used. */
+static int kuhl_private_model_lod(void)
+{
+	static int levels = -1;
+	if(levels == -1)
+	{
+		levels = kuhl_config_int("model.lod", 1, 1);
+		if(levels < 1)
+			levels = 1;
+		if(levels > MAX_LODS)
+			levels = MAX_LODS;
+	}
+	return levels;
+}
+
+/** Converts a float into a IEEE 16-bit half float (used with
+ * GL_HALF_FLOAT). Values too large to represent become infinity and
+ * values too small become zero. */
+static GLushort kuhl_private_float_to_half(float f)
+{
+	union { float f; uint32_t u; } in = { f };
+	uint32_t sign = (in.u >> 16) & 0x8000;
+	int32_t  exp  = (int32_t) ((in.u >> 23) & 0xff) - 127 + 15;
+	uint32_t mant = in.u & 0x7fffff;
+
+	if(exp >= 31) /* overflow, infinity or NaN */
+		return (GLushort) (sign | 0x7c00 | (((in.u & 0x7f800000) == 0x7f800000 && mant) ? 0x200 : 0));
+	if(exp <= 0) /* denormal or zero */
+	{
+		if(exp < -10)
+			return (GLushort) sign;
+		mant |= 0x800000;
+		return (GLushort) (sign | ((mant >> (14 - exp)) + ((mant >> (13 - exp)) & 1)));
+	}
+	/* Round to nearest; a carry out of the mantissa correctly
+	 * increments the exponent. */
+	return (GLushort) ((sign | ((uint32_t)exp << 10) | (mant >> 13)) + ((mant >> 12) & 1));
+}
+
+/** Converts a float in [-1,1] into a normalized signed 16-bit integer. */
+static GLshort kuhl_private_pack_snorm16(float f)
+{
+	f = fmaxf(-1.0f, fminf(1.0f, f));
+	return (GLshort) lroundf(f * 32767.0f);
+}
+
+/** Converts a float in [0,1] into a normalized unsigned byte. */
+static GLubyte kuhl_private_pack_unorm8(float f)
+{
+	f = fmaxf(0.0f, fminf(1.0f, f));
+	return (GLubyte) lroundf(f * 255.0f);
+}
+
+/** Packs a normal vector into the GL_INT_2_10_10_10_REV format (10
+ * bits each for x, y, z; the 2 bit w component is set to 0). */
+static GLuint kuhl_private_pack_snorm_2_10_10_10(const float n[3])
+{
+	GLuint packed = 0;
+	for(int i=0; i<3; i++)
+	{
+		float f = fmaxf(-1.0f, fminf(1.0f, n[i]));
+		GLint v = (GLint) lroundf(f * 511.0f);
+		packed |= ((GLuint) v & 0x3ff) << (10*i);
+	}
+	return packed;
+}
+
+/** Adds an entry to a vertex layout and returns the byte offset of
+ * the new attribute within each vertex.
+ *
+ * @param layout The layout array to add to.
+ * @param count Number of entries in layout (incremented).
+ * @param stride Size of a vertex in bytes (increased by the size of the new attribute).
+ * @param name GLSL variable name of the attribute.
+ * @param components Number of components in the attribute.
+ * @param type OpenGL type of each component.
+ * @param normalized Should integer values be normalized?
+ */
+static int kuhl_private_layout_add(kuhl_vertex_layout *layout, unsigned int *count, int *stride,
+                                   const char *name, GLuint components, GLenum type, GLboolean normalized)
+{
+	kuhl_vertex_layout *l = &layout[*count];
+	l->name = name;
+	l->components = components;
+	l->type = type;
+	l->normalized = normalized;
+	(*count)++;
+
+	int offset = *stride;
+	*stride += kuhl_private_layout_bytes(l);
+	return offset;
+}
+
 /** Recursively calls itself to create one or more kuhl_geometry
  * structs for all of the nodes in the scene.
  *
@@ -3156,152 +6281,203 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 		geom->assimp_scene = (struct aiScene*) sc;
 		mat4f_copy(geom->matrix, currentTransform);
 
-		/* Store the vertex position attribute into the kuhl_geometry struct */
-		float *vertexPositions = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
-		for(unsigned int i=0; i<mesh->mNumVertices; i++)
-		{
-			vertexPositions[i*3+0] = (mesh->mVertices)[i].x;
-			vertexPositions[i*3+1] = (mesh->mVertices)[i].y;
-			vertexPositions[i*3+2] = (mesh->mVertices)[i].z;
-		}
-		kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", 0);
-		free(vertexPositions);
+		/* If there are no vertex colors, try to use material colors
+		 * instead. It would be more efficient to send material colors
+		 * as a uniform variable. However, by using this approach, we
+		 * don't need to use both a material color uniform and a
+		 * vertex color attribute in a GLSL program that displays a
+		 * model. */
+		// Note: mesh->mColors is a C array, not a pointer
+		int hasColors = 0;
+		struct aiColor4D diffuse;
+		if(mesh->mColors[0] != NULL)
+			hasColors = 1;
+		else if(AI_SUCCESS == aiGetMaterialColor(sc->mMaterials[mesh->mMaterialIndex], AI_MATKEY_COLOR_DIFFUSE, &diffuse))
+			hasColors = 2;
 
-		/* Store the normal vectors in the kuhl_geometry struct */
-		if(mesh->mNormals != NULL)
+		if(mesh->mBones != NULL && mesh->mNumBones > MAX_BONES)
 		{
-			float *normals = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
-			for(unsigned int i=0; i<mesh->mNumVertices; i++)
-			{
-				normals[i*3+0] = (mesh->mNormals)[i].x;
-				normals[i*3+1] = (mesh->mNormals)[i].y;
-				normals[i*3+2] = (mesh->mNormals)[i].z;
-			}
-			kuhl_geometry_attrib(geom, normals, 3, "in_Normal", 0);
-			free(normals);
+			msg(MSG_FATAL, "This mesh has %d bones but we only support %d",
+			    mesh->mNumBones, MAX_BONES);
+			exit(EXIT_FAILURE);
 		}
 
-		/* Store the vertex color attribute */
-		// Note: mesh->mColors is a C array, not a pointer
-		if(mesh->mColors[0] != NULL)
+		/* Describe the layout of each vertex in the interleaved
+		 * buffer. An offset of -1 means that the mesh doesn't have
+		 * that attribute. If model.compact is set, normals, colors,
+		 * texture coordinates and bone indices are stored in
+		 * smaller formats. */
+		int compact = kuhl_private_model_compact();
+		kuhl_vertex_layout layout[6];
+		unsigned int layoutCount = 0;
+		int normalOffset = -1, colorOffset = -1, texCoordOffset = -1;
+		int boneIndexOffset = -1, boneWeightOffset = -1;
+		/* Don't use alpha by default; changing this to 4 may require
+		   the size of in_Color the vertex program to be adjusted. In
+		   compact mode, the alpha byte is padding. */
+		static const int colorComps = 3;
+		int stride = 0;
+		int positionOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_Position", 3, GL_FLOAT, GL_FALSE);
+		if(mesh->mNormals != NULL)
 		{
-			/* Don't use alpha by default; changing this to 4 may
-			   require the size of in_Color the vertex program to be
-			   adjusted. */
-			static const int colorComps = 3;
-			float *colors = kuhl_malloc(sizeof(float)*mesh->mNumVertices*colorComps);
-			for(unsigned int i=0; i<mesh->mNumVertices; i++)
-			{
-				colors[i*colorComps+0] = mesh->mColors[0][i].r;
-				colors[i*colorComps+1] = mesh->mColors[0][i].g;
-				colors[i*colorComps+2] = mesh->mColors[0][i].b;
-				if(colorComps == 4)
-					colors[i*colorComps+3] = mesh->mColors[0][i].a;
-			}
-			kuhl_geometry_attrib(geom, colors, colorComps, "in_Color", 0);
-			free(colors);
+			if(compact == 2)
+				normalOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_Normal", 4, GL_INT_2_10_10_10_REV, GL_TRUE);
+			else if(compact)
+				normalOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_Normal", 4, GL_SHORT, GL_TRUE);
+			else
+				normalOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_Normal", 3, GL_FLOAT, GL_FALSE);
 		}
-		/* If there are no vertex colors, try to use material colors instead */
-		else
+		if(hasColors)
 		{
-			/* It would be more efficient to send material colors as a
-			 * uniform variable. However, by using this approach, we
-			 * don't need to use both a material color uniform and a
-			 * vertex color attribute in a GLSL program that displays
-			 * a model. */
-			const struct aiMaterial *mtl = sc->mMaterials[mesh->mMaterialIndex];
-			struct aiColor4D diffuse;
-			if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_DIFFUSE, &diffuse))
-			{
-				static const int colorComps = 3;
-				float *colors = kuhl_malloc(sizeof(float)*mesh->mNumVertices*colorComps);
-				for(unsigned int i=0; i<mesh->mNumVertices; i++)
-				{
-					colors[i*colorComps+0] = diffuse.r;
-					colors[i*colorComps+1] = diffuse.g;
-					colors[i*colorComps+2] = diffuse.b;
-					// Alpha is not handled for now.
-				}
-				kuhl_geometry_attrib(geom, colors, colorComps, "in_Color", 0);
-				free(colors);
-			}
+			if(compact)
+				colorOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_Color", 4, GL_UNSIGNED_BYTE, GL_TRUE);
+			else
+				colorOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_Color", colorComps, GL_FLOAT, GL_FALSE);
 		}
-
-		/* Store the texture coordinate attribute */
 		// Note: mesh->mTextureCoords is a C array, not a pointer
 		if(mesh->mTextureCoords[0] != NULL)
 		{
-			float *texCoord = kuhl_malloc(sizeof(float)*mesh->mNumVertices*2);
-			for(unsigned int i=0; i<mesh->mNumVertices; i++)
-			{
-				texCoord[i*2+0] = mesh->mTextureCoords[0][i].x;
-				texCoord[i*2+1] = mesh->mTextureCoords[0][i].y;
-			}
-			kuhl_geometry_attrib(geom, texCoord, 2, "in_TexCoord", 0);
-			free(texCoord);
+			if(compact)
+				texCoordOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_TexCoord", 2, GL_HALF_FLOAT, GL_FALSE);
+			else
+				texCoordOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_TexCoord", 2, GL_FLOAT, GL_FALSE);
 		}
-
-		/* Fill in bone information */
 		if(mesh->mBones != NULL && mesh->mNumBones > 0)
 		{
-			if(mesh->mNumBones > MAX_BONES)
+			/* MAX_BONES is small enough that bone indices fit in a byte. */
+			if(compact)
+				boneIndexOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_BoneIndex", 4, GL_UNSIGNED_BYTE, GL_FALSE);
+			else
+				boneIndexOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_BoneIndex", 4, GL_FLOAT, GL_FALSE);
+			boneWeightOffset = kuhl_private_layout_add(layout, &layoutCount, &stride, "in_BoneWeight", 4, GL_FLOAT, GL_FALSE);
+		}
+
+		/* Fill in the interleaved array, one vertex at a time. Every
+		 * attribute starts on a 4 byte boundary. */
+		unsigned char *vertices = kuhl_malloc((size_t)stride*mesh->mNumVertices);
+		memset(vertices, 0, (size_t)stride*mesh->mNumVertices);
+		for(unsigned int i=0; i<mesh->mNumVertices; i++)
+		{
+			unsigned char *v = vertices + (size_t)i*stride;
+			float *pos = (float*) (v+positionOffset);
+			pos[0] = (mesh->mVertices)[i].x;
+			pos[1] = (mesh->mVertices)[i].y;
+			pos[2] = (mesh->mVertices)[i].z;
+
+			if(normalOffset >= 0)
 			{
-				msg(MSG_FATAL, "This mesh has %d bones but we only support %d",
-				    mesh->mNumBones, MAX_BONES);
-				exit(EXIT_FAILURE);
+				float n[3] = { (mesh->mNormals)[i].x,
+				               (mesh->mNormals)[i].y,
+				               (mesh->mNormals)[i].z };
+				if(compact == 2)
+					*(GLuint*) (v+normalOffset) = kuhl_private_pack_snorm_2_10_10_10(n);
+				else if(compact)
+				{
+					GLshort *ns = (GLshort*) (v+normalOffset);
+					for(int j=0; j<3; j++)
+						ns[j] = kuhl_private_pack_snorm16(n[j]);
+				}
+				else
+					vec3f_copy((float*) (v+normalOffset), n);
 			}
 
-			float *indices = kuhl_malloc(sizeof(float)*mesh->mNumVertices*4);
-			float *weights = kuhl_malloc(sizeof(float)*mesh->mNumVertices*4);
-			/* For each vertex */
-			for(unsigned int i=0; i<mesh->mNumVertices; i++)
+			if(colorOffset >= 0)
 			{
-				/* Zero out weights */
-				for(int j=0; j<4; j++)
+				struct aiColor4D c;
+				if(hasColors == 1)
+					c = mesh->mColors[0][i];
+				else
+					c = diffuse; // Alpha is not handled for material colors.
+				float rgba[4] = { c.r, c.g, c.b, c.a };
+				if(compact)
+				{
+					GLubyte *cb = (GLubyte*) (v+colorOffset);
+					for(int j=0; j<4; j++)
+						cb[j] = kuhl_private_pack_unorm8(rgba[j]);
+				}
+				else
 				{
-					// If weight is zero, it doesn't matter what the index
-					// is as long as it isn't out of bounds.
-					indices[i*4+j] = 0;
-					weights[i*4+j] = 0;
+					float *cf = (float*) (v+colorOffset);
+					for(int j=0; j<colorComps; j++)
+						cf[j] = rgba[j];
 				}
+			}
 
-				int count = 0; /* How many bones refer to this vertex? */
+			if(texCoordOffset >= 0)
+			{
+				float u = mesh->mTextureCoords[0][i].x;
+				float w = mesh->mTextureCoords[0][i].y;
+				if(compact)
+				{
+					GLushort *th = (GLushort*) (v+texCoordOffset);
+					th[0] = kuhl_private_float_to_half(u);
+					th[1] = kuhl_private_float_to_half(w);
+				}
+				else
+				{
+					float *tf = (float*) (v+texCoordOffset);
+					tf[0] = u;
+					tf[1] = w;
+				}
+			}
+			/* Bone indices and weights were zeroed by memset(). If
+			 * weight is zero, it doesn't matter what the index is as
+			 * long as it isn't out of bounds. */
+		}
 
-				/* For each bone */
-				for(unsigned int j=0; j<mesh->mNumBones; j++)
+		/* Fill in bone information */
+		if(boneWeightOffset >= 0)
+		{
+			/* How many bones refer to each vertex? */
+			unsigned char *count = calloc(mesh->mNumVertices, sizeof(unsigned char));
+			unsigned int ignored = 0; /* Weights beyond the fourth for a vertex */
+			/* For each bone */
+			for(unsigned int j=0; j<mesh->mNumBones; j++)
+			{
+				/* Each vertex that this bone refers to. */
+				for(unsigned int k=0; k<mesh->mBones[j]->mNumWeights; k++)
 				{
-					/* Each vertex that this bone refers to. */
-					for(unsigned int k=0; k<mesh->mBones[j]->mNumWeights; k++)
+					unsigned int idx = mesh->mBones[j]->mWeights[k].mVertexId;
+					float wght       = mesh->mBones[j]->mWeights[k].mWeight;
+					if(idx >= mesh->mNumVertices)
+						continue;
+					if(count[idx] == 4)
 					{
-						/* If this bone refers to a vertex that matches the one
-						   that we are on, use the data and send it to the vertex program.
-						 */
-						unsigned int idx = mesh->mBones[j]->mWeights[k].mVertexId;
-						float wght       = mesh->mBones[j]->mWeights[k].mWeight;
-						if(idx == i)
-						{
-							indices[i*4+count] = (float) j;
-							weights[i*4+count] = wght;
-							count++;
-						} // end if vertices match
-					} // end for each vertex the bone refers to
-				} // end for each bone
-			} // end for each vertex in mesh
+						ignored++;
+						continue;
+					}
+					unsigned char *v = vertices + (size_t)idx*stride;
+					if(compact)
+						((GLubyte*) (v+boneIndexOffset))[count[idx]] = (GLubyte) j;
+					else
+						((float*) (v+boneIndexOffset))[count[idx]] = (float) j;
+					((float*) (v+boneWeightOffset))[count[idx]] = wght;
+					count[idx]++;
+				} // end for each vertex the bone refers to
+			} // end for each bone
+			free(count);
+			if(ignored > 0)
+			{
+				msg(MSG_WARNING, "Mesh %u (%u/%u meshes in node \"%s\"): %u bone weights were "
+				    "ignored because we only support 4 bones per vertex. Load the model "
+				    "with aiProcess_LimitBoneWeights to make ASSIMP keep the largest "
+				    "weights.", nd->mMeshes[n], n+1, nd->mNumMeshes, nd->mName.data, ignored);
+			}
 
 			for(unsigned int i=0; i<mesh->mNumVertices; i++)
 			{
-				if(weights[i*4+0] == 0)
+				if(((float*) (vertices + (size_t)i*stride + boneWeightOffset))[0] == 0)
 				{
 					msg(MSG_FATAL, "Every vertex should have at least one weight but vertex %ud has no weights!", i);
 					exit(EXIT_FAILURE);
 				}
 			}
-			kuhl_geometry_attrib(geom, indices, 4, "in_BoneIndex", 0);
-			kuhl_geometry_attrib(geom, weights, 4, "in_BoneWeight", 0);
-			free(indices);
-			free(weights);
 		} // end if there are bones
 
+		/* Store all of the vertex attributes in one interleaved
+		 * buffer in the kuhl_geometry struct */
+		kuhl_geometry_attrib_interleaved(geom, vertices, layout, layoutCount, 0);
+
 		/* Find our texture and tell our kuhl_geometry object about
 		 * it. */
 		struct aiString texPath;	//contains filename of texture
@@ -3310,14 +6486,9 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 		                                      aiTextureType_DIFFUSE, texIndex, &texPath,
 		                                      NULL, NULL, NULL, NULL, NULL, NULL))
 		{
-			GLuint texture = 0;
-			for(int i=0; i<textureIdMapSize; i++)
-			{
-				char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
-				if(strcmp(textureIdMap[i].textureFileName, fullpath) == 0)
-					texture = textureIdMap[i].textureID;
-				free(fullpath);
-			}
+			char *fullpath = kuhl_private_assimp_fullpath(texPath.data, modelFilename, textureDirname);
+			GLuint texture = texcache_find(fullpath, GL_REPEAT, GL_REPEAT);
+			free(fullpath);
 			if(texture == 0)
 			{
 				msg(MSG_WARNING, "Mesh %u uses texture '%s'."
@@ -3325,16 +6496,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				    nd->mMeshes[n], texPath.data);
 			}
 			else
-			{
-				/* If model uses texture and we found the texture file,
-				   Make sure we repeat instead of clamp textures */
-				glBindTexture(GL_TEXTURE_2D, texture);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-				kuhl_errorcheck();
-
 				kuhl_geometry_texture(geom, texture, "tex", 0);
-			}
 		}
 
 		if(mesh->mNumFaces > 0)
@@ -3348,9 +6510,13 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				for(unsigned int x = 0; x < meshPrimitiveType; x++) // for each index
 					indices[t*meshPrimitiveType+x] = face->mIndices[x];
 			}
-			kuhl_geometry_indices(geom, indices, numIndices);
+			/* If model.lod is set, simplified versions of the mesh
+			 * are stored with the indices. */
+			kuhl_geometry_lod(geom, (const GLfloat*) (vertices+positionOffset), stride/sizeof(GLfloat),
+			                  indices, numIndices, kuhl_private_model_lod());
 			free(indices);
 		}
+		free(vertices);
 
 
 		/* Initialize list of bone matrices if this mesh has bones. */
@@ -3361,9 +6527,35 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			bones->mesh = n;
 			for(unsigned int b=0; b < mesh->mNumBones; b++)
 				bones->boneList[b] = mesh->mBones[b];
-			// set any unused bone matrices to the identity.
-			for(unsigned int b=mesh->mNumBones; b < MAX_BONES; b++)
+			// set the bones to the identity until kuhl_update_model() is called.
+			for(unsigned int b=0; b < MAX_BONES; b++)
+			{
 				mat4f_identity(bones->matrices[b]);
+				dualquatf_from_mat4f(bones->dualquats[b], bones->matrices[b]);
+			}
+
+			/* The uniform buffer is as large as the BonePalette block
+			 * so that the whole block is backed by the buffer, but
+			 * kuhl_update_model() only updates the bones that are
+			 * used. */
+			bones->palette = 0;
+			bones->palette_type = KUHL_BONES_MATRIX;
+			bones->baked = 0;
+			bones->baked_fps = 0;
+			bones->dirty = 0;
+			if(GLEW_VERSION_3_1 || GLEW_ARB_uniform_buffer_object)
+			{
+				if(kuhl_config_boolean("model.dualquat", 0, 0))
+					bones->palette_type = KUHL_BONES_DUALQUAT;
+				glGenBuffers(1, &bones->palette);
+				glBindBuffer(GL_UNIFORM_BUFFER, bones->palette);
+				if(bones->palette_type == KUHL_BONES_DUALQUAT)
+					glBufferData(GL_UNIFORM_BUFFER, sizeof(bones->dualquats), bones->dualquats, GL_DYNAMIC_DRAW);
+				else
+					glBufferData(GL_UNIFORM_BUFFER, sizeof(bones->matrices), bones->matrices, GL_DYNAMIC_DRAW);
+				glBindBuffer(GL_UNIFORM_BUFFER, 0);
+				kuhl_errorcheck();
+			}
 			geom->bones = bones;
 		}
 
@@ -3394,6 +6586,25 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 }
 
 
+/* Prints a warning (once per model) if a bone matrix contains
+ * scaling, which dual quaternions can't represent. The flag is kept
+ * in the skeleton so that different models can be updated on
+ * different threads. */
+static void kuhl_private_check_rigid(kuhl_skeleton *skel, const float matrix[16])
+{
+	if(skel->warned_scale)
+		return;
+	for(int col=0; col<3; col++)
+	{
+		if(fabsf(vec3f_norm(matrix+col*4)-1) > 0.01f)
+		{
+			msg(MSG_WARNING, "A bone contains scaling, which is ignored when model.dualquat is set.");
+			skel->warned_scale = 1;
+			return;
+		}
+	}
+}
+
 /** Setup a model to draw at a specific time.
 
     @param modelFilename Name of model file to update.
@@ -3406,81 +6617,169 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 */
 void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time)
 {
+	/* Every kuhl_geometry in a model shares one skeleton. Compute
+	 * the transforms in each skeleton only once per call. Only the
+	 * model itself is modified, so different models can be updated
+	 * on different threads (see jobs.h). */
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+		if(g->skeleton)
+			g->skeleton->updated = 0;
+
 	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
 	{
 		/* The aiScene object that this kuhl_geometry refers to. */
 		struct aiScene *scene = g->assimp_scene;
-		/* The aiNode object that this kuhl_geometry refers to. */
-		struct aiNode *node = g->assimp_node;
+		kuhl_skeleton *skel = g->skeleton;
 
 		/* If the geometry contains no animations, isn't associated
 		 * with an ASSIMP scene or node, then there is no need to try
 		 * to animate it. */
-		if(scene == NULL || scene->mNumAnimations == 0 || node == NULL)
+		if(scene == NULL || scene->mNumAnimations == 0 || skel == NULL || g->skeleton_node < 0)
 			continue;
 
-		/* If there are no bones, or if a negative time value was
-		 * provided, update g->matrix. If there are bones, we assume
-		 * that the bones will drive the animation. */
-		if(g->bones == NULL )
-		{
-			/* Start at our current node and traverse up. Apply all of the
-			 * transformation matrices as we traverse up.
-			 *
-			 * TODO: By repeatedly traversing up, we repeatedly
-			 * recalculate the transformation matrices for the nodes
-			 * near the root---potentially reducing performance.
-			 */
-			mat4f_identity(g->matrix);
-			do
-			{
-				float transform[16];
-				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->matrix, transform, g->matrix);
-				node = node->mParent;
-			} while(node != NULL);
+		if(!skel->updated)
+		{
+			kuhl_private_skeleton_update(skel, scene, animationNum, time);
+			skel->updated = 1;
 		}
 
-		/* Don't process bones if there aren't any. */
+		/* If there are no bones, update g->matrix. If there are
+		 * bones, we assume that the bones will drive the
+		 * animation. */
 		if(g->bones == NULL)
+		{
+			mat4f_copy(g->matrix, skel->world + 16*g->skeleton_node);
 			continue;
+		}
 
 		/* Update the list of bone matrices. */
 		for(int b=0; b < g->bones->count; b++) // For each bone
 		{
-			// Find the bone node and the bone itself.
-			const struct aiNode *node = kuhl_assimp_find_node(g->bones->boneList[b]->mName.data, scene->mRootNode);
-			if(node == NULL)
+			/* Apply the bone offset to the transform of the bone's node. */
+			float offset[16];
+			mat4f_from_aiMatrix4x4(offset, g->bones->boneList[b]->mOffsetMatrix);
+			mat4f_mult_mat4f_new(g->bones->matrices[b], skel->world + 16*g->bones->node[b], offset);
+		} // end for each bone
+
+		/* Dual quaternions are half the size of the matrices. */
+		if(g->bones->palette_type == KUHL_BONES_DUALQUAT)
+		{
+			for(int b=0; b < g->bones->count; b++)
 			{
-				msg(MSG_FATAL, "Failed to find node that corresponded to bone: %s\n", g->bones->boneList[b]->mName.data);
-				exit(EXIT_FAILURE);
+				kuhl_private_check_rigid(skel, g->bones->matrices[b]);
+				dualquatf_from_mat4f(g->bones->dualquats[b], g->bones->matrices[b]);
 			}
-			const struct aiBone *bone = g->bones->boneList[b];
-
-
-			/* Start at our current node and traverse up. Apply all of the
-			 * transformation matrices as we traverse up.
-			 *
-			 * TODO: By repeatedly traversing up, we repeatedly
-			 * recalculate the transformation matrices for the nodes
-			 * near the root---potentially reducing performance.
-			 */
-			mat4f_identity(g->bones->matrices[b]);
-			do
-			{
-				float transform[16];
-				kuhl_private_node_matrix(transform, scene, node, animationNum, time);
-				mat4f_mult_mat4f_new(g->bones->matrices[b], transform, g->bones->matrices[b]);
-				node = node->mParent; // move to next node up
-			} while(node != NULL);
+		}
+		/* kuhl_geometry_draw() copies the bones into the palette the
+		 * next time the geometry is drawn. */
+		g->bones->dirty = 1;
+	} // end for each geometry
+}
 
-			/* Also apply the bone offset */
-			float offset[16];
-			mat4f_from_aiMatrix4x4(offset, bone->mOffsetMatrix);
-			mat4f_mult_mat4f_new(g->bones->matrices[b], g->bones->matrices[b], offset);
+/** Samples an animation at a fixed rate and stores the bone matrices
+    for every frame in a floating point texture for each mesh in the
+    model. GLSL programs which have a "BoneFrames" sampler (such as
+    assimp-baked.vert) can then animate the model without calling
+    kuhl_update_model() every frame. Combined with
+    kuhl_geometry_instances_anim(), hundreds of copies of a character
+    can each play the animation from a different point with no
+    animation work on the CPU.
 
-		} // end for each bone
-	} // end for each geometry
+    Each row of the texture is one frame and each bone uses four RGBA
+    texels (the columns of its matrix). kuhl_geometry_draw() binds the
+    texture to KUHL_BONE_TEXTURE_UNIT and sets the "BoneFrameRate"
+    uniform to fps.
+
+    @param first_geom The model returned by kuhl_load_model().
+
+    @param animationNum The animation to bake. If the file only
+    contains one animation, set it to 0.
+
+    @param fps The number of frames per second to sample the animation at.
+
+    @return The number of frames baked or 0 if the model has no
+    animation or the animation couldn't be baked.
+*/
+int kuhl_bake_model(kuhl_geometry *first_geom, unsigned int animationNum, float fps)
+{
+	const struct aiScene *scene = NULL;
+	for(kuhl_geometry *g = first_geom; g != NULL && scene == NULL; g=g->next)
+		if(g->skeleton)
+			scene = g->assimp_scene;
+	if(scene == NULL || animationNum >= scene->mNumAnimations)
+	{
+		msg(MSG_WARNING, "Unable to bake animation %u because the model doesn't contain it.", animationNum);
+		return 0;
+	}
+	const struct aiAnimation *anim = scene->mAnimations[animationNum];
+	if(anim->mTicksPerSecond <= 0 || fps <= 0)
+	{
+		msg(MSG_WARNING, "Unable to bake animation %u at %f frames per second (%f ticks per second).",
+		    animationNum, fps, anim->mTicksPerSecond);
+		return 0;
+	}
+
+	/* The frame at the very end is left out because it is the same
+	 * as the first frame when the animation loops. */
+	double duration = anim->mDuration / anim->mTicksPerSecond;
+	int frames = (int) ceil(duration * fps);
+	if(frames < 1)
+		frames = 1;
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	if(frames > maxSize || MAX_BONES*4 > maxSize)
+	{
+		msg(MSG_WARNING, "Unable to bake %d frames into a texture (max texture size is %d).", frames, maxSize);
+		return 0;
+	}
+
+	/* Collect the matrices for every mesh with bones. */
+	int meshes = 0;
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+		if(g->bones)
+			meshes++;
+	float **data = (float**) kuhl_malloc(sizeof(float*)*meshes);
+	int m = 0;
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+		if(g->bones)
+			data[m++] = (float*) kuhl_malloc(sizeof(float)*16*g->bones->count*frames);
+
+	for(int f=0; f<frames; f++)
+	{
+		kuhl_update_model(first_geom, animationNum, f/fps);
+		m = 0;
+		for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+		{
+			if(g->bones == NULL)
+				continue;
+			memcpy(data[m] + 16*g->bones->count*f, g->bones->matrices[0], sizeof(float)*16*g->bones->count);
+			m++;
+		}
+	}
+
+	m = 0;
+	for(kuhl_geometry *g = first_geom; g != NULL; g=g->next)
+	{
+		if(g->bones == NULL)
+			continue;
+		if(g->bones->baked == 0)
+			glGenTextures(1, &g->bones->baked);
+		glBindTexture(GL_TEXTURE_2D, g->bones->baked);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, g->bones->count*4, frames, 0, GL_RGBA, GL_FLOAT, data[m]);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		kuhl_errorcheck();
+		g->bones->baked_fps = fps;
+		free(data[m]);
+		m++;
+	}
+	free(data);
+
+	msg(MSG_INFO, "Baked animation %u: %d frames at %g fps for %d meshes.", animationNum, frames, fps, meshes);
+	return frames;
 }
 
 /** Loads a model without drawing it.
@@ -3522,10 +6821,19 @@ kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDir
 	                                             program, transform,
 	                                             newModelFilename, textureDirname);
 
+	/* Flatten the node hierarchy once so that kuhl_update_model()
+	 * doesn't need to search it for every bone each frame. */
+	kuhl_private_skeleton_attach(ret, scene);
+
 	/* Ensure model shows up in bind pose if the caller doesn't
 	 * also call kuhl_update_model(). */
 	kuhl_update_model(ret, 0, -1);
 
+	/* Optionally share buffers between the meshes in the model so
+	 * that they can be drawn with fewer draw calls. */
+	if(kuhl_config_boolean("model.merge", 0, 0))
+		kuhl_geometry_merge(ret);
+
 	/* Calculate bounding box information for the model */
 	float bboxLocal[6];
 	kuhl_private_calc_bbox(scene->mRootNode, NULL, scene, bboxLocal);
@@ -70,8 +70,25 @@ extern "C" {
 
 /** Maximum number of bones that can be sent to GLSL program */
 #define MAX_BONES 128
+/** Uniform buffer binding point for bone matrices. GLSL programs
+ * that declare a "BonePalette" uniform block (see samples/assimp.vert)
+ * read the bone matrices from a buffer bound here instead of from a
+ * BoneMat uniform array. */
+#define KUHL_BONE_BINDING 0
+/** Bone palette contains a 4x4 matrix per bone ("BonePalette" uniform block) */
+#define KUHL_BONES_MATRIX 1
+/** Bone palette contains a dual quaternion per bone ("BoneDualQuats" uniform block, see samples/assimp-dq.vert) */
+#define KUHL_BONES_DUALQUAT 2
+/** Texture unit that kuhl_geometry_draw() binds the texture created
+ * by kuhl_bake_model() to. The units before it are used by the
+ * textures in kuhl_geometry. */
+#define KUHL_BONE_TEXTURE_UNIT MAX_TEXTURES
 #define MAX_ATTRIBUTES 16
 #define MAX_TEXTURES 8
+/** Maximum number of levels of detail in a kuhl_geometry (including the full resolution mesh) */
+#define MAX_LODS 4
+/** Number of viewports which keep their own occlusion queries (see kuhl_occlusion_viewport()) */
+#define KUHL_OCCLUSION_VIEWPORTS 4
 	
 #if KUHL_UTIL_USE_ASSIMP
 typedef struct
@@ -79,8 +96,45 @@ typedef struct
 	int count; /**< Number of bones in this struct */
 	unsigned int mesh; /**< The bones in this struct are associated with this matrix index */
 	const struct aiBone *boneList[MAX_BONES];
+	int node[MAX_BONES]; /**< Index of the node for each bone in the kuhl_skeleton */
 	float matrices[MAX_BONES][16]; /**< Transformation matrices for each bone */
+	float dualquats[MAX_BONES][8]; /**< Dual quaternion for each bone (only if palette_type is KUHL_BONES_DUALQUAT) */
+	GLuint palette; /**< Uniform buffer containing the matrices or dual quaternions (0 if uniform buffers aren't supported) */
+	int palette_type; /**< KUHL_BONES_MATRIX or KUHL_BONES_DUALQUAT */
+	int dirty; /**< Set when the bones have changed since they were copied into palette */
+	GLuint baked; /**< Texture containing the bone matrices for every frame of an animation (0 if kuhl_bake_model() wasn't called) */
+	float baked_fps; /**< Frames per second that baked was sampled at */
 } kuhl_bonemat;
+
+/** The animation of one node in one animation. The keys used last
+ * time are remembered so that playing the animation forward rarely
+ * needs to search for keys. If model.resample is set, the keys are
+ * also resampled at a fixed rate when the model is loaded so that
+ * the samples can be found without searching. */
+typedef struct
+{
+	const struct aiNodeAnim *channel; /**< Animation channel of the node (NULL if the node isn't animated) */
+	unsigned int cursor[3]; /**< Position, rotation and scaling key used last time */
+	unsigned int frames; /**< Number of resampled frames (0 if the channel isn't resampled) */
+	double start; /**< Time in ticks of the first resampled frame */
+	double step; /**< Time in ticks between resampled frames */
+	float *samples; /**< Resampled position (xyz), rotation (xyzw) and scaling (xyz), stored as 10 arrays of frames floats */
+} kuhl_anim_track;
+
+/** A flattened copy of the node hierarchy in a model. It is created
+ * by kuhl_load_model() and shared by every kuhl_geometry in the
+ * model so that kuhl_update_model() can compute the transform of
+ * each node once per call in a single pass. */
+typedef struct
+{
+	unsigned int count; /**< Number of nodes */
+	const struct aiNode **nodes; /**< Every node in the scene, ordered so that parents come before their children */
+	int *parent; /**< Index of the parent of each node (-1 for the root) */
+	kuhl_anim_track *tracks; /**< Animation of each node in each animation (count entries per animation) */
+	float *world; /**< Transform of each node relative to the root (16 floats per node) */
+	int updated; /**< Set once the current kuhl_update_model() call has computed world */
+	int warned_scale; /**< Has kuhl_update_model() warned that a bone is scaled (see model.dualquat)? */
+} kuhl_skeleton;
 #endif
 
 /** This enum is used by some kuhl_geometry related functions */
@@ -97,8 +151,26 @@ typedef struct
 {
 	char*    name; /**< GLSL variable name the attribute information should be linked with. */
 	GLuint   bufferobject; /**< OpenGL buffer the attribute is stored in */
+	GLboolean mapped; /**< Set when kuhl_geometry_attrib_get() maps the buffer; cleared when kuhl_geometry_draw() or kuhl_geometry_attrib_unmap() unmaps it. */
+	GLuint   components; /**< Number of components per vertex in this attribute */
+	GLenum   type; /**< Type of each component in the buffer (GL_FLOAT, GL_HALF_FLOAT, GL_UNSIGNED_BYTE, etc.) */
+	GLboolean normalized; /**< Are integer components normalized to [0,1] or [-1,1]? */
+	GLsizei  stride; /**< Bytes between consecutive vertices in the buffer (0 if tightly packed) */
+	GLsizei  offset; /**< Byte offset of the first element of this attribute in the buffer */
+	GLboolean external; /**< Buffer is owned by the caller (see kuhl_geometry_attrib_buffer()) and is not deleted with the geometry */
 } kuhl_attrib;
 
+/** Describes one vertex attribute inside of an interleaved vertex
+ * buffer. An array of these structs is passed to
+ * kuhl_geometry_attrib_interleaved(). */
+typedef struct
+{
+	const char* name; /**< GLSL variable name of the attribute. */
+	GLuint components; /**< Number of components per vertex in this attribute. */
+	GLenum type; /**< Type of each component; 0 means GL_FLOAT. */
+	GLboolean normalized; /**< Normalize integer components? */
+} kuhl_vertex_layout;
+
 /** There is an array of kuhl_texture structs inside of
  * kuhl_geometry. */
 typedef struct
@@ -128,14 +200,37 @@ typedef struct _kuhl_geometry_
 
 	GLuint indices_len; /**< How many indices are there? - Set by kuhl_geometry_indices(). */
 	GLuint indices_bufferobject; /**< ID of buffer holding indices. - Set by kuhl_geometry_indices(). */
+	GLenum indices_type; /**< GL_UNSIGNED_SHORT or GL_UNSIGNED_INT - Set by kuhl_geometry_indices(). */
+
+	GLuint instance_count; /**< Number of instances to draw (0 if not instanced) - Set by kuhl_geometry_instances(). */
+	GLuint instance_bufferobject; /**< ID of buffer holding per-instance data - Set by kuhl_geometry_instances(). */
+
+	GLint base_vertex; /**< Added to each index before fetching a vertex - Set by kuhl_geometry_merge(). */
+	GLuint first_index; /**< Position of the first index in the index buffer - Set by kuhl_geometry_merge(). */
+	GLuint merged; /**< Nonzero if the buffers and VAO are shared with other geometry - Set by kuhl_geometry_merge(). */
+
+	GLuint lod_count; /**< Number of levels of detail, including the full mesh (0 if there are none) - Set by kuhl_geometry_lod(). */
+	GLuint lod; /**< Level of detail to draw (0 is the full mesh) - Set by kuhl_geometry_lod_select(). */
+	GLuint lod_first[MAX_LODS]; /**< Position of the first index of each level relative to first_index - Set by kuhl_geometry_lod(). */
+	GLuint lod_len[MAX_LODS]; /**< Number of indices in each level - Set by kuhl_geometry_lod(). */
+	float lod_error[MAX_LODS]; /**< Approximate distance between the surface of each level and the full mesh (a root mean square distance, see simplify_mesh()) - Set by kuhl_geometry_lod(). */
 
 	float matrix[16]; /**< A matrix that all of this geometry should be transformed by. Appears in GLSL as GeomTransform. */
+	float aabbox[6]; /**< Axis-aligned bounding box of in_Position (xmin, xmax, ymin, ymax, zmin, zmax) before matrix is applied - Set by kuhl_geometry_attrib(). */
+	float bsphere[4]; /**< Bounding sphere of in_Position (x, y, z, radius) before matrix is applied - Set by kuhl_geometry_attrib(). */
+	int has_bounds; /**< Are aabbox and bsphere valid? Geometry without bounds is never culled. */
 	int has_been_drawn; /**< Has this piece of geometry been drawn yet? */
+
+	GLuint occlusion_query[KUHL_OCCLUSION_VIEWPORTS]; /**< Occlusion query object for each viewport or 0 - Created when drawn with kuhl.occlusion enabled. */
+	int occlusion_pending[KUHL_OCCLUSION_VIEWPORTS]; /**< Is the result of occlusion_query still unread? */
+	int occluded[KUHL_OCCLUSION_VIEWPORTS]; /**< Did the most recent occlusion query in each viewport find that no part of this geometry was visible? */
 	
 #if KUHL_UTIL_USE_ASSIMP
 	struct aiNode *assimp_node; /**< Assimp node that this kuhl_geometry object was created from. */
 	struct aiScene *assimp_scene; /**< Assimp scene that this kuhl_geometry object is a part of. */
 	kuhl_bonemat *bones; /**< Information about bones in the model */
+	kuhl_skeleton *skeleton; /**< Node hierarchy of the model, shared with the other geometry in the model (NULL if the model isn't animated) */
+	int skeleton_node; /**< Index of assimp_node in the skeleton */
 #endif
 
 	struct _kuhl_geometry_ *next; /**< A kuhl_geometry object can be a linked list. */
@@ -169,6 +264,8 @@ int kuhl_errorcheckFileLine(const char *file, int line, const char *func);
 void* kuhl_mallocFileLine(size_t size, const char *file, int line);
 
 GLFWwindow* kuhl_get_window();
+int kuhl_headless(void);
+GLuint kuhl_default_framebuffer(void);
 void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfile, int msaaSamples);
 
 GLuint kuhl_create_shader(const char *filename, GLuint shader_type);
@@ -177,27 +274,66 @@ void kuhl_delete_program(GLuint program);
 void kuhl_print_program_log(GLuint program);
 void kuhl_print_program_info(GLuint program);
 GLint kuhl_get_uniform(const char *uniformName);
+GLint kuhl_get_uniform_program(GLuint program, const char *uniformName);
 GLint kuhl_get_attribute(GLuint program, const char *attributeName);
 
 
 
 void kuhl_bbox_transform(float bbox[6], float mat[16]);
+void kuhl_frustum_planes(float planes[6][4], const float modelviewProjection[16]);
+int kuhl_geometry_visible(const kuhl_geometry *geom, const float modelview[16], const float projection[16]);
+void kuhl_geometry_draw_culled(kuhl_geometry *geom, const float modelview[16], const float projection[16]);
+void kuhl_geometry_cull_stats(unsigned int *drawn, unsigned int *culled);
 
-#if 0
 int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
                           kuhl_geometry *geom2, float mat2[16]);
-#endif
+
+/** Tracks the OpenGL state that kuhl_geometry_draw_state() has set
+ * so that redundant state changes can be skipped, and counts the
+ * state changes and draw calls. Initialize it with
+ * kuhl_draw_state_begin(). */
+typedef struct
+{
+	GLuint program; /**< GLSL program currently in use */
+	GLuint vao; /**< VAO currently bound */
+	GLuint textures[MAX_TEXTURES]; /**< Texture bound to each texture unit (0 if unknown) */
+	GLuint previous_program; /**< Program to restore in kuhl_draw_state_end() */
+	GLuint previous_vao; /**< VAO to restore in kuhl_draw_state_end() */
+
+	unsigned int draw_calls; /**< Number of draw calls issued */
+	unsigned int program_changes; /**< Number of glUseProgram() calls */
+	unsigned int vao_changes; /**< Number of glBindVertexArray() calls */
+	unsigned int texture_changes; /**< Number of glBindTexture() calls */
+	unsigned int occlusion_queries; /**< Number of occlusion queries issued (see kuhl_geometry_draw_occlusion()) */
+	unsigned int occluded; /**< Number of objects found to be hidden behind other objects */
+} kuhl_draw_state;
 
 void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type);
 void kuhl_geometry_draw(kuhl_geometry *geom);
+void kuhl_draw_state_begin(kuhl_draw_state *state);
+int kuhl_geometry_draw_state(kuhl_geometry *geom, kuhl_draw_state *state);
+int kuhl_geometry_draw_occlusion(kuhl_geometry *geom, kuhl_draw_state *state, const float modelview[16], const float projection[16]);
+void kuhl_geometry_occlusion_stats(unsigned int *queries, unsigned int *occluded);
+void kuhl_occlusion_viewport(int viewportID);
+void kuhl_draw_state_end(kuhl_draw_state *state);
 void kuhl_geometry_delete(kuhl_geometry *geom);
 unsigned int kuhl_geometry_count(const kuhl_geometry *geom);
 
 void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options);
 GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size);
+void kuhl_geometry_attrib_unmap(kuhl_geometry *geom, const char *name);
 void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount);
+void kuhl_geometry_lod(kuhl_geometry *geom, const GLfloat *positions, GLuint stride, GLuint *indices, GLuint indexCount, unsigned int levels);
+unsigned int kuhl_geometry_lod_select(kuhl_geometry *geom, const float modelview[16], const float projection[16], const int viewport[4], int kg_options);
 void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options);
+void kuhl_geometry_attrib_typed(kuhl_geometry *geom, const void *data, GLuint components, GLenum type, GLboolean normalized, const char* name, int kg_options);
+void kuhl_geometry_attrib_interleaved(kuhl_geometry *geom, const void *data, const kuhl_vertex_layout *layout, unsigned int layout_count, int kg_options);
+void kuhl_geometry_attrib_buffer(kuhl_geometry *geom, GLuint bufferobject, GLintptr offset, GLuint components, GLenum type, GLboolean normalized, const char *name, int kg_options);
+GLint kuhl_geometry_attrib_stride(kuhl_geometry *geom, const char *name);
 void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name, int kg_options);
+void kuhl_geometry_instances(kuhl_geometry *geom, const GLfloat *matrices, const GLfloat *colors, GLuint instanceCount, int kg_options);
+void kuhl_geometry_instances_anim(kuhl_geometry *geom, const GLfloat *matrices, const GLfloat *colors, const GLfloat *anim, GLuint instanceCount, int kg_options);
+void kuhl_geometry_merge(kuhl_geometry *geom);
 
 
 GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height, int components, GLuint wrapS, GLuint wrapT);
@@ -214,6 +350,7 @@ void kuhl_video_record(const char *fileLabel, int fps);
 
 #ifdef KUHL_UTIL_USE_ASSIMP
 void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, float time);
+int kuhl_bake_model(kuhl_geometry *first_geom, unsigned int animationNum, float fps);
 kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDirname, GLuint program, float bbox[6]);
 #endif // end use assimp
 
@@ -13,8 +13,11 @@
 #pragma once
 
 #include "bufferswap.h"
+#include "bvh.h"
+#include "capture.h"
 #include "dgr.h"
 #include "font-helper.h"
+#include "jobs.h"
 #include "kalman.h"
 #include "keyboard.h"
 #include "kuhl-config.h"
@@ -22,11 +25,18 @@
 #include "kuhl-util.h"	
 #include "list.h"
 #include "mousemove.h"
+#include "modelcache.h"
 #include "msg.h"
 #include "orient-sensor.h"
 #include "queue.h"
+#include "renderqueue.h"
 #include "serial.h"
+#include "simplify.h"
+#include "streambuf.h"
 #include "tdl-util.h"
+#include "texcache.h"
+#include "texcompress.h"
+#include "texload.h"
 #include "vecmat.h"
 #include "video.h"
 #include "viewmat.h"
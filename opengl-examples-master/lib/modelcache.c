@@ -0,0 +1,774 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <assimp/scene.h>
+#include <assimp/version.h>
+
+#include "modelcache.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "msg.h"
+
+/** Increase this whenever the layout of the cache file changes. */
+#define MODELCACHE_VERSION 1
+
+/** Appended to the name of the model file to get the name of the cache file. */
+#define MODELCACHE_SUFFIX ".kuhlcache"
+
+/** Arrays in the file start at a multiple of this many bytes so that
+ * the scene can point directly at them. */
+#define MODELCACHE_ALIGN 16
+
+/** Deepest node hierarchy that we will read. */
+#define MODELCACHE_MAX_DEPTH 1000
+
+/** The first bytes in every cache file. */
+typedef struct {
+	char magic[8];        /**< "KUHLMDL" */
+	uint32_t version;     /**< MODELCACHE_VERSION */
+	uint32_t flags;       /**< Post-processing flags that the model was imported with */
+	uint32_t assimp;      /**< Version of ASSIMP that imported the model */
+	uint32_t layout;      /**< Hash of the sizes of the ASSIMP structs in the file */
+	uint64_t sourceSize;  /**< Size of the model file */
+	int64_t sourceMtime;  /**< Modification time of the model file */
+	uint64_t cacheSize;   /**< Size of the cache file */
+} modelcache_header;
+
+/** Keeps track of where we are while writing a cache file. */
+typedef struct {
+	FILE *f;
+	uint64_t offset;
+} modelcache_writer;
+
+/** Keeps track of where we are while reading a cache file. Every
+ * struct that we allocate is recorded so that everything can be
+ * freed if the file turns out to be corrupt. */
+typedef struct {
+	unsigned char *data;
+	size_t size;
+	size_t offset;
+	int error;
+	void **allocs;
+	size_t allocCount, allocSize;
+} modelcache_reader;
+
+
+/** Combines the sizes of the structs which are stored directly in
+ * the file so that a cache written by a differently compiled copy of
+ * ASSIMP is rejected. */
+static uint32_t modelcache_layout(void)
+{
+	const size_t sizes[] = {
+		sizeof(struct aiVector3D), sizeof(struct aiColor4D), sizeof(struct aiMatrix4x4),
+		sizeof(struct aiVertexWeight), sizeof(struct aiVectorKey), sizeof(struct aiQuatKey),
+		sizeof(void*)
+	};
+	uint32_t h = 2166136261u;
+	for(unsigned int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++)
+		h = (h ^ (uint32_t) sizes[i]) * 16777619u;
+	return h;
+}
+
+static uint32_t modelcache_assimp_version(void)
+{
+	return aiGetVersionMajor() << 20 | aiGetVersionMinor() << 10 | aiGetVersionRevision();
+}
+
+/** Returns the name of the cache file for a model (which should be
+ * free()'d). */
+static char* modelcache_path(const char *modelFilename)
+{
+	const char *dir = kuhl_config_get("model.cachedir");
+	if(dir == NULL || dir[0] == '\0')
+	{
+		size_t len = strlen(modelFilename) + strlen(MODELCACHE_SUFFIX) + 1;
+		char *path = kuhl_malloc(len);
+		snprintf(path, len, "%s%s", modelFilename, MODELCACHE_SUFFIX);
+		return path;
+	}
+
+	/* Models with the same name in different directories shouldn't
+	 * share a cache file, so add a hash of the whole path. */
+	uint32_t h = 2166136261u;
+	for(const unsigned char *c = (const unsigned char*) modelFilename; *c; c++)
+		h = (h ^ *c) * 16777619u;
+	const char *base = modelFilename;
+	for(const char *c = modelFilename; *c; c++)
+		if(*c == '/' || *c == '\\')
+			base = c+1;
+	size_t len = strlen(dir) + strlen(base) + strlen(MODELCACHE_SUFFIX) + 16;
+	char *path = kuhl_malloc(len);
+	snprintf(path, len, "%s/%s-%08x%s", dir, base, h, MODELCACHE_SUFFIX);
+	return path;
+}
+
+/** Fills in the header which a cache for the model should have.
+ * Returns -1 if the model file doesn't exist. */
+static int modelcache_expected_header(modelcache_header *header, const char *modelFilename, unsigned int flags)
+{
+	struct stat st;
+	if(stat(modelFilename, &st) != 0)
+		return -1;
+	memset(header, 0, sizeof(modelcache_header));
+	memcpy(header->magic, "KUHLMDL", 8);
+	header->version = MODELCACHE_VERSION;
+	header->flags = flags;
+	header->assimp = modelcache_assimp_version();
+	header->layout = modelcache_layout();
+	header->sourceSize = (uint64_t) st.st_size;
+	header->sourceMtime = (int64_t) st.st_mtime;
+	return 0;
+}
+
+
+static void modelcache_write(modelcache_writer *w, const void *data, size_t bytes)
+{
+	if(bytes > 0)
+		fwrite(data, 1, bytes, w->f);
+	w->offset += bytes;
+}
+
+static void modelcache_write_u32(modelcache_writer *w, uint32_t value)
+{
+	modelcache_write(w, &value, sizeof(value));
+}
+
+static void modelcache_write_double(modelcache_writer *w, double value)
+{
+	modelcache_write(w, &value, sizeof(value));
+}
+
+static void modelcache_write_string(modelcache_writer *w, const struct aiString *s)
+{
+	modelcache_write_u32(w, (uint32_t) s->length);
+	modelcache_write(w, s->data, s->length);
+}
+
+/** Writes an array which the reader will point at directly. */
+static void modelcache_write_array(modelcache_writer *w, const void *data, size_t bytes)
+{
+	static const unsigned char zeros[MODELCACHE_ALIGN] = { 0 };
+	modelcache_write(w, zeros, (MODELCACHE_ALIGN - w->offset % MODELCACHE_ALIGN) % MODELCACHE_ALIGN);
+	modelcache_write(w, data, bytes);
+}
+
+static void modelcache_write_material(modelcache_writer *w, const struct aiMaterial *mat)
+{
+	modelcache_write_u32(w, mat->mNumProperties);
+	for(unsigned int i=0; i<mat->mNumProperties; i++)
+	{
+		const struct aiMaterialProperty *p = mat->mProperties[i];
+		modelcache_write_string(w, &p->mKey);
+		modelcache_write_u32(w, p->mSemantic);
+		modelcache_write_u32(w, p->mIndex);
+		modelcache_write_u32(w, (uint32_t) p->mType);
+		modelcache_write_u32(w, p->mDataLength);
+		modelcache_write_array(w, p->mData, p->mDataLength);
+	}
+}
+
+static void modelcache_write_mesh(modelcache_writer *w, const struct aiMesh *mesh)
+{
+	modelcache_write_string(w, &mesh->mName);
+	modelcache_write_u32(w, mesh->mPrimitiveTypes);
+	modelcache_write_u32(w, mesh->mNumVertices);
+	modelcache_write_u32(w, mesh->mNumFaces);
+	modelcache_write_u32(w, mesh->mMaterialIndex);
+
+	/* Record which of the per-vertex arrays are present. */
+	uint32_t present = 0;
+	if(mesh->mVertices)   present |= 1;
+	if(mesh->mNormals)    present |= 2;
+	if(mesh->mTangents)   present |= 4;
+	if(mesh->mBitangents) present |= 8;
+	for(int i=0; i<AI_MAX_NUMBER_OF_COLOR_SETS && i<8; i++)
+		if(mesh->mColors[i])
+			present |= 1u << (4+i);
+	for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS && i<8; i++)
+		if(mesh->mTextureCoords[i])
+			present |= 1u << (12+i);
+	modelcache_write_u32(w, present);
+
+	size_t n = mesh->mNumVertices;
+	const struct aiVector3D *vectors[4] = { mesh->mVertices, mesh->mNormals, mesh->mTangents, mesh->mBitangents };
+	for(int i=0; i<4; i++)
+		if(vectors[i])
+			modelcache_write_array(w, vectors[i], n*sizeof(struct aiVector3D));
+	for(int i=0; i<AI_MAX_NUMBER_OF_COLOR_SETS && i<8; i++)
+		if(mesh->mColors[i])
+			modelcache_write_array(w, mesh->mColors[i], n*sizeof(struct aiColor4D));
+	for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS && i<8; i++)
+		if(mesh->mTextureCoords[i])
+		{
+			modelcache_write_u32(w, mesh->mNumUVComponents[i]);
+			modelcache_write_array(w, mesh->mTextureCoords[i], n*sizeof(struct aiVector3D));
+		}
+
+	/* The number of indices in each face, then all of the indices. */
+	uint32_t *counts = kuhl_malloc(sizeof(uint32_t)*(mesh->mNumFaces+1));
+	for(unsigned int i=0; i<mesh->mNumFaces; i++)
+		counts[i] = mesh->mFaces[i].mNumIndices;
+	modelcache_write_array(w, counts, sizeof(uint32_t)*mesh->mNumFaces);
+	free(counts);
+	modelcache_write_array(w, NULL, 0);
+	for(unsigned int i=0; i<mesh->mNumFaces; i++)
+		modelcache_write(w, mesh->mFaces[i].mIndices, sizeof(unsigned int)*mesh->mFaces[i].mNumIndices);
+
+	modelcache_write_u32(w, mesh->mNumBones);
+	for(unsigned int i=0; i<mesh->mNumBones; i++)
+	{
+		const struct aiBone *bone = mesh->mBones[i];
+		modelcache_write_string(w, &bone->mName);
+		modelcache_write_array(w, &bone->mOffsetMatrix, sizeof(struct aiMatrix4x4));
+		modelcache_write_u32(w, bone->mNumWeights);
+		modelcache_write_array(w, bone->mWeights, sizeof(struct aiVertexWeight)*bone->mNumWeights);
+	}
+}
+
+static void modelcache_write_animation(modelcache_writer *w, const struct aiAnimation *anim)
+{
+	modelcache_write_string(w, &anim->mName);
+	modelcache_write_double(w, anim->mDuration);
+	modelcache_write_double(w, anim->mTicksPerSecond);
+	modelcache_write_u32(w, anim->mNumChannels);
+	for(unsigned int i=0; i<anim->mNumChannels; i++)
+	{
+		const struct aiNodeAnim *ch = anim->mChannels[i];
+		modelcache_write_string(w, &ch->mNodeName);
+		modelcache_write_u32(w, (uint32_t) ch->mPreState);
+		modelcache_write_u32(w, (uint32_t) ch->mPostState);
+		modelcache_write_u32(w, ch->mNumPositionKeys);
+		modelcache_write_array(w, ch->mPositionKeys, sizeof(struct aiVectorKey)*ch->mNumPositionKeys);
+		modelcache_write_u32(w, ch->mNumRotationKeys);
+		modelcache_write_array(w, ch->mRotationKeys, sizeof(struct aiQuatKey)*ch->mNumRotationKeys);
+		modelcache_write_u32(w, ch->mNumScalingKeys);
+		modelcache_write_array(w, ch->mScalingKeys, sizeof(struct aiVectorKey)*ch->mNumScalingKeys);
+	}
+}
+
+static void modelcache_write_node(modelcache_writer *w, const struct aiNode *node)
+{
+	modelcache_write_string(w, &node->mName);
+	modelcache_write_array(w, &node->mTransformation, sizeof(struct aiMatrix4x4));
+	modelcache_write_u32(w, node->mNumMeshes);
+	modelcache_write_array(w, node->mMeshes, sizeof(unsigned int)*node->mNumMeshes);
+	modelcache_write_u32(w, node->mNumChildren);
+	for(unsigned int i=0; i<node->mNumChildren; i++)
+		modelcache_write_node(w, node->mChildren[i]);
+}
+
+/** Writes a cache file for a model that was just imported by
+    ASSIMP. The file is written under a temporary name and then
+    renamed so that a partially written cache is never read.
+
+    @param modelFilename The model file that was imported.
+
+    @param flags The post-processing flags that were used.
+
+    @param scene The scene returned by ASSIMP.
+
+    @return 0 on success, -1 if the cache couldn't be written (which
+    isn't fatal---the model just won't be cached).
+*/
+int modelcache_save(const char *modelFilename, unsigned int flags, const struct aiScene *scene)
+{
+	if(!kuhl_config_boolean("model.cache", 1, 1) || scene == NULL)
+		return -1;
+
+	modelcache_header header;
+	if(modelcache_expected_header(&header, modelFilename, flags) < 0)
+		return -1;
+
+	char *path = modelcache_path(modelFilename);
+	size_t tmpLen = strlen(path) + 5;
+	char *tmp = kuhl_malloc(tmpLen);
+	snprintf(tmp, tmpLen, "%s.tmp", path);
+
+	modelcache_writer w;
+	w.offset = 0;
+	w.f = fopen(tmp, "wb");
+	if(w.f == NULL)
+	{
+		msg(MSG_WARNING, "Unable to write model cache '%s'. Set model.cachedir to a writable directory.", tmp);
+		free(tmp);
+		free(path);
+		return -1;
+	}
+
+	modelcache_write(&w, &header, sizeof(header));
+	modelcache_write_u32(&w, scene->mFlags);
+	modelcache_write_u32(&w, scene->mNumMaterials);
+	for(unsigned int i=0; i<scene->mNumMaterials; i++)
+		modelcache_write_material(&w, scene->mMaterials[i]);
+	modelcache_write_u32(&w, scene->mNumMeshes);
+	for(unsigned int i=0; i<scene->mNumMeshes; i++)
+		modelcache_write_mesh(&w, scene->mMeshes[i]);
+	modelcache_write_u32(&w, scene->mNumAnimations);
+	for(unsigned int i=0; i<scene->mNumAnimations; i++)
+	{
+		if(scene->mAnimations[i]->mNumMeshChannels > 0)
+			msg(MSG_DEBUG, "%s: Mesh animation channels are not stored in the model cache.", modelFilename);
+		modelcache_write_animation(&w, scene->mAnimations[i]);
+	}
+	modelcache_write_node(&w, scene->mRootNode);
+
+	/* Now that we know the size, write the header again. */
+	header.cacheSize = w.offset;
+	fseek(w.f, 0, SEEK_SET);
+	fwrite(&header, 1, sizeof(header), w.f);
+	int err = ferror(w.f);
+	if(fclose(w.f) != 0 || err)
+	{
+		msg(MSG_WARNING, "Failed to write model cache '%s'.", tmp);
+		remove(tmp);
+		free(tmp);
+		free(path);
+		return -1;
+	}
+
+	remove(path); // rename() won't replace an existing file on Windows
+	if(rename(tmp, path) != 0)
+	{
+		msg(MSG_WARNING, "Unable to rename '%s' to '%s'.", tmp, path);
+		remove(tmp);
+		free(tmp);
+		free(path);
+		return -1;
+	}
+	msg(MSG_INFO, "Wrote model cache '%s' (%.1f MiB)", path, w.offset/(1024.0*1024.0));
+	free(tmp);
+	free(path);
+	return 0;
+}
+
+
+/** Allocates zeroed memory for part of the scene and remembers it in
+ * case the file is corrupt. */
+static void* modelcache_alloc(modelcache_reader *r, size_t bytes)
+{
+	if(r->allocCount == r->allocSize)
+	{
+		r->allocSize = r->allocSize == 0 ? 256 : r->allocSize*2;
+		r->allocs = realloc(r->allocs, sizeof(void*)*r->allocSize);
+	}
+	void *ptr = calloc(1, bytes > 0 ? bytes : 1);
+	r->allocs[r->allocCount++] = ptr;
+	return ptr;
+}
+
+/** Returns a pointer to the next bytes in the file or NULL (and sets
+ * r->error) if the file isn't that long. */
+static unsigned char* modelcache_take(modelcache_reader *r, size_t bytes)
+{
+	if(r->error || bytes > r->size - r->offset)
+	{
+		r->error = 1;
+		return NULL;
+	}
+	unsigned char *ptr = r->data + r->offset;
+	r->offset += bytes;
+	return ptr;
+}
+
+static uint32_t modelcache_read_u32(modelcache_reader *r)
+{
+	uint32_t value = 0;
+	unsigned char *ptr = modelcache_take(r, sizeof(value));
+	if(ptr)
+		memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static double modelcache_read_double(modelcache_reader *r)
+{
+	double value = 0;
+	unsigned char *ptr = modelcache_take(r, sizeof(value));
+	if(ptr)
+		memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static void modelcache_read_string(modelcache_reader *r, struct aiString *s)
+{
+	uint32_t length = modelcache_read_u32(r);
+	if(length >= MAXLEN)
+	{
+		r->error = 1;
+		return;
+	}
+	unsigned char *ptr = modelcache_take(r, length);
+	if(ptr == NULL)
+		return;
+	memcpy(s->data, ptr, length);
+	s->data[length] = '\0';
+	s->length = length;
+}
+
+/** Returns a pointer to an array in the file (or NULL if count is 0
+ * or the file is too short). */
+static void* modelcache_read_array(modelcache_reader *r, size_t count, size_t size)
+{
+	size_t pad = (MODELCACHE_ALIGN - r->offset % MODELCACHE_ALIGN) % MODELCACHE_ALIGN;
+	if(modelcache_take(r, pad) == NULL)
+		return NULL;
+	if(count > (r->size - r->offset) / size)
+	{
+		r->error = 1;
+		return NULL;
+	}
+	unsigned char *ptr = modelcache_take(r, count*size);
+	return count > 0 ? ptr : NULL;
+}
+
+static struct aiMaterial* modelcache_read_material(modelcache_reader *r)
+{
+	struct aiMaterial *mat = modelcache_alloc(r, sizeof(struct aiMaterial));
+	mat->mNumProperties = modelcache_read_u32(r);
+	if(mat->mNumProperties > r->size)
+	{
+		r->error = 1;
+		return mat;
+	}
+	mat->mNumAllocated = mat->mNumProperties;
+	mat->mProperties = modelcache_alloc(r, sizeof(struct aiMaterialProperty*)*mat->mNumProperties);
+	for(unsigned int i=0; i<mat->mNumProperties && !r->error; i++)
+	{
+		struct aiMaterialProperty *p = modelcache_alloc(r, sizeof(struct aiMaterialProperty));
+		mat->mProperties[i] = p;
+		modelcache_read_string(r, &p->mKey);
+		p->mSemantic = modelcache_read_u32(r);
+		p->mIndex = modelcache_read_u32(r);
+		p->mType = (enum aiPropertyTypeInfo) modelcache_read_u32(r);
+		p->mDataLength = modelcache_read_u32(r);
+		p->mData = modelcache_read_array(r, p->mDataLength, 1);
+	}
+	return mat;
+}
+
+static struct aiMesh* modelcache_read_mesh(modelcache_reader *r, unsigned int numMaterials)
+{
+	struct aiMesh *mesh = modelcache_alloc(r, sizeof(struct aiMesh));
+	modelcache_read_string(r, &mesh->mName);
+	mesh->mPrimitiveTypes = modelcache_read_u32(r);
+	mesh->mNumVertices = modelcache_read_u32(r);
+	mesh->mNumFaces = modelcache_read_u32(r);
+	mesh->mMaterialIndex = modelcache_read_u32(r);
+	if(mesh->mMaterialIndex >= numMaterials)
+		r->error = 1;
+
+	uint32_t present = modelcache_read_u32(r);
+	size_t n = mesh->mNumVertices;
+	struct aiVector3D **vectors[4] = { &mesh->mVertices, &mesh->mNormals, &mesh->mTangents, &mesh->mBitangents };
+	for(int i=0; i<4; i++)
+		if(present & (1u << i))
+			*vectors[i] = modelcache_read_array(r, n, sizeof(struct aiVector3D));
+	for(int i=0; i<AI_MAX_NUMBER_OF_COLOR_SETS && i<8; i++)
+		if(present & (1u << (4+i)))
+			mesh->mColors[i] = modelcache_read_array(r, n, sizeof(struct aiColor4D));
+	for(int i=0; i<AI_MAX_NUMBER_OF_TEXTURECOORDS && i<8; i++)
+		if(present & (1u << (12+i)))
+		{
+			mesh->mNumUVComponents[i] = modelcache_read_u32(r);
+			mesh->mTextureCoords[i] = modelcache_read_array(r, n, sizeof(struct aiVector3D));
+		}
+	if(r->error)
+		return mesh;
+
+	/* Point each face at its indices in the file. */
+	uint32_t *counts = modelcache_read_array(r, mesh->mNumFaces, sizeof(uint32_t));
+	uint64_t total = 0;
+	for(unsigned int i=0; i<mesh->mNumFaces && counts; i++)
+		total += counts[i];
+	if(total > r->size)
+		r->error = 1;
+	unsigned int *indices = modelcache_read_array(r, (size_t) total, sizeof(unsigned int));
+	if(r->error)
+		return mesh;
+	for(uint64_t i=0; i<total; i++)
+		if(indices[i] >= mesh->mNumVertices)
+		{
+			r->error = 1;
+			return mesh;
+		}
+	mesh->mFaces = modelcache_alloc(r, sizeof(struct aiFace)*mesh->mNumFaces);
+	for(unsigned int i=0; i<mesh->mNumFaces; i++)
+	{
+		mesh->mFaces[i].mNumIndices = counts[i];
+		mesh->mFaces[i].mIndices = indices;
+		indices += counts[i];
+	}
+
+	mesh->mNumBones = modelcache_read_u32(r);
+	if(mesh->mNumBones > r->size)
+	{
+		r->error = 1;
+		return mesh;
+	}
+	if(mesh->mNumBones > 0)
+		mesh->mBones = modelcache_alloc(r, sizeof(struct aiBone*)*mesh->mNumBones);
+	for(unsigned int i=0; i<mesh->mNumBones && !r->error; i++)
+	{
+		struct aiBone *bone = modelcache_alloc(r, sizeof(struct aiBone));
+		mesh->mBones[i] = bone;
+		modelcache_read_string(r, &bone->mName);
+		struct aiMatrix4x4 *offset = modelcache_read_array(r, 1, sizeof(struct aiMatrix4x4));
+		if(offset)
+			bone->mOffsetMatrix = *offset;
+		bone->mNumWeights = modelcache_read_u32(r);
+		bone->mWeights = modelcache_read_array(r, bone->mNumWeights, sizeof(struct aiVertexWeight));
+		for(unsigned int j=0; j<bone->mNumWeights && !r->error; j++)
+			if(bone->mWeights[j].mVertexId >= mesh->mNumVertices)
+				r->error = 1;
+	}
+	return mesh;
+}
+
+static struct aiAnimation* modelcache_read_animation(modelcache_reader *r)
+{
+	struct aiAnimation *anim = modelcache_alloc(r, sizeof(struct aiAnimation));
+	modelcache_read_string(r, &anim->mName);
+	anim->mDuration = modelcache_read_double(r);
+	anim->mTicksPerSecond = modelcache_read_double(r);
+	anim->mNumChannels = modelcache_read_u32(r);
+	if(anim->mNumChannels > r->size)
+	{
+		r->error = 1;
+		return anim;
+	}
+	if(anim->mNumChannels > 0)
+		anim->mChannels = modelcache_alloc(r, sizeof(struct aiNodeAnim*)*anim->mNumChannels);
+	for(unsigned int i=0; i<anim->mNumChannels && !r->error; i++)
+	{
+		struct aiNodeAnim *ch = modelcache_alloc(r, sizeof(struct aiNodeAnim));
+		anim->mChannels[i] = ch;
+		modelcache_read_string(r, &ch->mNodeName);
+		ch->mPreState = (enum aiAnimBehaviour) modelcache_read_u32(r);
+		ch->mPostState = (enum aiAnimBehaviour) modelcache_read_u32(r);
+		ch->mNumPositionKeys = modelcache_read_u32(r);
+		ch->mPositionKeys = modelcache_read_array(r, ch->mNumPositionKeys, sizeof(struct aiVectorKey));
+		ch->mNumRotationKeys = modelcache_read_u32(r);
+		ch->mRotationKeys = modelcache_read_array(r, ch->mNumRotationKeys, sizeof(struct aiQuatKey));
+		ch->mNumScalingKeys = modelcache_read_u32(r);
+		ch->mScalingKeys = modelcache_read_array(r, ch->mNumScalingKeys, sizeof(struct aiVectorKey));
+	}
+	return anim;
+}
+
+static struct aiNode* modelcache_read_node(modelcache_reader *r, struct aiNode *parent, unsigned int numMeshes, int depth)
+{
+	struct aiNode *node = modelcache_alloc(r, sizeof(struct aiNode));
+	node->mParent = parent;
+	if(depth > MODELCACHE_MAX_DEPTH)
+	{
+		r->error = 1;
+		return node;
+	}
+	modelcache_read_string(r, &node->mName);
+	struct aiMatrix4x4 *transform = modelcache_read_array(r, 1, sizeof(struct aiMatrix4x4));
+	if(transform)
+		node->mTransformation = *transform;
+	node->mNumMeshes = modelcache_read_u32(r);
+	node->mMeshes = modelcache_read_array(r, node->mNumMeshes, sizeof(unsigned int));
+	for(unsigned int i=0; i<node->mNumMeshes && !r->error; i++)
+		if(node->mMeshes[i] >= numMeshes)
+			r->error = 1;
+	node->mNumChildren = modelcache_read_u32(r);
+	if(r->error || node->mNumChildren > r->size)
+	{
+		r->error = 1;
+		return node;
+	}
+	if(node->mNumChildren > 0)
+		node->mChildren = modelcache_alloc(r, sizeof(struct aiNode*)*node->mNumChildren);
+	for(unsigned int i=0; i<node->mNumChildren && !r->error; i++)
+		node->mChildren[i] = modelcache_read_node(r, node, numMeshes, depth+1);
+	return node;
+}
+
+/** Builds an aiScene from a cache file which has already been
+ * checked to have the right header. Returns NULL if the file is
+ * corrupt. */
+static struct aiScene* modelcache_read_scene(unsigned char *data, size_t size)
+{
+	modelcache_reader r;
+	memset(&r, 0, sizeof(r));
+	r.data = data;
+	r.size = size;
+	r.offset = sizeof(modelcache_header);
+
+	struct aiScene *scene = modelcache_alloc(&r, sizeof(struct aiScene));
+	scene->mFlags = modelcache_read_u32(&r);
+
+	/* Every count is checked against the size of the file so that a
+	 * corrupt count can't make us allocate a huge amount of memory. */
+	scene->mNumMaterials = modelcache_read_u32(&r);
+	if(scene->mNumMaterials > size)
+		r.error = 1;
+	else if(scene->mNumMaterials > 0)
+		scene->mMaterials = modelcache_alloc(&r, sizeof(struct aiMaterial*)*scene->mNumMaterials);
+	for(unsigned int i=0; i<scene->mNumMaterials && !r.error; i++)
+		scene->mMaterials[i] = modelcache_read_material(&r);
+
+	scene->mNumMeshes = modelcache_read_u32(&r);
+	if(scene->mNumMeshes > size)
+		r.error = 1;
+	else if(scene->mNumMeshes > 0)
+		scene->mMeshes = modelcache_alloc(&r, sizeof(struct aiMesh*)*scene->mNumMeshes);
+	for(unsigned int i=0; i<scene->mNumMeshes && !r.error; i++)
+		scene->mMeshes[i] = modelcache_read_mesh(&r, scene->mNumMaterials);
+
+	scene->mNumAnimations = modelcache_read_u32(&r);
+	if(scene->mNumAnimations > size)
+		r.error = 1;
+	else if(scene->mNumAnimations > 0)
+		scene->mAnimations = modelcache_alloc(&r, sizeof(struct aiAnimation*)*scene->mNumAnimations);
+	for(unsigned int i=0; i<scene->mNumAnimations && !r.error; i++)
+		scene->mAnimations[i] = modelcache_read_animation(&r);
+
+	if(!r.error)
+		scene->mRootNode = modelcache_read_node(&r, NULL, scene->mNumMeshes, 0);
+
+	if(r.error || r.offset != size)
+	{
+		for(size_t i=0; i<r.allocCount; i++)
+			free(r.allocs[i]);
+		scene = NULL;
+	}
+	free(r.allocs);
+	return scene;
+}
+
+/** Maps a cache file into memory. Returns NULL if the file can't be
+ * opened. On machines without mmap(), the file is read instead. */
+static unsigned char* modelcache_map(const char *path, size_t *size)
+{
+#ifndef _WIN32
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(modelcache_header))
+	{
+		close(fd);
+		return NULL;
+	}
+	/* Private and writable so that the scene's arrays can be
+	 * modified like the arrays in a scene from ASSIMP (changes are
+	 * never written back to the file). */
+	void *data = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return data;
+#else
+	FILE *f = fopen(path, "rb");
+	if(f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if(len < (long) sizeof(modelcache_header))
+	{
+		fclose(f);
+		return NULL;
+	}
+	unsigned char *data = kuhl_malloc(len);
+	size_t got = fread(data, 1, len, f);
+	fclose(f);
+	if(got != (size_t) len)
+	{
+		free(data);
+		return NULL;
+	}
+	*size = len;
+	return data;
+#endif
+}
+
+static void modelcache_unmap(unsigned char *data, size_t size)
+{
+#ifndef _WIN32
+	munmap(data, size);
+#else
+	free(data);
+#endif
+}
+
+/** Loads a model from its cache file, if there is an up to date
+    cache for it.
+
+    @param modelFilename The model file.
+
+    @param flags The post-processing flags that the model would be
+    imported with. A cache written with different flags is ignored.
+
+    @return The scene or NULL if there isn't an up to date cache (or
+    caching is turned off). The scene (and the memory mapped file) is
+    never freed.
+*/
+const struct aiScene* modelcache_load(const char *modelFilename, unsigned int flags)
+{
+	if(!kuhl_config_boolean("model.cache", 1, 1))
+		return NULL;
+
+	modelcache_header expected;
+	if(modelcache_expected_header(&expected, modelFilename, flags) < 0)
+		return NULL;
+
+	char *path = modelcache_path(modelFilename);
+	size_t size = 0;
+	unsigned char *data = modelcache_map(path, &size);
+	if(data == NULL)
+	{
+		msg(MSG_DEBUG, "%s: No model cache at '%s'.", modelFilename, path);
+		free(path);
+		return NULL;
+	}
+
+	modelcache_header header;
+	memcpy(&header, data, sizeof(header));
+	expected.cacheSize = size;
+	if(memcmp(&header, &expected, sizeof(header)) != 0)
+	{
+		msg(MSG_INFO, "%s: Model cache '%s' is out of date.", modelFilename, path);
+		modelcache_unmap(data, size);
+		free(path);
+		return NULL;
+	}
+
+	struct aiScene *scene = modelcache_read_scene(data, size);
+	if(scene == NULL)
+	{
+		msg(MSG_WARNING, "%s: Model cache '%s' is corrupt.", modelFilename, path);
+		modelcache_unmap(data, size);
+		free(path);
+		return NULL;
+	}
+
+	msg(MSG_INFO, "%s: Loaded from model cache '%s'", modelFilename, path);
+	free(path);
+	return scene;
+}
+
+#endif // KUHL_UTIL_USE_ASSIMP
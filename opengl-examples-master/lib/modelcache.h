@@ -0,0 +1,53 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Caches models after ASSIMP has imported and post-processed them.
+    Importing a large model can take tens of seconds, most of which is
+    spent in ASSIMP's post-processing steps. The first time a model is
+    loaded, the processed aiScene (meshes, node hierarchy, bones,
+    animations and materials, which includes the names of the texture
+    files) is written to a binary cache file. Later, the cache file is
+    memory mapped and an aiScene is built which points directly at the
+    vertex data in the file, so ASSIMP's importer isn't used.
+
+    The cache is ignored (and replaced) if the size or modification
+    time of the model file changes, if the post-processing flags
+    change, or if it was written by a different version of ASSIMP or
+    of this file. Embedded cameras, lights, textures and mesh (morph)
+    animations are not stored in the cache.
+
+    Settings:
+
+    * model.cache: Set to false to always import models with ASSIMP (default true).
+
+    * model.cachedir: Directory to write the cache files in. By
+      default, "model.dae" is cached in "model.dae.kuhlcache" next to
+      the model.
+
+    Scenes returned by modelcache_load() must not be passed to
+    aiReleaseImport().
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+
+#ifdef KUHL_UTIL_USE_ASSIMP
+#include <assimp/scene.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+const struct aiScene* modelcache_load(const char *modelFilename, unsigned int flags);
+int modelcache_save(const char *modelFilename, unsigned int flags, const struct aiScene *scene);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
+
+#endif // KUHL_UTIL_USE_ASSIMP
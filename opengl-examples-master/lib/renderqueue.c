@@ -0,0 +1,259 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <GL/glew.h>
+#include "renderqueue.h"
+#include "kuhl-nodep.h"
+#include "vecmat.h"
+#include "msg.h"
+
+/** An object waiting in the render queue. */
+typedef struct {
+	uint64_t key; /**< Sort key (see renderqueue_key()) */
+	unsigned int order; /**< Order that the item was added (keeps sort stable) */
+	kuhl_geometry *geom; /**< Object to draw */
+	float modelview[16]; /**< Modelview matrix to use with this object */
+} renderqueue_item;
+
+
+/** Creates a new render queue.
+
+    @param modelviewUniform The name of the mat4 uniform variable
+    which the modelview matrix of each object should be sent to
+    (typically "ModelView").
+
+    @return A new render queue which should eventually be free()'d with
+    renderqueue_free().
+*/
+renderqueue* renderqueue_new(const char *modelviewUniform)
+{
+	renderqueue *rq = kuhl_malloc(sizeof(renderqueue));
+	rq->items = list_new(256, sizeof(renderqueue_item), NULL);
+	rq->modelviewName = strdup(modelviewUniform ? modelviewUniform : "ModelView");
+	rq->frameCount = 0;
+	memset(&(rq->stats), 0, sizeof(kuhl_draw_state));
+	mat4f_identity(rq->projection);
+	rq->cull = 0;
+	rq->pendingCulled = 0;
+	rq->culled = 0;
+	return rq;
+}
+
+/** Frees a render queue created with renderqueue_new(). The geometry
+ * in the queue is not affected.
+
+    @param rq The render queue to free.
+*/
+void renderqueue_free(renderqueue *rq)
+{
+	if(rq == NULL)
+		return;
+	list_free(rq->items);
+	free(rq->modelviewName);
+	free(rq);
+}
+
+/** Calculates a 64-bit key which sorts objects by program, texture,
+ * VAO and finally by depth. The program, texture and VAO IDs are
+ * truncated to fit in the key. If two different objects are truncated
+ * to the same value, they may not be grouped together but they will
+ * still be drawn correctly.
+ *
+ * @param geom The object.
+ *
+ * @param modelview The modelview matrix of the object.
+ *
+ * @return The sort key.
+ */
+static uint64_t renderqueue_key(const kuhl_geometry *geom, const float modelview[16])
+{
+	/* Distance in front of the camera to the origin of the object
+	 * (after GeomTransform is applied). */
+	const float *m = geom->matrix;
+	float z = modelview[2]*m[12] + modelview[6]*m[13] + modelview[10]*m[14] + modelview[14];
+	float depth = -z;
+	if(!(depth > 0)) // also handles NaN
+		depth = 0;
+	/* The bits of a positive float sort in the same order as the
+	 * floats themselves. Keep the 24 most significant bits. */
+	union { float f; uint32_t u; } d = { depth };
+	uint64_t depthBits = d.u >> 8;
+
+	uint64_t texture = geom->texture_count > 0 ? geom->textures[0].textureId : 0;
+	uint64_t key = 0;
+	key |= ((uint64_t) geom->program & 0xfff)  << 52;
+	key |= (texture                  & 0xffff) << 36;
+	key |= ((uint64_t) geom->vao     & 0xfff)  << 24;
+	key |= depthBits & 0xffffff;
+	return key;
+}
+
+/** Enables or disables view frustum culling in renderqueue_add().
+
+    @param rq The render queue.
+
+    @param projection The projection matrix that objects will be drawn
+    with (for example, from viewmat_get()). The matrix is copied. Set
+    to NULL to stop culling.
+*/
+void renderqueue_cull(renderqueue *rq, const float projection[16])
+{
+	if(rq == NULL)
+		return;
+	rq->cull = projection != NULL;
+	if(projection)
+		mat4f_copy(rq->projection, projection);
+}
+
+/** Adds an object to the render queue. The object will be drawn the
+ * next time renderqueue_flush() is called. If culling is enabled
+ * with renderqueue_cull(), objects outside of the view frustum are
+ * not added.
+
+    @param rq The render queue.
+
+    @param geom The object to draw. The object must not be deleted
+    before the queue is flushed.
+
+    @param modelview The modelview matrix to use when drawing the
+    object. The matrix is copied.
+
+    @param kg_options If KG_FULL_LIST is set, every object in the
+    geom linked list is added to the queue with the same modelview
+    matrix. Otherwise, only geom is added.
+*/
+void renderqueue_add(renderqueue *rq, kuhl_geometry *geom, const float modelview[16], int kg_options)
+{
+	if(rq == NULL || modelview == NULL)
+		return;
+
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		if(rq->cull && !kuhl_geometry_visible(g, modelview, rq->projection))
+		{
+			rq->pendingCulled++;
+			if(!(kg_options & KG_FULL_LIST))
+				break;
+			continue;
+		}
+
+		renderqueue_item item;
+		item.geom = g;
+		item.order = (unsigned int) list_length(rq->items);
+		mat4f_copy(item.modelview, modelview);
+		item.key = renderqueue_key(g, modelview);
+		list_append(rq->items, &item);
+
+		if(!(kg_options & KG_FULL_LIST))
+			break;
+	}
+}
+
+/** Returns the number of objects waiting in the render queue.
+
+    @param rq The render queue.
+*/
+int renderqueue_length(const renderqueue *rq)
+{
+	if(rq == NULL)
+		return 0;
+	return list_length(rq->items);
+}
+
+/** Compares two render queue items for qsort(). */
+static int renderqueue_compare(const void *a, const void *b)
+{
+	const renderqueue_item *ia = (const renderqueue_item*) a;
+	const renderqueue_item *ib = (const renderqueue_item*) b;
+	if(ia->key < ib->key)
+		return -1;
+	if(ia->key > ib->key)
+		return 1;
+	if(ia->order < ib->order)
+		return -1;
+	if(ia->order > ib->order)
+		return 1;
+	return 0;
+}
+
+/** Sorts and draws all of the objects in the render queue and then
+ * empties the queue. The GLSL program and VAO that were in use
+ * before this function was called are restored afterwards. The
+ * number of draw calls and state changes are stored in rq->stats.
+
+    @param rq The render queue.
+*/
+void renderqueue_flush(renderqueue *rq)
+{
+	if(rq == NULL)
+		return;
+
+	int length = list_length(rq->items);
+	if(length > 1)
+		qsort(rq->items->data, length, sizeof(renderqueue_item), renderqueue_compare);
+
+	kuhl_draw_state *state = &(rq->stats);
+	kuhl_draw_state_begin(state);
+
+	GLuint modelviewProgram = 0;
+	GLint modelviewLoc = -1;
+	for(int i=0; i<length; i++)
+	{
+		renderqueue_item *item = (renderqueue_item*) list_getptr(rq->items, i);
+		kuhl_geometry *geom = item->geom;
+
+		/* The modelview uniform must be set after the program is in
+		 * use, but before the object is drawn. */
+		if(geom->program != state->program)
+		{
+			glUseProgram(geom->program);
+			state->program = geom->program;
+			state->program_changes++;
+		}
+		if(geom->program != modelviewProgram)
+		{
+			modelviewProgram = geom->program;
+			modelviewLoc = kuhl_get_uniform_program(geom->program, rq->modelviewName);
+		}
+		if(modelviewLoc != -1)
+			glUniformMatrix4fv(modelviewLoc, 1, 0, item->modelview);
+
+		/* Objects are drawn roughly front to back, so nearby objects
+		 * can hide the ones behind them (if kuhl.occlusion is set). */
+		if(rq->cull)
+			kuhl_geometry_draw_occlusion(geom, state, item->modelview, rq->projection);
+		else
+			kuhl_geometry_draw_state(geom, state);
+	}
+
+	kuhl_draw_state_end(state);
+	list_set_length(rq->items, 0);
+	rq->culled = rq->pendingCulled;
+	rq->pendingCulled = 0;
+	rq->frameCount++;
+}
+
+/** Prints the number of draw calls and state changes that occurred
+ * during the most recent renderqueue_flush().
+
+    @param rq The render queue.
+*/
+void renderqueue_print_stats(const renderqueue *rq)
+{
+	if(rq == NULL)
+		return;
+	msg(MSG_INFO, "renderqueue frame %u: %u draws, %u culled, %u occluded, %u occlusion queries, %u program changes, %u VAO changes, %u texture binds",
+	    rq->frameCount, rq->stats.draw_calls, rq->culled, rq->stats.occluded,
+	    rq->stats.occlusion_queries, rq->stats.program_changes,
+	    rq->stats.vao_changes, rq->stats.texture_changes);
+}
@@ -0,0 +1,75 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    A render queue collects the kuhl_geometry objects that should be
+    drawn in a frame and draws them in an order which minimizes the
+    number of OpenGL state changes.
+
+    Instead of calling kuhl_geometry_draw() for each object, a program
+    calls renderqueue_add() with the object and its modelview
+    matrix. renderqueue_flush() then sorts the objects by GLSL
+    program, texture, vertex array object and finally by depth (front
+    to back) and draws them. The program, textures and VAO are only
+    changed when they differ from the previously drawn object.
+
+    <pre>
+    renderqueue *rq = renderqueue_new("ModelView");
+    // each frame:
+    glUseProgram(program);
+    glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, perspective);
+    renderqueue_add(rq, building, buildingModelview, KG_FULL_LIST);
+    renderqueue_add(rq, ground, groundModelview, KG_FULL_LIST);
+    renderqueue_flush(rq);
+    </pre>
+
+    If renderqueue_cull() is called with the projection matrix,
+    renderqueue_add() skips objects whose bounding volume is outside
+    of the view frustum (see kuhl_geometry_visible()).
+    If the kuhl.occlusion configuration setting is also enabled,
+    renderqueue_flush() skips objects which were hidden behind other
+    objects according to an occlusion query from a previous frame
+    (see kuhl_geometry_draw_occlusion()).
+
+    The queue only sets the modelview uniform. Any other uniforms
+    (such as the projection matrix) must be set on each GLSL program
+    before renderqueue_flush() is called. Since objects are sorted,
+    transparent objects that rely on being drawn back to front should
+    not be added to the queue.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "kuhl-util.h"
+#include "list.h"
+
+typedef struct {
+	list *items; /**< Objects which will be drawn by the next flush */
+	char *modelviewName; /**< Name of the modelview uniform set for each object */
+	unsigned int frameCount; /**< Number of times the queue has been flushed */
+	kuhl_draw_state stats; /**< State changes and draw calls in the most recent flush */
+	float projection[16]; /**< Projection matrix used for culling */
+	int cull; /**< Should renderqueue_add() cull objects outside of the view frustum? */
+	unsigned int pendingCulled; /**< Objects culled since the most recent flush */
+	unsigned int culled; /**< Objects culled before the most recent flush */
+} renderqueue;
+
+renderqueue* renderqueue_new(const char *modelviewUniform);
+void renderqueue_free(renderqueue *rq);
+void renderqueue_cull(renderqueue *rq, const float projection[16]);
+void renderqueue_add(renderqueue *rq, kuhl_geometry *geom, const float modelview[16], int kg_options);
+int renderqueue_length(const renderqueue *rq);
+void renderqueue_flush(renderqueue *rq);
+void renderqueue_print_stats(const renderqueue *rq);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -0,0 +1,486 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "simplify.h"
+#include "kuhl-nodep.h"
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "msg.h"
+
+/** A symmetric 4x4 matrix which measures the sum of the squared
+ * distances from a point to a set of planes. Only the upper triangle
+ * is stored: a², ab, ac, ad, b², bc, bd, c², cd, d². The weight is the
+ * total area of the triangles that were added to the quadric. */
+typedef struct {
+	double q[10];
+	double weight;
+} simplify_quadric;
+
+/** An edge collapse which moves every vertex at the position of
+ * vertex "from" onto the position of vertex "to". Both are position
+ * indices (see simplify_weld()). */
+typedef struct {
+	unsigned int from;
+	unsigned int to;
+	float cost;
+} simplify_collapse;
+
+/** A vertex position and index, used to find vertices that share a
+ * position. */
+typedef struct {
+	float pos[3];
+	unsigned int vertex;
+} simplify_position;
+
+/** Adds the plane of a triangle to a quadric, weighted by the area
+ * of the triangle. */
+static void simplify_quadric_add_triangle(simplify_quadric *quad, const float *p0, const float *p1, const float *p2)
+{
+	float e1[3], e2[3], n[3];
+	vec3f_sub_new(e1, p1, p0);
+	vec3f_sub_new(e2, p2, p0);
+	vec3f_cross_new(n, e1, e2);
+	double len = sqrt(vec3f_normSq(n));
+	if(len == 0)
+		return;
+	double a = n[0]/len, b = n[1]/len, c = n[2]/len;
+	double d = -(a*p0[0] + b*p0[1] + c*p0[2]);
+	double area = len / 2;
+
+	double plane[10] = { a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d };
+	for(int i=0; i<10; i++)
+		quad->q[i] += plane[i] * area;
+	quad->weight += area;
+}
+
+/** Adds one quadric to another. */
+static void simplify_quadric_add(simplify_quadric *dest, const simplify_quadric *src)
+{
+	for(int i=0; i<10; i++)
+		dest->q[i] += src->q[i];
+	dest->weight += src->weight;
+}
+
+/** Returns the average squared distance from a point to the planes
+ * in the sum of two quadrics. */
+static float simplify_quadric_error(const simplify_quadric *qa, const simplify_quadric *qb, const float *p)
+{
+	double q[10];
+	for(int i=0; i<10; i++)
+		q[i] = qa->q[i] + qb->q[i];
+	double weight = qa->weight + qb->weight;
+	double x = p[0], y = p[1], z = p[2];
+	double e = q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x
+	         + q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y
+	         + q[7]*z*z + 2*q[8]*z
+	         + q[9];
+	if(weight > 0)
+		e = e / weight;
+	return e > 0 ? (float) e : 0;
+}
+
+static int simplify_position_compare(const void *a, const void *b)
+{
+	const simplify_position *pa = (const simplify_position*) a;
+	const simplify_position *pb = (const simplify_position*) b;
+	for(int i=0; i<3; i++)
+	{
+		if(pa->pos[i] < pb->pos[i])
+			return -1;
+		if(pa->pos[i] > pb->pos[i])
+			return 1;
+	}
+	return 0;
+}
+
+static int simplify_edge_compare(const void *a, const void *b)
+{
+	const unsigned int *ea = (const unsigned int*) a;
+	const unsigned int *eb = (const unsigned int*) b;
+	if(ea[0] != eb[0])
+		return ea[0] < eb[0] ? -1 : 1;
+	if(ea[1] != eb[1])
+		return ea[1] < eb[1] ? -1 : 1;
+	return 0;
+}
+
+static int simplify_collapse_compare(const void *a, const void *b)
+{
+	const simplify_collapse *ca = (const simplify_collapse*) a;
+	const simplify_collapse *cb = (const simplify_collapse*) b;
+	if(ca->cost < cb->cost)
+		return -1;
+	if(ca->cost > cb->cost)
+		return 1;
+	return 0;
+}
+
+/** Welds vertices which share a position. Vertices along a texture
+ * or normal seam have the same position but different attributes.
+ * The simplification treats them as one position so that the seam
+ * can be simplified like the rest of the mesh, but every vertex keeps
+ * its own attributes.
+ *
+ * @param posId Filled in with the smallest index of a vertex which
+ * has the same position as each vertex.
+ *
+ * @param nextWedge Filled in with a circular list of the vertices at
+ * each position: nextWedge[v] is the next vertex with the same
+ * position as v (or v itself if no other vertex shares the
+ * position).
+ */
+static void simplify_weld(unsigned int *posId, unsigned int *nextWedge,
+                          const float *positions, unsigned int vertexCount, unsigned int stride)
+{
+	simplify_position *sorted = kuhl_malloc(sizeof(simplify_position)*vertexCount);
+	for(unsigned int i=0; i<vertexCount; i++)
+	{
+		vec3f_copy(sorted[i].pos, positions + (size_t)i*stride);
+		sorted[i].vertex = i;
+	}
+	qsort(sorted, vertexCount, sizeof(simplify_position), simplify_position_compare);
+	for(unsigned int i=0; i<vertexCount; )
+	{
+		/* The group is sorted by position only, so find the smallest
+		 * vertex index in it. */
+		unsigned int j = i+1, first = sorted[i].vertex;
+		while(j < vertexCount && simplify_position_compare(sorted+i, sorted+j) == 0)
+		{
+			if(sorted[j].vertex < first)
+				first = sorted[j].vertex;
+			j++;
+		}
+		for(unsigned int k=i; k<j; k++)
+		{
+			posId[sorted[k].vertex] = first;
+			nextWedge[sorted[k].vertex] = sorted[k+1 < j ? k+1 : i].vertex;
+		}
+		i = j;
+	}
+	free(sorted);
+}
+
+/** Marks positions which must not be moved: positions on the border
+ * of the mesh (edges that are used by only one triangle). Edges are
+ * compared by position so that a texture seam is not mistaken for a
+ * border.
+ */
+static void simplify_find_locked(unsigned char *locked, const unsigned int *indices, unsigned int indexCount,
+                                 const unsigned int *posId)
+{
+	/* Sort every edge (smallest position index first). An edge that
+	 * only appears once is on the border. */
+	unsigned int *edges = kuhl_malloc(sizeof(unsigned int)*2*indexCount);
+	unsigned int edgeCount = 0;
+	for(unsigned int t=0; t<indexCount; t=t+3)
+	{
+		for(int i=0; i<3; i++)
+		{
+			unsigned int a = posId[indices[t+i]], b = posId[indices[t+(i+1)%3]];
+			if(a == b)
+				continue;
+			edges[edgeCount*2]   = a < b ? a : b;
+			edges[edgeCount*2+1] = a < b ? b : a;
+			edgeCount++;
+		}
+	}
+	qsort(edges, edgeCount, sizeof(unsigned int)*2, simplify_edge_compare);
+	for(unsigned int i=0; i<edgeCount; )
+	{
+		unsigned int j = i+1;
+		while(j < edgeCount && simplify_edge_compare(edges+i*2, edges+j*2) == 0)
+			j++;
+		if(j-i == 1)
+		{
+			locked[edges[i*2]] = 1;
+			locked[edges[i*2+1]] = 1;
+		}
+		i = j;
+	}
+	free(edges);
+}
+
+/** Finds the vertex at position "to" that a vertex at position
+ * "from" should be moved onto: a vertex at position "to" which shares
+ * a triangle with the vertex. Following the triangles keeps each
+ * vertex on its own side of a texture seam.
+ *
+ * @return The vertex or (unsigned int)-1 if none of the triangles
+ * around the vertex use position "to".
+ */
+static unsigned int simplify_collapse_target(unsigned int to, const unsigned int *tris, const unsigned int *adjacency,
+                                             unsigned int adjacencyCount, const unsigned int *posId)
+{
+	for(unsigned int i=0; i<adjacencyCount; i++)
+	{
+		const unsigned int *t = tris + adjacency[i]*3;
+		for(int j=0; j<3; j++)
+			if(posId[t[j]] == to)
+				return t[j];
+	}
+	return (unsigned int) -1;
+}
+
+/** Checks if moving position "from" onto position "to" would flip
+ * any of the triangles around one of the vertices at position "from"
+ * which remain after the collapse. */
+static int simplify_collapse_flips(const simplify_collapse *c, const unsigned int *tris, const unsigned int *adjacency,
+                                   unsigned int adjacencyCount, const unsigned int *posId,
+                                   const float *positions, unsigned int stride)
+{
+	const float *newPos = positions + (size_t)c->to*stride;
+	for(unsigned int i=0; i<adjacencyCount; i++)
+	{
+		const unsigned int *t = tris + adjacency[i]*3;
+		if(posId[t[0]] == c->to || posId[t[1]] == c->to || posId[t[2]] == c->to)
+			continue; // this triangle will collapse
+
+		const float *p[3], *q[3];
+		for(int j=0; j<3; j++)
+		{
+			p[j] = positions + (size_t)t[j]*stride;
+			q[j] = posId[t[j]] == c->from ? newPos : p[j];
+		}
+		float e1[3], e2[3], before[3], after[3];
+		vec3f_sub_new(e1, p[1], p[0]);
+		vec3f_sub_new(e2, p[2], p[0]);
+		vec3f_cross_new(before, e1, e2);
+		vec3f_sub_new(e1, q[1], q[0]);
+		vec3f_sub_new(e2, q[2], q[0]);
+		vec3f_cross_new(after, e1, e2);
+		if(vec3f_dot(before, after) <= 0)
+			return 1;
+	}
+	return 0;
+}
+
+/** Simplifies a triangle mesh by collapsing edges until the mesh has
+ * the requested number of indices or until no more edges can be
+ * collapsed.
+
+    @param destination An array with space for indexCount indices
+    which is filled in with the simplified triangles. May be the same
+    array as indices.
+
+    @param indices The triangles of the mesh (3 indices per triangle).
+
+    @param indexCount The number of indices (a multiple of 3).
+
+    @param positions The vertex positions. The x, y and z coordinates
+    of each vertex must be consecutive.
+
+    @param vertexCount The number of vertices in positions.
+
+    @param stride The number of floats from the start of one position
+    to the start of the next one (3 for tightly packed positions).
+
+    @param targetIndexCount The number of indices to simplify the mesh
+    down to. The result may have more indices if the mesh can't be
+    simplified any further without moving locked vertices or flipping
+    triangles.
+
+    @param resultError If not NULL, filled in with an estimate of how
+    far the simplified mesh is from the original mesh, in the same
+    units as the positions. It is the root mean square distance from
+    a moved vertex to the planes of the original triangles around it
+    (weighted by triangle area), for the collapse where this distance
+    was the largest. Individual points may be further away.
+
+    @return The number of indices written into destination.
+*/
+unsigned int simplify_mesh(unsigned int *destination, const unsigned int *indices, unsigned int indexCount,
+                           const float *positions, unsigned int vertexCount, unsigned int stride,
+                           unsigned int targetIndexCount, float *resultError)
+{
+	if(resultError)
+		*resultError = 0;
+	if(destination != indices)
+		memcpy(destination, indices, sizeof(unsigned int)*indexCount);
+	if(indexCount % 3 != 0 || vertexCount == 0 || indexCount <= targetIndexCount)
+		return indexCount;
+	for(unsigned int i=0; i<indexCount; i++)
+	{
+		if(indices[i] >= vertexCount)
+		{
+			msg(MSG_ERROR, "Unable to simplify a mesh with %u vertices which uses vertex %u.", vertexCount, indices[i]);
+			return indexCount;
+		}
+	}
+
+	unsigned int *tris = destination;
+	unsigned int count = indexCount;
+
+	/* Vertices, quadrics and collapses are handled per position
+	 * (see simplify_weld()). Arrays indexed by position use the
+	 * position index in posId. */
+	unsigned int *posId = kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	unsigned int *nextWedge = kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	simplify_weld(posId, nextWedge, positions, vertexCount, stride);
+
+	unsigned char *locked = kuhl_malloc(vertexCount);
+	memset(locked, 0, vertexCount);
+	simplify_find_locked(locked, tris, count, posId);
+
+	simplify_quadric *quadrics = kuhl_malloc(sizeof(simplify_quadric)*vertexCount);
+	memset(quadrics, 0, sizeof(simplify_quadric)*vertexCount);
+	for(unsigned int t=0; t<count; t=t+3)
+	{
+		const float *p0 = positions + (size_t)tris[t]*stride;
+		const float *p1 = positions + (size_t)tris[t+1]*stride;
+		const float *p2 = positions + (size_t)tris[t+2]*stride;
+		for(int i=0; i<3; i++)
+			simplify_quadric_add_triangle(quadrics+posId[tris[t+i]], p0, p1, p2);
+	}
+
+	unsigned int *remap = kuhl_malloc(sizeof(unsigned int)*vertexCount);
+	unsigned char *used = kuhl_malloc(vertexCount);
+	unsigned int *adjacencyStart = kuhl_malloc(sizeof(unsigned int)*(vertexCount+1));
+	unsigned int *adjacency = kuhl_malloc(sizeof(unsigned int)*indexCount);
+	simplify_collapse *collapses = kuhl_malloc(sizeof(simplify_collapse)*2*indexCount);
+	float maxError = 0;
+
+	/* Each pass collapses many edges which don't affect each other
+	 * and then rebuilds the triangle list. */
+	while(count > targetIndexCount)
+	{
+		unsigned int triCount = count / 3;
+
+		/* Find the triangles around each vertex. */
+		memset(adjacencyStart, 0, sizeof(unsigned int)*(vertexCount+1));
+		for(unsigned int i=0; i<count; i++)
+			adjacencyStart[tris[i]+1]++;
+		for(unsigned int v=0; v<vertexCount; v++)
+			adjacencyStart[v+1] += adjacencyStart[v];
+		for(unsigned int i=0; i<count; i++)
+			adjacency[adjacencyStart[tris[i]]++] = i/3;
+		for(unsigned int v=vertexCount; v>0; v--)
+			adjacencyStart[v] = adjacencyStart[v-1];
+		adjacencyStart[0] = 0;
+
+		/* Every edge can collapse in either direction unless the
+		 * position that would move is locked. */
+		unsigned int collapseCount = 0;
+		for(unsigned int t=0; t<triCount; t++)
+		{
+			for(int i=0; i<3; i++)
+			{
+				unsigned int a = posId[tris[t*3+i]], b = posId[tris[t*3+(i+1)%3]];
+				if(a == b)
+					continue;
+				simplify_collapse c;
+				if(!locked[a])
+				{
+					c.from = a;
+					c.to = b;
+					c.cost = simplify_quadric_error(quadrics+a, quadrics+b, positions + (size_t)b*stride);
+					collapses[collapseCount++] = c;
+				}
+				if(!locked[b])
+				{
+					c.from = b;
+					c.to = a;
+					c.cost = simplify_quadric_error(quadrics+b, quadrics+a, positions + (size_t)a*stride);
+					collapses[collapseCount++] = c;
+				}
+			}
+		}
+		qsort(collapses, collapseCount, sizeof(simplify_collapse), simplify_collapse_compare);
+
+		/* Apply the cheapest collapses. A collapse is skipped if any
+		 * position of the triangles around the moving position was
+		 * already involved in a collapse during this pass. Each
+		 * vertex at the moving position is moved onto the vertex at
+		 * the destination that it shares a triangle with, so a seam
+		 * can only collapse along itself. Most collapses remove two
+		 * triangles. */
+		for(unsigned int v=0; v<vertexCount; v++)
+			remap[v] = v;
+		memset(used, 0, vertexCount);
+		unsigned int removeGoal = (count - targetIndexCount) / 6 + 1;
+		unsigned int applied = 0;
+		for(unsigned int i=0; i<collapseCount && applied < removeGoal; i++)
+		{
+			const simplify_collapse *c = collapses+i;
+
+			int available = !used[c->to];
+			unsigned int w = c->from;
+			do
+			{
+				const unsigned int *adj = adjacency + adjacencyStart[w];
+				unsigned int adjCount = adjacencyStart[w+1] - adjacencyStart[w];
+				for(unsigned int j=0; j<adjCount && available; j++)
+				{
+					for(int k=0; k<3; k++)
+						if(used[posId[tris[adj[j]*3+k]]])
+							available = 0;
+				}
+				if(available && adjCount > 0 &&
+				   (simplify_collapse_target(c->to, tris, adj, adjCount, posId) == (unsigned int) -1 ||
+				    simplify_collapse_flips(c, tris, adj, adjCount, posId, positions, stride)))
+					available = 0;
+				w = nextWedge[w];
+			} while(w != c->from && available);
+			if(!available)
+				continue;
+
+			w = c->from;
+			do
+			{
+				const unsigned int *adj = adjacency + adjacencyStart[w];
+				unsigned int adjCount = adjacencyStart[w+1] - adjacencyStart[w];
+				for(unsigned int j=0; j<adjCount; j++)
+					for(int k=0; k<3; k++)
+						used[posId[tris[adj[j]*3+k]]] = 1;
+				if(adjCount > 0)
+					remap[w] = simplify_collapse_target(c->to, tris, adj, adjCount, posId);
+				w = nextWedge[w];
+			} while(w != c->from);
+			used[c->to] = 1;
+
+			simplify_quadric_add(quadrics+c->to, quadrics+c->from);
+			if(c->cost > maxError)
+				maxError = c->cost;
+			applied++;
+		}
+		if(applied == 0)
+			break;
+
+		/* Rebuild the triangle list without the triangles that
+		 * collapsed. */
+		unsigned int newCount = 0;
+		for(unsigned int t=0; t<count; t=t+3)
+		{
+			unsigned int a = remap[tris[t]], b = remap[tris[t+1]], c = remap[tris[t+2]];
+			if(posId[a] == posId[b] || posId[b] == posId[c] || posId[a] == posId[c])
+				continue;
+			tris[newCount++] = a;
+			tris[newCount++] = b;
+			tris[newCount++] = c;
+		}
+		count = newCount;
+	}
+
+	free(posId);
+	free(nextWedge);
+	free(locked);
+	free(quadrics);
+	free(remap);
+	free(used);
+	free(adjacencyStart);
+	free(adjacency);
+	free(collapses);
+
+	if(resultError)
+		*resultError = sqrtf(maxError);
+	return count;
+}
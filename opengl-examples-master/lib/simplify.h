@@ -0,0 +1,50 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Simplifies a triangle mesh by repeatedly collapsing the edge that
+    changes the shape of the mesh the least. The change is measured
+    with quadric error metrics (Garland and Heckbert, "Surface
+    Simplification Using Quadric Error Metrics", SIGGRAPH 1997): each
+    vertex keeps a quadric which measures the squared distance to the
+    planes of the triangles around it and the cost of collapsing an
+    edge is the quadric evaluated at the position the edge collapses
+    to.
+
+    Edges are only collapsed onto one of their own vertices, so the
+    simplified mesh uses a subset of the original vertices and only a
+    new index list is produced. This allows several levels of detail
+    to share one vertex buffer (see kuhl_geometry_lod()).
+
+    Vertices on the border of an open mesh are never moved, so the
+    outline of the mesh is preserved. Vertices that share a position
+    (for example, along a texture seam) are moved together and only
+    along the seam, so each of them keeps its own texture coordinates
+    and normal.
+
+    <pre>
+    unsigned int *lod = malloc(sizeof(unsigned int)*indexCount);
+    float error;
+    unsigned int lodCount = simplify_mesh(lod, indices, indexCount,
+                                          positions, vertexCount, 3,
+                                          indexCount/4, &error);
+    </pre>
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+unsigned int simplify_mesh(unsigned int *destination, const unsigned int *indices, unsigned int indexCount,
+                           const float *positions, unsigned int vertexCount, unsigned int stride,
+                           unsigned int targetIndexCount, float *resultError);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
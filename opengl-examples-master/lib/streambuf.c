@@ -0,0 +1,299 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/glew.h>
+#include "streambuf.h"
+#include "kuhl-nodep.h"
+#include "kuhl-util.h"
+#include "msg.h"
+
+/** Allocations inside of a region are aligned to this many bytes so
+ * that any vertex format can start at the returned offset. */
+#define STREAMBUF_ALIGN 16
+
+/** Regions start on a multiple of this many bytes (a common value of
+ * GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT) so that a region could also be
+ * used as a uniform buffer. */
+#define STREAMBUF_REGION_ALIGN 256
+
+/** Returns 1 if fences are available. Without fences, we rely on
+ * glBufferSubData() to synchronize with the GPU. */
+static int streambuf_have_fences(void)
+{
+	return GLEW_VERSION_3_2 || GLEW_ARB_sync;
+}
+
+/** Creates a new streaming buffer.
+
+    @param regionSize The number of bytes that will be written each
+    frame (or between calls to streambuf_next()). The size is rounded
+    up to a multiple of 256 bytes.
+
+    @param regionCount The number of regions in the buffer. Three
+    regions allow the CPU to write one frame while the GPU is drawing
+    the previous two. Must be between 1 and STREAMBUF_MAX_REGIONS.
+
+    @return A new streaming buffer which should be free()'d with
+    streambuf_free().
+*/
+streambuf* streambuf_new(GLsizeiptr regionSize, unsigned int regionCount)
+{
+	if(regionSize <= 0)
+	{
+		msg(MSG_FATAL, "Unable to create a streaming buffer with a region size of %ld bytes.", (long) regionSize);
+		exit(EXIT_FAILURE);
+	}
+	if(regionCount < 1)
+		regionCount = 1;
+	if(regionCount > STREAMBUF_MAX_REGIONS)
+		regionCount = STREAMBUF_MAX_REGIONS;
+
+	streambuf *sb = kuhl_malloc(sizeof(streambuf));
+	memset(sb, 0, sizeof(streambuf));
+	sb->regionSize = (regionSize + STREAMBUF_REGION_ALIGN-1) / STREAMBUF_REGION_ALIGN * STREAMBUF_REGION_ALIGN;
+	sb->regionCount = regionCount;
+	GLsizeiptr totalSize = sb->regionSize * regionCount;
+
+	glGenBuffers(1, &(sb->bufferobject));
+	glBindBuffer(GL_ARRAY_BUFFER, sb->bufferobject);
+	if(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)
+	{
+		/* Map the buffer once and keep it mapped. With the coherent
+		 * bit, writes become visible to the GPU without explicitly
+		 * flushing them. */
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, totalSize, NULL, flags);
+		sb->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, totalSize, flags);
+		if(sb->mapped == NULL)
+		{
+			/* Buffer storage is immutable, start over with a new buffer. */
+			msg(MSG_WARNING, "Unable to persistently map a streaming buffer; using glBufferSubData() instead.");
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			glDeleteBuffers(1, &(sb->bufferobject));
+			glGenBuffers(1, &(sb->bufferobject));
+			glBindBuffer(GL_ARRAY_BUFFER, sb->bufferobject);
+		}
+	}
+	if(sb->mapped == NULL)
+	{
+		glBufferData(GL_ARRAY_BUFFER, totalSize, NULL, GL_STREAM_DRAW);
+		sb->staging = kuhl_malloc(totalSize);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	kuhl_errorcheck();
+
+	msg(MSG_DEBUG, "Created %s streaming buffer with %u regions of %ld bytes.",
+	    sb->mapped ? "persistently mapped" : "glBufferSubData()",
+	    sb->regionCount, (long) sb->regionSize);
+	return sb;
+}
+
+/** Frees a streaming buffer and the OpenGL buffer inside of it. Any
+ * geometry that uses the buffer must not be drawn afterwards.
+
+    @param sb The streaming buffer to free.
+*/
+void streambuf_free(streambuf *sb)
+{
+	if(sb == NULL)
+		return;
+	for(unsigned int i=0; i<sb->regionCount; i++)
+	{
+		if(sb->fences[i])
+			glDeleteSync(sb->fences[i]);
+	}
+	if(sb->mapped)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, sb->bufferobject);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	glDeleteBuffers(1, &(sb->bufferobject));
+	free(sb->staging);
+	free(sb);
+}
+
+/** Returns the OpenGL buffer object of a streaming buffer. Use it
+ * with the offsets returned by streambuf_alloc() or
+ * streambuf_write(), for example with kuhl_geometry_attrib_buffer().
+
+    @param sb The streaming buffer.
+*/
+GLuint streambuf_id(const streambuf *sb)
+{
+	if(sb == NULL)
+		return 0;
+	return sb->bufferobject;
+}
+
+/** Returns the byte offset in the current region where an allocation
+ * would start. */
+static GLsizeiptr streambuf_aligned_used(const streambuf *sb)
+{
+	return (sb->used + STREAMBUF_ALIGN-1) / STREAMBUF_ALIGN * STREAMBUF_ALIGN;
+}
+
+/** Checks if an allocation fits in the current region of the
+ * streaming buffer. Code which draws right after each allocation
+ * (for example, one draw call per streambuf_write()) may use this to
+ * call streambuf_next() itself when the region is full.
+
+    @param sb The streaming buffer.
+
+    @param bytes The number of bytes that would be allocated.
+
+    @return 1 if streambuf_alloc() would succeed without moving to the
+    next region.
+*/
+int streambuf_fits(const streambuf *sb, GLsizeiptr bytes)
+{
+	if(sb == NULL || bytes <= 0)
+		return 0;
+	return streambuf_aligned_used(sb) + bytes <= sb->regionSize;
+}
+
+/** Reserves space in the current region of the streaming buffer. The
+ * region is not changed automatically when it is full: the fence
+ * placed by streambuf_next() must come after the draw calls that read
+ * the region, and only the caller knows when those have been issued.
+
+    @param sb The streaming buffer.
+
+    @param bytes The number of bytes to reserve. Must not be larger
+    than the region size.
+
+    @param offset Filled in with the byte offset of the reserved
+    space in the OpenGL buffer.
+
+    @return A pointer to write the data to. The pointer is only valid
+    until the next call to streambuf_next(). The data must be written
+    before streambuf_flush() is called and the data is drawn. Returns
+    NULL if the data doesn't fit in the rest of the current region
+    (see streambuf_fits()).
+*/
+void* streambuf_alloc(streambuf *sb, GLsizeiptr bytes, GLintptr *offset)
+{
+	if(sb == NULL || bytes <= 0)
+		return NULL;
+	if(bytes > sb->regionSize)
+	{
+		msg(MSG_ERROR, "Unable to store %ld bytes in a streaming buffer with %ld byte regions.", (long) bytes, (long) sb->regionSize);
+		return NULL;
+	}
+
+	GLsizeiptr start = streambuf_aligned_used(sb);
+	if(start + bytes > sb->regionSize)
+	{
+		msg(MSG_WARNING, "Streaming buffer region is full (%ld of %ld bytes used). Call streambuf_next() after drawing or create the buffer with larger regions.",
+		    (long) start, (long) sb->regionSize);
+		return NULL;
+	}
+	/* Skip alignment padding so that streambuf_flush() doesn't
+	 * upload it. */
+	if(sb->flushed == sb->used)
+		sb->flushed = start;
+	sb->used = start + bytes;
+
+	GLintptr pos = sb->region * sb->regionSize + start;
+	if(offset)
+		*offset = pos;
+	return (sb->mapped ? sb->mapped : sb->staging) + pos;
+}
+
+/** Copies data into the streaming buffer. This is equivalent to
+ * calling streambuf_alloc(), copying the data and calling
+ * streambuf_flush().
+
+    @param sb The streaming buffer.
+
+    @param data The data to copy.
+
+    @param bytes The number of bytes to copy.
+
+    @return The byte offset of the data in the OpenGL buffer or -1 if
+    the data did not fit in the current region.
+*/
+GLintptr streambuf_write(streambuf *sb, const void *data, GLsizeiptr bytes)
+{
+	GLintptr offset = -1;
+	void *dest = streambuf_alloc(sb, bytes, &offset);
+	if(dest == NULL)
+		return -1;
+	memcpy(dest, data, bytes);
+	streambuf_flush(sb);
+	return offset;
+}
+
+/** Makes the data written since the last flush available to
+ * OpenGL. Must be called after writing to the pointer returned by
+ * streambuf_alloc() and before drawing with the data. If the buffer
+ * is persistently mapped, this function does nothing.
+
+    @param sb The streaming buffer.
+*/
+void streambuf_flush(streambuf *sb)
+{
+	if(sb == NULL || sb->staging == NULL || sb->flushed >= sb->used)
+		return;
+
+	GLintptr start = sb->region * sb->regionSize + sb->flushed;
+	glBindBuffer(GL_ARRAY_BUFFER, sb->bufferobject);
+	glBufferSubData(GL_ARRAY_BUFFER, start, sb->used - sb->flushed, sb->staging + start);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	sb->flushed = sb->used;
+}
+
+/** Finishes the current region and moves to the next one. Call this
+ * after the draw calls which use the data in the current region have
+ * been issued (typically once per frame). A fence is placed so that
+ * the region isn't overwritten until the GPU has finished reading
+ * it. If the GPU is still using the next region, this function
+ * waits for it and increments sb->stalls.
+
+    @param sb The streaming buffer.
+*/
+void streambuf_next(streambuf *sb)
+{
+	if(sb == NULL || sb->used == 0)
+		return;
+	streambuf_flush(sb);
+
+	if(streambuf_have_fences())
+	{
+		if(sb->fences[sb->region])
+			glDeleteSync(sb->fences[sb->region]);
+		sb->fences[sb->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	sb->region = (sb->region + 1) % sb->regionCount;
+	sb->used = 0;
+	sb->flushed = 0;
+
+	GLsync fence = sb->fences[sb->region];
+	if(fence == NULL)
+		return;
+	GLenum result = glClientWaitSync(fence, 0, 0);
+	if(result == GL_TIMEOUT_EXPIRED)
+	{
+		/* The GPU is still reading this region. Wait for it,
+		 * flushing the commands so the fence is guaranteed to
+		 * signal. */
+		sb->stalls++;
+		do {
+			result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		} while(result == GL_TIMEOUT_EXPIRED);
+	}
+	if(result == GL_WAIT_FAILED)
+		kuhl_errorcheck();
+	glDeleteSync(fence);
+	sb->fences[sb->region] = NULL;
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    A streaming buffer is an OpenGL buffer for vertex data that
+    changes every frame (particles, animated vertices, text, etc). The
+    buffer is split into several regions (typically three). The CPU
+    writes into one region while the GPU may still be reading the
+    data that was written into the other regions during the previous
+    frames. A fence is placed after the draw calls that use a region
+    and the CPU only waits on that fence when it wraps around to the
+    region again. Since the data is never reallocated and the buffer
+    is never mapped or unmapped while drawing, the CPU and GPU rarely
+    have to wait for each other.
+
+    If OpenGL 4.4 or ARB_buffer_storage is available, the buffer is
+    mapped once with GL_MAP_PERSISTENT_BIT and the CPU writes
+    directly into it. Otherwise, the data is written into a copy in
+    CPU memory and uploaded with glBufferSubData() by
+    streambuf_flush().
+
+    Each region must be large enough for everything that is written
+    between calls to streambuf_next(). When a region is full,
+    streambuf_alloc() returns NULL instead of moving to the next
+    region on its own, since the data in the region may not have
+    been drawn yet.
+
+    <pre>
+    streambuf *sb = streambuf_new(sizeof(GLfloat)*3*vertexCount, 3);
+    // each frame:
+    GLintptr offset;
+    GLfloat *pos = streambuf_alloc(sb, sizeof(GLfloat)*3*vertexCount, &offset);
+    // ... write the positions into pos ...
+    streambuf_flush(sb);
+    kuhl_geometry_attrib_buffer(geom, streambuf_id(sb), offset, 3, GL_FLOAT, GL_FALSE, "in_Position", KG_WARN);
+    kuhl_geometry_draw(geom);
+    streambuf_next(sb);
+    </pre>
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <GL/glew.h>
+
+/** Maximum number of regions in a streaming buffer. */
+#define STREAMBUF_MAX_REGIONS 4
+
+typedef struct {
+	GLuint bufferobject; /**< OpenGL buffer containing all of the regions */
+	GLsizeiptr regionSize; /**< Size of each region in bytes */
+	unsigned int regionCount; /**< Number of regions in the buffer */
+	unsigned int region; /**< Region that is currently being written to */
+	GLsizeiptr used; /**< Bytes used in the current region */
+	GLsizeiptr flushed; /**< Bytes in the current region that have been uploaded */
+	GLsync fences[STREAMBUF_MAX_REGIONS]; /**< Fence placed after each region was last used */
+	char *mapped; /**< Persistently mapped pointer to the buffer or NULL */
+	char *staging; /**< Copy of the buffer in CPU memory if it can't be persistently mapped */
+	unsigned int stalls; /**< Number of times the CPU had to wait for the GPU */
+} streambuf;
+
+streambuf* streambuf_new(GLsizeiptr regionSize, unsigned int regionCount);
+void streambuf_free(streambuf *sb);
+GLuint streambuf_id(const streambuf *sb);
+int streambuf_fits(const streambuf *sb, GLsizeiptr bytes);
+void* streambuf_alloc(streambuf *sb, GLsizeiptr bytes, GLintptr *offset);
+GLintptr streambuf_write(streambuf *sb, const void *data, GLsizeiptr bytes);
+void streambuf_flush(streambuf *sb);
+void streambuf_next(streambuf *sb);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -0,0 +1,383 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <GL/glew.h>
+#include "texcache.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "kuhl-nodep.h"
+#include "msg.h"
+
+/** A texture in the cache. Each entry is in two hash chains: one
+ * which is found by the file and settings and one which is found by
+ * the texture name. */
+typedef struct texcache_entry {
+	char *path;          /**< Canonical path of the image file */
+	GLuint wrapS, wrapT;
+	int srgb;            /**< Was the texture loaded with color.linear set? */
+	uint32_t hash;       /**< Hash of path and the settings above */
+	GLuint texName;
+	float aspectRatio;
+	int refcount;
+	struct texcache_entry *nextKey;  /**< Next entry in the same texcache_keys bucket */
+	struct texcache_entry *nextName; /**< Next entry in the same texcache_names bucket */
+} texcache_entry;
+
+/** Remembers the canonical path of a filename that was passed to
+ * texcache_acquire() or texcache_find() so that the file system is
+ * only searched the first time that a filename is used. */
+typedef struct texcache_alias {
+	char *filename;      /**< Filename as it was passed in */
+	char *path;          /**< Canonical path of the file */
+	uint32_t hash;       /**< Hash of filename */
+	struct texcache_alias *next; /**< Next alias in the same texcache_aliases bucket */
+} texcache_alias;
+
+static texcache_entry **texcache_keys = NULL;  /**< Buckets found by texcache_hash() */
+static texcache_entry **texcache_names = NULL; /**< Buckets found by texture name */
+static unsigned int texcache_bucket_count = 0; /**< Number of buckets in each table (a power of 2) */
+static unsigned int texcache_count = 0;        /**< Number of textures in the cache */
+static unsigned int texcache_hits = 0;
+static unsigned int texcache_misses = 0;
+
+static texcache_alias **texcache_aliases = NULL;   /**< Buckets found by the hash of the filename */
+static unsigned int texcache_alias_buckets = 0;    /**< Number of buckets in texcache_aliases (a power of 2) */
+static unsigned int texcache_alias_count = 0;      /**< Number of filenames in texcache_aliases */
+
+/** FNV-1a hash of a string. */
+/** Deletes a texture with glDeleteTextures(). The default
+ * texcache_delete_func. */
+static void texcache_delete_texture(GLuint texName)
+{
+	glDeleteTextures(1, &texName);
+}
+
+static texcache_load_func texcache_load = kuhl_read_texture_file_wrap; /**< Loads textures (see texcache_set_loader()) */
+static texcache_delete_func texcache_delete = texcache_delete_texture;  /**< Deletes textures (see texcache_set_loader()) */
+
+static uint32_t texcache_hash_string(const char *str)
+{
+	uint32_t h = 2166136261u;
+	for(const unsigned char *c = (const unsigned char*) str; *c; c++)
+		h = (h ^ *c) * 16777619u;
+	return h;
+}
+
+/** FNV-1a hash of the path and the settings. */
+static uint32_t texcache_hash(const char *path, GLuint wrapS, GLuint wrapT, int srgb)
+{
+	uint32_t h = texcache_hash_string(path);
+	uint32_t params[3] = { wrapS, wrapT, (uint32_t) srgb };
+	for(int i=0; i<3; i++)
+		h = (h ^ params[i]) * 16777619u;
+	return h;
+}
+
+static unsigned int texcache_name_bucket(GLuint texName)
+{
+	return (texName * 2654435761u) & (texcache_bucket_count-1);
+}
+
+/** Makes both tables have the given number of buckets (a power of 2)
+ * and puts every entry into its new bucket. */
+static void texcache_resize(unsigned int buckets)
+{
+	texcache_entry **oldKeys = texcache_keys;
+	unsigned int oldCount = texcache_bucket_count;
+
+	texcache_keys  = calloc(buckets, sizeof(texcache_entry*));
+	texcache_names = realloc(texcache_names, buckets*sizeof(texcache_entry*));
+	memset(texcache_names, 0, buckets*sizeof(texcache_entry*));
+	texcache_bucket_count = buckets;
+
+	for(unsigned int i=0; i<oldCount; i++)
+	{
+		texcache_entry *e = oldKeys[i];
+		while(e != NULL)
+		{
+			texcache_entry *next = e->nextKey;
+			unsigned int k = e->hash & (buckets-1);
+			e->nextKey = texcache_keys[k];
+			texcache_keys[k] = e;
+			unsigned int n = texcache_name_bucket(e->texName);
+			e->nextName = texcache_names[n];
+			texcache_names[n] = e;
+			e = next;
+		}
+	}
+	free(oldKeys);
+}
+
+/** Returns the canonical path to an image file or NULL if the file
+ * can't be found. The path belongs to the cache and should not be
+ * free()'d. Each filename is only looked up in the file system the
+ * first time it is used; files that aren't found are looked up again
+ * next time. */
+static const char* texcache_canonical_path(const char *filename)
+{
+	uint32_t hash = texcache_hash_string(filename);
+	if(texcache_alias_buckets > 0)
+	{
+		for(texcache_alias *a = texcache_aliases[hash & (texcache_alias_buckets-1)]; a != NULL; a = a->next)
+			if(a->hash == hash && strcmp(a->filename, filename) == 0)
+				return a->path;
+	}
+
+	/* kuhl_find_file() returns the filename it was given if it
+	 * can't find the file. */
+	char *found = kuhl_find_file(filename);
+	if(found == NULL)
+		return NULL;
+	if(!kuhl_can_read_file(found))
+	{
+		free(found);
+		return NULL;
+	}
+#ifdef _WIN32
+	char *canonical = _fullpath(NULL, found, 0);
+#else
+	char *canonical = realpath(found, NULL);
+#endif
+	if(canonical == NULL)
+		canonical = found;
+	else
+		free(found);
+
+	/* Keep the table at most 75% full. */
+	if((texcache_alias_count+1)*4 > texcache_alias_buckets*3)
+	{
+		unsigned int buckets = texcache_alias_buckets == 0 ? 64 : texcache_alias_buckets*2;
+		texcache_alias **aliases = calloc(buckets, sizeof(texcache_alias*));
+		for(unsigned int i=0; i<texcache_alias_buckets; i++)
+		{
+			texcache_alias *a = texcache_aliases[i];
+			while(a != NULL)
+			{
+				texcache_alias *next = a->next;
+				a->next = aliases[a->hash & (buckets-1)];
+				aliases[a->hash & (buckets-1)] = a;
+				a = next;
+			}
+		}
+		free(texcache_aliases);
+		texcache_aliases = aliases;
+		texcache_alias_buckets = buckets;
+	}
+
+	texcache_alias *a = kuhl_malloc(sizeof(texcache_alias));
+	a->filename = strdup(filename);
+	a->path = canonical;
+	a->hash = hash;
+	a->next = texcache_aliases[hash & (texcache_alias_buckets-1)];
+	texcache_aliases[hash & (texcache_alias_buckets-1)] = a;
+	texcache_alias_count++;
+	return canonical;
+}
+
+/** Finds an entry in the cache or returns NULL. */
+static texcache_entry* texcache_lookup(const char *path, GLuint wrapS, GLuint wrapT, int srgb, uint32_t hash)
+{
+	if(texcache_bucket_count == 0)
+		return NULL;
+	for(texcache_entry *e = texcache_keys[hash & (texcache_bucket_count-1)]; e != NULL; e = e->nextKey)
+	{
+		if(e->hash == hash && e->wrapS == wrapS && e->wrapT == wrapT &&
+		   e->srgb == srgb && strcmp(e->path, path) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static texcache_entry* texcache_lookup_name(GLuint texName)
+{
+	if(texcache_bucket_count == 0)
+		return NULL;
+	for(texcache_entry *e = texcache_names[texcache_name_bucket(texName)]; e != NULL; e = e->nextName)
+		if(e->texName == texName)
+			return e;
+	return NULL;
+}
+
+/** Changes how the cache loads and deletes textures. By default,
+    textures are loaded with kuhl_read_texture_file_wrap() and
+    deleted with glDeleteTextures(). This is mainly useful for testing
+    the cache without an OpenGL context. Change the loader before any
+    textures are added to the cache.
+
+    @param load The function which loads textures or NULL for the
+    default.
+
+    @param del The function which deletes textures or NULL for the
+    default.
+*/
+void texcache_set_loader(texcache_load_func load, texcache_delete_func del)
+{
+	if(texcache_count > 0)
+		msg(MSG_WARNING, "Changing the texture loader while %u textures are in the cache.", texcache_count);
+	texcache_load = load ? load : kuhl_read_texture_file_wrap;
+	texcache_delete = del ? del : texcache_delete_texture;
+}
+
+/** Gets a texture for an image file from the cache. If the image
+    hasn't been loaded with the same settings yet, it is loaded with
+    kuhl_read_texture_file_wrap() (see texcache_set_loader()).
+
+    @param filename Name of the image file.
+
+    @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+
+    @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+
+    @param aspectRatio Set to the aspect ratio of the image. May be NULL.
+
+    @return The texture, or 0 if the image couldn't be loaded. Call
+    texcache_release() when you are done with the texture.
+*/
+GLuint texcache_acquire(const char *filename, GLuint wrapS, GLuint wrapT, float *aspectRatio)
+{
+	if(filename == NULL)
+	{
+		msg(MSG_ERROR, "Failed to load texture file because filename was NULL.");
+		return 0;
+	}
+
+	const char *path = texcache_canonical_path(filename);
+	if(path == NULL)
+	{
+		msg(MSG_ERROR, "Unable to find texture file '%s'.", filename);
+		return 0;
+	}
+	int srgb = kuhl_config_int("color.linear", 1, 1);
+	uint32_t hash = texcache_hash(path, wrapS, wrapT, srgb);
+
+	texcache_entry *e = texcache_lookup(path, wrapS, wrapT, srgb, hash);
+	if(e != NULL)
+	{
+		e->refcount++;
+		texcache_hits++;
+		if(aspectRatio)
+			*aspectRatio = e->aspectRatio;
+		return e->texName;
+	}
+
+	GLuint texName = 0;
+	float aspect = texcache_load(path, &texName, wrapS, wrapT);
+	texcache_misses++;
+	if(aspect < 0 || texName == 0)
+		return 0;
+
+	/* Keep the tables at most 75% full. */
+	if((texcache_count+1)*4 > texcache_bucket_count*3)
+		texcache_resize(texcache_bucket_count == 0 ? 64 : texcache_bucket_count*2);
+
+	e = kuhl_malloc(sizeof(texcache_entry));
+	e->path = strdup(path);
+	e->wrapS = wrapS;
+	e->wrapT = wrapT;
+	e->srgb = srgb;
+	e->hash = hash;
+	e->texName = texName;
+	e->aspectRatio = aspect;
+	e->refcount = 1;
+	unsigned int k = hash & (texcache_bucket_count-1);
+	e->nextKey = texcache_keys[k];
+	texcache_keys[k] = e;
+	unsigned int n = texcache_name_bucket(texName);
+	e->nextName = texcache_names[n];
+	texcache_names[n] = e;
+	texcache_count++;
+
+	if(aspectRatio)
+		*aspectRatio = aspect;
+	return texName;
+}
+
+/** Finds a texture in the cache without loading it or adding a
+    reference to it.
+
+    @return The texture or 0 if the image hasn't been loaded with
+    these settings.
+*/
+GLuint texcache_find(const char *filename, GLuint wrapS, GLuint wrapT)
+{
+	if(filename == NULL || texcache_count == 0)
+		return 0;
+	const char *path = texcache_canonical_path(filename);
+	if(path == NULL)
+		return 0;
+	int srgb = kuhl_config_int("color.linear", 1, 1);
+	texcache_entry *e = texcache_lookup(path, wrapS, wrapT, srgb, texcache_hash(path, wrapS, wrapT, srgb));
+	if(e == NULL)
+		return 0;
+	return e->texName;
+}
+
+/** Releases a reference to a texture from texcache_acquire(). The
+ * texture is deleted when no references remain. */
+void texcache_release(GLuint texName)
+{
+	texcache_entry *e = texcache_lookup_name(texName);
+	if(e == NULL)
+	{
+		msg(MSG_WARNING, "Texture %u is not in the texture cache.", texName);
+		return;
+	}
+	e->refcount--;
+	if(e->refcount > 0)
+		return;
+
+	/* Unlink the entry from both tables. */
+	texcache_entry **p = &texcache_keys[e->hash & (texcache_bucket_count-1)];
+	while(*p != e)
+		p = &((*p)->nextKey);
+	*p = e->nextKey;
+	p = &texcache_names[texcache_name_bucket(texName)];
+	while(*p != e)
+		p = &((*p)->nextName);
+	*p = e->nextName;
+	texcache_count--;
+
+	texcache_delete(texName);
+	free(e->path);
+	free(e);
+}
+
+/** Returns the number of references to a texture in the cache, or 0
+ * if the texture isn't in the cache. */
+int texcache_refcount(GLuint texName)
+{
+	texcache_entry *e = texcache_lookup_name(texName);
+	if(e == NULL)
+		return 0;
+	return e->refcount;
+}
+
+/** Retrieves information about the cache.
+
+    @param textures Set to the number of textures in the cache. May be NULL.
+
+    @param hits Set to the number of times texcache_acquire() found an
+    existing texture. May be NULL.
+
+    @param misses Set to the number of times texcache_acquire() had to
+    load an image. May be NULL.
+*/
+void texcache_stats(unsigned int *textures, unsigned int *hits, unsigned int *misses)
+{
+	if(textures)
+		*textures = texcache_count;
+	if(hits)
+		*hits = texcache_hits;
+	if(misses)
+		*misses = texcache_misses;
+}
@@ -0,0 +1,58 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    A cache of textures loaded from image files which is shared by the
+    whole library. kuhl_read_texture_file() decodes and uploads an
+    image every time that it is called, even if the same image is
+    already in a texture. texcache_acquire() instead returns the
+    existing texture if one was loaded from the same file with the
+    same settings.
+
+    Textures are found by the canonical path of the file (so
+    "images/a.png" and "./images/../images/a.png" are the same), the
+    wrapping parameters and whether the texture uses sRGB storage
+    (color.linear). The canonical path of each filename is only
+    looked up in the file system the first time that the filename is
+    used. Each call to texcache_acquire() must be matched
+    with a call to texcache_release(); the texture is deleted when the
+    last reference is released. Do not call glDeleteTextures() on a
+    texture from the cache.
+
+    <pre>
+    float aspect;
+    GLuint tex = texcache_acquire("images/rainbow.png", GL_REPEAT, GL_REPEAT, &aspect);
+    ...
+    texcache_release(tex);
+    </pre>
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Loads an image file into a new texture. Returns the aspect ratio
+ * of the image or a negative number on failure (see
+ * kuhl_read_texture_file_wrap()). */
+typedef float (*texcache_load_func)(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT);
+/** Deletes a texture that was created by a texcache_load_func. */
+typedef void (*texcache_delete_func)(GLuint texName);
+
+void texcache_set_loader(texcache_load_func load, texcache_delete_func del);
+GLuint texcache_acquire(const char *filename, GLuint wrapS, GLuint wrapT, float *aspectRatio);
+GLuint texcache_find(const char *filename, GLuint wrapS, GLuint wrapT);
+void texcache_release(GLuint texName);
+int texcache_refcount(GLuint texName);
+void texcache_stats(unsigned int *textures, unsigned int *hits, unsigned int *misses);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
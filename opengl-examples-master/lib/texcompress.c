@@ -0,0 +1,1077 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <GL/glew.h>
+#include "texcompress.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "msg.h"
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+#include "imageio.h"
+#else
+#include "stb_image.h" // implementation is in kuhl-util.c
+#endif
+
+/* How the rows of pixels are stored inside of a block (used to flip
+ * images which are stored with the top row first). */
+#define TEXCOMPRESS_FLIP_NONE 0 /**< Can't be flipped without decoding */
+#define TEXCOMPRESS_FLIP_BC1  1
+#define TEXCOMPRESS_FLIP_BC2  2
+#define TEXCOMPRESS_FLIP_BC3  3
+#define TEXCOMPRESS_FLIP_BC4  4
+#define TEXCOMPRESS_FLIP_BC5  5
+
+/** A compressed format and the names that each file type uses for it. */
+typedef struct {
+	GLenum linear;         /**< OpenGL format (with linear storage) */
+	GLenum srgb;           /**< OpenGL format with sRGB storage, or 0 if there isn't one */
+	int blockBytes;        /**< Bytes per 4x4 block */
+	int flip;              /**< One of the TEXCOMPRESS_FLIP_ values */
+	const char *extension; /**< OpenGL extension which provides the format */
+	const char *version;   /**< OpenGL version which includes the format, or NULL */
+	unsigned int vk, vkSrgb;     /**< VkFormat values used by KTX2 files */
+	unsigned int dxgi, dxgiSrgb; /**< DXGI_FORMAT values used by DDS files */
+} texcompress_format;
+
+static const texcompress_format texcompress_formats[] = {
+	{ GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_SRGB_S3TC_DXT1_EXT, 8, TEXCOMPRESS_FLIP_BC1,
+	  "GL_EXT_texture_compression_s3tc", NULL, 131, 132, 0, 0 },
+	{ GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT, 8, TEXCOMPRESS_FLIP_BC1,
+	  "GL_EXT_texture_compression_s3tc", NULL, 133, 134, 71, 72 },
+	{ GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT, 16, TEXCOMPRESS_FLIP_BC2,
+	  "GL_EXT_texture_compression_s3tc", NULL, 135, 136, 74, 75 },
+	{ GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT, 16, TEXCOMPRESS_FLIP_BC3,
+	  "GL_EXT_texture_compression_s3tc", NULL, 137, 138, 77, 78 },
+	{ GL_COMPRESSED_RED_RGTC1, 0, 8, TEXCOMPRESS_FLIP_BC4,
+	  "GL_ARB_texture_compression_rgtc", "GL_VERSION_3_0", 139, 0, 80, 0 },
+	{ GL_COMPRESSED_SIGNED_RED_RGTC1, 0, 8, TEXCOMPRESS_FLIP_BC4,
+	  "GL_ARB_texture_compression_rgtc", "GL_VERSION_3_0", 140, 0, 81, 0 },
+	{ GL_COMPRESSED_RG_RGTC2, 0, 16, TEXCOMPRESS_FLIP_BC5,
+	  "GL_ARB_texture_compression_rgtc", "GL_VERSION_3_0", 141, 0, 83, 0 },
+	{ GL_COMPRESSED_SIGNED_RG_RGTC2, 0, 16, TEXCOMPRESS_FLIP_BC5,
+	  "GL_ARB_texture_compression_rgtc", "GL_VERSION_3_0", 142, 0, 84, 0 },
+	{ GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, 0, 16, TEXCOMPRESS_FLIP_NONE,
+	  "GL_ARB_texture_compression_bptc", "GL_VERSION_4_2", 143, 0, 95, 0 },
+	{ GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT, 0, 16, TEXCOMPRESS_FLIP_NONE,
+	  "GL_ARB_texture_compression_bptc", "GL_VERSION_4_2", 144, 0, 96, 0 },
+	{ GL_COMPRESSED_RGBA_BPTC_UNORM, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM, 16, TEXCOMPRESS_FLIP_NONE,
+	  "GL_ARB_texture_compression_bptc", "GL_VERSION_4_2", 145, 146, 98, 99 },
+	{ GL_COMPRESSED_RGB8_ETC2, GL_COMPRESSED_SRGB8_ETC2, 8, TEXCOMPRESS_FLIP_NONE,
+	  "GL_ARB_ES3_compatibility", "GL_VERSION_4_3", 147, 148, 0, 0 },
+	{ GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2, GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2, 8, TEXCOMPRESS_FLIP_NONE,
+	  "GL_ARB_ES3_compatibility", "GL_VERSION_4_3", 149, 150, 0, 0 },
+	{ GL_COMPRESSED_RGBA8_ETC2_EAC, GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC, 16, TEXCOMPRESS_FLIP_NONE,
+	  "GL_ARB_ES3_compatibility", "GL_VERSION_4_3", 151, 152, 0, 0 },
+};
+#define TEXCOMPRESS_FORMAT_COUNT (sizeof(texcompress_formats)/sizeof(texcompress_formats[0]))
+
+static const unsigned char texcompress_ktx1_id[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+static const unsigned char texcompress_ktx2_id[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+/** The value that we write for the KTXorientation key: the first row
+ * of each level is the bottom of the image. */
+#define TEXCOMPRESS_ORIENTATION "S=r,T=u"
+
+
+/* All of the integers in these files are little-endian. */
+static uint32_t texcompress_u32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static uint64_t texcompress_u64(const unsigned char *p)
+{
+	return (uint64_t)texcompress_u32(p) | (uint64_t)texcompress_u32(p+4) << 32;
+}
+
+/** Finds the entry in texcompress_formats for an OpenGL format. */
+static const texcompress_format* texcompress_find_gl(GLenum format)
+{
+	for(unsigned int i=0; i<TEXCOMPRESS_FORMAT_COUNT; i++)
+		if(texcompress_formats[i].linear == format || texcompress_formats[i].srgb == format)
+			return &texcompress_formats[i];
+	return NULL;
+}
+
+/** Sets img->internalformat and img->blockBytes from the entry in
+ * texcompress_formats which has a matching VkFormat (file=2) or
+ * DXGI_FORMAT (file=1) value. Returns -1 if there isn't one. */
+static int texcompress_set_format(texcompress_image *img, int file, unsigned int value)
+{
+	for(unsigned int i=0; i<TEXCOMPRESS_FORMAT_COUNT && value != 0; i++)
+	{
+		const texcompress_format *f = &texcompress_formats[i];
+		unsigned int lin  = file == 2 ? f->vk     : f->dxgi;
+		unsigned int srgb = file == 2 ? f->vkSrgb : f->dxgiSrgb;
+		if(value == lin || value == srgb)
+		{
+			img->internalformat = value == lin ? f->linear : f->srgb;
+			img->blockBytes = f->blockBytes;
+			return 0;
+		}
+	}
+	msg(MSG_ERROR, "Unsupported %s format %u.", file == 2 ? "VkFormat" : "DXGI_FORMAT", value);
+	return -1;
+}
+
+/** Checks that the mipmap levels fit in the file and sets
+ * img->levelSize. img->level[] must already be set. */
+static int texcompress_check_levels(texcompress_image *img)
+{
+	if(img->width < 1 || img->height < 1 || img->levels < 1 || img->levels > TEXCOMPRESS_MAX_LEVELS)
+	{
+		msg(MSG_ERROR, "Compressed texture has an invalid size (%dx%d, %d levels).", img->width, img->height, img->levels);
+		return -1;
+	}
+	for(int i=0; i<img->levels; i++)
+	{
+		int w = img->width  >> i;
+		int h = img->height >> i;
+		if(w < 1) w = 1;
+		if(h < 1) h = 1;
+		size_t size = (size_t)((w+3)/4) * ((h+3)/4) * img->blockBytes;
+		if(img->level[i] < img->file || img->level[i] + size > img->file + img->fileSize)
+		{
+			msg(MSG_ERROR, "Compressed texture is truncated (mipmap level %d).", i);
+			return -1;
+		}
+		img->levelSize[i] = size;
+	}
+	return 0;
+}
+
+/** Looks for the KTXorientation key in key/value data in a KTX or KTX2
+ * file and sets img->bottomUp from it. Both file types store the top
+ * row first if the key is missing. */
+static void texcompress_orientation(texcompress_image *img, const unsigned char *kv, size_t length)
+{
+	img->bottomUp = 0;
+	size_t offset = 0;
+	while(offset + 4 <= length)
+	{
+		uint32_t size = texcompress_u32(kv+offset);
+		const char *key = (const char*) kv+offset+4;
+		if(size > length-offset-4)
+			return;
+		size_t keyLen = strnlen(key, size);
+		if(keyLen < size && strcmp(key, "KTXorientation") == 0)
+		{
+			/* KTX files use "S=r,T=u" and KTX2 files use "ru" */
+			const char *value = key+keyLen+1;
+			size_t valueLen = strnlen(value, size-keyLen-1);
+			for(size_t i=0; i<valueLen; i++)
+				if(value[i] == 'u')
+					img->bottomUp = 1;
+			return;
+		}
+		offset += 4 + ((size+3) & ~3u);
+	}
+}
+
+static int texcompress_parse_ktx1(texcompress_image *img)
+{
+	const unsigned char *h = img->file;
+	if(img->fileSize < 64 || texcompress_u32(h+12) != 0x04030201)
+	{
+		msg(MSG_ERROR, "KTX file is truncated or big-endian.");
+		return -1;
+	}
+	if(texcompress_u32(h+16) != 0) // glType is 0 for compressed formats
+	{
+		msg(MSG_ERROR, "KTX file isn't compressed. Use texconvert to compress it.");
+		return -1;
+	}
+	if(texcompress_u32(h+44) > 1 || texcompress_u32(h+48) != 0 || texcompress_u32(h+52) != 1)
+	{
+		msg(MSG_ERROR, "KTX file is not a 2D texture (cube maps, arrays and 3D textures are not supported).");
+		return -1;
+	}
+	img->internalformat = texcompress_u32(h+28);
+	const texcompress_format *f = texcompress_find_gl(img->internalformat);
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Unsupported KTX internal format 0x%x.", img->internalformat);
+		return -1;
+	}
+	img->blockBytes = f->blockBytes;
+	img->width  = (int) texcompress_u32(h+36);
+	img->height = (int) texcompress_u32(h+40);
+	img->levels = (int) texcompress_u32(h+56);
+	if(img->levels == 0) // file wants us to generate mipmaps
+		img->levels = 1;
+
+	uint32_t kvBytes = texcompress_u32(h+60);
+	if(kvBytes > img->fileSize - 64)
+	{
+		msg(MSG_ERROR, "KTX file is truncated.");
+		return -1;
+	}
+	texcompress_orientation(img, h+64, kvBytes);
+
+	/* Each level is the number of bytes in the level followed by the
+	 * data (padded to a multiple of 4 bytes). */
+	size_t offset = 64 + kvBytes;
+	for(int i=0; i<img->levels && i<TEXCOMPRESS_MAX_LEVELS; i++)
+	{
+		if(offset + 4 > img->fileSize)
+		{
+			msg(MSG_ERROR, "KTX file is truncated (mipmap level %d).", i);
+			return -1;
+		}
+		uint32_t size = texcompress_u32(h+offset);
+		img->level[i] = img->file + offset + 4;
+		offset += 4 + (((size_t)size+3) & ~(size_t)3);
+	}
+	return texcompress_check_levels(img);
+}
+
+static int texcompress_parse_ktx2(texcompress_image *img)
+{
+	const unsigned char *h = img->file;
+	if(img->fileSize < 80)
+	{
+		msg(MSG_ERROR, "KTX2 file is truncated.");
+		return -1;
+	}
+	if(texcompress_u32(h+28) > 1 || texcompress_u32(h+32) > 1 || texcompress_u32(h+36) != 1)
+	{
+		msg(MSG_ERROR, "KTX2 file is not a 2D texture (cube maps, arrays and 3D textures are not supported).");
+		return -1;
+	}
+	if(texcompress_u32(h+44) != 0)
+	{
+		msg(MSG_ERROR, "KTX2 file uses supercompression (Basis Universal or Zstandard) which is not supported. Save it without supercompression.");
+		return -1;
+	}
+	if(texcompress_set_format(img, 2, texcompress_u32(h+12)) < 0)
+		return -1;
+	img->width  = (int) texcompress_u32(h+20);
+	img->height = (int) texcompress_u32(h+24);
+	img->levels = (int) texcompress_u32(h+40);
+	if(img->levels == 0)
+		img->levels = 1;
+	if(img->levels > TEXCOMPRESS_MAX_LEVELS || 80 + 24*(size_t)img->levels > img->fileSize)
+	{
+		msg(MSG_ERROR, "KTX2 file is truncated.");
+		return -1;
+	}
+
+	uint32_t kvOffset = texcompress_u32(h+56);
+	uint32_t kvBytes  = texcompress_u32(h+60);
+	img->bottomUp = 0;
+	if(kvOffset <= img->fileSize && kvBytes <= img->fileSize - kvOffset)
+		texcompress_orientation(img, h+kvOffset, kvBytes);
+
+	/* The level index is ordered from the largest level to the
+	 * smallest (the data in the file is stored in the opposite
+	 * order). */
+	for(int i=0; i<img->levels; i++)
+	{
+		uint64_t offset = texcompress_u64(h+80+24*i);
+		if(offset > img->fileSize)
+		{
+			msg(MSG_ERROR, "KTX2 file is truncated (mipmap level %d).", i);
+			return -1;
+		}
+		img->level[i] = img->file + offset;
+	}
+	return texcompress_check_levels(img);
+}
+
+static int texcompress_parse_dds(texcompress_image *img)
+{
+	const unsigned char *h = img->file;
+	if(img->fileSize < 128 || texcompress_u32(h+4) != 124)
+	{
+		msg(MSG_ERROR, "DDS file is truncated.");
+		return -1;
+	}
+	if(texcompress_u32(h+112) & 0x200) // DDSCAPS2_CUBEMAP
+	{
+		msg(MSG_ERROR, "DDS cube maps are not supported.");
+		return -1;
+	}
+	img->height = (int) texcompress_u32(h+12);
+	img->width  = (int) texcompress_u32(h+16);
+	img->levels = 1;
+	if(texcompress_u32(h+8) & 0x20000) // DDSD_MIPMAPCOUNT
+		img->levels = (int) texcompress_u32(h+28);
+	if(img->levels == 0)
+		img->levels = 1;
+	img->bottomUp = 0;
+
+	size_t offset = 128;
+	const unsigned char *fourcc = h+84;
+	if(memcmp(fourcc, "DX10", 4) == 0)
+	{
+		if(img->fileSize < 148)
+		{
+			msg(MSG_ERROR, "DDS file is truncated.");
+			return -1;
+		}
+		if(texcompress_u32(h+132) != 3 || (texcompress_u32(h+136) & 0x4) || texcompress_u32(h+140) > 1)
+		{
+			msg(MSG_ERROR, "DDS file is not a 2D texture (cube maps, arrays and 3D textures are not supported).");
+			return -1;
+		}
+		if(texcompress_set_format(img, 1, texcompress_u32(h+128)) < 0)
+			return -1;
+		offset = 148;
+	}
+	else
+	{
+		/* Older files name the format with a four character code. */
+		static const struct { const char *fourcc; GLenum format; } codes[] = {
+			{ "DXT1", GL_COMPRESSED_RGBA_S3TC_DXT1_EXT },
+			{ "DXT3", GL_COMPRESSED_RGBA_S3TC_DXT3_EXT },
+			{ "DXT5", GL_COMPRESSED_RGBA_S3TC_DXT5_EXT },
+			{ "ATI1", GL_COMPRESSED_RED_RGTC1 },
+			{ "BC4U", GL_COMPRESSED_RED_RGTC1 },
+			{ "BC4S", GL_COMPRESSED_SIGNED_RED_RGTC1 },
+			{ "ATI2", GL_COMPRESSED_RG_RGTC2 },
+			{ "BC5U", GL_COMPRESSED_RG_RGTC2 },
+			{ "BC5S", GL_COMPRESSED_SIGNED_RG_RGTC2 },
+		};
+		img->internalformat = 0;
+		for(unsigned int i=0; i<sizeof(codes)/sizeof(codes[0]); i++)
+			if(memcmp(fourcc, codes[i].fourcc, 4) == 0)
+				img->internalformat = codes[i].format;
+		if(img->internalformat == 0)
+		{
+			msg(MSG_ERROR, "DDS file isn't compressed with a supported format (FourCC '%.4s').", (const char*) fourcc);
+			return -1;
+		}
+		img->blockBytes = texcompress_find_gl(img->internalformat)->blockBytes;
+	}
+
+	/* The levels are stored one after another. */
+	for(int i=0; i<img->levels && i<TEXCOMPRESS_MAX_LEVELS; i++)
+	{
+		int w = img->width  >> i;
+		int h = img->height >> i;
+		if(w < 1) w = 1;
+		if(h < 1) h = 1;
+		img->level[i] = img->file + offset;
+		offset += (size_t)((w+3)/4) * ((h+3)/4) * img->blockBytes;
+	}
+	return texcompress_check_levels(img);
+}
+
+/** Fills in a texcompress_image from the contents of a KTX, KTX2 or
+    DDS file.
+
+    @param img The image to fill in.
+
+    @param file The contents of the file, allocated with malloc(). The
+    image takes ownership of it and texcompress_free() frees it
+    (even if this function fails).
+
+    @param fileSize Number of bytes in the file.
+
+    @return 0 on success or -1 if the file isn't a compressed texture
+    that we can read.
+*/
+int texcompress_parse(texcompress_image *img, unsigned char *file, size_t fileSize)
+{
+	memset(img, 0, sizeof(texcompress_image));
+	img->file = file;
+	img->fileSize = fileSize;
+	if(file == NULL || fileSize < 12)
+		return -1;
+
+	if(memcmp(file, texcompress_ktx1_id, 12) == 0)
+		return texcompress_parse_ktx1(img);
+	if(memcmp(file, texcompress_ktx2_id, 12) == 0)
+		return texcompress_parse_ktx2(img);
+	if(memcmp(file, "DDS ", 4) == 0)
+		return texcompress_parse_dds(img);
+	msg(MSG_ERROR, "File is not a KTX, KTX2 or DDS file.");
+	return -1;
+}
+
+/** Reads a KTX, KTX2 or DDS file into memory. Call texcompress_free()
+    when you are done with the image (even if this function fails).
+
+    @param img The image to fill in.
+
+    @param filename The file to read (found with kuhl_find_file()).
+
+    @return 0 on success or -1 on error.
+*/
+int texcompress_read(texcompress_image *img, const char *filename)
+{
+	memset(img, 0, sizeof(texcompress_image));
+	char *path = kuhl_find_file(filename);
+	FILE *f = fopen(path, "rb");
+	free(path);
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Unable to open '%s'.", filename);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if(size <= 0)
+	{
+		msg(MSG_ERROR, "Unable to read '%s'.", filename);
+		fclose(f);
+		return -1;
+	}
+	unsigned char *file = kuhl_malloc(size);
+	size_t got = fread(file, 1, size, f);
+	fclose(f);
+	if(got != (size_t) size)
+	{
+		msg(MSG_ERROR, "Unable to read '%s'.", filename);
+		free(file);
+		return -1;
+	}
+
+	if(texcompress_parse(img, file, size) < 0)
+	{
+		msg(MSG_ERROR, "Failed to read compressed texture '%s'.", filename);
+		return -1;
+	}
+	return 0;
+}
+
+/** Frees the memory used by an image from texcompress_read() or
+ * texcompress_parse(). */
+void texcompress_free(texcompress_image *img)
+{
+	free(img->file);
+	memset(img, 0, sizeof(texcompress_image));
+}
+
+/** Checks the first few bytes of a file to see if it is a KTX, KTX2
+ * or DDS file.
+ *
+ * @return 1 if the file is one of these files, 0 otherwise.
+ */
+int texcompress_is_container(const char *filename)
+{
+	if(filename == NULL)
+		return 0;
+	char *path = kuhl_find_file(filename);
+	FILE *f = fopen(path, "rb");
+	free(path);
+	if(f == NULL)
+		return 0;
+	unsigned char id[12];
+	size_t got = fread(id, 1, 12, f);
+	fclose(f);
+	if(got != 12)
+		return 0;
+	return memcmp(id, texcompress_ktx1_id, 12) == 0 ||
+		memcmp(id, texcompress_ktx2_id, 12) == 0 ||
+		memcmp(id, "DDS ", 4) == 0;
+}
+
+
+/* Each of the following functions reverses the order of the first
+ * "rows" rows of pixels inside of one block. */
+static void texcompress_flip_bc1(unsigned char *b, int rows)
+{
+	/* Two bytes for each color, then one byte of indices per row. */
+	for(int r=0; r<rows/2; r++)
+	{
+		unsigned char t = b[4+r];
+		b[4+r] = b[4+rows-1-r];
+		b[4+rows-1-r] = t;
+	}
+}
+static void texcompress_flip_bc2(unsigned char *b, int rows)
+{
+	/* Two bytes of alpha per row, then a BC1 block. */
+	for(int r=0; r<rows/2; r++)
+	{
+		unsigned char t[2];
+		memcpy(t, b+2*r, 2);
+		memcpy(b+2*r, b+2*(rows-1-r), 2);
+		memcpy(b+2*(rows-1-r), t, 2);
+	}
+	texcompress_flip_bc1(b+8, rows);
+}
+static void texcompress_flip_bc4(unsigned char *b, int rows)
+{
+	/* Two endpoints followed by 12 bits of indices per row. */
+	uint64_t bits = 0, flipped = 0;
+	for(int i=0; i<6; i++)
+		bits |= (uint64_t)b[2+i] << (8*i);
+	for(int r=0; r<4; r++)
+	{
+		int from = r < rows ? rows-1-r : r;
+		flipped |= ((bits >> (12*from)) & 0xFFF) << (12*r);
+	}
+	for(int i=0; i<6; i++)
+		b[2+i] = (unsigned char)(flipped >> (8*i));
+}
+
+/** Flips one mipmap level upside down. Returns 0 if the level can't
+ * be flipped without decoding it. */
+static int texcompress_flip_level(unsigned char *data, int width, int height, int blockBytes, int kind)
+{
+	/* If the height isn't a multiple of 4, the rows in each flipped
+	 * block would come from two different blocks. */
+	if(kind == TEXCOMPRESS_FLIP_NONE || (height > 4 && height % 4 != 0))
+		return 0;
+
+	int blocksWide = (width+3)/4;
+	int blocksHigh = (height+3)/4;
+	int rows = height < 4 ? height : 4;
+	size_t rowBytes = (size_t) blocksWide * blockBytes;
+
+	unsigned char *temp = kuhl_malloc(rowBytes);
+	for(int j=0; j<blocksHigh/2; j++)
+	{
+		unsigned char *a = data + j*rowBytes;
+		unsigned char *b = data + (blocksHigh-1-j)*rowBytes;
+		memcpy(temp, a, rowBytes);
+		memcpy(a, b, rowBytes);
+		memcpy(b, temp, rowBytes);
+	}
+	free(temp);
+
+	for(size_t i=0; i<(size_t)blocksWide*blocksHigh; i++)
+	{
+		unsigned char *b = data + i*blockBytes;
+		switch(kind)
+		{
+			case TEXCOMPRESS_FLIP_BC1: texcompress_flip_bc1(b, rows); break;
+			case TEXCOMPRESS_FLIP_BC2: texcompress_flip_bc2(b, rows); break;
+			case TEXCOMPRESS_FLIP_BC3: texcompress_flip_bc4(b, rows); texcompress_flip_bc1(b+8, rows); break;
+			case TEXCOMPRESS_FLIP_BC4: texcompress_flip_bc4(b, rows); break;
+			case TEXCOMPRESS_FLIP_BC5: texcompress_flip_bc4(b, rows); texcompress_flip_bc4(b+8, rows); break;
+		}
+	}
+	return 1;
+}
+
+/** Flips an image which was stored with the top row first so that
+    the bottom row is first (which is what OpenGL and the rest of this
+    library expect). BC1-BC5 images are flipped by rearranging the
+    blocks. Other formats can't be flipped without decoding them.
+
+    @return 1 if the image was flipped (or didn't need to be), 0 if it
+    couldn't be flipped.
+*/
+int texcompress_flip(texcompress_image *img)
+{
+	if(img->bottomUp)
+		return 1;
+	const texcompress_format *f = texcompress_find_gl(img->internalformat);
+	if(f == NULL || f->flip == TEXCOMPRESS_FLIP_NONE)
+		return 0;
+
+	/* Make sure we can flip every level before changing any of them. */
+	for(int i=0; i<img->levels; i++)
+	{
+		int h = img->height >> i;
+		if(h > 4 && h % 4 != 0)
+			return 0;
+	}
+	for(int i=0; i<img->levels; i++)
+	{
+		int w = img->width  >> i;
+		int h = img->height >> i;
+		texcompress_flip_level(img->level[i], w < 1 ? 1 : w, h < 1 ? 1 : h, img->blockBytes, f->flip);
+	}
+	img->bottomUp = 1;
+	return 1;
+}
+
+
+/** Reads a compressed texture from a KTX, KTX2 or DDS file and
+    uploads every mipmap level in the file with
+    glCompressedTexImage2D(). If the file contains only one level, the
+    texture is not mipmapped. Formats which have an sRGB version are
+    stored as sRGB if color.linear is set (like
+    kuhl_read_texture_array() does).
+
+    @param filename name of file to load
+
+    @param texName A pointer to where the OpenGL texture name should be stored.
+
+    @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+
+    @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+
+    @returns The aspect ratio of the image in the file or a negative
+    number on error.
+*/
+float kuhl_read_texture_file_compressed(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
+{
+	*texName = 0;
+	texcompress_image img;
+	if(texcompress_read(&img, filename) < 0)
+	{
+		texcompress_free(&img);
+		return -1;
+	}
+
+	const texcompress_format *f = texcompress_find_gl(img.internalformat);
+	if(!glewIsSupported(f->extension) && (f->version == NULL || !glewIsSupported(f->version)))
+	{
+		msg(MSG_ERROR, "Unable to load '%s' because your OpenGL implementation doesn't support its compressed format (%s).", filename, f->extension);
+		texcompress_free(&img);
+		return -1;
+	}
+	if(f->srgb != 0)
+		img.internalformat = kuhl_config_int("color.linear", 1, 1) ? f->srgb : f->linear;
+	if(!texcompress_flip(&img))
+		msg(MSG_WARNING, "'%s' is stored with the top row first and its format can't be flipped. It will appear upside down.", filename);
+
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	if(img.width > maxTextureSize || img.height > maxTextureSize)
+	{
+		msg(MSG_ERROR, "Unable to load %dx%d texture '%s' because it is too large.", img.width, img.height, filename);
+		msg(MSG_ERROR, "Your card's rough estimate for the maximum texture size that it supports: %dx%d\n", maxTextureSize, maxTextureSize);
+		texcompress_free(&img);
+		return -1;
+	}
+
+	kuhl_errorcheck();
+	glGenTextures(1, texName);
+	glBindTexture(GL_TEXTURE_2D, *texName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, img.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, img.levels-1);
+	if(glewIsSupported("GL_EXT_texture_filter_anisotropic"))
+	{
+		float maxAniso;
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAniso);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAniso);
+	}
+
+	for(int i=0; i<img.levels; i++)
+	{
+		int w = img.width  >> i;
+		int h = img.height >> i;
+		glCompressedTexImage2D(GL_TEXTURE_2D, i, img.internalformat, w < 1 ? 1 : w, h < 1 ? 1 : h,
+		                       0, (GLsizei) img.levelSize[i], img.level[i]);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	GLenum err = glGetError();
+	if(err != GL_NO_ERROR)
+	{
+		msg(MSG_ERROR, "Failed to create OpenGL texture from %s (OpenGL error 0x%x)\n", filename, err);
+		glDeleteTextures(1, texName);
+		*texName = 0;
+		texcompress_free(&img);
+		return -1;
+	}
+
+	msg(MSG_DEBUG, "Finished reading '%s' (%dx%d, %d mipmap levels, texName=%d) without decoding\n",
+	    filename, img.width, img.height, img.levels, *texName);
+	float aspectRatio = (float)img.width/img.height;
+	texcompress_free(&img);
+	return aspectRatio;
+}
+
+
+static uint16_t texcompress_pack565(const int c[3])
+{
+	return (uint16_t)(((c[0]*31+127)/255) << 11 | ((c[1]*63+127)/255) << 5 | ((c[2]*31+127)/255));
+}
+static void texcompress_unpack565(uint16_t v, int c[3])
+{
+	int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+	c[0] = (r << 3) | (r >> 2);
+	c[1] = (g << 2) | (g >> 4);
+	c[2] = (b << 3) | (b >> 2);
+}
+
+/** Compresses a 4x4 block of pixels into BC1 (DXT1). The endpoints
+    are the corners of the bounding box of the colors in the block,
+    moved slightly inward.
+
+    @param rgba 16 RGBA pixels, one row after another. Alpha is ignored.
+
+    @param block The 8 byte block to fill in.
+*/
+void texcompress_encode_bc1(const unsigned char rgba[64], unsigned char block[8])
+{
+	int lo[3] = { 255, 255, 255 };
+	int hi[3] = { 0, 0, 0 };
+	int mean[3] = { 0, 0, 0 };
+	for(int i=0; i<16; i++)
+		for(int c=0; c<3; c++)
+		{
+			int v = rgba[4*i+c];
+			if(v < lo[c]) lo[c] = v;
+			if(v > hi[c]) hi[c] = v;
+			mean[c] += v;
+		}
+
+	/* Use the diagonal of the box that the colors lie along: If a
+	 * channel decreases as the channel with the largest range
+	 * increases, swap its endpoints. */
+	int ref = 0;
+	for(int c=1; c<3; c++)
+		if(hi[c]-lo[c] > hi[ref]-lo[ref])
+			ref = c;
+	for(int c=0; c<3; c++)
+	{
+		if(c == ref)
+			continue;
+		long cov = 0;
+		for(int i=0; i<16; i++)
+			cov += (long)(16*rgba[4*i+ref] - mean[ref]) * (16*rgba[4*i+c] - mean[c]);
+		if(cov < 0)
+		{
+			int t = lo[c];
+			lo[c] = hi[c];
+			hi[c] = t;
+		}
+	}
+	for(int c=0; c<3; c++)
+	{
+		int inset = (hi[c]-lo[c])/16;
+		hi[c] -= inset;
+		lo[c] += inset;
+	}
+
+	uint16_t c0 = texcompress_pack565(hi);
+	uint16_t c1 = texcompress_pack565(lo);
+	if(c0 < c1)
+	{
+		uint16_t t = c0;
+		c0 = c1;
+		c1 = t;
+	}
+
+	uint32_t indices = 0;
+	if(c0 != c1)
+	{
+		int pal[4][3];
+		texcompress_unpack565(c0, pal[0]);
+		texcompress_unpack565(c1, pal[1]);
+		for(int c=0; c<3; c++)
+		{
+			pal[2][c] = (2*pal[0][c] + pal[1][c])/3;
+			pal[3][c] = (pal[0][c] + 2*pal[1][c])/3;
+		}
+		for(int i=0; i<16; i++)
+		{
+			int best = 0, bestDist = 0x7fffffff;
+			for(int p=0; p<4; p++)
+			{
+				int dist = 0;
+				for(int c=0; c<3; c++)
+				{
+					int d = rgba[4*i+c] - pal[p][c];
+					dist += d*d;
+				}
+				if(dist < bestDist)
+				{
+					bestDist = dist;
+					best = p;
+				}
+			}
+			indices |= (uint32_t)best << (2*i);
+		}
+	}
+
+	block[0] = c0 & 0xff;
+	block[1] = c0 >> 8;
+	block[2] = c1 & 0xff;
+	block[3] = c1 >> 8;
+	for(int i=0; i<4; i++)
+		block[4+i] = (indices >> (8*i)) & 0xff;
+}
+
+/** Compresses a 4x4 block of pixels into BC3 (DXT5): The alpha
+    values are stored in a block which interpolates between the
+    smallest and largest alpha value and the colors are stored in a
+    BC1 block.
+
+    @param rgba 16 RGBA pixels, one row after another.
+
+    @param block The 16 byte block to fill in.
+*/
+void texcompress_encode_bc3(const unsigned char rgba[64], unsigned char block[16])
+{
+	int lo = 255, hi = 0;
+	for(int i=0; i<16; i++)
+	{
+		if(rgba[4*i+3] < lo) lo = rgba[4*i+3];
+		if(rgba[4*i+3] > hi) hi = rgba[4*i+3];
+	}
+
+	uint64_t indices = 0;
+	if(hi > lo)
+	{
+		int pal[8] = { hi, lo };
+		for(int i=1; i<7; i++)
+			pal[i+1] = ((7-i)*hi + i*lo + 3)/7;
+		for(int i=0; i<16; i++)
+		{
+			int best = 0;
+			for(int p=1; p<8; p++)
+				if(abs(rgba[4*i+3]-pal[p]) < abs(rgba[4*i+3]-pal[best]))
+					best = p;
+			indices |= (uint64_t)best << (3*i);
+		}
+	}
+	block[0] = (unsigned char) hi;
+	block[1] = (unsigned char) lo;
+	for(int i=0; i<6; i++)
+		block[2+i] = (indices >> (8*i)) & 0xff;
+	texcompress_encode_bc1(rgba, block+8);
+}
+
+static float texcompress_to_linear(unsigned char v)
+{
+	float c = v/255.0f;
+	return c <= 0.04045f ? c/12.92f : powf((c+0.055f)/1.055f, 2.4f);
+}
+static unsigned char texcompress_to_srgb(float c)
+{
+	c = c <= 0.0031308f ? c*12.92f : 1.055f*powf(c, 1/2.4f)-0.055f;
+	return (unsigned char)(c*255+0.5f);
+}
+
+/** Makes the next smaller mipmap level by averaging 2x2 boxes of
+ * pixels. If srgb is set, colors are averaged in linear light. */
+static unsigned char* texcompress_downsample(const unsigned char *rgba, int width, int height, int srgb)
+{
+	int w = width  > 1 ? width/2  : 1;
+	int h = height > 1 ? height/2 : 1;
+	unsigned char *out = kuhl_malloc((size_t)w*h*4);
+	for(int y=0; y<h; y++)
+		for(int x=0; x<w; x++)
+		{
+			int x0 = 2*x, x1 = 2*x+1 < width  ? 2*x+1 : width-1;
+			int y0 = 2*y, y1 = 2*y+1 < height ? 2*y+1 : height-1;
+			if(x0 >= width)  x0 = width-1;
+			if(y0 >= height) y0 = height-1;
+			const unsigned char *p[4] = {
+				rgba + ((size_t)y0*width+x0)*4, rgba + ((size_t)y0*width+x1)*4,
+				rgba + ((size_t)y1*width+x0)*4, rgba + ((size_t)y1*width+x1)*4 };
+			unsigned char *o = out + ((size_t)y*w+x)*4;
+			for(int c=0; c<4; c++)
+			{
+				if(srgb && c < 3)
+				{
+					float sum = 0;
+					for(int i=0; i<4; i++)
+						sum += texcompress_to_linear(p[i][c]);
+					o[c] = texcompress_to_srgb(sum/4);
+				}
+				else
+					o[c] = (unsigned char)((p[0][c]+p[1][c]+p[2][c]+p[3][c]+2)/4);
+			}
+		}
+	return out;
+}
+
+static void texcompress_put_u32(FILE *f, uint32_t v)
+{
+	unsigned char b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff };
+	fwrite(b, 1, 4, f);
+}
+
+/** Compresses an image (and every mipmap level below it) and writes
+    it to a KTX file.
+
+    @param filename The file to write.
+
+    @param rgba RGBA pixels with the bottom row of the image first.
+
+    @param width Width of the image.
+
+    @param height Height of the image.
+
+    @param format One of GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+    GL_COMPRESSED_SRGB_S3TC_DXT1_EXT (BC1, no alpha),
+    GL_COMPRESSED_RGBA_S3TC_DXT5_EXT or
+    GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT (BC3). For the sRGB
+    formats, the mipmaps are averaged in linear light.
+
+    @return 0 on success, -1 on error.
+*/
+int texcompress_write_ktx(const char *filename, const unsigned char *rgba, int width, int height, GLenum format)
+{
+	int bc3 = (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT || format == GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT);
+	int srgb = (format == GL_COMPRESSED_SRGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT);
+	if(!bc3 && format != GL_COMPRESSED_RGB_S3TC_DXT1_EXT && format != GL_COMPRESSED_SRGB_S3TC_DXT1_EXT)
+	{
+		msg(MSG_ERROR, "Can't write compressed format 0x%x, use BC1 or BC3.", format);
+		return -1;
+	}
+	if(width < 1 || height < 1)
+		return -1;
+
+	FILE *f = fopen(filename, "wb");
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Unable to open '%s' for writing.", filename);
+		return -1;
+	}
+
+	int levels = 1;
+	while((width >> levels) > 0 || (height >> levels) > 0)
+		levels++;
+	int blockBytes = bc3 ? 16 : 8;
+
+	fwrite(texcompress_ktx1_id, 1, 12, f);
+	texcompress_put_u32(f, 0x04030201);
+	texcompress_put_u32(f, 0);  // glType
+	texcompress_put_u32(f, 1);  // glTypeSize
+	texcompress_put_u32(f, 0);  // glFormat
+	texcompress_put_u32(f, format);
+	texcompress_put_u32(f, bc3 ? GL_RGBA : GL_RGB);
+	texcompress_put_u32(f, width);
+	texcompress_put_u32(f, height);
+	texcompress_put_u32(f, 0);  // depth
+	texcompress_put_u32(f, 0);  // array elements
+	texcompress_put_u32(f, 1);  // faces
+	texcompress_put_u32(f, levels);
+
+	/* Record that the bottom row is first so readers don't flip it. */
+	const char key[] = "KTXorientation";
+	const char value[] = TEXCOMPRESS_ORIENTATION;
+	uint32_t kvSize = sizeof(key) + sizeof(value);
+	uint32_t kvPadded = (kvSize+3) & ~3u;
+	texcompress_put_u32(f, 4 + kvPadded);
+	texcompress_put_u32(f, kvSize);
+	fwrite(key, 1, sizeof(key), f);
+	fwrite(value, 1, sizeof(value), f);
+	const unsigned char pad[4] = { 0, 0, 0, 0 };
+	fwrite(pad, 1, kvPadded-kvSize, f);
+
+	const unsigned char *level = rgba;
+	unsigned char *smaller = NULL;
+	int w = width, h = height;
+	for(int i=0; i<levels; i++)
+	{
+		int blocksWide = (w+3)/4;
+		int blocksHigh = (h+3)/4;
+		size_t size = (size_t) blocksWide * blocksHigh * blockBytes;
+		unsigned char *data = kuhl_malloc(size);
+		for(int by=0; by<blocksHigh; by++)
+			for(int bx=0; bx<blocksWide; bx++)
+			{
+				/* Repeat the last row/column for blocks which hang
+				 * off of the edge of the image. */
+				unsigned char px[64];
+				for(int y=0; y<4; y++)
+					for(int x=0; x<4; x++)
+					{
+						int sx = bx*4+x < w ? bx*4+x : w-1;
+						int sy = by*4+y < h ? by*4+y : h-1;
+						memcpy(px+(y*4+x)*4, level+((size_t)sy*w+sx)*4, 4);
+					}
+				unsigned char *block = data + ((size_t)by*blocksWide+bx)*blockBytes;
+				if(bc3)
+					texcompress_encode_bc3(px, block);
+				else
+					texcompress_encode_bc1(px, block);
+			}
+		texcompress_put_u32(f, (uint32_t) size);
+		fwrite(data, 1, size, f);
+		free(data);
+
+		if(i+1 < levels)
+		{
+			unsigned char *next = texcompress_downsample(level, w, h, srgb);
+			free(smaller);
+			smaller = next;
+			level = next;
+			w = w > 1 ? w/2 : 1;
+			h = h > 1 ? h/2 : 1;
+		}
+	}
+	free(smaller);
+
+	int err = ferror(f);
+	if(fclose(f) != 0 || err)
+	{
+		msg(MSG_ERROR, "Failed to write '%s'.", filename);
+		return -1;
+	}
+	return 0;
+}
+
+/** Reads an image file and writes it as a compressed KTX file with a
+    full set of mipmaps (see texcompress_write_ktx()).
+
+    @param input An image file that kuhl_read_texture_file() can read.
+
+    @param output The KTX file to write.
+
+    @param format The compressed format to use, or 0 to use
+    GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT if the image has transparent
+    pixels and GL_COMPRESSED_SRGB_S3TC_DXT1_EXT otherwise.
+
+    @return 0 on success, -1 on error.
+*/
+int texcompress_convert(const char *input, const char *output, GLenum format)
+{
+	char *path = kuhl_find_file(input);
+	int width = 0, height = 0;
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info iioinfo;
+	iioinfo.filename   = path;
+	iioinfo.type       = CharPixel;
+	iioinfo.map        = (char*) "RGBA";
+	iioinfo.colorspace = sRGBColorspace;
+	unsigned char *image = (unsigned char*) imagein(&iioinfo);
+	if(image != NULL)
+	{
+		width  = (int)iioinfo.width;
+		height = (int)iioinfo.height;
+		if(iioinfo.comment)
+			free(iioinfo.comment);
+	}
+#else
+	int comp;
+	stbi_set_flip_vertically_on_load(1);
+	unsigned char *image = stbi_load(path, &width, &height, &comp, STBI_rgb_alpha);
+#endif
+	free(path);
+	if(image == NULL)
+	{
+		msg(MSG_ERROR, "Unable to read '%s'.", input);
+		return -1;
+	}
+
+	if(format == 0)
+	{
+		format = GL_COMPRESSED_SRGB_S3TC_DXT1_EXT;
+		for(size_t i=0; i<(size_t)width*height; i++)
+			if(image[4*i+3] != 255)
+			{
+				format = GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;
+				break;
+			}
+	}
+
+	int ret = texcompress_write_ktx(output, image, width, height, format);
+	if(ret == 0)
+		msg(MSG_INFO, "Wrote '%s' (%dx%d, %s)", output, width, height,
+		    (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT || format == GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT) ? "BC3" : "BC1");
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	free(image);
+#else
+	stbi_image_free(image);
+#endif
+	return ret;
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Reads textures which are already compressed into a format that the
+    video card can sample from directly (BC1-BC7 or ETC2) from KTX,
+    KTX2 and DDS files. The mipmaps stored in the file are uploaded
+    with glCompressedTexImage2D(): the image isn't decoded on the CPU
+    and no mipmaps are generated at runtime. A BC1 texture uses 1/8th
+    of the memory of the same image stored as GL_SRGB8_ALPHA8.
+
+    kuhl_read_texture_file() calls kuhl_read_texture_file_compressed()
+    when it is given one of these files, so most programs never need
+    to call the functions here directly.
+
+    Images can be converted into KTX files with the texconvert sample
+    program, which uses texcompress_convert():
+
+    <pre>
+    ./texconvert ../images/panorama.png panorama.ktx
+    </pre>
+
+    The file is found by its contents (not its extension). Cube maps,
+    arrays, 3D textures and supercompressed KTX2 files (Basis
+    Universal or Zstandard) are not supported.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <stddef.h>
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Largest number of mipmap levels that a file may contain (enough
+ * for a 65536x65536 texture). */
+#define TEXCOMPRESS_MAX_LEVELS 17
+
+/** A compressed texture read from a KTX, KTX2 or DDS file. */
+typedef struct {
+	GLenum internalformat; /**< Format to pass to glCompressedTexImage2D() */
+	int width, height;     /**< Size of the largest mipmap level */
+	int levels;            /**< Number of mipmap levels in the file */
+	int blockBytes;        /**< Number of bytes used for each 4x4 block */
+	int bottomUp;          /**< 1 if the first row of each level is the bottom of the image */
+	unsigned char *level[TEXCOMPRESS_MAX_LEVELS]; /**< Start of each mipmap level */
+	size_t levelSize[TEXCOMPRESS_MAX_LEVELS];     /**< Bytes in each mipmap level */
+	unsigned char *file;   /**< Contents of the file */
+	size_t fileSize;
+} texcompress_image;
+
+int texcompress_is_container(const char *filename);
+int texcompress_parse(texcompress_image *img, unsigned char *file, size_t fileSize);
+int texcompress_read(texcompress_image *img, const char *filename);
+void texcompress_free(texcompress_image *img);
+int texcompress_flip(texcompress_image *img);
+float kuhl_read_texture_file_compressed(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT);
+
+void texcompress_encode_bc1(const unsigned char rgba[64], unsigned char block[8]);
+void texcompress_encode_bc3(const unsigned char rgba[64], unsigned char block[16]);
+int texcompress_write_ktx(const char *filename, const unsigned char *rgba, int width, int height, GLenum format);
+int texcompress_convert(const char *input, const char *output, GLenum format);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -0,0 +1,516 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#define TEXLOAD_THREADS 1
+#endif
+
+#include <GL/glew.h>
+#include "texload.h"
+#include "texcompress.h"
+#include "kuhl-util.h"
+#include "kuhl-config.h"
+#include "list.h"
+#include "queue.h"
+#include "msg.h"
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+#include "imageio.h"
+#else
+#include "stb_image.h" // implementation is in kuhl-util.c
+#endif
+
+/** The largest number of decoding threads we will start. */
+#define TEXLOAD_MAX_THREADS 8
+
+/* The stages that each texture goes through. */
+#define TEXLOAD_STATE_QUEUED  0 /**< Waiting to be decoded */
+#define TEXLOAD_STATE_DECODED 1 /**< Decoded, waiting to be staged */
+#define TEXLOAD_STATE_STAGING 2 /**< Being copied into the unpack buffer */
+#define TEXLOAD_STATE_READY   3 /**< Texture contains the image */
+#define TEXLOAD_STATE_FAILED  4 /**< Texture still contains the placeholder */
+
+/** A texture that was requested with kuhl_read_texture_file_async(). */
+typedef struct {
+	GLuint texName;
+	char *path;            /**< Image file, as found by kuhl_find_file() */
+	int state;             /**< One of the TEXLOAD_STATE_ values */
+	unsigned char *pixels; /**< Decoded RGBA pixels with the bottom row first */
+	int width, height;
+	size_t staged;         /**< Bytes of pixels copied into the unpack buffer */
+} texload_item;
+
+static list *texload_items = NULL;  /**< Every texload_item, in the order they were requested */
+static queue *texload_queue = NULL; /**< Items waiting to be decoded */
+static int texload_remaining = 0;   /**< Number of items that aren't ready or failed */
+static int texload_decoded = 0;     /**< Number of items in the TEXLOAD_STATE_DECODED state */
+
+static texload_item *texload_current = NULL; /**< Item being staged */
+static GLuint texload_pbo = 0;               /**< Pixel unpack buffer used for staging */
+
+#ifdef TEXLOAD_THREADS
+static pthread_t texload_threads[TEXLOAD_MAX_THREADS];
+static int texload_thread_count = 0;
+static pthread_mutex_t texload_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when an item is added to texload_queue or the workers should exit. */
+static pthread_cond_t texload_cond_work = PTHREAD_COND_INITIALIZER;
+/** Signaled when a worker finishes decoding an image. */
+static pthread_cond_t texload_cond_done = PTHREAD_COND_INITIALIZER;
+static int texload_quit = 0;
+#define texload_lock()   pthread_mutex_lock(&texload_mutex)
+#define texload_unlock() pthread_mutex_unlock(&texload_mutex)
+#else
+#define texload_lock()
+#define texload_unlock()
+#endif
+
+
+static void texload_free_pixels(unsigned char *pixels)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	free(pixels);
+#else
+	stbi_image_free(pixels);
+#endif
+}
+
+/** Decodes the image for an item. Called by the worker threads. */
+static void texload_decode(texload_item *item)
+{
+	int width = 0, height = 0;
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info iioinfo;
+	iioinfo.filename   = item->path;
+	iioinfo.type       = CharPixel;
+	iioinfo.map        = (char*) "RGBA";
+	iioinfo.colorspace = sRGBColorspace;
+	unsigned char *image = (unsigned char*) imagein(&iioinfo);
+	if(image != NULL)
+	{
+		width  = (int)iioinfo.width;
+		height = (int)iioinfo.height;
+		if(iioinfo.comment)
+			free(iioinfo.comment);
+	}
+#else
+	int comp;
+	unsigned char *image = stbi_load(item->path, &width, &height, &comp, STBI_rgb_alpha);
+#endif
+	if(image == NULL)
+		msg(MSG_ERROR, "Unable to read '%s'.", item->path);
+
+	texload_lock();
+	item->pixels = image;
+	item->width = width;
+	item->height = height;
+	if(image)
+	{
+		item->state = TEXLOAD_STATE_DECODED;
+		texload_decoded++;
+	}
+	else
+	{
+		item->state = TEXLOAD_STATE_FAILED;
+		texload_remaining--;
+	}
+#ifdef TEXLOAD_THREADS
+	pthread_cond_broadcast(&texload_cond_done);
+#endif
+	texload_unlock();
+}
+
+#ifdef TEXLOAD_THREADS
+/** Decodes images from texload_queue until texload_quit is set. */
+static void* texload_worker(void *arg)
+{
+	texload_lock();
+	while(1)
+	{
+		while(queue_length(texload_queue) == 0 && !texload_quit)
+			pthread_cond_wait(&texload_cond_work, &texload_mutex);
+		if(texload_quit)
+			break;
+
+		texload_item *item;
+		queue_remove(texload_queue, &item);
+		texload_unlock();
+		texload_decode(item);
+		texload_lock();
+	}
+	texload_unlock();
+	return NULL;
+}
+
+/** Stops the workers when the program exits. Images which haven't
+ * been decoded yet are skipped. */
+static void texload_shutdown(void)
+{
+	texload_lock();
+	texload_quit = 1;
+	pthread_cond_broadcast(&texload_cond_work);
+	texload_unlock();
+	for(int i=0; i<texload_thread_count; i++)
+		pthread_join(texload_threads[i], NULL);
+}
+#endif
+
+/** Sets up our lists and starts the worker threads the first time
+ * that it is called. */
+static void texload_init(void)
+{
+	if(texload_items != NULL)
+		return;
+
+	texload_items = list_new(32, sizeof(texload_item*), NULL);
+	texload_queue = queue_new(32, sizeof(texload_item*));
+
+#ifndef KUHL_UTIL_USE_IMAGEMAGICK
+	/* Flip images the same way kuhl_read_texture_file() does. This
+	 * version of stb_image only has a global setting, so we set it
+	 * once here before any worker can read it. */
+	stbi_set_flip_vertically_on_load(1);
+#endif
+
+#ifdef TEXLOAD_THREADS
+	texload_thread_count = kuhl_config_int("texload.threads", 2, 2);
+	if(texload_thread_count < 1)
+		texload_thread_count = 1;
+	if(texload_thread_count > TEXLOAD_MAX_THREADS)
+		texload_thread_count = TEXLOAD_MAX_THREADS;
+	for(int i=0; i<texload_thread_count; i++)
+	{
+		if(pthread_create(&texload_threads[i], NULL, texload_worker, NULL) != 0)
+		{
+			msg(MSG_FATAL, "Unable to start texture loading thread.");
+			exit(EXIT_FAILURE);
+		}
+	}
+	atexit(texload_shutdown);
+	msg(MSG_DEBUG, "Texture loading: Started %d decoding threads.", texload_thread_count);
+#endif
+}
+
+/** Returns the internal format that kuhl_read_texture_array() would
+ * use for RGBA images. */
+static GLenum texload_internalformat(void)
+{
+	return kuhl_config_int("color.linear", 1, 1) ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+}
+
+/** Reads an image file in the background and returns a texture that
+    will contain it. Until the image is ready, the texture contains a
+    single gray texel. See texload.h for details. Requires OpenGL 3.0
+    or newer.
+
+    @param filename Name of image file to load.
+
+    @param wrapS The wrapping texture parameter to apply to GL_TEXTURE_WRAP_S.
+
+    @param wrapT The wrapping texture parameter to apply to GL_TEXTURE_WRAP_T.
+
+    @return The texture name, or 0 if the file can't be read. Use
+    texload_status() to find out when the image has been loaded (and
+    the aspect ratio of the image) or if it couldn't be decoded.
+*/
+GLuint kuhl_read_texture_file_async(const char *filename, GLuint wrapS, GLuint wrapT)
+{
+	if(filename == NULL)
+	{
+		msg(MSG_ERROR, "Failed to load texture file because filename was NULL.");
+		return 0;
+	}
+	texload_init();
+
+	texload_item *item = kuhl_malloc(sizeof(texload_item));
+	memset(item, 0, sizeof(texload_item));
+	item->path = kuhl_find_file(filename);
+	item->state = TEXLOAD_STATE_QUEUED;
+	if(!kuhl_can_read_file(item->path))
+	{
+		msg(MSG_ERROR, "Unable to read texture file '%s'.", filename);
+		free(item->path);
+		free(item);
+		return 0;
+	}
+
+	/* Compressed textures don't need to be decoded, so they are
+	 * uploaded right away. */
+	if(texcompress_is_container(item->path))
+	{
+		if(kuhl_read_texture_file_compressed(item->path, &item->texName, wrapS, wrapT) < 0)
+		{
+			free(item->path);
+			free(item);
+			return 0;
+		}
+		glBindTexture(GL_TEXTURE_2D, item->texName);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &item->width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &item->height);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		item->state = TEXLOAD_STATE_READY;
+		list_append(texload_items, &item);
+		return item->texName;
+	}
+
+	const GLubyte placeholder[4] = { 128, 128, 128, 255 };
+	glGenTextures(1, &item->texName);
+	glBindTexture(GL_TEXTURE_2D, item->texName);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, texload_internalformat(), 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	kuhl_errorcheck();
+
+	list_append(texload_items, &item);
+	texload_lock();
+	texload_remaining++;
+	queue_add(texload_queue, &item);
+#ifdef TEXLOAD_THREADS
+	pthread_cond_signal(&texload_cond_work);
+#endif
+	texload_unlock();
+
+	msg(MSG_DEBUG, "Loading '%s' in the background (texName=%d)", filename, item->texName);
+	return item->texName;
+}
+
+/** Removes the oldest decoded item from the list of items waiting to
+ * be staged and returns it (or NULL if there isn't one). */
+static texload_item* texload_next_decoded(void)
+{
+	texload_item *found = NULL;
+	texload_lock();
+	for(int i=0; i<list_length(texload_items) && texload_decoded > 0; i++)
+	{
+		texload_item *item = *(texload_item**) list_getptr(texload_items, i);
+		if(item->state == TEXLOAD_STATE_DECODED)
+		{
+			item->state = TEXLOAD_STATE_STAGING;
+			texload_decoded--;
+			found = item;
+			break;
+		}
+	}
+	texload_unlock();
+	return found;
+}
+
+/** Marks an item as ready or failed and frees its pixels. */
+static void texload_done(texload_item *item, int state)
+{
+	texload_free_pixels(item->pixels);
+	item->pixels = NULL;
+	texload_lock();
+	item->state = state;
+	texload_remaining--;
+	texload_unlock();
+}
+
+/** Checks that OpenGL will accept the image and makes the unpack
+ * buffer large enough for it. Returns 1 on success. */
+static int texload_stage_begin(texload_item *item)
+{
+	glTexImage2D(GL_PROXY_TEXTURE_2D, 0, texload_internalformat(), item->width, item->height,
+	             0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	int tmp;
+	glGetTexLevelParameteriv(GL_PROXY_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &tmp);
+	if(tmp == 0)
+	{
+		msg(MSG_ERROR, "Unable to load %dx%d texture '%s' (possibly because it is too large)",
+		    item->width, item->height, item->path);
+		return 0;
+	}
+
+	if(texload_pbo == 0)
+		glGenBuffers(1, &texload_pbo);
+	/* Giving the buffer new storage means that we never write to
+	 * memory that a previous upload may still be reading from. */
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texload_pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr) item->width*item->height*4, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	kuhl_errorcheck();
+	item->staged = 0;
+	return 1;
+}
+
+/** Fills the texture from the unpack buffer (which contains the
+ * whole image) and generates mipmaps. */
+static void texload_commit(texload_item *item)
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texload_pbo);
+	glBindTexture(GL_TEXTURE_2D, item->texName);
+	glTexImage2D(GL_TEXTURE_2D, 0, texload_internalformat(), item->width, item->height,
+	             0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glGenerateMipmap(GL_TEXTURE_2D);
+
+	if(glewIsSupported("GL_EXT_texture_filter_anisotropic"))
+	{
+		float maxAniso;
+		glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAniso);
+		glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, maxAniso);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	kuhl_errorcheck();
+	msg(MSG_DEBUG, "Finished reading '%s' (%dx%d, texName=%d) in the background",
+	    item->path, item->width, item->height, item->texName);
+}
+
+/** Copies up to budget bytes of decoded images into the unpack
+ * buffer. Textures are filled in as soon as their entire image has
+ * been staged. */
+static void texload_stage(size_t budget)
+{
+	while(budget > 0)
+	{
+		if(texload_current == NULL)
+		{
+			texload_current = texload_next_decoded();
+			if(texload_current == NULL)
+				return;
+			if(!texload_stage_begin(texload_current))
+			{
+				texload_done(texload_current, TEXLOAD_STATE_FAILED);
+				texload_current = NULL;
+				continue;
+			}
+		}
+
+		texload_item *item = texload_current;
+		size_t size = (size_t) item->width*item->height*4;
+		size_t count = size - item->staged;
+		if(count > budget)
+			count = budget;
+
+		/* We only write to parts of the buffer that OpenGL hasn't
+		 * been asked to read yet, so there is no need to
+		 * synchronize. */
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, texload_pbo);
+		void *dest = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, item->staged, count,
+		                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if(dest != NULL)
+		{
+			memcpy(dest, item->pixels + item->staged, count);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if(dest == NULL)
+		{
+			msg(MSG_ERROR, "Unable to map pixel unpack buffer for '%s'", item->path);
+			texload_done(item, TEXLOAD_STATE_FAILED);
+			texload_current = NULL;
+			continue;
+		}
+
+		item->staged += count;
+		budget -= count;
+		if(item->staged == size)
+		{
+			texload_commit(item);
+			texload_done(item, TEXLOAD_STATE_READY);
+			texload_current = NULL;
+		}
+	}
+}
+
+/** Uploads part of any images that have been decoded. Copies at most
+ * texload.budget bytes (default 4MB) per call. bufferswap() calls
+ * this once per frame. */
+void texload_update(void)
+{
+	if(texload_items == NULL)
+		return;
+
+#ifndef TEXLOAD_THREADS
+	/* Without worker threads, decode one image each frame. */
+	if(queue_length(texload_queue) > 0)
+	{
+		texload_item *item;
+		queue_remove(texload_queue, &item);
+		texload_decode(item);
+	}
+#endif
+
+	int budget = kuhl_config_int("texload.budget", 4*1024*1024, 4*1024*1024);
+	if(budget < 64*1024)
+		budget = 64*1024;
+	texload_stage((size_t) budget);
+}
+
+/** Waits until every texture requested with
+ * kuhl_read_texture_file_async() has been loaded (or has failed). */
+void texload_finish(void)
+{
+	if(texload_items == NULL)
+		return;
+
+	while(1)
+	{
+#ifndef TEXLOAD_THREADS
+		while(queue_length(texload_queue) > 0)
+		{
+			texload_item *item;
+			queue_remove(texload_queue, &item);
+			texload_decode(item);
+		}
+#endif
+		texload_stage((size_t) -1);
+
+		texload_lock();
+#ifdef TEXLOAD_THREADS
+		while(texload_remaining > 0 && texload_decoded == 0)
+			pthread_cond_wait(&texload_cond_done, &texload_mutex);
+#endif
+		int remaining = texload_remaining;
+		texload_unlock();
+		if(remaining == 0)
+			return;
+	}
+}
+
+/** Checks if a texture requested with kuhl_read_texture_file_async()
+    has been loaded.
+
+    @param texName The texture returned by kuhl_read_texture_file_async().
+
+    @param aspectRatio Set to the aspect ratio of the image once it is
+    ready. May be NULL.
+
+    @return TEXLOAD_READY, TEXLOAD_LOADING or TEXLOAD_FAILED (which
+    is also returned if the texture wasn't loaded asynchronously).
+*/
+int texload_status(GLuint texName, float *aspectRatio)
+{
+	if(texload_items == NULL)
+		return TEXLOAD_FAILED;
+
+	int status = TEXLOAD_FAILED;
+	texload_lock();
+	for(int i=0; i<list_length(texload_items); i++)
+	{
+		texload_item *item = *(texload_item**) list_getptr(texload_items, i);
+		if(item->texName != texName)
+			continue;
+		if(item->state == TEXLOAD_STATE_READY)
+		{
+			status = TEXLOAD_READY;
+			if(aspectRatio)
+				*aspectRatio = (float) item->width / item->height;
+		}
+		else if(item->state != TEXLOAD_STATE_FAILED)
+			status = TEXLOAD_LOADING;
+		break;
+	}
+	texload_unlock();
+	return status;
+}
@@ -0,0 +1,69 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    Loads textures in the background. kuhl_read_texture_file() decodes
+    the image and uploads it to OpenGL before it returns, which can
+    freeze a program for seconds when many or large textures are
+    loaded. kuhl_read_texture_file_async() instead returns a texture
+    name immediately. The texture contains a single gray texel until
+    the image is ready:
+
+    * Images are decoded by worker threads (texload.threads, default
+      2). On machines without pthreads, one image is decoded per frame
+      inside of texload_update().
+
+    * Decoded images are copied into a pixel unpack buffer a slice at
+      a time so that no more than texload.budget bytes (default 4MB)
+      are copied each frame. Once the whole image has been staged,
+      the texture is filled from the buffer and mipmaps are generated.
+      Only the copy is spread across frames: the texture is filled
+      and its mipmaps are generated in a single frame, which can
+      still take a few milliseconds for very large images.
+
+    * Compressed KTX, KTX2 and DDS files (see texcompress.h) don't need
+      to be decoded and are uploaded before
+      kuhl_read_texture_file_async() returns.
+
+    bufferswap() calls texload_update() once per frame, so programs
+    which use bufferswap() only need to call
+    kuhl_read_texture_file_async(). The aspect ratio of the image is
+    available from texload_status() once the texture is ready.
+    kuhl_read_texture_file_async() returns 0 if the file can't be
+    read. Files that can't be decoded are reported by texload_status()
+    as TEXLOAD_FAILED, and the texture keeps the placeholder.
+
+    <pre>
+    GLuint tex = kuhl_read_texture_file_async("images/big.png", GL_REPEAT, GL_REPEAT);
+    ...
+    float aspect;
+    if(texload_status(tex, &aspect) == TEXLOAD_READY)
+        ...
+    </pre>
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <GL/glew.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Values returned by texload_status(). */
+#define TEXLOAD_LOADING 0 /**< Texture still contains the placeholder */
+#define TEXLOAD_READY 1   /**< Image has been uploaded into the texture */
+#define TEXLOAD_FAILED -1 /**< Image could not be loaded or texture is unknown */
+
+GLuint kuhl_read_texture_file_async(const char *filename, GLuint wrapS, GLuint wrapT);
+int texload_status(GLuint texName, float *aspectRatio);
+void texload_update(void);
+void texload_finish(void);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
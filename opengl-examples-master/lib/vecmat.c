@@ -1301,7 +1301,7 @@ void quatf_from_mat3f(float quat[4], const float matrix[9])
 
 	   quat[X] = (matrix[mat3_getIndex(Z,Y)] - matrix[mat3_getIndex(Y,Z)]) * s;
 	   quat[Y] = (matrix[mat3_getIndex(X,Z)] - matrix[mat3_getIndex(Z,X)]) * s;
-	   quat[Z] = (matrix[mat3_getIndex(Y,Z)] - matrix[mat3_getIndex(X,Y)]) * s;
+	   quat[Z] = (matrix[mat3_getIndex(Y,X)] - matrix[mat3_getIndex(X,Y)]) * s;
    }
 
    else
@@ -1339,7 +1339,7 @@ void quatd_from_mat3d(double quat[4], const double matrix[9])
 
 	   quat[X] = (matrix[mat3_getIndex(Z,Y)] - matrix[mat3_getIndex(Y,Z)]) * s;
 	   quat[Y] = (matrix[mat3_getIndex(X,Z)] - matrix[mat3_getIndex(Z,X)]) * s;
-	   quat[Z] = (matrix[mat3_getIndex(Y,Z)] - matrix[mat3_getIndex(X,Y)]) * s;
+	   quat[Z] = (matrix[mat3_getIndex(Y,X)] - matrix[mat3_getIndex(X,Y)]) * s;
    }
 
    else
@@ -1587,6 +1587,71 @@ void quatd_slerp_new(double result[4], const double start[4], const double end[4
 	vec4d_normalize(result);
 }
 
+/** Multiplies two quaternions (x,y,z,w). The result is the rotation
+ * "b" followed by the rotation "a".
+
+ @param result The location to store the product (can be the same as a or b).
+ @param a The quaternion on the left side of the multiplication.
+ @param b The quaternion on the right side of the multiplication.
+ */
+void quatf_mult_quatf_new(float result[4], const float a[4], const float b[4])
+{
+	float tmp[4];
+	tmp[0] = a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1];
+	tmp[1] = a[3]*b[1] - a[0]*b[2] + a[1]*b[3] + a[2]*b[0];
+	tmp[2] = a[3]*b[2] + a[0]*b[1] - a[1]*b[0] + a[2]*b[3];
+	tmp[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	vec4f_copy(result, tmp);
+}
+/** Multiplies two quaternions (x,y,z,w). For full documentation, see quatf_mult_quatf_new() */
+void quatd_mult_quatd_new(double result[4], const double a[4], const double b[4])
+{
+	double tmp[4];
+	tmp[0] = a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1];
+	tmp[1] = a[3]*b[1] - a[0]*b[2] + a[1]*b[3] + a[2]*b[0];
+	tmp[2] = a[3]*b[2] + a[0]*b[1] - a[1]*b[0] + a[2]*b[3];
+	tmp[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	vec4d_copy(result, tmp);
+}
+
+/** Creates a unit dual quaternion from a rotation and translation
+ * matrix. The first four values are the rotation quaternion (x,y,z,w)
+ * and the last four are the dual part, which is half of the
+ * translation (as a quaternion with w=0) multiplied by the
+ * rotation. Dual quaternions can't represent scaling, so any scaling
+ * in the matrix is removed.
+
+ @param dq The location to store the dual quaternion.
+ @param matrix The input matrix.
+ */
+void dualquatf_from_mat4f(float dq[8], const float matrix[16])
+{
+	float rot[9];
+	mat3f_from_mat4f(rot, matrix);
+	for(int col=0; col<3; col++)
+		vec3f_normalize(rot+col*3);
+	quatf_from_mat3f(dq, rot);
+	quatf_normalize(dq);
+
+	float translate[4] = { matrix[mat4_getIndex(0,3)], matrix[mat4_getIndex(1,3)], matrix[mat4_getIndex(2,3)], 0 };
+	quatf_mult_quatf_new(dq+4, translate, dq);
+	vec4f_scalarMult(dq+4, 0.5f);
+}
+/** Creates a unit dual quaternion from a rotation and translation matrix. For full documentation, see dualquatf_from_mat4f() */
+void dualquatd_from_mat4d(double dq[8], const double matrix[16])
+{
+	double rot[9];
+	mat3d_from_mat4d(rot, matrix);
+	for(int col=0; col<3; col++)
+		vec3d_normalize(rot+col*3);
+	quatd_from_mat3d(dq, rot);
+	quatd_normalize(dq);
+
+	double translate[4] = { matrix[mat4_getIndex(0,3)], matrix[mat4_getIndex(1,3)], matrix[mat4_getIndex(2,3)], 0 };
+	quatd_mult_quatd_new(dq+4, translate, dq);
+	vec4d_scalarMult(dq+4, 0.5);
+}
+
 	
 
 
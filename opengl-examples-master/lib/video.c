@@ -30,6 +30,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define VIDEO_PIPE_MODE "wb"
+#define VIDEO_NULL_DEVICE "NUL"
+#else
+#include <signal.h>
+#define VIDEO_PIPE_MODE "w"
+#define VIDEO_NULL_DEVICE "/dev/null"
+#endif
 
 #include "kuhl-util.h"
 #include "video.h"
@@ -309,3 +320,345 @@ video_state* video_get_next_frame(video_state *state, const char *filename)
 }
 
 #endif // HAVE_FFMPEG
+
+
+
+/* ----- Encoding ----- */
+
+/** Returns 1 if a string can be placed inside of double quotes in a
+ * shell command without the shell interpreting any part of it. */
+static int video_encoder_shell_safe(const char *str)
+{
+#ifdef _WIN32
+	const char *special = "\"%\r\n";
+#else
+	const char *special = "\"$`\\\r\n";
+#endif
+	return strpbrk(str, special) == NULL;
+}
+
+/** Starts an ffmpeg process which reads raw RGB frames from a pipe
+ * and encodes them. Returns 1 on success. */
+static int video_encoder_pipe_open(video_encoder *enc)
+{
+	const char *ffmpeg = kuhl_config_get("video.ffmpeg");
+	if(ffmpeg == NULL)
+		ffmpeg = "ffmpeg";
+	const char *codec = kuhl_config_get("video.codec");
+	if(codec == NULL)
+		codec = "libx264";
+
+	/* Each of these is quoted in the command that is passed to the
+	 * shell. Refuse anything that the shell would still expand. */
+	const char *args[3] = { ffmpeg, codec, enc->filename };
+	for(int i=0; i<3; i++)
+	{
+		if(!video_encoder_shell_safe(args[i]))
+		{
+			msg(MSG_ERROR, "Video encoder: '%s' contains characters (such as quotes, $ or `) that can't be passed to ffmpeg.", args[i]);
+			return 0;
+		}
+	}
+
+	/* OpenGL gives us the bottom row first, so ffmpeg flips the
+	 * image. yuv420p (which most players require) needs an even
+	 * width and height. */
+	char command[2048];
+	snprintf(command, sizeof(command),
+	         "\"%s\" -loglevel error -y -f rawvideo -pix_fmt rgb24 -s %dx%d -r %d -i - "
+	         "-vf \"vflip,scale=trunc(iw/2)*2:trunc(ih/2)*2\" -c:v \"%s\" -pix_fmt yuv420p \"%s\"",
+	         ffmpeg, enc->width, enc->height, enc->fps, codec, enc->filename);
+
+	/* popen() succeeds as long as the shell starts, so make sure
+	 * that ffmpeg can actually be run first. */
+	char probe[1024];
+	snprintf(probe, sizeof(probe), "\"%s\" -version >%s 2>&1", ffmpeg, VIDEO_NULL_DEVICE);
+	if(system(probe) != 0)
+	{
+		msg(MSG_ERROR, "Video encoder: Unable to run '%s'. Set video.ffmpeg to the location of ffmpeg.", ffmpeg);
+		return 0;
+	}
+
+	msg(MSG_DEBUG, "Video encoder: Running: %s", command);
+	enc->pipe = popen(command, VIDEO_PIPE_MODE);
+	if(enc->pipe == NULL)
+	{
+		msg(MSG_ERROR, "Video encoder: Failed to run '%s'", ffmpeg);
+		return 0;
+	}
+
+#ifndef _WIN32
+	/* If ffmpeg exits early, writing a frame would kill the program
+	 * with SIGPIPE. Ignore SIGPIPE so that the write fails instead.
+	 * This is done once, here, since the signal disposition belongs
+	 * to the whole process. A handler installed by the program is
+	 * left alone. */
+	struct sigaction previous;
+	if(sigaction(SIGPIPE, NULL, &previous) == 0 &&
+	   !(previous.sa_flags & SA_SIGINFO) && previous.sa_handler == SIG_DFL)
+		signal(SIGPIPE, SIG_IGN);
+#endif
+	return 1;
+}
+
+#ifdef HAVE_FFMPEG
+/** Sends a frame to the codec (or NULL to flush it) and writes any
+ * packets it produces to the file. Returns 0 on success. */
+static int video_encoder_send(video_encoder *enc, AVFrame *frame)
+{
+	int ret = avcodec_send_frame(enc->codec_ctx, frame);
+	while(ret >= 0)
+	{
+		ret = avcodec_receive_packet(enc->codec_ctx, enc->pkt);
+		if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return 0;
+		if(ret < 0)
+			break;
+		av_packet_rescale_ts(enc->pkt, enc->codec_ctx->time_base, enc->stream->time_base);
+		enc->pkt->stream_index = enc->stream->index;
+		ret = av_interleaved_write_frame(enc->fmt_ctx, enc->pkt);
+	}
+	msg(MSG_ERROR, "Video encoder: Error encoding %s (%s)", enc->filename, av_err2str(ret));
+	return ret;
+}
+
+/** Frees everything that video_encoder_av_open() may have allocated. */
+static void video_encoder_av_close(video_encoder *enc)
+{
+	if(enc->fmt_ctx && enc->fmt_ctx->pb && !(enc->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&(enc->fmt_ctx->pb));
+	avcodec_free_context(&(enc->codec_ctx));
+	av_frame_free(&(enc->frame));
+	av_packet_free(&(enc->pkt));
+	sws_freeContext(enc->sws_ctx);
+	enc->sws_ctx = NULL;
+	avformat_free_context(enc->fmt_ctx);
+	enc->fmt_ctx = NULL;
+	enc->stream = NULL;
+}
+
+/** Sets up libavformat and libavcodec to write the video. The
+ * container is chosen from the filename extension. Returns 1 on
+ * success. */
+static int video_encoder_av_open(video_encoder *enc)
+{
+	av_register_all();
+
+	avformat_alloc_output_context2(&(enc->fmt_ctx), NULL, NULL, enc->filename);
+	if(enc->fmt_ctx == NULL)
+	{
+		msg(MSG_ERROR, "Video encoder: Unable to determine the format of %s", enc->filename);
+		return 0;
+	}
+
+	const char *codecName = kuhl_config_get("video.codec");
+	if(codecName == NULL)
+		codecName = "libx264";
+	AVCodec *codec = avcodec_find_encoder_by_name(codecName);
+	if(codec == NULL)
+	{
+		msg(MSG_WARNING, "Video encoder: Codec %s is unavailable, using the default codec for %s", codecName, enc->filename);
+		codec = avcodec_find_encoder(enc->fmt_ctx->oformat->video_codec);
+	}
+	if(codec == NULL)
+	{
+		msg(MSG_ERROR, "Video encoder: No codec available for %s", enc->filename);
+		video_encoder_av_close(enc);
+		return 0;
+	}
+
+	enc->stream = avformat_new_stream(enc->fmt_ctx, NULL);
+	enc->codec_ctx = avcodec_alloc_context3(codec);
+	enc->frame = av_frame_alloc();
+	enc->pkt = av_packet_alloc();
+	if(!enc->stream || !enc->codec_ctx || !enc->frame || !enc->pkt)
+	{
+		msg(MSG_ERROR, "Video encoder: Out of memory");
+		video_encoder_av_close(enc);
+		return 0;
+	}
+
+	/* yuv420p requires an even width and height. */
+	AVCodecContext *c = enc->codec_ctx;
+	c->width = enc->width & ~1;
+	c->height = enc->height & ~1;
+	c->time_base = (AVRational){ 1, enc->fps };
+	c->framerate = (AVRational){ enc->fps, 1 };
+	c->gop_size = enc->fps;
+	c->pix_fmt = AV_PIX_FMT_YUV420P;
+	if(enc->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	if(c->codec_id == AV_CODEC_ID_H264)
+		av_opt_set(c->priv_data, "preset", "veryfast", 0);
+
+	int ret = avcodec_open2(c, codec, NULL);
+	if(ret >= 0)
+		ret = avcodec_parameters_from_context(enc->stream->codecpar, c);
+	enc->stream->time_base = c->time_base;
+	if(ret >= 0 && !(enc->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+		ret = avio_open(&(enc->fmt_ctx->pb), enc->filename, AVIO_FLAG_WRITE);
+	if(ret >= 0)
+		ret = avformat_write_header(enc->fmt_ctx, NULL);
+	if(ret < 0)
+	{
+		msg(MSG_ERROR, "Video encoder: Unable to start writing %s (%s)", enc->filename, av_err2str(ret));
+		video_encoder_av_close(enc);
+		return 0;
+	}
+
+	enc->frame->format = c->pix_fmt;
+	enc->frame->width = c->width;
+	enc->frame->height = c->height;
+	if(av_frame_get_buffer(enc->frame, 0) < 0)
+	{
+		msg(MSG_ERROR, "Video encoder: Unable to allocate frame for %s", enc->filename);
+		video_encoder_av_close(enc);
+		return 0;
+	}
+
+	enc->sws_ctx = sws_getContext(enc->width, enc->height, AV_PIX_FMT_RGB24,
+	                              c->width, c->height, c->pix_fmt,
+	                              SWS_BILINEAR, NULL, NULL, NULL);
+	msg(MSG_DEBUG, "Video encoder: Writing %s with %s", enc->filename, codec->name);
+	return 1;
+}
+#endif // HAVE_FFMPEG
+
+
+/** Starts writing a video file. Frames are encoded with libavcodec
+    if the library was compiled against FFmpeg. Otherwise (or if
+    libavcodec fails), raw frames are piped into an ffmpeg process.
+
+    Settings: video.codec chooses the codec (default libx264) and
+    video.ffmpeg is the ffmpeg program to run (default ffmpeg).
+
+    When frames are piped into ffmpeg, the filename and settings can't
+    contain quotes, $, ` or \\ (or % on Windows), and SIGPIPE is
+    ignored for the rest of the program unless the program has
+    installed its own handler.
+
+    @param filename The video file to write. The extension chooses the
+    container (for example, .mp4 or .mkv).
+
+    @param width The width of the frames that will be encoded.
+
+    @param height The height of the frames that will be encoded.
+
+    @param fps The number of frames per second in the video.
+
+    @return A new encoder which should be freed with
+    video_encoder_free() or NULL on failure.
+*/
+video_encoder* video_encoder_new(const char *filename, int width, int height, int fps)
+{
+	if(width < 2 || height < 2 || fps < 1)
+	{
+		msg(MSG_ERROR, "Video encoder: Invalid size %dx%d or frame rate %d", width, height, fps);
+		return NULL;
+	}
+
+	video_encoder *enc = calloc(sizeof(video_encoder), 1);
+	strncpy(enc->filename, filename, 1024);
+	enc->filename[1023] = '\0';
+	enc->width = width;
+	enc->height = height;
+	enc->fps = fps;
+
+#ifdef HAVE_FFMPEG
+	if(video_encoder_av_open(enc))
+		return enc;
+	msg(MSG_WARNING, "Video encoder: Falling back to piping frames to ffmpeg.");
+#endif
+	if(video_encoder_pipe_open(enc))
+		return enc;
+
+	free(enc);
+	return NULL;
+}
+
+/** Encodes one frame. Frames are written in the order they are
+    given; the encoder is not thread safe, so only one thread should
+    call this for each encoder.
+
+    @param enc The encoder.
+
+    @param rgb The pixels of the frame as 8-bit RGB with the bottom
+    row first (the order glReadPixels() returns them in).
+
+    @param width The width of the frame. Must match the width the
+    encoder was created with.
+
+    @param height The height of the frame. Must match the height the
+    encoder was created with.
+
+    @return 1 if the frame was encoded, 0 otherwise.
+*/
+int video_encoder_frame(video_encoder *enc, const unsigned char *rgb, int width, int height)
+{
+	if(width != enc->width || height != enc->height)
+	{
+		msg(MSG_ERROR, "Video encoder: Frame is %dx%d but %s is %dx%d. Skipping frame.",
+		    width, height, enc->filename, enc->width, enc->height);
+		return 0;
+	}
+
+	if(enc->pipe)
+	{
+		size_t size = (size_t) width*height*3;
+		/* Flush so that nothing is left in the buffer to be written
+		 * outside of this function. SIGPIPE is ignored (see
+		 * video_encoder_pipe_open()), so this fails instead of
+		 * killing the program if ffmpeg has exited. */
+		int ok = fwrite(rgb, 1, size, enc->pipe) == size && fflush(enc->pipe) == 0;
+		if(!ok)
+		{
+			msg(MSG_ERROR, "Video encoder: Failed to write frame to ffmpeg for %s", enc->filename);
+			return 0;
+		}
+		enc->frames++;
+		return 1;
+	}
+
+#ifdef HAVE_FFMPEG
+	if(av_frame_make_writable(enc->frame) < 0)
+		return 0;
+	/* Start at the last row and use a negative stride to flip the
+	 * image while converting it. */
+	const uint8_t *src[1] = { rgb + (size_t) (height-1)*width*3 };
+	const int srcStride[1] = { -width*3 };
+	sws_scale(enc->sws_ctx, src, srcStride, 0, height, enc->frame->data, enc->frame->linesize);
+	enc->frame->pts = enc->frames;
+	if(video_encoder_send(enc, enc->frame) < 0)
+		return 0;
+	enc->frames++;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/** Finishes writing the video file and frees the encoder.
+
+    @param enc The encoder to free. May be NULL.
+*/
+void video_encoder_free(video_encoder *enc)
+{
+	if(enc == NULL)
+		return;
+
+	if(enc->pipe)
+	{
+		if(pclose(enc->pipe) != 0)
+			msg(MSG_WARNING, "Video encoder: ffmpeg reported an error while writing %s", enc->filename);
+	}
+#ifdef HAVE_FFMPEG
+	else if(enc->fmt_ctx)
+	{
+		video_encoder_send(enc, NULL); // flush frames buffered inside of the codec
+		av_write_trailer(enc->fmt_ctx);
+		video_encoder_av_close(enc);
+	}
+#endif
+	msg(MSG_INFO, "Video encoder: Wrote %ld frames to %s", enc->frames, enc->filename);
+	free(enc);
+}
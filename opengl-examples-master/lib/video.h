@@ -1,11 +1,14 @@
 #pragma once
+#include <stdio.h> // FILE
 
 #ifdef HAVE_FFMPEG
 #include <libavutil/imgutils.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
+#include <libavutil/opt.h>
 #endif
 
 typedef struct {
@@ -37,3 +40,28 @@ typedef struct {
 
 video_state* video_get_next_frame(video_state *state, const char *filename);
 void video_cleanup(video_state *state);
+
+/** Encodes frames into a video file. Created with video_encoder_new(). */
+typedef struct video_encoder {
+	int width;           /**< Width of the frames passed to video_encoder_frame() */
+	int height;          /**< Height of the frames passed to video_encoder_frame() */
+	int fps;             /**< Frames per second */
+	long frames;         /**< Number of frames encoded so far */
+	char filename[1024]; /**< Filename of the video we are writing */
+
+	/* The following variables are used internally by video.c */
+	FILE *pipe;          /**< ffmpeg process we write raw frames to, if not using libavcodec */
+
+#ifdef HAVE_FFMPEG
+	AVFormatContext *fmt_ctx;
+	AVCodecContext *codec_ctx;
+	AVStream *stream;
+	AVFrame *frame;
+	AVPacket *pkt;
+	struct SwsContext *sws_ctx;
+#endif
+} video_encoder;
+
+video_encoder* video_encoder_new(const char *filename, int width, int height, int fps);
+int video_encoder_frame(video_encoder *enc, const unsigned char *rgb, int width, int height);
+void video_encoder_free(video_encoder *enc);
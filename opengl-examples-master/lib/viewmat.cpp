@@ -154,6 +154,7 @@ void viewmat_end_frame(void)
  */
 void viewmat_begin_eye(int viewportID)
 {
+	kuhl_occlusion_viewport(viewportID);
 	display->begin_eye(viewportID);
 }
 
@@ -0,0 +1,92 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+// Instanced variant of assimp.vert for models that were baked with
+// kuhl_bake_model(). Each instance picks its own frame of the
+// animation from the BoneFrames texture, so kuhl_update_model()
+// doesn't need to be called. Use with kuhl_geometry_instances_anim().
+
+in vec3 in_Position;
+in vec2 in_TexCoord;
+in vec3 in_Normal;
+in vec3 in_Color;
+
+in vec4 in_BoneIndex;
+in vec4 in_BoneWeight;
+// Each row of BoneFrames is a frame of the animation. Each bone uses
+// four texels (one per column of its matrix).
+uniform sampler2D BoneFrames;
+uniform float BoneFrameRate; // frames per second in BoneFrames
+uniform float AnimTime;      // current time in seconds
+uniform int NumBones;
+
+in mat4 in_InstanceMatrix; // model matrix for this instance
+in vec3 in_InstanceColor;  // color for this instance
+in vec2 in_InstanceAnim;   // time offset (seconds) and playback speed for this instance
+
+uniform mat4 ModelView; // view matrix (model matrix is per-instance)
+uniform mat4 Projection;
+uniform mat4 GeomTransform;
+
+out vec2 out_TexCoord;
+out vec3 out_Color;
+out vec3 out_Normal;   // normal vector (camera coordinates)
+out vec3 out_CamCoord; // vertex position (camera coordinates)
+
+/* Interpolates the matrix for a bone between two frames. */
+mat4 boneMatrix(float bone, int frame0, int frame1, float t)
+{
+	int x = int(bone)*4;
+	return (1.0-t) * mat4(texelFetch(BoneFrames, ivec2(x,   frame0), 0),
+	                      texelFetch(BoneFrames, ivec2(x+1, frame0), 0),
+	                      texelFetch(BoneFrames, ivec2(x+2, frame0), 0),
+	                      texelFetch(BoneFrames, ivec2(x+3, frame0), 0)) +
+	            t  * mat4(texelFetch(BoneFrames, ivec2(x,   frame1), 0),
+	                      texelFetch(BoneFrames, ivec2(x+1, frame1), 0),
+	                      texelFetch(BoneFrames, ivec2(x+2, frame1), 0),
+	                      texelFetch(BoneFrames, ivec2(x+3, frame1), 0));
+}
+
+void main() 
+{
+	// Copy texture coordinates and color to fragment program
+	out_TexCoord = in_TexCoord;
+	out_Color = in_Color * in_InstanceColor;
+
+	/* Calculate the actual modelview matrix: */
+	mat4 instanceModelView = ModelView * in_InstanceMatrix;
+	mat4 actualModelView;
+	if(NumBones > 0)
+	{
+		/* If we have an animated model/character that contains bones,
+		   we need to account for the bone matrices. */
+		/* Find the two frames for this instance. The animation
+		   loops. */
+		int frames = textureSize(BoneFrames, 0).y;
+		float frame = mod((AnimTime*in_InstanceAnim.y + in_InstanceAnim.x) * BoneFrameRate, float(frames));
+		int frame0 = int(frame);
+		int frame1 = (frame0+1) % frames;
+		float t = fract(frame);
+
+		mat4 m = in_BoneWeight.x * boneMatrix(in_BoneIndex.x, frame0, frame1, t) +
+		         in_BoneWeight.y * boneMatrix(in_BoneIndex.y, frame0, frame1, t) +
+		         in_BoneWeight.z * boneMatrix(in_BoneIndex.z, frame0, frame1, t) +
+		         in_BoneWeight.w * boneMatrix(in_BoneIndex.w, frame0, frame1, t);
+		actualModelView = instanceModelView * m;
+	}
+	else
+		/* If we have a model without animation/bones in it, we simply
+		 * need to account for the GeomTransform matrix embedded in
+		 * the 3D model. */
+		actualModelView = instanceModelView * GeomTransform;
+
+	mat3 NormalMat = transpose(inverse(mat3(actualModelView)));
+	
+	// Transform normal from object coordinates to camera coordinates
+	out_Normal = NormalMat * in_Normal.xyz;
+
+	// Transform vertex from object to unhomogenized Normalized Device
+	// Coordinates (NDC).
+	gl_Position = Projection * actualModelView * vec4(in_Position.xyz, 1);
+
+	// Calculate the position of the vertex in camera coordinates:
+	out_CamCoord = vec3(actualModelView * vec4(in_Position.xyz, 1));
+}
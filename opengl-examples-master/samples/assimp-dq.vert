@@ -0,0 +1,84 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+// Variant of assimp.vert which uses dual quaternion skinning. Use with
+// model.dualquat=1 so that kuhl_update_model() stores the bones as
+// dual quaternions.
+
+in vec3 in_Position;
+in vec2 in_TexCoord;
+in vec3 in_Normal;
+in vec3 in_Color;
+
+in vec4 in_BoneIndex;
+in vec4 in_BoneWeight;
+// Each bone is a unit dual quaternion: column 0 is the rotation
+// (x,y,z,w) and column 1 is the dual part. The size must match
+// MAX_BONES in kuhl-util.h.
+layout(std140) uniform BoneDualQuats
+{
+	mat2x4 BoneDQ[128];
+};
+uniform int NumBones;
+
+uniform mat4 ModelView;
+uniform mat4 Projection;
+uniform mat4 GeomTransform;
+
+out vec2 out_TexCoord;
+out vec3 out_Color;
+out vec3 out_Normal;   // normal vector (camera coordinates)
+out vec3 out_CamCoord; // vertex position (camera coordinates)
+
+void main() 
+{
+	// Copy texture coordinates and color to fragment program
+	out_TexCoord = in_TexCoord;
+	out_Color = in_Color;
+
+	/* Calculate the actual modelview matrix: */
+	mat4 actualModelView;
+	if(NumBones > 0)
+	{
+		/* If we have an animated model/character that contains bones,
+		   we need to account for the bone matrices. */
+		mat2x4 dq0 = BoneDQ[int(in_BoneIndex.x)];
+		mat2x4 dq1 = BoneDQ[int(in_BoneIndex.y)];
+		mat2x4 dq2 = BoneDQ[int(in_BoneIndex.z)];
+		mat2x4 dq3 = BoneDQ[int(in_BoneIndex.w)];
+
+		/* q and -q are the same rotation. Flip the quaternions that
+		   are on the other side of the first one so that blending
+		   takes the shortest path. */
+		mat2x4 dq = in_BoneWeight.x * dq0 +
+		            (dot(dq0[0], dq1[0]) < 0 ? -in_BoneWeight.y : in_BoneWeight.y) * dq1 +
+		            (dot(dq0[0], dq2[0]) < 0 ? -in_BoneWeight.z : in_BoneWeight.z) * dq2 +
+		            (dot(dq0[0], dq3[0]) < 0 ? -in_BoneWeight.w : in_BoneWeight.w) * dq3;
+		dq /= length(dq[0]);
+
+		/* Convert the blended dual quaternion into a matrix. */
+		vec4 r = dq[0];
+		vec4 d = dq[1];
+		vec3 t = 2.0 * (r.w*d.xyz - d.w*r.xyz + cross(r.xyz, d.xyz));
+		mat4 m = mat4(1.0 - 2.0*(r.y*r.y + r.z*r.z), 2.0*(r.x*r.y + r.w*r.z), 2.0*(r.x*r.z - r.w*r.y), 0.0,
+		              2.0*(r.x*r.y - r.w*r.z), 1.0 - 2.0*(r.x*r.x + r.z*r.z), 2.0*(r.y*r.z + r.w*r.x), 0.0,
+		              2.0*(r.x*r.z + r.w*r.y), 2.0*(r.y*r.z - r.w*r.x), 1.0 - 2.0*(r.x*r.x + r.y*r.y), 0.0,
+		              t, 1.0);
+		actualModelView = ModelView * m;
+	}
+	else
+		/* If we have a model without animation/bones in it, we simply
+		 * need to account for the GeomTransform matrix embedded in
+		 * the 3D model. */
+		actualModelView = ModelView * GeomTransform;
+
+	mat3 NormalMat = transpose(inverse(mat3(actualModelView)));
+	
+	// Transform normal from object coordinates to camera coordinates
+	out_Normal = NormalMat * in_Normal.xyz;
+
+	// Transform vertex from object to unhomogenized Normalized Device
+	// Coordinates (NDC).
+	gl_Position = Projection * actualModelView * vec4(in_Position.xyz, 1);
+
+	// Calculate the position of the vertex in camera coordinates:
+	out_CamCoord = vec3(actualModelView * vec4(in_Position.xyz, 1));
+}
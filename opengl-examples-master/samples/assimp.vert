@@ -7,7 +7,12 @@ in vec3 in_Color;
 
 in vec4 in_BoneIndex;
 in vec4 in_BoneWeight;
-uniform mat4 BoneMat[128];
+// Bone matrices are stored in a uniform buffer which is updated by
+// kuhl_update_model(). The size must match MAX_BONES in kuhl-util.h.
+layout(std140) uniform BonePalette
+{
+	mat4 BoneMat[128];
+};
 uniform int NumBones;
 
 uniform mat4 ModelView;
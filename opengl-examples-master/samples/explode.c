@@ -26,11 +26,16 @@ static float bbox[6];
 
 
 typedef struct {
+	GLfloat position[3];
 	GLfloat velocity[3];
 } particle;
 
 static particle **particles;
 
+/** The vertex positions are written into a streaming buffer every
+ * frame instead of mapping the model's vertex buffer. */
+static streambuf *positionStream = NULL;
+
 #define GLSL_VERT_FILE "assimp.vert"
 #define GLSL_FRAG_FILE "assimp.frag"
 
@@ -44,13 +49,20 @@ void explode()
 		GLint numFloats = 0;
 		GLfloat *norm = kuhl_geometry_attrib_get(g, "in_Normal",
 		                                         &numFloats);
+		/* Normals may be interleaved with other vertex attributes. */
+		GLint stride = kuhl_geometry_attrib_stride(g, "in_Normal");
 		
 		/* Calculate the velocity of each vertex when the explosion occurs */
 		for(unsigned int j=0; j<g->vertex_count; j++)
 		{
 			// Start by setting the velocity equal to the normal to
-			// make the particles move out.
-			vec3f_copy(particles[i][j].velocity, &norm[j*3]);
+			// make the particles move out. Models without normals
+			// (or with normals stored in a compact format, see
+			// model.compact) just move up and in random directions.
+			if(norm)
+				vec3f_copy(particles[i][j].velocity, &norm[j*stride]);
+			else
+				vec3f_set(particles[i][j].velocity, 0,0,0);
 
 			// Scale the initial velocity
 			vec3f_scalarMult(particles[i][j].velocity, 10);
@@ -64,53 +76,81 @@ void explode()
 			for(int k=0; k<3; k++)
 				particles[i][j].velocity[k] += (drand48()-.5);
 		}
+		kuhl_geometry_attrib_unmap(g, "in_Normal");
 		g = g->next;
 	}
 }
 
-/** Update the vertex positions and the velocity stored in the
- * particles array. */
-void update()
+/** Copy the vertex positions in the particles array into the
+ * streaming buffer and point the in_Position attribute of each
+ * kuhl_geometry at them. */
+void upload()
 {
 	kuhl_geometry *g = modelgeom;
 	for(unsigned int i=0; i<kuhl_geometry_count(modelgeom); i++)
 	{
-		int numFloats = 0;
-		GLfloat *pos = kuhl_geometry_attrib_get(g, "in_Position",
-		                                        &numFloats);
-
+		GLintptr offset = 0;
+		GLfloat *pos = streambuf_alloc(positionStream, sizeof(GLfloat)*3*g->vertex_count, &offset);
+		if(pos == NULL)
+			return;
 		for(unsigned int j=0; j<g->vertex_count; j++)
+			vec3f_copy(&pos[j*3], particles[i][j].position);
+		streambuf_flush(positionStream);
+		kuhl_geometry_attrib_buffer(g, streambuf_id(positionStream), offset,
+		                            3, GL_FLOAT, GL_FALSE, "in_Position", 0);
+		g = g->next;
+	}
+}
+
+/** Update the vertex positions and the velocity of the particles
+ * begin to end-1 in one of the arrays in particles. Called by
+ * jobs_parallel_for(). */
+static void update_range(void *arg, int begin, int end)
+{
+	particle *p = (particle*) arg;
+	for(int j=begin; j<end; j++)
+	{
+		float *pos = p[j].position;
+
+		/* Gravity is pushing particles down -Y, but we are
+		 * operating in object coordinates. If GeomTransform
+		 * (i.e., g->matrix) is used to rotate the model, then
+		 * gravity might not push the particles down in world
+		 * coordinates. */
+		float accel[3] = { 0, -1, 0};
+		float timestep = 0.1f; // change this to change speed of explosion
+		for(int k=0; k<3; k++)
 		{
-			/* If the first point isn't moving, don't update anything */
-			if(vec3f_norm(particles[i][j].velocity) == 0)
-				return;
-
-			/* Gravity is pushing particles down -Y, but we are
-			 * operating in object coordinates. If GeomTransform
-			 * (i.e., g->matrix) is used to rotate the model, then
-			 * gravity might not push the particles down in world
-			 * coordinates. */
-			float accel[3] = { 0, -1, 0};
-			float timestep = 0.1f; // change this to change speed of explosion
-			for(int k=0; k<3; k++)
-			{
-				pos[j*3+k] += timestep * (particles[i][j].velocity[k] + timestep * accel[k]/2);
-				particles[i][j].velocity[k] += timestep * accel[k];
-			}
+			pos[k] += timestep * (p[j].velocity[k] + timestep * accel[k]/2);
+			p[j].velocity[k] += timestep * accel[k];
+		}
 #if 1   /* Bounce the particles off the xz-plane. */
-			if(pos[j*3+1] < 0)
-			{
-				/* How much velocity is lost when a bounce occurs? */
-				float velocityLossFactor = .4;
-				/* If particle fell through floor, negate its position */
-				pos[j*3+1] *= -velocityLossFactor;
-				/* Negative the Y velocity */
-				particles[i][j].velocity[1] *= -1;
-				/* Scale velocity in all directions */
-				vec3f_scalarMult(particles[i][j].velocity, velocityLossFactor); // lose energy on bounce
-			}
-#endif
+		if(pos[1] < 0)
+		{
+			/* How much velocity is lost when a bounce occurs? */
+			float velocityLossFactor = .4;
+			/* If particle fell through floor, negate its position */
+			pos[1] *= -velocityLossFactor;
+			/* Negative the Y velocity */
+			p[j].velocity[1] *= -1;
+			/* Scale velocity in all directions */
+			vec3f_scalarMult(p[j].velocity, velocityLossFactor); // lose energy on bounce
 		}
+#endif
+	}
+}
+
+/** Update the vertex positions and the velocity stored in the
+ * particles array. The particles are split across the threads in
+ * the job system (see jobs.h). */
+void update()
+{
+	kuhl_geometry *g = modelgeom;
+	for(unsigned int i=0; i<kuhl_geometry_count(modelgeom); i++)
+	{
+		/* If the first point isn't moving, don't update anything */
+		if(g->vertex_count > 0 && vec3f_norm(particles[i][0].velocity) != 0)
+			jobs_parallel_for(g->vertex_count, 0, update_range, particles[i]);
 		g = g->next;
 	}
 }
@@ -234,7 +274,11 @@ void display()
 
 		kuhl_limitfps(60);
 		update();
+		upload();
 		kuhl_geometry_draw(modelgeom); /* Draw the model */
+		/* Let the GPU read this frame's positions while we write the
+		 * next frame's positions elsewhere in the buffer. */
+		streambuf_next(positionStream);
 		kuhl_errorcheck();
 
 		glUseProgram(0); // stop using a GLSL program.
@@ -308,19 +352,39 @@ int main(int argc, char** argv)
 	/* Allocate an array of particle arrays */
 	particles = malloc(sizeof(particle*)*geomCount);
 	int i = 0;
+	unsigned int vertexCount = 0;
 	for(kuhl_geometry *g = modelgeom; g != NULL; g=g->next)
 	{
-		/* allocate space to store velocity information for all of the
-		 * vertices in this kuhl_geometry */
+		/* allocate space to store position and velocity information
+		 * for all of the vertices in this kuhl_geometry */
 		particles[i] = malloc(sizeof(particle)*g->vertex_count);
+		GLint numFloats = 0;
+		GLfloat *pos = kuhl_geometry_attrib_get(g, "in_Position", &numFloats);
+		if(pos == NULL)
+		{
+			msg(MSG_FATAL, "Unable to read the vertex positions of %s.", modelFilename);
+			exit(EXIT_FAILURE);
+		}
+		GLint stride = kuhl_geometry_attrib_stride(g, "in_Position");
 		for(unsigned int j=0; j<g->vertex_count; j++)
+		{
+			vec3f_copy(particles[i][j].position, &pos[j*stride]);
 			vec3f_set(particles[i][j].velocity, 0,0,0);
+		}
+		/* We have our own copy of the positions now. The buffer must
+		 * be unmapped before it can be drawn from. */
+		kuhl_geometry_attrib_unmap(g, "in_Position");
+		vertexCount += g->vertex_count;
 
 		/* Change the geometry to be drawn as points */
 		g->primitive_type = GL_POINTS; // Comment out this line to default to triangle rendering.
 		i++;
 	}
 
+	/* Triple-buffer the positions of every vertex in the model. Each
+	 * kuhl_geometry starts on a 16 byte boundary in the buffer. */
+	positionStream = streambuf_new(sizeof(GLfloat)*3*vertexCount + 16*geomCount, 3);
+
 	while(!glfwWindowShouldClose(kuhl_get_window()))
 	{
 		display();
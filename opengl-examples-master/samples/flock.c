@@ -4,10 +4,16 @@
  */
 
 /** @file Draws a single model repeatedly. Useful for doing very
- * simple performance measurements. Note that we could draw the same
- * thing more efficiently by placing more models into a single
- * geometry object (and therefore reduce the number of "draw"
- * calls). For more information, see:
+ * simple performance measurements. By default, all of the copies of
+ * the model are drawn with instancing (one draw call per mesh, see
+ * kuhl_geometry_instances()). Press 'i' to switch to drawing each
+ * copy with its own draw call to compare the performance. When each
+ * copy is drawn separately and the model was loaded with levels of
+ * detail (see the model.lod configuration setting), distant copies
+ * are drawn with fewer triangles. If the model is animated, the
+ * animation is baked into a texture (see kuhl_bake_model()) and each
+ * instance plays it from a different point on the GPU. For more
+ * information, see:
  * https://stackoverflow.com/questions/37058648/how-to-render-numerous-objects-in-opengl-efficiently
  *
  * @author Scott Kuhl
@@ -22,6 +28,9 @@
 #include <GLFW/glfw3.h>
 
 static GLuint program = 0; /**< id value for the GLSL program */
+static GLuint instancedProgram = 0; /**< id value for the GLSL program used for instancing */
+static int useInstancing = 1; /**< Draw all models with one draw call per mesh? */
+static int baked = 0; /**< Was the animation baked with kuhl_bake_model()? */
 
 static kuhl_geometry *fpsgeom = NULL;
 static kuhl_geometry *modelgeom = NULL;
@@ -43,10 +52,32 @@ static const float initCamUp[3]   = {0,1,0};
 
 #define NUM_MODELS 5000
 static float positions[NUM_MODELS][3];
+static float modelMatrices[NUM_MODELS][16];
+static float modelAnims[NUM_MODELS][2]; /**< Time offset and speed of the animation for each copy */
 
 #define GLSL_VERT_FILE "assimp.vert"
+#define GLSL_VERT_INSTANCED_FILE "assimp-instanced.vert"
+#define GLSL_VERT_BAKED_FILE "assimp-baked.vert"
 #define GLSL_FRAG_FILE "assimp.frag"
 
+/** Switches the model between instanced drawing (with the
+ * instancedProgram) and drawing each copy separately (with program). */
+void set_instancing(int enable)
+{
+	useInstancing = enable;
+	if(useInstancing)
+	{
+		kuhl_geometry_program(modelgeom, instancedProgram, KG_FULL_LIST);
+		kuhl_geometry_instances_anim(modelgeom, modelMatrices[0], NULL, modelAnims[0], NUM_MODELS, KG_WARN | KG_FULL_LIST);
+	}
+	else
+	{
+		kuhl_geometry_instances(modelgeom, NULL, NULL, 0, KG_FULL_LIST);
+		kuhl_geometry_program(modelgeom, program, KG_FULL_LIST);
+	}
+	printf("Instancing: %s\n", useInstancing ? "on" : "off");
+}
+
 /* Called by GLFW whenever a key is pressed. */
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
@@ -54,7 +85,12 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 	if (kuhl_keyboard_handler(window, key, scancode, action, mods))
 		return;
 
+	if(action != GLFW_PRESS)
+		return;
+
 	/* Custom key handling code here */
+	if(key == GLFW_KEY_I)
+		set_instancing(!useInstancing);
 }
 
 
@@ -87,6 +123,9 @@ void get_fit_matrix(float result[16], float xPos, float yPos, float zPos, float
 /** Draws the 3D scene. */
 void display()
 {
+	double time = glfwGetTime();
+	dgr_setget("time", &time, sizeof(double));
+
 	/* Display FPS if we are a DGR master OR if we are running without
 	 * dgr. */
 	if(dgr_is_master())
@@ -152,6 +191,27 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
+		float modelview[16];
+		if(useInstancing)
+		{
+			glUseProgram(instancedProgram);
+			kuhl_errorcheck();
+			glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, perspective);
+			glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
+			if(baked)
+				glUniform1f(kuhl_get_uniform("AnimTime"), time);
+
+			/* The model matrix for each copy is stored in the
+			 * per-instance data, so ModelView only needs the view
+			 * matrix. */
+			glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, viewMat);
+			/* Every instance is drawn with the same level of
+			 * detail, so use the full resolution mesh. */
+			kuhl_geometry_lod_select(modelgeom, NULL, NULL, NULL, KG_FULL_LIST);
+			kuhl_geometry_draw(modelgeom); /* Draw all of the models */
+			kuhl_errorcheck();
+		}
+
 		glUseProgram(program);
 		kuhl_errorcheck();
 		/* Send the perspective projection matrix to the vertex program. */
@@ -162,13 +222,9 @@ void display()
 
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
-		float modelview[16];
-		for(int i=0; i<NUM_MODELS; i++)
+		for(int i=0; i<NUM_MODELS && !useInstancing; i++)
 		{
-			float fitMat[16];
-			get_fit_matrix(fitMat, positions[i][0], positions[i][1], positions[i][2], bbox);
-
-			mat4f_mult_mat4f_new(modelview, viewMat, fitMat); // modelview = view * model
+			mat4f_mult_mat4f_new(modelview, viewMat, modelMatrices[i]); // modelview = view * model
 
 			/* Send the modelview matrix to the vertex program. */
 			glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
@@ -176,6 +232,9 @@ void display()
 			                   0, // transpose
 			                   modelview); // value
 
+			/* Use fewer triangles for copies which are far away. */
+			kuhl_geometry_lod_select(modelgeom, modelview, perspective, viewport, KG_FULL_LIST);
+
 			kuhl_errorcheck();
 			kuhl_geometry_draw(modelgeom); /* Draw the model */
 			kuhl_errorcheck();
@@ -214,10 +273,10 @@ void display()
 
 	/* Update the model for the next frame based on the time. We
 	 * convert the time to seconds and then use mod to cause the
-	 * animation to repeat. */
-	double time = glfwGetTime();
-	dgr_setget("time", &time, sizeof(double));
-	kuhl_update_model(modelgeom, 0, fmod(time,10));
+	 * animation to repeat. Baked instances are animated by the
+	 * vertex program instead. */
+	if(!(baked && useInstancing))
+		kuhl_update_model(modelgeom, 0, fmod(time,10));
 
 	/* Check for errors. If there are errors, consider adding more
 	 * calls to kuhl_errorcheck() in your code. */
@@ -240,6 +299,7 @@ int main(int argc, char** argv)
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
 	program = kuhl_create_program(GLSL_VERT_FILE, GLSL_FRAG_FILE);
+	instancedProgram = kuhl_create_program(GLSL_VERT_INSTANCED_FILE, GLSL_FRAG_FILE);
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	viewmat_init(initCamPos, initCamLook, initCamUp);
@@ -250,8 +310,19 @@ int main(int argc, char** argv)
 
 	// Load the model from the file
 	const char *modelFile = "../models/duck/duck.dae";
+	if(argc > 1)
+		modelFile = argv[1];
 	modelgeom = kuhl_load_model(modelFile, NULL, program, bbox);
 
+	/* If the model is animated, store every frame of the animation in
+	 * a texture so that each instance can be animated on the GPU. */
+	if(modelgeom->skeleton && kuhl_bake_model(modelgeom, 0, 30) > 0)
+	{
+		kuhl_delete_program(instancedProgram);
+		instancedProgram = kuhl_create_program(GLSL_VERT_BAKED_FILE, GLSL_FRAG_FILE);
+		baked = 1;
+	}
+
 
 
 	for(int i=0; i<NUM_MODELS; i++)
@@ -259,7 +330,11 @@ int main(int argc, char** argv)
 		positions[i][0] = drand48()*50-25;
 		positions[i][1] = drand48()*50-25;
 		positions[i][2] = drand48()*50-25;
+		get_fit_matrix(modelMatrices[i], positions[i][0], positions[i][1], positions[i][2], bbox);
+		modelAnims[i][0] = drand48()*10;     // start at a different time
+		modelAnims[i][1] = .75+drand48()*.5; // and play at a different speed
 	}
+	set_instancing(useInstancing);
 	
 	while(!glfwWindowShouldClose(kuhl_get_window()))
 	{
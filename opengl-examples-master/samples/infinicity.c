@@ -23,6 +23,7 @@ static float cameraMovment = 0;
 static int newrowindicator = 0; //used for tracking when we move 1 unit
 static int terrainsidelength = 11;
 static kuhl_geometry ground;
+static renderqueue *rq = NULL; /**< Sorts the ground and buildings to reduce state changes */
 
 static kuhl_geometry buildingbottom[10][10];
 static kuhl_geometry windowbottom[10][10];
@@ -123,7 +124,7 @@ void display()
 					vec2[1] = j;
 					seed = (long)(100 * vecNf_dot(vec1, vec2, 2));
 					srand48(seed); //each new building gets its own seed based on coordinates
-					init_geometryBuilding(&buildingbottom[i][tempjindex], &windowbottom[i][tempjindex], &buildingtop[i][tempjindex], &windowtop[i][tempjindex], program, i, tempjindex);
+					init_geometryBuilding(&buildingbottom[i][tempjindex], &windowbottom[i][tempjindex], &buildingtop[i][tempjindex], &windowtop[i][tempjindex], program);
 				}
 				tempjindex++;
 			}
@@ -139,43 +140,26 @@ void display()
 		float modelview[16];
 		mat4f_mult_mat4f_new(modelview, viewMat, modelMat);
 
-		kuhl_errorcheck();
+		/* Send the projection matrix to both programs. The render
+		 * queue will set the ModelView matrix for each object. */
 		glUseProgram(program2);
-		kuhl_errorcheck();
-
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
 			1, // number of 4x4 float matrices
 			0, // transpose
 			perspective); // value
-		/* Send the modelview matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
-			1, // number of 4x4 float matrices
-			0, // transpose
-			modelview); // value
-		kuhl_errorcheck();
-		kuhl_geometry_draw(&ground);
-		glUseProgram(0); // stop using a GLSL program.
-
-
-		//--------Draw buildings-------------------//
-		kuhl_errorcheck();
 		glUseProgram(program);
-		kuhl_errorcheck();
-		//mat4f_mult_mat4f_new(modelMat, scaleMat, scaleMat);
-		//mat4f_mult_mat4f_new(modelview, viewMat, modelMat);
-
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
 			1, // number of 4x4 float matrices
 			0, // transpose
 			perspective); // value
-		/* Send the modelview matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
-			1, // number of 4x4 float matrices
-			0, // transpose
-			modelview); // value
+		glUseProgram(0);
 		kuhl_errorcheck();
-		/* Draw the geometry using the matrices that we sent to the
-		 * vertex programs immediately above */
+
+		/* Skip buildings that are outside of the view frustum. */
+		renderqueue_cull(rq, perspective);
+		renderqueue_add(rq, &ground, modelview, 0);
+
+		//--------Draw buildings-------------------//
 		int jindex = 0;
 		for (int j = newrowindicator; j < newrowindicator + 10; j++) {
 			for (int i = 0; i < 10; i++) {
@@ -194,26 +178,19 @@ void display()
 				float modelview[16];
 				mat4f_mult_mat4f_new(modelview, viewMat, modelMat);
 
-				glUniformMatrix4fv(kuhl_get_uniform("Projection"),
-					1, // number of 4x4 float matrices
-					0, // transpose
-					perspective); // value
-				/* Send the modelview matrix to the vertex program. */
-				glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
-					1, // number of 4x4 float matrices
-					0, // transpose
-					modelview); // value
-				kuhl_errorcheck();
-
-				kuhl_geometry_draw(&buildingbottom[i][jindex]);
-				kuhl_geometry_draw(&windowbottom[i][jindex]);
-				kuhl_geometry_draw(&buildingtop[i][jindex]);
-				kuhl_geometry_draw(&windowtop[i][jindex]);
+				renderqueue_add(rq, &buildingbottom[i][jindex], modelview, 0);
+				renderqueue_add(rq, &windowbottom[i][jindex], modelview, 0);
+				renderqueue_add(rq, &buildingtop[i][jindex], modelview, 0);
+				renderqueue_add(rq, &windowtop[i][jindex], modelview, 0);
 			}
 			jindex++;
 		}
 
-		glUseProgram(0);
+		/* Draw everything sorted by program, texture and depth. */
+		renderqueue_flush(rq);
+		if(rq->frameCount % 300 == 0)
+			renderqueue_print_stats(rq);
+		kuhl_errorcheck();
 
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
@@ -858,6 +835,7 @@ int main(int argc, char** argv)
 	/* Create kuhl_geometry structs for the objects that we want to
 	 * draw. */
 	init_geometryGround(&ground, program2);
+	rq = renderqueue_new("ModelView");
 
 	float vec1[2] = { 123.456, 9876.543 }; //random numbers for making seed
 	float vec2[2] = { 0,0 };
@@ -868,7 +846,7 @@ int main(int argc, char** argv)
 			vec2[1] = j;
 			seed = (long) (100 * vecNf_dot(vec1, vec2, 2));
 			srand48(seed); //each new building gets its own seed based on coordinates
-			init_geometryBuilding(&buildingbottom[i][j], &windowbottom[i][j], &buildingtop[i][j], &windowtop[i][j], program, i,j);
+			init_geometryBuilding(&buildingbottom[i][j], &windowbottom[i][j], &buildingtop[i][j], &windowtop[i][j], program);
 
 		}
 	}
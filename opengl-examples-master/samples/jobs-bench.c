@@ -0,0 +1,131 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Measures how much faster CPU work runs when it is split
+ * across threads with the job system (see jobs.h). The first test
+ * transforms a large array of vertices by a matrix. If a model file is
+ * provided, the second test updates the animation of many copies of
+ * the model with kuhl_update_model(). Each test is run on one thread
+ * and then with jobs_parallel_for(). Use the jobs.threads setting to
+ * change the number of threads.
+ *
+ * @author Scott Kuhl
+ */
+
+#include "libkuhl.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#define VERTEX_COUNT 4000000 /**< Number of vertices to transform */
+#define MODEL_COUNT 200 /**< Number of copies of the model to animate */
+#define REPEAT 10 /**< Number of times each test is run */
+
+/** Data for transform_range() */
+typedef struct {
+	float matrix[16];
+	const float *in;
+	float *out;
+} transform_data;
+
+/** Transforms vertices begin to end-1. */
+static void transform_range(void *arg, int begin, int end)
+{
+	transform_data *d = (transform_data*) arg;
+	for(int i=begin; i<end; i++)
+	{
+		float v[4] = { d->in[i*3], d->in[i*3+1], d->in[i*3+2], 1 };
+		float result[4];
+		mat4f_mult_vec4f_new(result, d->matrix, v);
+		vec3f_copy(&d->out[i*3], result);
+	}
+}
+
+/** Data for update_range() */
+typedef struct {
+	kuhl_geometry **models;
+	float time;
+} update_data;
+
+/** Updates the animation of models begin to end-1. */
+static void update_range(void *arg, int begin, int end)
+{
+	update_data *d = (update_data*) arg;
+	for(int i=begin; i<end; i++)
+		kuhl_update_model(d->models[i], 0, d->time + i*0.1f);
+}
+
+/** Runs func on count items REPEAT times, first on this thread and
+ * then with jobs_parallel_for(), and prints how long it took. */
+static void bench(const char *name, int count, jobs_range_func func, void *arg)
+{
+	long start = kuhl_microseconds();
+	for(int r=0; r<REPEAT; r++)
+		func(arg, 0, count);
+	double serial = (kuhl_microseconds()-start) / 1000.0 / REPEAT;
+
+	start = kuhl_microseconds();
+	for(int r=0; r<REPEAT; r++)
+		jobs_parallel_for(count, 0, func, arg);
+	double parallel = (kuhl_microseconds()-start) / 1000.0 / REPEAT;
+
+	printf("%s: %8.3f ms on one thread, %8.3f ms with jobs (%.2fx faster)\n",
+	       name, serial, parallel, parallel > 0 ? serial/parallel : 0);
+}
+
+int main(int argc, char** argv)
+{
+	if(argc > 2)
+	{
+		printf("Usage: %s [model]\n", argv[0]);
+		printf("Compares CPU work on one thread with the same work split into jobs.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	jobs_init();
+	printf("Using %d threads.\n", jobs_thread_count());
+
+	transform_data tdata;
+	float *in = malloc(sizeof(float)*3*VERTEX_COUNT);
+	float *out = malloc(sizeof(float)*3*VERTEX_COUNT);
+	if(in == NULL || out == NULL)
+	{
+		msg(MSG_FATAL, "Failed to allocate space for %d vertices.", VERTEX_COUNT);
+		exit(EXIT_FAILURE);
+	}
+	for(int i=0; i<VERTEX_COUNT*3; i++)
+		in[i] = (float) drand48();
+	mat4f_rotateAxis_new(tdata.matrix, 30, 0, 1, 0);
+	tdata.in = in;
+	tdata.out = out;
+	bench("Transform vertices", VERTEX_COUNT, transform_range, &tdata);
+	free(in);
+	free(out);
+
+	if(argc < 2)
+		exit(EXIT_SUCCESS);
+
+	/* Loading a model requires an OpenGL context. */
+	kuhl_ogl_init(&argc, argv, 512, 512, 32, 4);
+	GLuint program = kuhl_create_program("assimp.vert", "assimp.frag");
+
+	update_data udata;
+	udata.models = malloc(sizeof(kuhl_geometry*)*MODEL_COUNT);
+	udata.time = 0;
+	float bbox[6];
+	for(int i=0; i<MODEL_COUNT; i++)
+		udata.models[i] = kuhl_load_model(argv[1], NULL, program, bbox);
+	if(udata.models[0] == NULL || udata.models[0]->skeleton == NULL)
+	{
+		msg(MSG_FATAL, "%s isn't an animated model.", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	bench("Update animated models", MODEL_COUNT, update_range, &udata);
+
+	exit(EXIT_SUCCESS);
+}
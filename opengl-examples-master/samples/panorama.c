@@ -31,6 +31,36 @@ static GLuint cubemapRightTex[6];
 
 
 
+/** Exits if any of the images couldn't be loaded in the background
+ * (see texload.h). */
+void check_textures()
+{
+	static int ready = 0;
+	if(ready)
+		return;
+
+	GLuint textures[14] = { texIdLeft, texIdRight };
+	for(int i=0; i<6; i++)
+	{
+		textures[2+i] = cubemapLeftTex[i];
+		textures[8+i] = cubemapRightTex[i];
+	}
+	ready = 1;
+	for(int i=0; i<14; i++)
+	{
+		if(textures[i] == 0)
+			continue;
+		int status = texload_status(textures[i], NULL);
+		if(status == TEXLOAD_FAILED)
+		{
+			msg(MSG_FATAL, "Failed to load one of the panorama images.");
+			exit(EXIT_FAILURE);
+		}
+		if(status == TEXLOAD_LOADING)
+			ready = 0;
+	}
+}
+
 /* Called by GLFW whenever a key is pressed. */
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
@@ -432,17 +462,18 @@ int main(int argc, char** argv)
 	if(argc == 2)
 	{
 		msg(MSG_INFO, "Cylinder mono image: %s\n", argv[1]);
-		if(kuhl_read_texture_file(argv[1], &texIdLeft) < 0)
+		texIdLeft = kuhl_read_texture_file_async(argv[1], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+		if(texIdLeft == 0)
 			exit(EXIT_FAILURE);
 		texIdRight = texIdLeft;
 	}
 	if(argc == 3)
 	{
 		msg(MSG_INFO, "Cylinder left  image: %s\n", argv[1]);
-		if(kuhl_read_texture_file(argv[1], &texIdLeft) < 0)
-			exit(EXIT_FAILURE);
+		texIdLeft = kuhl_read_texture_file_async(argv[1], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
 		msg(MSG_INFO, "Cylinder right image: %s\n", argv[2]);
-		if(kuhl_read_texture_file(argv[2], &texIdRight) < 0)
+		texIdRight = kuhl_read_texture_file_async(argv[2], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+		if(texIdLeft == 0 || texIdRight == 0)
 			exit(EXIT_FAILURE);
 	}
 
@@ -452,7 +483,8 @@ int main(int argc, char** argv)
 		for(int i=0; i<6; i++)
 		{
 			msg(MSG_INFO, "Cubemap image (%-5s): %s\n", cubemapNames[i], argv[i+1]);
-			if(kuhl_read_texture_file(argv[i+1], &(cubemapLeftTex[i])) < 0)
+			cubemapLeftTex[i] = kuhl_read_texture_file_async(argv[i+1], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+			if(cubemapLeftTex[i] == 0)
 				exit(EXIT_FAILURE);
 			cubemapRightTex[i]= cubemapLeftTex[i];
 			texIdLeft =0;
@@ -464,10 +496,10 @@ int main(int argc, char** argv)
 		for(int i=0; i<6; i++)
 		{
 			msg(MSG_INFO, "Cubemap image (left,  %-5s): %s\n", cubemapNames[i], argv[i+6+1]);
-			if(kuhl_read_texture_file(argv[i+1], &(cubemapLeftTex[i])) < 0)
-				exit(EXIT_FAILURE);
+			cubemapLeftTex[i] = kuhl_read_texture_file_async(argv[i+1], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
 			msg(MSG_INFO, "Cubemap image (right, %-5s)\n", cubemapNames[i], argv[i+6+1]);
-			if(kuhl_read_texture_file(argv[i+6+1], &(cubemapRightTex[i])) < 0)
+			cubemapRightTex[i] = kuhl_read_texture_file_async(argv[i+6+1], GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
+			if(cubemapLeftTex[i] == 0 || cubemapRightTex[i] == 0)
 				exit(EXIT_FAILURE);
 			texIdLeft =0;
 			texIdRight=0;
@@ -487,6 +519,7 @@ int main(int argc, char** argv)
 	
 	while(!glfwWindowShouldClose(kuhl_get_window()))
 	{
+		check_textures();
 		display();
 		kuhl_errorcheck();
 
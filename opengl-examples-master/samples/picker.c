@@ -4,9 +4,12 @@
  */
 
 /** @file This example demonstrates how to draw a HUD cursor and how
- * to use the stencil buffer to determine what piece of geometry the
- * cursor is on. For more information and details, see:
- * http://en.wikibooks.org/wiki/OpenGL_Programming/Object_selection
+ * to determine what piece of geometry the cursor is on. A ray is
+ * cast from the camera through the cursor and tested against a
+ * bounding volume hierarchy (see bvh.h) of the triangles in the
+ * scene. Unlike reading back the stencil buffer (see
+ * http://en.wikibooks.org/wiki/OpenGL_Programming/Object_selection ),
+ * this doesn't make the CPU wait for the GPU to finish drawing.
  *
  * @author Scott Kuhl
  */
@@ -14,6 +17,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
@@ -24,6 +28,22 @@ static kuhl_geometry cursor;
 static kuhl_geometry triangle;
 static kuhl_geometry quad;
 
+/** BVH containing the triangle (item 0) and the two triangles of the
+ * quad (items 1 and 2) in object coordinates. */
+static bvh *pickTree = NULL;
+
+/** Vertex positions of the triangle. Every 3 numbers is a vertex
+ * position. */
+static const GLfloat trianglePositions[] = {0, 0, 0,
+                                            1, 0, 0,
+                                            1, 1, 0};
+
+/** Vertex positions of the quad. */
+static const GLfloat quadPositions[] = {0+1.1, 0, 0,
+                                        1+1.1, 0, 0,
+                                        1+1.1, 1, 0,
+                                        0+1.1, 1, 0 };
+
 
 /* Called by GLFW whenever a key is pressed. */
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -107,17 +127,9 @@ void display()
 		kuhl_errorcheck();
 
 		/* Draw the geometry using the matrices that we sent to the
-		 * vertex programs immediately above. Use the stencil buffer
-		 * to keep track of which object appears on top. */
-		if(viewportID == 0)
-			glEnable(GL_STENCIL_TEST);
-		glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
-		glStencilFunc(GL_ALWAYS, 1, -1);
+		 * vertex programs immediately above. */
 		kuhl_geometry_draw(&triangle);
-		
-		glStencilFunc(GL_ALWAYS, 2, -1);
 		kuhl_geometry_draw(&quad);
-		glDisable(GL_STENCIL_TEST);
 		
 		/* If we have multiple viewports, only draw cursor in the
 		 * first viewport. */
@@ -138,25 +150,24 @@ void display()
 			kuhl_geometry_draw(&cursor);
 			glEnable(GL_DEPTH_TEST);
 
-			/* When we render images on the Oculus, we are rendering
-			 * into a multisampled framebuffer object, and we can't
-			 * read from the multisample FBO until we have blitted it
-			 * into a normal FBO. Here, we get the blitted FBO for the
-			 * *previous* frame. */
-			GLint fb = viewmat_get_framebuffer(viewportID);
-			glBindFramebuffer(GL_FRAMEBUFFER, fb);
-			
-			GLuint stencilVal = 0;
-			kuhl_errorcheck();
-			glReadPixels(viewport[0]+viewport[2]/2, viewport[1]+viewport[3]/2,
-			             1,1, // get data for 1x1 area (i.e., a pixel)
-			             GL_STENCIL_INDEX, // query the stencil buffer
-			             GL_UNSIGNED_INT,
-			             &stencilVal);
-			kuhl_errorcheck();
-			if(stencilVal == 1)
+			/* The cursor is in the center of the screen. Find the
+			 * points on the near and far clipping planes behind the
+			 * cursor in object coordinates and cast a ray between
+			 * them. */
+			float mvp[16], inverse[16];
+			mat4f_mult_mat4f_new(mvp, perspective, modelview);
+			mat4f_invert_new(inverse, mvp);
+			float nearPt[4] = { 0, 0, -1, 1 };
+			float farPt[4]  = { 0, 0,  1, 1 };
+			mat4f_mult_vec4f(nearPt, inverse);
+			mat4f_mult_vec4f(farPt, inverse);
+			vec3f_scalarDiv(nearPt, nearPt[3]);
+			vec3f_scalarDiv(farPt, farPt[3]);
+
+			int hit = bvh_segment(pickTree, nearPt, farPt, NULL, NULL, NULL);
+			if(hit == 0)
 				printf("Cursor is on triangle.\n");
-			else if(stencilVal == 2)
+			else if(hit > 0)
 				printf("Cursor is on quad.\n");
 			else
 				printf("Cursor isn't on anything.\n");
@@ -178,13 +189,10 @@ void init_geometryTriangle(kuhl_geometry *geom, GLuint prog)
 	kuhl_geometry_new(geom, prog, 3, // num vertices
 	                  GL_TRIANGLES); // primitive type
 
-	/* Vertices that we want to form triangles out of. Every 3 numbers
-	 * is a vertex position. Since no indices are provided, every
-	 * three vertex positions form a single triangle.*/
-	GLfloat vertexPositions[] = {0, 0, 0,
-	                             1, 0, 0,
-	                             1, 1, 0};
-	kuhl_geometry_attrib(geom, vertexPositions, // data
+	/* Vertices that we want to form triangles out of. Since no
+	 * indices are provided, every three vertex positions form a
+	 * single triangle.*/
+	kuhl_geometry_attrib(geom, trianglePositions, // data
 	                     3, // number of components (x,y,z)
 	                     "in_Position", // GLSL variable
 	                     KG_WARN); // warn if attribute is missing in GLSL program?
@@ -222,14 +230,9 @@ void init_geometryQuad(kuhl_geometry *geom, GLuint prog)
 	                  4, // number of vertices
 	                  GL_TRIANGLES); // type of thing to draw
 
-	/* Vertices that we want to form triangles out of. Every 3 numbers
-	 * is a vertex position. Below, we provide indices to form
-	 * triangles out of these vertices. */
-	GLfloat vertexPositions[] = {0+1.1, 0, 0,
-	                             1+1.1, 0, 0,
-	                             1+1.1, 1, 0,
-	                             0+1.1, 1, 0 };
-	kuhl_geometry_attrib(geom, vertexPositions,
+	/* Vertices that we want to form triangles out of. Below, we
+	 * provide indices to form triangles out of these vertices. */
+	kuhl_geometry_attrib(geom, quadPositions,
 	                     3, // number of components x,y,z
 	                     "in_Position", // GLSL variable
 	                     KG_WARN); // warn if attribute is missing in GLSL program?
@@ -268,6 +271,17 @@ int main(int argc, char** argv)
 	init_geometryTriangle(&triangle, program);
 	init_geometryQuad(&quad, program);
 
+	/* Build a BVH from the vertices of the triangle and quad so we
+	 * can check which one the cursor is on. */
+	GLfloat pickPositions[3*7];
+	memcpy(pickPositions, trianglePositions, sizeof(trianglePositions));
+	memcpy(pickPositions+9, quadPositions, sizeof(quadPositions));
+	unsigned int pickIndices[] = { 0, 1, 2,
+	                               3, 4, 5,
+	                               3, 5, 6 };
+	pickTree = bvh_new();
+	bvh_build_triangles(pickTree, pickPositions, pickIndices, 3);
+
 	dgr_init();     /* Initialize DGR based on environment variables. */
 
 	float initCamPos[3]  = {0,0,10}; // location of camera
@@ -284,5 +298,6 @@ int main(int argc, char** argv)
 		glfwPollEvents();
 	}
 
+	bvh_free(pickTree);
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,48 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Converts an image file into a compressed KTX texture (with
+ * mipmaps) that kuhl_read_texture_file() can load without decoding
+ * it. Doesn't need an OpenGL context.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <GL/glew.h>
+
+#include "texcompress.h"
+#include "msg.h"
+
+int main(int argc, char** argv)
+{
+	if(argc != 3 && argc != 4)
+	{
+		printf("Usage: %s input.png output.ktx [bc1|bc3]\n", argv[0]);
+		printf("Compresses an image into a KTX file. If the format isn't specified, BC3\n");
+		printf("is used for images with transparent pixels and BC1 for other images.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	GLenum format = 0;
+	if(argc == 4)
+	{
+		if(strcmp(argv[3], "bc1") == 0)
+			format = GL_COMPRESSED_SRGB_S3TC_DXT1_EXT;
+		else if(strcmp(argv[3], "bc3") == 0)
+			format = GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;
+		else
+		{
+			msg(MSG_FATAL, "Unknown format '%s'. Use bc1 or bc3.", argv[3]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(texcompress_convert(argv[1], argv[2], format) < 0)
+		exit(EXIT_FAILURE);
+	exit(EXIT_SUCCESS);
+}
@@ -47,7 +47,9 @@ static const float initCamLook[3] = {0.0f,0.0f,-5.0f};
 static const float initCamUp[3]   = {0.0f,1.0f,0.0f};
 
 
-#define GLSL_VERT_FILE "assimp.vert"
+/* Use dual quaternion skinning if the model's bones are stored as
+ * dual quaternions. */
+#define GLSL_VERT_FILE (kuhl_config_boolean("model.dualquat", 0, 0) ? "assimp-dq.vert" : "assimp.vert")
 #define GLSL_FRAG_FILE "assimp.frag"
 
 /* Called by GLFW whenever a key is pressed. */
@@ -218,7 +220,8 @@ void display()
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
 		kuhl_errorcheck();
-		kuhl_geometry_draw(modelgeom); /* Draw the model */
+		/* Draw the parts of the model inside of the view frustum */
+		kuhl_geometry_draw_culled(modelgeom, modelview, perspective);
 		kuhl_errorcheck();
 		if(showOrigin && origingeom != NULL)
 		{
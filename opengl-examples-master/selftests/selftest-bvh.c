@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+#include "vecmat.h"
+#include "bvh.h"
+
+#define NUM_BOXES 2000
+
+/* Fills in a random box somewhere in a 100x100x100 area. */
+static void random_box(float box[6])
+{
+	for(int i=0; i<6; i=i+2)
+	{
+		float center = drand48()*100-50;
+		float size = drand48()*2;
+		box[i]   = center - size;
+		box[i+1] = center + size;
+	}
+}
+
+static int box_overlap(const float a[6], const float b[6])
+{
+	for(int i=0; i<6; i=i+2)
+		if(a[i] > b[i+1] || a[i+1] < b[i])
+			return 0;
+	return 1;
+}
+
+/* Checks that every item that overlaps a query box is returned by
+ * the BVH and nothing else is. */
+static void test_overlap(bvh *b, const float *boxes, int count)
+{
+	list *results = list_new(64, sizeof(int), NULL);
+	for(int q=0; q<200; q++)
+	{
+		float query[6];
+		random_box(query);
+		for(int i=0; i<6; i=i+2)
+		{
+			query[i]   -= 5;
+			query[i+1] += 5;
+		}
+		list_set_length(results, 0);
+		bvh_overlap(b, query, results);
+
+		char *found = calloc(count, 1);
+		for(int i=0; i<list_length(results); i++)
+		{
+			int item = *(int*) list_getptr(results, i);
+			if(found[item])
+				printf("ERROR: Item %d was returned twice.\n", item);
+			found[item] = 1;
+		}
+		for(int i=0; i<count; i++)
+		{
+			if(found[i] != box_overlap(boxes+i*6, query))
+				printf("ERROR: Overlap query was wrong for item %d.\n", i);
+		}
+		free(found);
+	}
+	list_free(results);
+}
+
+/* Makes sure the frustum query returns every box that a brute force
+ * test says is inside of the frustum. */
+static void test_frustum(bvh *b, const float *boxes, int count)
+{
+	float proj[16], view[16], viewproj[16], planes[6][4];
+	mat4f_perspective_new(proj, 60, 1, 1, 40);
+	mat4f_lookat_new(view, 0,0,0, drand48()-.5, drand48()-.5, drand48()-.5, 0,1,0);
+	mat4f_mult_mat4f_new(viewproj, proj, view);
+	kuhl_frustum_planes(planes, viewproj);
+
+	list *results = list_new(64, sizeof(int), NULL);
+	bvh_frustum(b, planes, results);
+	char *found = calloc(count, 1);
+	for(int i=0; i<list_length(results); i++)
+		found[*(int*) list_getptr(results, i)] = 1;
+
+	for(int i=0; i<count; i++)
+	{
+		/* Check if any corner of the box is inside of the frustum. If
+		 * one is, the BVH must have returned the box. */
+		const float *box = boxes+i*6;
+		for(int c=0; c<8; c++)
+		{
+			float p[4] = { box[(c&1)], box[2+((c>>1)&1)], box[4+((c>>2)&1)], 1 };
+			mat4f_mult_vec4f(p, viewproj);
+			if(fabsf(p[0]) < p[3] && fabsf(p[1]) < p[3] && fabsf(p[2]) < p[3] && !found[i])
+			{
+				printf("ERROR: Box %d is inside of the frustum but was not returned.\n", i);
+				break;
+			}
+		}
+	}
+	free(found);
+	list_free(results);
+}
+
+/* Compares the closest triangle hit by a ray against brute force. */
+static void test_triangles(void)
+{
+	int count = 1000;
+	float *positions = malloc(sizeof(float)*9*count);
+	for(int i=0; i<count; i++)
+	{
+		float center[3] = { drand48()*20-10, drand48()*20-10, drand48()*20-10 };
+		for(int j=0; j<3; j++)
+			for(int k=0; k<3; k++)
+				positions[i*9+j*3+k] = center[k] + drand48()-.5;
+	}
+	bvh *b = bvh_new();
+	bvh_build_triangles(b, positions, NULL, count);
+
+	bvh *brute = bvh_new();
+	for(int q=0; q<500; q++)
+	{
+		float origin[3] = { drand48()*30-15, drand48()*30-15, -20 };
+		float dir[3] = { drand48()-.5, drand48()-.5, 1 };
+		float dist = 0;
+		int hit = bvh_ray(b, origin, dir, FLT_MAX, NULL, NULL, &dist);
+
+		/* Test every triangle by putting each one in its own BVH. */
+		int bestItem = -1;
+		float best = FLT_MAX;
+		for(int i=0; i<count; i++)
+		{
+			float d;
+			bvh_build_triangles(brute, positions+i*9, NULL, 1);
+			if(bvh_ray(brute, origin, dir, FLT_MAX, NULL, NULL, &d) == 0 && d < best)
+			{
+				best = d;
+				bestItem = i;
+			}
+		}
+		if(hit != bestItem)
+			printf("ERROR: Ray hit triangle %d, expected %d.\n", hit, bestItem);
+		else if(hit >= 0 && fabsf(dist-best) > 1e-4)
+			printf("ERROR: Ray hit at distance %f, expected %f.\n", dist, best);
+
+		/* A segment that ends before the hit must not hit it. */
+		if(hit >= 0)
+		{
+			float end[3];
+			for(int i=0; i<3; i++)
+				end[i] = origin[i] + dir[i]*dist*.5f;
+			if(bvh_segment(b, origin, end, NULL, NULL, NULL) != -1)
+				printf("ERROR: Segment hit a triangle beyond its end.\n");
+		}
+	}
+	bvh_free(brute);
+	bvh_free(b);
+	free(positions);
+}
+
+int main(void)
+{
+	srand48(1);
+	float *boxes = malloc(sizeof(float)*6*NUM_BOXES);
+	for(int i=0; i<NUM_BOXES; i++)
+		random_box(boxes+i*6);
+
+	bvh *b = bvh_new();
+	bvh_build(b, boxes, NUM_BOXES);
+	test_overlap(b, boxes, NUM_BOXES);
+	test_frustum(b, boxes, NUM_BOXES);
+
+	/* Move every box and refit instead of rebuilding. */
+	for(int i=0; i<NUM_BOXES*6; i++)
+		boxes[i] += (float) (drand48()*4-2);
+	for(int i=0; i<NUM_BOXES; i++)
+	{
+		/* Keep min <= max after moving each side randomly. */
+		for(int j=0; j<6; j=j+2)
+		{
+			if(boxes[i*6+j] > boxes[i*6+j+1])
+			{
+				float tmp = boxes[i*6+j];
+				boxes[i*6+j] = boxes[i*6+j+1];
+				boxes[i*6+j+1] = tmp;
+			}
+		}
+	}
+	bvh_refit(b, boxes);
+	test_overlap(b, boxes, NUM_BOXES);
+	test_frustum(b, boxes, NUM_BOXES);
+
+	/* An empty tree shouldn't return anything. */
+	bvh_build(b, NULL, 0);
+	float origin[3] = {0,0,0}, dir[3] = {0,0,1};
+	if(bvh_ray(b, origin, dir, FLT_MAX, NULL, NULL, NULL) != -1)
+		printf("ERROR: Empty BVH returned a hit.\n");
+	bvh_free(b);
+	free(boxes);
+
+	test_triangles();
+	return 0;
+}
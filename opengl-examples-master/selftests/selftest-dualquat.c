@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "vecmat.h"
+
+/* Converts a dual quaternion back into a matrix the same way that
+ * samples/assimp-dq.vert does. */
+void mat4f_from_dualquatf(float mat[16], const float dq[8])
+{
+	const float *r = dq, *d = dq+4;
+	mat4f_rotateQuatVec_new(mat, r);
+	float cross[3];
+	vec3f_cross_new(cross, r, d);
+	for(int i=0; i<3; i++)
+		mat[mat4_getIndex(i,3)] = 2*(r[3]*d[i] - d[3]*r[i] + cross[i]);
+}
+
+/* Given a rotation and translation matrix, convert it to a dual
+ * quaternion and back. The resulting matrix should match the
+ * original matrix. */
+void test_dualquat(const float mat[16])
+{
+	float dq[8], result[16];
+	dualquatf_from_mat4f(dq, mat);
+	mat4f_from_dualquatf(result, dq);
+
+	float diff = 0;
+	for(int i=0; i<16; i++)
+		diff += fabsf(mat[i]-result[i]);
+	if(diff > .0001)
+		printf("ERROR: dual quaternion: %0.20f\n", diff);
+}
+
+/* Multiplying two quaternions should be the same as multiplying
+ * their rotation matrices. */
+void test_quat_mult(const float a[4], const float b[4])
+{
+	float ab[4], matA[16], matB[16], expected[16], result[16];
+	quatf_mult_quatf_new(ab, a, b);
+	mat4f_rotateQuatVec_new(matA, a);
+	mat4f_rotateQuatVec_new(matB, b);
+	mat4f_mult_mat4f_new(expected, matA, matB);
+	mat4f_rotateQuatVec_new(result, ab);
+
+	float diff = 0;
+	for(int i=0; i<16; i++)
+		diff += fabsf(expected[i]-result[i]);
+	if(diff > .00001)
+		printf("ERROR: quaternion multiply: %0.20f\n", diff);
+}
+
+int main(void)
+{
+	for(int i=0; i<10000; i++)
+	{
+		float a[4], b[4];
+		quatf_rotateAxis_new(a, drand48()*360, drand48()-.5, drand48()-.5, drand48()-.5);
+		quatf_rotateAxis_new(b, drand48()*360, drand48()-.5, drand48()-.5, drand48()-.5);
+		test_quat_mult(a, b);
+
+		float mat[16];
+		mat4f_rotateQuatVec_new(mat, a);
+		mat[12] = drand48()*20-10;
+		mat[13] = drand48()*20-10;
+		mat[14] = drand48()*20-10;
+		test_dualquat(mat);
+	}
+
+	printf("This program will print out ERROR above if an error occurs.\n");
+}
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "jobs.h"
+
+#define COUNT 100000
+
+static int values[COUNT];
+
+static void square(void *arg, int begin, int end)
+{
+	int *v = (int*) arg;
+	for(int i=begin; i<end; i++)
+		v[i] = i*i;
+}
+
+/* Every index should be visited exactly once. */
+void test_parallel_for(int grain)
+{
+	memset(values, 0, sizeof(values));
+	jobs_parallel_for(COUNT, grain, square, values);
+	for(int i=0; i<COUNT; i++)
+		if(values[i] != i*i)
+		{
+			printf("ERROR: parallel_for (grain %d): index %d was %d\n", grain, i, values[i]);
+			return;
+		}
+}
+
+static void increment(void *arg)
+{
+	int *v = (int*) arg;
+	(*v)++;
+}
+
+/* Each job adds and waits on jobs of its own. */
+static void nested(void *arg)
+{
+	int *v = (int*) arg;
+	jobs_group group;
+	jobs_group_init(&group);
+	for(int i=0; i<100; i++)
+		jobs_add(&group, increment, v+i);
+	jobs_wait(&group);
+}
+
+void test_nested(void)
+{
+	memset(values, 0, sizeof(values));
+	jobs_group group;
+	jobs_group_init(&group);
+	for(int i=0; i<100; i++)
+		jobs_add(&group, nested, values+i*100);
+	jobs_wait(&group);
+	if(group.pending != 0)
+		printf("ERROR: nested: %d jobs still pending\n", group.pending);
+	for(int i=0; i<100*100; i++)
+		if(values[i] != 1)
+		{
+			printf("ERROR: nested: job %d ran %d times\n", i, values[i]);
+			return;
+		}
+}
+
+int main(void)
+{
+	printf("Using %d threads.\n", jobs_thread_count());
+	for(int i=0; i<20; i++)
+	{
+		test_parallel_for(0);
+		test_parallel_for(1);
+		test_parallel_for(777);
+		test_parallel_for(COUNT);
+		test_nested();
+	}
+	printf("This program will print out ERROR above if an error occurs.\n");
+	return 0;
+}
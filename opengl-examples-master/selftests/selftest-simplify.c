@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "vecmat.h"
+#include "simplify.h"
+
+/* Checks that the simplified triangles only use valid vertices and
+ * that none of them are degenerate. */
+static void check_triangles(const unsigned int *indices, unsigned int count, unsigned int vertexCount, const char *name)
+{
+	if(count % 3 != 0)
+		printf("ERROR: %s: %u indices is not a multiple of 3.\n", name, count);
+	for(unsigned int t=0; t+2<count; t=t+3)
+	{
+		for(int i=0; i<3; i++)
+			if(indices[t+i] >= vertexCount)
+				printf("ERROR: %s: Triangle %u uses vertex %u which doesn't exist.\n", name, t/3, indices[t+i]);
+		if(indices[t] == indices[t+1] || indices[t+1] == indices[t+2] || indices[t] == indices[t+2])
+			printf("ERROR: %s: Triangle %u is degenerate.\n", name, t/3);
+	}
+}
+
+/* A flat grid should simplify without any error and its border
+ * vertices should not move. */
+static void test_grid(void)
+{
+	int n = 30;
+	unsigned int vertexCount = (n+1)*(n+1);
+	float *positions = malloc(sizeof(float)*3*vertexCount);
+	for(int y=0; y<=n; y++)
+		for(int x=0; x<=n; x++)
+			vec3f_set(positions+(y*(n+1)+x)*3, x, y, 0);
+
+	unsigned int indexCount = n*n*6;
+	unsigned int *indices = malloc(sizeof(unsigned int)*indexCount);
+	unsigned int *result = malloc(sizeof(unsigned int)*indexCount);
+	unsigned int *ind = indices;
+	for(int y=0; y<n; y++)
+	{
+		for(int x=0; x<n; x++)
+		{
+			unsigned int a = y*(n+1)+x, b = a+1, c = a+n+1, d = c+1;
+			*ind++ = a; *ind++ = b; *ind++ = d;
+			*ind++ = a; *ind++ = d; *ind++ = c;
+		}
+	}
+
+	float error = -1;
+	unsigned int count = simplify_mesh(result, indices, indexCount, positions, vertexCount, 3, indexCount/4, &error);
+	check_triangles(result, count, vertexCount, "grid");
+	if(count > indexCount/4)
+		printf("ERROR: grid: Simplified to %u indices, wanted at most %u.\n", count, indexCount/4);
+	if(error != 0)
+		printf("ERROR: grid: Flat grid had error %f.\n", error);
+
+	/* Every triangle should still face +z. */
+	for(unsigned int t=0; t<count; t=t+3)
+	{
+		float e1[3], e2[3], normal[3];
+		vec3f_sub_new(e1, positions+result[t+1]*3, positions+result[t]*3);
+		vec3f_sub_new(e2, positions+result[t+2]*3, positions+result[t]*3);
+		vec3f_cross_new(normal, e1, e2);
+		if(normal[2] <= 0)
+			printf("ERROR: grid: Triangle %u was flipped.\n", t/3);
+	}
+
+	/* Simplifying in place should produce the same result. */
+	unsigned int inPlace = simplify_mesh(indices, indices, indexCount, positions, vertexCount, 3, indexCount/4, NULL);
+	if(inPlace != count)
+		printf("ERROR: grid: In place simplification produced %u indices instead of %u.\n", inPlace, count);
+
+	free(positions);
+	free(indices);
+	free(result);
+}
+
+/* A flat grid with a texture seam down the middle: the vertices in
+ * the middle column are duplicated and the right half of the grid
+ * uses the copies. The seam should simplify like the rest of the
+ * grid and each half should keep using its own vertices. */
+static void test_seam(void)
+{
+	int n = 30, half = n/2;
+	unsigned int gridCount = (n+1)*(n+1);
+	unsigned int vertexCount = gridCount + n+1;
+	float *positions = malloc(sizeof(float)*3*vertexCount);
+	for(int y=0; y<=n; y++)
+	{
+		for(int x=0; x<=n; x++)
+			vec3f_set(positions+(y*(n+1)+x)*3, x, y, 0);
+		vec3f_set(positions+(gridCount+y)*3, half, y, 0);
+	}
+
+	unsigned int indexCount = n*n*6;
+	unsigned int *indices = malloc(sizeof(unsigned int)*indexCount);
+	unsigned int *result = malloc(sizeof(unsigned int)*indexCount);
+	unsigned int *ind = indices;
+	for(int y=0; y<n; y++)
+	{
+		for(int x=0; x<n; x++)
+		{
+			unsigned int a = y*(n+1)+x, b = a+1, c = a+n+1, d = c+1;
+			if(x == half)
+			{
+				a = gridCount+y;
+				c = gridCount+y+1;
+			}
+			*ind++ = a; *ind++ = b; *ind++ = d;
+			*ind++ = a; *ind++ = d; *ind++ = c;
+		}
+	}
+
+	float error = -1;
+	unsigned int count = simplify_mesh(result, indices, indexCount, positions, vertexCount, 3, indexCount/4, &error);
+	check_triangles(result, count, vertexCount, "seam");
+	if(count > indexCount/4)
+		printf("ERROR: seam: Simplified to %u indices, wanted at most %u.\n", count, indexCount/4);
+	if(error != 0)
+		printf("ERROR: seam: Flat grid had error %f.\n", error);
+
+	for(unsigned int t=0; t<count; t=t+3)
+	{
+		/* A triangle on the right side of the seam must use the
+		 * copies of the seam vertices and a triangle on the left
+		 * side must use the originals. */
+		int left = 0, right = 0, original = 0, copy = 0;
+		for(int i=0; i<3; i++)
+		{
+			unsigned int v = result[t+i];
+			if(positions[v*3] < half)
+				left = 1;
+			if(positions[v*3] > half)
+				right = 1;
+			if(v >= gridCount)
+				copy = 1;
+			else if(positions[v*3] == half)
+				original = 1;
+		}
+		if((right && original) || (left && copy) || (left && right))
+			printf("ERROR: seam: Triangle %u crosses the seam.\n", t/3);
+	}
+
+	/* The seam itself should be simplified too. */
+	unsigned char *kept = calloc(vertexCount, 1);
+	for(unsigned int i=0; i<count; i++)
+		kept[result[i]] = 1;
+	int seamKept = 0;
+	for(int y=0; y<=n; y++)
+		if(kept[y*(n+1)+half])
+			seamKept++;
+	if(seamKept > n/2)
+		printf("ERROR: seam: %d of the %d vertices along the seam were kept.\n", seamKept, n+1);
+	free(kept);
+
+	free(positions);
+	free(indices);
+	free(result);
+}
+
+/* A sphere should simplify with a small amount of error and all of
+ * the triangles should continue to face outward. */
+static void test_sphere(void)
+{
+	int slices = 40, stacks = 20;
+	unsigned int vertexCount = 2 + slices*(stacks-1);
+	float *positions = malloc(sizeof(float)*3*vertexCount);
+	vec3f_set(positions, 0, 1, 0);
+	vec3f_set(positions+3, 0, -1, 0);
+	for(int s=1; s<stacks; s++)
+	{
+		float phi = M_PI * s / stacks;
+		for(int i=0; i<slices; i++)
+		{
+			float theta = 2*M_PI * i / slices;
+			vec3f_set(positions+(2+(s-1)*slices+i)*3, sinf(phi)*cosf(theta), cosf(phi), -sinf(phi)*sinf(theta));
+		}
+	}
+
+	unsigned int indexCount = slices*6*(stacks-1);
+	unsigned int *indices = malloc(sizeof(unsigned int)*indexCount);
+	unsigned int *ind = indices;
+	for(int i=0; i<slices; i++)
+	{
+		int j = (i+1) % slices;
+		/* Triangles touching the poles. */
+		*ind++ = 0; *ind++ = 2+i; *ind++ = 2+j;
+		*ind++ = 1; *ind++ = 2+(stacks-2)*slices+j; *ind++ = 2+(stacks-2)*slices+i;
+		for(int s=1; s<stacks-1; s++)
+		{
+			unsigned int a = 2+(s-1)*slices+i, b = 2+(s-1)*slices+j;
+			unsigned int c = a+slices, d = b+slices;
+			*ind++ = a; *ind++ = c; *ind++ = d;
+			*ind++ = a; *ind++ = d; *ind++ = b;
+		}
+	}
+
+	unsigned int *result = malloc(sizeof(unsigned int)*indexCount);
+	float error = -1;
+	unsigned int count = simplify_mesh(result, indices, indexCount, positions, vertexCount, 3, indexCount/8, &error);
+	check_triangles(result, count, vertexCount, "sphere");
+	if(count > indexCount/8)
+		printf("ERROR: sphere: Simplified to %u indices, wanted at most %u.\n", count, indexCount/8);
+	if(error <= 0 || error > .2)
+		printf("ERROR: sphere: Unexpected error %f.\n", error);
+	for(unsigned int t=0; t<count; t=t+3)
+	{
+		float e1[3], e2[3], normal[3];
+		const float *p0 = positions+result[t]*3;
+		vec3f_sub_new(e1, positions+result[t+1]*3, p0);
+		vec3f_sub_new(e2, positions+result[t+2]*3, p0);
+		vec3f_cross_new(normal, e1, e2);
+		if(vec3f_dot(normal, p0) <= 0)
+			printf("ERROR: sphere: Triangle %u faces inward.\n", t/3);
+	}
+
+	free(positions);
+	free(indices);
+	free(result);
+}
+
+int main(void)
+{
+	test_grid();
+	test_seam();
+	test_sphere();
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <GL/glew.h>
+#include "texcache.h"
+
+/* These replace kuhl_read_texture_file_wrap() and glDeleteTextures()
+ * (see texcache_set_loader()) so that the test can run without an
+ * OpenGL context. */
+static GLuint next_texture = 1;
+static int loads = 0;
+static GLuint deleted[1024];
+static int deleted_count = 0;
+
+static float test_load(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT)
+{
+	loads++;
+	*texName = next_texture++;
+	return 2.0f;
+}
+
+static void test_delete(GLuint texName)
+{
+	if(deleted_count < 1024)
+		deleted[deleted_count++] = texName;
+}
+
+static int was_deleted(GLuint tex)
+{
+	for(int i=0; i<deleted_count; i++)
+		if(deleted[i] == tex)
+			return 1;
+	return 0;
+}
+
+static void make_file(const char *filename)
+{
+	FILE *f = fopen(filename, "wb");
+	if(f == NULL)
+	{
+		printf("ERROR: Unable to write %s\n", filename);
+		return;
+	}
+	fputs("not really an image", f);
+	fclose(f);
+}
+
+/* The same file with the same settings should be loaded once and
+ * shared until every reference is released. */
+static void test_refcount(void)
+{
+	make_file("selftest-texcache-a.png");
+	unsigned int hits, misses;
+	texcache_stats(NULL, &hits, &misses);
+
+	float aspect = 0;
+	GLuint a = texcache_acquire("selftest-texcache-a.png", GL_REPEAT, GL_REPEAT, &aspect);
+	GLuint b = texcache_acquire("./selftest-texcache-a.png", GL_REPEAT, GL_REPEAT, NULL);
+	if(a == 0 || a != b)
+		printf("ERROR: refcount: Same file was given textures %u and %u.\n", a, b);
+	if(aspect != 2.0f)
+		printf("ERROR: refcount: Aspect ratio is %f, expected 2.\n", aspect);
+	if(loads != 1)
+		printf("ERROR: refcount: File was loaded %d times, expected once.\n", loads);
+	if(texcache_refcount(a) != 2)
+		printf("ERROR: refcount: Texture has %d references, expected 2.\n", texcache_refcount(a));
+
+	unsigned int hits2, misses2;
+	texcache_stats(NULL, &hits2, &misses2);
+	if(hits2 != hits+1 || misses2 != misses+1)
+		printf("ERROR: refcount: %u hits and %u misses, expected 1 and 1.\n", hits2-hits, misses2-misses);
+
+	/* Different settings need their own texture. */
+	GLuint c = texcache_acquire("selftest-texcache-a.png", GL_CLAMP_TO_EDGE, GL_REPEAT, NULL);
+	if(c == a || c == 0)
+		printf("ERROR: refcount: Different wrapping shared texture %u.\n", c);
+
+	/* texcache_find() doesn't add a reference. */
+	if(texcache_find("selftest-texcache-a.png", GL_REPEAT, GL_REPEAT) != a || texcache_refcount(a) != 2)
+		printf("ERROR: refcount: texcache_find() didn't find the texture or added a reference.\n");
+
+	texcache_release(a);
+	if(was_deleted(a) || texcache_refcount(a) != 1)
+		printf("ERROR: refcount: Texture was deleted while it was still in use.\n");
+	texcache_release(b);
+	if(!was_deleted(a) || texcache_refcount(a) != 0)
+		printf("ERROR: refcount: Texture wasn't deleted after the last release.\n");
+	if(texcache_find("selftest-texcache-a.png", GL_REPEAT, GL_REPEAT) != 0)
+		printf("ERROR: refcount: Released texture is still in the cache.\n");
+	if(texcache_refcount(c) != 1)
+		printf("ERROR: refcount: Releasing one texture changed another.\n");
+
+	/* Loading the file again after it was evicted. */
+	GLuint d = texcache_acquire("selftest-texcache-a.png", GL_REPEAT, GL_REPEAT, NULL);
+	if(d == 0 || d == a || loads != 3)
+		printf("ERROR: refcount: File wasn't reloaded after it was evicted.\n");
+	texcache_release(d);
+	texcache_release(c);
+	remove("selftest-texcache-a.png");
+}
+
+/* Adding and removing many textures makes the tables grow. */
+static void test_many(void)
+{
+	enum { COUNT = 300 };
+	GLuint tex[COUNT];
+	char filename[64];
+	for(int i=0; i<COUNT; i++)
+	{
+		snprintf(filename, sizeof(filename), "selftest-texcache-%d.png", i);
+		make_file(filename);
+		tex[i] = texcache_acquire(filename, GL_REPEAT, GL_REPEAT, NULL);
+	}
+
+	unsigned int textures;
+	texcache_stats(&textures, NULL, NULL);
+	if(textures != COUNT)
+		printf("ERROR: many: Cache contains %u textures, expected %d.\n", textures, COUNT);
+
+	for(int i=0; i<COUNT; i++)
+	{
+		snprintf(filename, sizeof(filename), "selftest-texcache-%d.png", i);
+		if(tex[i] == 0 || texcache_find(filename, GL_REPEAT, GL_REPEAT) != tex[i])
+			printf("ERROR: many: Texture %d was not found.\n", i);
+	}
+
+	/* Release every other texture first so that entries are removed
+	 * from the middle of the hash chains. */
+	for(int i=0; i<COUNT; i+=2)
+		texcache_release(tex[i]);
+	for(int i=1; i<COUNT; i+=2)
+	{
+		if(texcache_refcount(tex[i]) != 1)
+			printf("ERROR: many: Texture %d was released with another texture.\n", i);
+		texcache_release(tex[i]);
+	}
+	texcache_stats(&textures, NULL, NULL);
+	if(textures != 0)
+		printf("ERROR: many: %u textures left in the cache.\n", textures);
+
+	for(int i=0; i<COUNT; i++)
+	{
+		snprintf(filename, sizeof(filename), "selftest-texcache-%d.png", i);
+		remove(filename);
+	}
+}
+
+/* texcache_acquire() would print an error message, so only
+ * texcache_find() is tested with a missing file. */
+static void test_missing(void)
+{
+	/* Make sure the cache isn't empty so that the lookup happens. */
+	make_file("selftest-texcache-a.png");
+	GLuint a = texcache_acquire("selftest-texcache-a.png", GL_REPEAT, GL_REPEAT, NULL);
+	if(texcache_find("selftest-texcache-missing.png", GL_REPEAT, GL_REPEAT) != 0)
+		printf("ERROR: missing: A file that doesn't exist was found.\n");
+	texcache_release(a);
+	remove("selftest-texcache-a.png");
+}
+
+int main(void)
+{
+	texcache_set_loader(test_load, test_delete);
+	test_refcount();
+	test_many();
+	test_missing();
+	printf("This program will print out ERROR above if an error occurs.\n");
+	return 0;
+}
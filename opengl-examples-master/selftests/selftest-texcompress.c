@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "texcompress.h"
+
+#define TEST_FILE "selftest-texcompress.ktx"
+
+/* Makes an image with a different color and alpha in each pixel. If
+ * flip is set, the rows are in the opposite order. */
+static unsigned char* make_image(int width, int height, int flip)
+{
+	unsigned char *rgba = malloc(width*height*4);
+	for(int y=0; y<height; y++)
+		for(int x=0; x<width; x++)
+		{
+			int row = flip ? height-1-y : y;
+			unsigned char *p = rgba + (y*width+x)*4;
+			p[0] = x*255/width;
+			p[1] = row*255/height;
+			p[2] = (x*row*7) % 256;
+			p[3] = 255 - row*20;
+		}
+	return rgba;
+}
+
+static int read_file(const char *filename, texcompress_image *img)
+{
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+		return -1;
+	unsigned char *data = malloc(1<<20);
+	size_t size = fread(data, 1, 1<<20, f);
+	fclose(f);
+	return texcompress_parse(img, data, size);
+}
+
+/* A block with a single color should be stored exactly (to the
+ * precision of a 565 color). */
+static void test_solid(void)
+{
+	unsigned char rgba[64], block[8];
+	for(int i=0; i<16; i++)
+	{
+		rgba[4*i+0] = 255;
+		rgba[4*i+1] = 128;
+		rgba[4*i+2] = 0;
+		rgba[4*i+3] = 255;
+	}
+	texcompress_encode_bc1(rgba, block);
+	int c0 = block[0] | block[1] << 8;
+	int expected = 31 << 11 | 32 << 5 | 0;
+	if(c0 != expected)
+		printf("ERROR: solid: Color is 0x%04x, expected 0x%04x.\n", c0, expected);
+	if(block[4] || block[5] || block[6] || block[7])
+		printf("ERROR: solid: Block uses more than one color.\n");
+}
+
+/* Writes a KTX file and reads it back. */
+static void test_ktx(void)
+{
+	int width = 20, height = 12;
+	unsigned char *rgba = make_image(width, height, 0);
+	if(texcompress_write_ktx(TEST_FILE, rgba, width, height, GL_COMPRESSED_SRGB_S3TC_DXT1_EXT) < 0)
+		printf("ERROR: ktx: Failed to write file.\n");
+	free(rgba);
+
+	texcompress_image img;
+	if(read_file(TEST_FILE, &img) < 0)
+		printf("ERROR: ktx: Failed to read file.\n");
+	else
+	{
+		if(img.width != width || img.height != height)
+			printf("ERROR: ktx: Size is %dx%d, expected %dx%d.\n", img.width, img.height, width, height);
+		if(img.levels != 5)
+			printf("ERROR: ktx: File has %d levels, expected 5.\n", img.levels);
+		if(img.internalformat != GL_COMPRESSED_SRGB_S3TC_DXT1_EXT || img.blockBytes != 8)
+			printf("ERROR: ktx: Wrong format 0x%x.\n", img.internalformat);
+		if(!img.bottomUp)
+			printf("ERROR: ktx: Orientation was not read.\n");
+		if(img.levelSize[0] != 5*3*8 || img.levelSize[4] != 8)
+			printf("ERROR: ktx: Wrong level sizes (%zu, %zu).\n", img.levelSize[0], img.levelSize[4]);
+	}
+	texcompress_free(&img);
+	remove(TEST_FILE);
+}
+
+/* Flipping a compressed image should give the same blocks as
+ * compressing the flipped image. */
+static void test_flip(void)
+{
+	int width = 16, height = 8;
+	texcompress_image img, flipped;
+	for(int i=0; i<2; i++)
+	{
+		unsigned char *rgba = make_image(width, height, i);
+		texcompress_write_ktx(TEST_FILE, rgba, width, height, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT);
+		free(rgba);
+		if(read_file(TEST_FILE, i == 0 ? &img : &flipped) < 0)
+			printf("ERROR: flip: Failed to read file.\n");
+	}
+	remove(TEST_FILE);
+
+	img.bottomUp = 0;
+	if(!texcompress_flip(&img))
+		printf("ERROR: flip: Unable to flip image.\n");
+	/* Levels that are 4 or more rows tall are flipped by whole blocks. */
+	for(int i=0; i<2; i++)
+		if(memcmp(img.level[i], flipped.level[i], img.levelSize[i]) != 0)
+			printf("ERROR: flip: Level %d doesn't match.\n", i);
+	texcompress_free(&img);
+	texcompress_free(&flipped);
+}
+
+/* Reads the header of a DDS file with a FourCC code. */
+static void test_dds(void)
+{
+	size_t size = 128 + 32 + 8 + 8;
+	unsigned char *dds = calloc(size, 1);
+	memcpy(dds, "DDS ", 4);
+	dds[4] = 124;
+	dds[10] = 0x02; // DDSD_MIPMAPCOUNT
+	dds[12] = 8;    // height
+	dds[16] = 8;    // width
+	dds[28] = 3;    // levels
+	memcpy(dds+84, "DXT1", 4);
+
+	texcompress_image img;
+	if(texcompress_parse(&img, dds, size) < 0)
+		printf("ERROR: dds: Failed to parse file.\n");
+	else
+	{
+		if(img.width != 8 || img.height != 8 || img.levels != 3 || img.bottomUp)
+			printf("ERROR: dds: Wrong size or orientation.\n");
+		if(img.level[2] != dds+128+40 || img.levelSize[2] != 8)
+			printf("ERROR: dds: Wrong level offsets.\n");
+	}
+	texcompress_free(&img);
+
+	/* A file which is too short should be rejected. */
+	dds = calloc(size, 1);
+	memcpy(dds, "DDS ", 4);
+	dds[4] = 124;
+	dds[10] = 0x02;
+	dds[12] = 16;
+	dds[16] = 16;
+	dds[28] = 1;
+	memcpy(dds+84, "DXT1", 4);
+	if(texcompress_parse(&img, dds, size) == 0)
+		printf("ERROR: dds: Truncated file was accepted.\n");
+	texcompress_free(&img);
+}
+
+int main(void)
+{
+	test_solid();
+	test_ktx();
+	test_flip();
+	test_dds();
+	return 0;
+}